@@ -6,18 +6,33 @@ common_src_files := \
 	VoldCommand.cpp \
 	NetlinkManager.cpp \
 	NetlinkHandler.cpp \
+	UeventCoalescer.cpp \
+	BlockEvent.cpp \
+	DevpathTrie.cpp \
 	Volume.cpp \
 	DirectVolume.cpp \
 	Process.cpp \
+	ProcessScanner.cpp \
+	WorkerPool.cpp \
+	SerialExecutor.cpp \
+	JobEngine.cpp \
 	Ext4.cpp \
 	Fat.cpp \
+	FsProbe.cpp \
+	FsDriver.cpp \
 	Ntfs.cpp \
 	Loop.cpp \
+	MountTable.cpp \
+	AsecCatalog.cpp \
+	ContainerRegistry.cpp \
 	Devmapper.cpp \
+	dmclient.c \
 	ResponseCode.cpp \
 	Xwarp.cpp \
 	VoldUtil.c \
 	fstrim.c \
+	cryptfs_inplace.c \
+	cryptfs_alloc.c \
 	cryptfs.c
 
 common_c_includes := \
@@ -40,6 +55,7 @@ common_shared_libraries := \
 	liblogwrap \
 	libext4_utils \
 	libcrypto \
+	libz \
     libicuuc 
 
 common_static_libraries := \
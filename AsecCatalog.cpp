@@ -0,0 +1,354 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+
+#define LOG_TAG "Vold"
+
+#include <cutils/log.h>
+
+#include <sysutils/SocketClient.h>
+
+#include "AsecCatalog.h"
+#include "Asec.h"
+#include "Loop.h"
+#include "Volume.h"
+
+#define ASEC_SUFFIX ".asec"
+#define ASEC_SUFFIX_LEN (sizeof(ASEC_SUFFIX) - 1)
+#define ASEC_WATCH_MASK (IN_CREATE | IN_CLOSE_WRITE | IN_DELETE | IN_MOVED_FROM | \
+                         IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_UNMOUNT)
+
+AsecCatalog *AsecCatalog::sInstance = NULL;
+
+AsecCatalog *AsecCatalog::Instance() {
+    if (!sInstance)
+        sInstance = new AsecCatalog();
+    return sInstance;
+}
+
+AsecCatalog::AsecCatalog() {
+    pthread_mutex_init(&mLock, NULL);
+    mInotifyFd = -1;
+    mLookups = 0;
+    mLoads = 0;
+    mEvents = 0;
+
+    // Search order matches what findAsec has always done
+    const char *paths[] = { Volume::SEC_ASECDIR_INT, Volume::SEC_ASECDIR_EXT };
+    for (size_t i = 0; i < sizeof(paths) / sizeof(paths[0]); i++) {
+        Dir d;
+        d.path = paths[i];
+        d.wd = -1;
+        d.loaded = false;
+        mDirs.push_back(d);
+    }
+}
+
+AsecCatalog::~AsecCatalog() {
+    if (mInotifyFd >= 0)
+        close(mInotifyFd);
+    pthread_mutex_destroy(&mLock);
+}
+
+int AsecCatalog::start() {
+    if ((mInotifyFd = inotify_init()) < 0) {
+        SLOGE("Unable to init inotify (%s)", strerror(errno));
+        return -1;
+    }
+    fcntl(mInotifyFd, F_SETFD, FD_CLOEXEC);
+
+    if (pthread_create(&mThread, NULL, AsecCatalog::threadStart, this)) {
+        SLOGE("pthread_create (%s)", strerror(errno));
+        close(mInotifyFd);
+        mInotifyFd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+bool AsecCatalog::idFromFileName(const char *name, std::string *id) {
+    size_t len = strlen(name);
+
+    if (name[0] == '.' || len <= ASEC_SUFFIX_LEN ||
+            strcmp(name + len - ASEC_SUFFIX_LEN, ASEC_SUFFIX)) {
+        return false;
+    }
+    id->assign(name, len - ASEC_SUFFIX_LEN);
+    return true;
+}
+
+AsecCatalog::Dir *AsecCatalog::findDirLocked(const char *path) {
+    for (size_t i = 0; i < mDirs.size(); i++) {
+        if (!strcmp(mDirs[i].path, path)) {
+            return &mDirs[i];
+        }
+    }
+    return NULL;
+}
+
+void AsecCatalog::updateLocked(Dir *dir, const std::string &id) {
+    char path[PATH_MAX];
+    struct stat st;
+
+    snprintf(path, sizeof(path), "%s/%s%s", dir->path, id.c_str(), ASEC_SUFFIX);
+    if (lstat(path, &st) || !S_ISREG(st.st_mode)) {
+        dir->entries.erase(id);
+        return;
+    }
+
+    Entry e;
+    e.id = id;
+    e.dir = dir->path;
+    e.size = st.st_size;
+    e.hasSuperblock = false;
+    e.cipher = ASEC_SB_C_CIPHER_NONE;
+    e.opts = ASEC_SB_C_OPTS_NONE;
+
+    /* A container still being created has no superblock yet */
+    struct asec_superblock sb;
+    if (st.st_size >= 512 && !Loop::readSuperblock(path, &sb) && sb.magic == ASEC_SB_MAGIC) {
+        e.hasSuperblock = true;
+        e.cipher = sb.c_cipher;
+        e.opts = sb.c_opts;
+    }
+    dir->entries[id] = e;
+}
+
+int AsecCatalog::loadLocked(Dir *dir) {
+    DIR *d;
+    struct dirent *de;
+
+    if (dir->loaded) {
+        return 0;
+    }
+
+    /* Watch before reading so nothing created in between is missed */
+    if (mInotifyFd >= 0 && dir->wd < 0) {
+        if ((dir->wd = inotify_add_watch(mInotifyFd, dir->path, ASEC_WATCH_MASK)) < 0) {
+            SLOGW("Unable to watch %s (%s)", dir->path, strerror(errno));
+        }
+    }
+
+    if (!(d = opendir(dir->path))) {
+        SLOGE("Could not open asec dir %s (%s)", dir->path, strerror(errno));
+        return -1;
+    }
+
+    dir->entries.clear();
+    while ((de = readdir(d))) {
+        std::string id;
+
+        if (de->d_type != DT_REG && de->d_type != DT_UNKNOWN)
+            continue;
+        if (!idFromFileName(de->d_name, &id))
+            continue;
+        updateLocked(dir, id);
+    }
+    closedir(d);
+
+    // Without a watch the directory is re-read on every use
+    dir->loaded = (dir->wd >= 0);
+    mLoads++;
+    return 0;
+}
+
+bool AsecCatalog::lookup(const char *id, Entry *entry) {
+    bool found = false;
+
+    pthread_mutex_lock(&mLock);
+    mLookups++;
+    for (size_t i = 0; i < mDirs.size() && !found; i++) {
+        if (loadLocked(&mDirs[i])) {
+            continue;
+        }
+        std::map<std::string, Entry>::iterator it = mDirs[i].entries.find(id);
+        if (it != mDirs[i].entries.end()) {
+            if (entry) {
+                *entry = it->second;
+            }
+            found = true;
+        }
+    }
+    pthread_mutex_unlock(&mLock);
+
+    if (!found) {
+        errno = ENOENT;
+    }
+    return found;
+}
+
+int AsecCatalog::list(const char *path, std::vector<std::string> *ids) {
+    int rc = -1;
+
+    pthread_mutex_lock(&mLock);
+    Dir *dir = findDirLocked(path);
+    if (!dir) {
+        errno = ENOENT;
+    } else if (!loadLocked(dir)) {
+        std::map<std::string, Entry>::iterator it;
+        for (it = dir->entries.begin(); it != dir->entries.end(); ++it) {
+            ids->push_back(it->first);
+        }
+        rc = 0;
+    }
+    pthread_mutex_unlock(&mLock);
+    return rc;
+}
+
+void AsecCatalog::update(const char *path, const char *id) {
+    pthread_mutex_lock(&mLock);
+    Dir *dir = findDirLocked(path);
+    if (dir && dir->loaded) {
+        updateLocked(dir, id);
+    }
+    pthread_mutex_unlock(&mLock);
+}
+
+void AsecCatalog::invalidate(const char *path) {
+    pthread_mutex_lock(&mLock);
+    Dir *dir = findDirLocked(path);
+    if (dir) {
+        if (dir->wd >= 0) {
+            inotify_rm_watch(mInotifyFd, dir->wd);
+            dir->wd = -1;
+        }
+        dir->entries.clear();
+        dir->loaded = false;
+    }
+    pthread_mutex_unlock(&mLock);
+}
+
+void *AsecCatalog::threadStart(void *obj) {
+    AsecCatalog *me = reinterpret_cast<AsecCatalog *>(obj);
+
+    me->watchLoop();
+    pthread_exit(NULL);
+    return NULL;
+}
+
+void AsecCatalog::watchLoop() {
+    char buffer[sizeof(struct inotify_event) + NAME_MAX + 1]
+            __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    while (true) {
+        ssize_t len = read(mInotifyFd, buffer, sizeof(buffer));
+        if (len < 0) {
+            if (errno == EINTR)
+                continue;
+            SLOGE("inotify read failed (%s)", strerror(errno));
+            break;
+        }
+
+        pthread_mutex_lock(&mLock);
+        for (char *p = buffer; p < buffer + len; ) {
+            struct inotify_event *ev = (struct inotify_event *) p;
+            p += sizeof(struct inotify_event) + ev->len;
+            mEvents++;
+
+            if (ev->mask & IN_Q_OVERFLOW) {
+                // Events were dropped, so nothing cached can be trusted
+                SLOGW("inotify queue overflowed, reloading asec dirs");
+                for (size_t i = 0; i < mDirs.size(); i++) {
+                    mDirs[i].entries.clear();
+                    mDirs[i].loaded = false;
+                    loadLocked(&mDirs[i]);
+                }
+                continue;
+            }
+
+            Dir *dir = NULL;
+            for (size_t i = 0; i < mDirs.size(); i++) {
+                if (mDirs[i].wd == ev->wd) {
+                    dir = &mDirs[i];
+                    break;
+                }
+            }
+            if (!dir) {
+                continue;
+            }
+
+            if (ev->mask & (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF | IN_UNMOUNT)) {
+                // The directory itself went away; start over on next use
+                dir->wd = -1;
+                dir->entries.clear();
+                dir->loaded = false;
+                continue;
+            }
+
+            std::string id;
+            if (ev->len && idFromFileName(ev->name, &id)) {
+                updateLocked(dir, id);
+            }
+        }
+        pthread_mutex_unlock(&mLock);
+    }
+
+    /* Nobody keeps the directories current anymore, so read them on every use */
+    pthread_mutex_lock(&mLock);
+    for (size_t i = 0; i < mDirs.size(); i++) {
+        if (mDirs[i].wd >= 0) {
+            inotify_rm_watch(mInotifyFd, mDirs[i].wd);
+            mDirs[i].wd = -1;
+        }
+        mDirs[i].entries.clear();
+        mDirs[i].loaded = false;
+    }
+    close(mInotifyFd);
+    mInotifyFd = -1;
+    pthread_mutex_unlock(&mLock);
+}
+
+int AsecCatalog::dumpState(SocketClient *c) {
+    char buffer[256];
+
+    pthread_mutex_lock(&mLock);
+    for (size_t i = 0; i < mDirs.size(); i++) {
+        Dir &dir = mDirs[i];
+        snprintf(buffer, sizeof(buffer), "%s: %s, %d containers", dir.path,
+                 dir.loaded ? "watched" : "not loaded", (int) dir.entries.size());
+        c->sendMsg(0, buffer, false);
+
+        std::map<std::string, Entry>::iterator it;
+        for (it = dir.entries.begin(); it != dir.entries.end(); ++it) {
+            Entry &e = it->second;
+            if (e.hasSuperblock) {
+                snprintf(buffer, sizeof(buffer), "  %s %lld %s cipher=%d", e.id.c_str(),
+                         (long long) e.size,
+                         (e.opts & ASEC_SB_C_OPTS_EXT4) ? "ext4" : "fat", e.cipher);
+            } else {
+                snprintf(buffer, sizeof(buffer), "  %s %lld (no superblock)", e.id.c_str(),
+                         (long long) e.size);
+            }
+            c->sendMsg(0, buffer, false);
+        }
+    }
+    snprintf(buffer, sizeof(buffer), "%u lookups, %u directory loads, %u inotify events",
+             mLookups, mLoads, mEvents);
+    pthread_mutex_unlock(&mLock);
+
+    c->sendMsg(0, buffer, false);
+    return 0;
+}
@@ -0,0 +1,105 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _ASECCATALOG_H
+#define _ASECCATALOG_H
+
+#include <pthread.h>
+#include <sys/types.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+class SocketClient;
+
+/*
+ * In-memory index of the .asec files in the internal and external secure
+ * directories. Each directory is read once and then kept current by an
+ * inotify watcher thread; callers that change a directory also update the
+ * catalog directly so their next command never races the watcher. If the
+ * watcher drops events everything is reloaded, and if it dies directories
+ * are read on every use.
+ *
+ * Something mounted over a watched directory (the external secure area is
+ * a bind mount) hides it from inotify, so whoever mounts or unmounts it
+ * must invalidate() the directory.
+ */
+class AsecCatalog {
+public:
+    struct Entry {
+        std::string   id;
+        const char   *dir;
+        off_t         size;
+        bool          hasSuperblock;
+        unsigned char cipher;
+        unsigned char opts;
+    };
+
+private:
+    struct Dir {
+        const char                   *path;
+        int                           wd;
+        bool                          loaded;
+        std::map<std::string, Entry>  entries;
+    };
+
+    static AsecCatalog *sInstance;
+
+    pthread_mutex_t  mLock;
+    int              mInotifyFd;
+    pthread_t        mThread;
+    std::vector<Dir> mDirs;
+
+    unsigned int mLookups;
+    unsigned int mLoads;
+    unsigned int mEvents;
+
+public:
+    static AsecCatalog *Instance();
+    virtual ~AsecCatalog();
+
+    /* Starts the watcher thread */
+    int start();
+
+    /*
+     * Finds 'id', preferring the internal directory as findAsec always has.
+     * Only the first lookup after a directory is (re)loaded touches disk.
+     */
+    bool lookup(const char *id, Entry *entry);
+    /* Ids of every container in 'dir'; fails if it can't be read */
+    int list(const char *dir, std::vector<std::string> *ids);
+
+    /* Re-reads one container, dropping it if the file is gone */
+    void update(const char *dir, const char *id);
+    /* Forgets everything known about 'dir' until it is next used */
+    void invalidate(const char *dir);
+
+    int dumpState(SocketClient *c);
+
+    /* Returns the id for an .asec file name, or false if it isn't one */
+    static bool idFromFileName(const char *name, std::string *id);
+
+private:
+    AsecCatalog();
+    Dir *findDirLocked(const char *path);
+    int loadLocked(Dir *dir);
+    void updateLocked(Dir *dir, const std::string &id);
+    static void *threadStart(void *obj);
+    void watchLoop();
+};
+
+#endif
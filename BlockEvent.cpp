@@ -0,0 +1,67 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#define LOG_TAG "Vold"
+
+#include <cutils/log.h>
+
+#include <sysutils/NetlinkEvent.h>
+
+#include "BlockEvent.h"
+
+bool BlockEvent::parse(NetlinkEvent *evt, BlockEvent *out) {
+    const char *devpath = evt->findParam("DEVPATH");
+    const char *devtype = evt->findParam("DEVTYPE");
+    const char *major = evt->findParam("MAJOR");
+    const char *minor = evt->findParam("MINOR");
+    const char *nparts = evt->findParam("NPARTS");
+    const char *partn = evt->findParam("PARTN");
+
+    if (!devpath || !major || !minor) {
+        SLOGW("Ignoring block uevent without DEVPATH, MAJOR or MINOR");
+        return false;
+    }
+
+    out->action = evt->getAction();
+    out->devpath = devpath;
+    if (!devtype) {
+        out->type = Type_Unknown;
+    } else if (!strcmp(devtype, "disk")) {
+        out->type = Type_Disk;
+    } else if (!strcmp(devtype, "partition")) {
+        out->type = Type_Partition;
+    } else {
+        out->type = Type_Unknown;
+    }
+    out->major = atoi(major);
+    out->minor = atoi(minor);
+    out->nparts = nparts ? atoi(nparts) : -1;
+    out->partn = partn ? atoi(partn) : -1;
+    return true;
+}
+
+std::string BlockEvent::diskPath() const {
+    if (type == Type_Partition) {
+        size_t slash = devpath.rfind('/');
+        if (slash != std::string::npos && slash > 0) {
+            return devpath.substr(0, slash);
+        }
+    }
+    return devpath;
+}
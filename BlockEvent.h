@@ -0,0 +1,47 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _BLOCKEVENT_H
+#define _BLOCKEVENT_H
+
+#include <string>
+
+class NetlinkEvent;
+
+/*
+ * A block uevent, parsed once on the netlink thread so nothing downstream
+ * has to search the raw parameters again.
+ */
+struct BlockEvent {
+    enum Type { Type_Unknown, Type_Disk, Type_Partition };
+
+    int         action;     // NetlinkEvent::NlAction*
+    std::string devpath;
+    Type        type;
+    int         major;
+    int         minor;
+    int         nparts;     // -1 if the event had no NPARTS
+    int         partn;      // -1 if the event had no PARTN
+
+    /* Fails for events without DEVPATH, MAJOR or MINOR */
+    static bool parse(NetlinkEvent *evt, BlockEvent *out);
+
+    bool isDisk() const { return type == Type_Disk; }
+    /* The devpath of the disk this event belongs to */
+    std::string diskPath() const;
+};
+
+#endif
@@ -37,6 +37,11 @@
 #include "Xwarp.h"
 #include "Loop.h"
 #include "Devmapper.h"
+#include "MountTable.h"
+#include "AsecCatalog.h"
+#include "FsDriver.h"
+#include "JobEngine.h"
+#include "UeventCoalescer.h"
 #include "cryptfs.h"
 #include "fstrim.h"
 
@@ -52,6 +57,7 @@ CommandListener::CommandListener() :
     registerCmd(new XwarpCmd());
     registerCmd(new CryptfsCmd());
     registerCmd(new FstrimCmd());
+    registerCmd(new JobCmd());
 }
 
 void CommandListener::dumpArgs(int argc, char **argv, int argObscure) {
@@ -98,6 +104,16 @@ int CommandListener::DumpCmd::runCommand(SocketClient *cli,
     if (Devmapper::dumpState(cli)) {
         cli->sendMsg(ResponseCode::CommandOkay, "Devmapper dump failed", true);
     }
+    cli->sendMsg(0, "Dumping mount table cache", false);
+    MountTable::Instance()->dumpState(cli);
+    cli->sendMsg(0, "Dumping ASEC catalog", false);
+    AsecCatalog::Instance()->dumpState(cli);
+    cli->sendMsg(0, "Dumping active containers", false);
+    VolumeManager::Instance()->dumpContainers(cli);
+    cli->sendMsg(0, "Dumping filesystem drivers", false);
+    FsDriver::dumpAll(cli);
+    cli->sendMsg(0, "Dumping uevent coalescer", false);
+    UeventCoalescer::Instance()->dumpState(cli);
     cli->sendMsg(0, "Dumping mounted filesystems", false);
     FILE *fp = fopen("/proc/mounts", "r");
     if (fp) {
@@ -279,41 +295,16 @@ CommandListener::AsecCmd::AsecCmd() :
 }
 
 void CommandListener::AsecCmd::listAsecsInDirectory(SocketClient *cli, const char *directory) {
-    DIR *d = opendir(directory);
+    std::vector<std::string> ids;
 
-    if (!d) {
+    if (AsecCatalog::Instance()->list(directory, &ids)) {
         cli->sendMsg(ResponseCode::OperationFailed, "Failed to open asec dir", true);
         return;
     }
 
-    size_t dirent_len = offsetof(struct dirent, d_name) +
-            fpathconf(dirfd(d), _PC_NAME_MAX) + 1;
-
-    struct dirent *dent = (struct dirent *) malloc(dirent_len);
-    if (dent == NULL) {
-        cli->sendMsg(ResponseCode::OperationFailed, "Failed to allocate memory", true);
-        return;
-    }
-
-    struct dirent *result;
-
-    while (!readdir_r(d, dent, &result) && result != NULL) {
-        if (dent->d_name[0] == '.')
-            continue;
-        if (dent->d_type != DT_REG)
-            continue;
-        size_t name_len = strlen(dent->d_name);
-        if (name_len > 5 && name_len < 260 &&
-                !strcmp(&dent->d_name[name_len - 5], ".asec")) {
-            char id[255];
-            memset(id, 0, sizeof(id));
-            strlcpy(id, dent->d_name, name_len - 4);
-            cli->sendMsg(ResponseCode::AsecListResult, id, false);
-        }
+    for (size_t i = 0; i < ids.size(); i++) {
+        cli->sendMsg(ResponseCode::AsecListResult, ids[i].c_str(), false);
     }
-    closedir(d);
-
-    free(dent);
 }
 
 int CommandListener::AsecCmd::runCommand(SocketClient *cli,
@@ -384,6 +375,30 @@ int CommandListener::AsecCmd::runCommand(SocketClient *cli,
             return 0;
         }
         rc = vm->mountAsec(argv[2], argv[3], atoi(argv[4]));
+    } else if (!strcmp(argv[1], "mount-batch")) {
+        // Every third argument is a key, so don't dump them
+        if (argc < 5 || (argc - 2) % 3) {
+            cli->sendMsg(ResponseCode::CommandSyntaxError,
+                    "Usage: asec mount-batch <namespace-id> <key> <ownerUid> [...]", false);
+            return 0;
+        }
+        if ((argc - 2) / 3 > ASEC_MOUNT_BATCH_MAX) {
+            char msg[64];
+            snprintf(msg, sizeof(msg), "At most %d containers per mount-batch",
+                     ASEC_MOUNT_BATCH_MAX);
+            cli->sendMsg(ResponseCode::CommandSyntaxError, msg, false);
+            return 0;
+        }
+
+        std::vector<AsecMountRequest> requests;
+        for (int i = 2; i < argc; i += 3) {
+            AsecMountRequest req;
+            req.id = argv[i];
+            req.key = argv[i + 1];
+            req.ownerUid = atoi(argv[i + 2]);
+            requests.push_back(req);
+        }
+        rc = vm->mountAsecBatch(requests, cli);
     } else if (!strcmp(argv[1], "unmount")) {
         dumpArgs(argc, argv, -1);
         if (argc < 3) {
@@ -679,3 +694,205 @@ int CommandListener::FstrimCmd::runCommand(SocketClient *cli,
 
     return 0;
 }
+
+/* Volume jobs run on their volume's executor, in parallel with other volumes */
+static SerialExecutor *volumeExecutor(const std::string &label) {
+    Volume *v = VolumeManager::Instance()->lookupVolume(label.c_str());
+    return v ? v->getExecutor() : NULL;
+}
+
+class MountVolumeJob : public Job {
+    std::string mLabel;
+
+public:
+    MountVolumeJob(const char *label)
+            : Job((std::string("volume mount ") + label).c_str()), mLabel(label) {}
+
+    int run() {
+        return VolumeManager::Instance()->mountVolume(mLabel.c_str());
+    }
+
+    SerialExecutor *getExecutor() { return volumeExecutor(mLabel); }
+};
+
+class UnmountVolumeJob : public Job {
+    std::string mLabel;
+    bool        mForce;
+    bool        mRevert;
+
+public:
+    UnmountVolumeJob(const char *label, bool force, bool revert)
+            : Job((std::string("volume unmount ") + label).c_str()), mLabel(label),
+              mForce(force), mRevert(revert) {}
+
+    int run() {
+        return VolumeManager::Instance()->unmountVolume(mLabel.c_str(), mForce, mRevert);
+    }
+
+    SerialExecutor *getExecutor() { return volumeExecutor(mLabel); }
+};
+
+class FormatVolumeJob : public Job {
+    std::string mLabel;
+    bool        mWipe;
+
+public:
+    FormatVolumeJob(const char *label, bool wipe)
+            : Job((std::string("volume format ") + label).c_str()), mLabel(label),
+              mWipe(wipe) {}
+
+    int run() {
+        return VolumeManager::Instance()->formatVolume(mLabel.c_str(), mWipe);
+    }
+
+    SerialExecutor *getExecutor() { return volumeExecutor(mLabel); }
+};
+
+class DestroyAsecJob : public Job {
+    std::string mId;
+    bool        mForce;
+
+public:
+    DestroyAsecJob(const char *id, bool force)
+            : Job((std::string("asec destroy ") + id).c_str()), mId(id), mForce(force) {}
+
+    int run() {
+        return VolumeManager::Instance()->destroyAsec(mId.c_str(), mForce);
+    }
+};
+
+class CheckPasswordJob : public Job {
+    char *mPassword;
+
+public:
+    CheckPasswordJob(const char *password) : Job("cryptfs checkpw") {
+        mPassword = strdup(password);
+    }
+
+    virtual ~CheckPasswordJob() {
+        memset(mPassword, 0, strlen(mPassword));
+        free(mPassword);
+    }
+
+    // Like the synchronous command, the job succeeds and carries cryptfs's code
+    int run() {
+        char result[16];
+        snprintf(result, sizeof(result), "%d", cryptfs_check_passwd(mPassword));
+        setResult(result);
+        return 0;
+    }
+};
+
+/*
+ * Streams each measurement to the client that asked as soon as it is
+ * taken, prefixed with the job id. The largest scrypt run alone takes
+ * about 64 MB and a few seconds.
+ */
+class KdfBenchmarkJob : public Job {
+    SocketClient *mClient;
+
+    static void sendResult(const char *result, void *arg) {
+        KdfBenchmarkJob *job = (KdfBenchmarkJob *) arg;
+        char msg[255];
+
+        snprintf(msg, sizeof(msg), "%d %s", job->getId(), result);
+        job->mClient->sendMsg(ResponseCode::CryptfsBenchmarkResult, msg, false);
+    }
+
+public:
+    KdfBenchmarkJob(SocketClient *cli) : Job("cryptfs benchmark-kdf"), mClient(cli) {
+        mClient->incRef();
+    }
+
+    virtual ~KdfBenchmarkJob() {
+        mClient->decRef();
+    }
+
+    int run() {
+        char result[16];
+        snprintf(result, sizeof(result), "%d", cryptfs_benchmark_kdf(sendResult, this));
+        setResult(result);
+        return 0;
+    }
+};
+
+CommandListener::JobCmd::JobCmd() :
+                 VoldCommand("job") {
+}
+
+/*
+ * job list
+ * job volume mount <path>
+ * job volume unmount <path> [force|force_and_revert]
+ * job volume format <path> [wipe]
+ * job asec destroy <container-id> [force]
+ * job cryptfs checkpw <passwd>
+ * job cryptfs benchmark-kdf
+ *
+ * Queued commands answer with JobQueuedResult and their job id at once;
+ * the outcome follows as a JobCompleted broadcast.
+ */
+int CommandListener::JobCmd::runCommand(SocketClient *cli,
+                                        int argc, char **argv) {
+    if (argc < 2) {
+        cli->sendMsg(ResponseCode::CommandSyntaxError, "Missing Argument", false);
+        return 0;
+    }
+
+    if (!strcmp(argv[1], "list")) {
+        dumpArgs(argc, argv, -1);
+        JobEngine::Instance()->listJobs(cli);
+        cli->sendMsg(ResponseCode::CommandOkay, "Job list complete", false);
+        return 0;
+    }
+
+    Job *job = NULL;
+    if (argc >= 4 && !strcmp(argv[1], "volume")) {
+        dumpArgs(argc, argv, -1);
+        if (!strcmp(argv[2], "mount") && argc == 4) {
+            job = new MountVolumeJob(argv[3]);
+        } else if (!strcmp(argv[2], "unmount") && argc <= 5) {
+            bool force = argc == 5 && (!strcmp(argv[4], "force") ||
+                                       !strcmp(argv[4], "force_and_revert"));
+            bool revert = argc == 5 && !strcmp(argv[4], "force_and_revert");
+            if (argc == 4 || force) {
+                job = new UnmountVolumeJob(argv[3], force, revert);
+            }
+        } else if (!strcmp(argv[2], "format") && argc <= 5) {
+            if (argc == 4 || !strcmp(argv[4], "wipe")) {
+                job = new FormatVolumeJob(argv[3], argc == 5);
+            }
+        }
+    } else if (argc >= 4 && !strcmp(argv[1], "asec")) {
+        dumpArgs(argc, argv, -1);
+        if (!strcmp(argv[2], "destroy") && argc <= 5) {
+            job = new DestroyAsecJob(argv[3], argc == 5 && !strcmp(argv[4], "force"));
+        }
+    } else if (argc == 4 && !strcmp(argv[1], "cryptfs") && !strcmp(argv[2], "checkpw")) {
+        dumpArgs(argc, argv, 3);
+        if ((cli->getUid() != 0) && (cli->getUid() != AID_SYSTEM)) {
+            cli->sendMsg(ResponseCode::CommandNoPermission,
+                    "No permission to run cryptfs commands", false);
+            return 0;
+        }
+        job = new CheckPasswordJob(argv[3]);
+    } else if (argc == 3 && !strcmp(argv[1], "cryptfs") && !strcmp(argv[2], "benchmark-kdf")) {
+        dumpArgs(argc, argv, -1);
+        if ((cli->getUid() != 0) && (cli->getUid() != AID_SYSTEM)) {
+            cli->sendMsg(ResponseCode::CommandNoPermission,
+                    "No permission to run cryptfs commands", false);
+            return 0;
+        }
+        job = new KdfBenchmarkJob(cli);
+    }
+
+    if (!job) {
+        cli->sendMsg(ResponseCode::CommandSyntaxError, "Unknown or malformed job", false);
+        return 0;
+    }
+
+    char msg[16];
+    snprintf(msg, sizeof(msg), "%d", JobEngine::Instance()->submit(job));
+    cli->sendMsg(ResponseCode::JobQueuedResult, msg, false);
+    return 0;
+}
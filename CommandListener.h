@@ -79,6 +79,13 @@ private:
         int runCommand(SocketClient *c, int argc, char ** argv);
     };
 
+    class JobCmd : public VoldCommand {
+    public:
+        JobCmd();
+        virtual ~JobCmd() {}
+        int runCommand(SocketClient *c, int argc, char ** argv);
+    };
+
     class FstrimCmd : public VoldCommand {
     public:
         FstrimCmd();
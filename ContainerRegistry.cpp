@@ -0,0 +1,135 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#define LOG_TAG "Vold"
+
+#include <cutils/log.h>
+
+#include <sysutils/SocketClient.h>
+
+#include "ContainerRegistry.h"
+#include "Volume.h"
+
+ContainerRegistry::ContainerRegistry() {
+    pthread_mutex_init(&mLock, NULL);
+}
+
+ContainerRegistry::~ContainerRegistry() {
+    pthread_mutex_destroy(&mLock);
+}
+
+int ContainerRegistry::add(const Container &c) {
+    pthread_mutex_lock(&mLock);
+    if (mById.find(c.id) != mById.end()) {
+        pthread_mutex_unlock(&mLock);
+        errno = EADDRINUSE;
+        return -1;
+    }
+    mById[c.id] = c;
+    mByOwner[c.owner].insert(c.id);
+    pthread_mutex_unlock(&mLock);
+    return 0;
+}
+
+int ContainerRegistry::remove(const char *id) {
+    pthread_mutex_lock(&mLock);
+    ContainerMap::iterator it = mById.find(id);
+    if (it == mById.end()) {
+        pthread_mutex_unlock(&mLock);
+        errno = ENOENT;
+        return -1;
+    }
+
+    OwnerMap::iterator owner = mByOwner.find(it->second.owner);
+    if (owner != mByOwner.end()) {
+        owner->second.erase(it->first);
+        if (owner->second.empty()) {
+            mByOwner.erase(owner);
+        }
+    }
+    mById.erase(it);
+    pthread_mutex_unlock(&mLock);
+    return 0;
+}
+
+bool ContainerRegistry::lookup(const char *id, Container *c) {
+    bool found = false;
+
+    pthread_mutex_lock(&mLock);
+    ContainerMap::iterator it = mById.find(id);
+    if (it != mById.end()) {
+        if (c) {
+            *c = it->second;
+        }
+        found = true;
+    }
+    pthread_mutex_unlock(&mLock);
+    return found;
+}
+
+void ContainerRegistry::listByType(container_type_t type, std::vector<Container> *containers) {
+    pthread_mutex_lock(&mLock);
+    for (ContainerMap::iterator it = mById.begin(); it != mById.end(); ++it) {
+        if (it->second.type == type) {
+            containers->push_back(it->second);
+        }
+    }
+    pthread_mutex_unlock(&mLock);
+}
+
+void ContainerRegistry::listByOwner(Volume *owner, std::vector<Container> *containers) {
+    pthread_mutex_lock(&mLock);
+    OwnerMap::iterator it = mByOwner.find(owner);
+    if (it != mByOwner.end()) {
+        std::set<std::string>::iterator id;
+        for (id = it->second.begin(); id != it->second.end(); ++id) {
+            containers->push_back(mById[*id]);
+        }
+    }
+    pthread_mutex_unlock(&mLock);
+}
+
+size_t ContainerRegistry::size() {
+    pthread_mutex_lock(&mLock);
+    size_t n = mById.size();
+    pthread_mutex_unlock(&mLock);
+    return n;
+}
+
+int ContainerRegistry::dumpState(SocketClient *c) {
+    char buffer[1024];
+
+    pthread_mutex_lock(&mLock);
+    for (ContainerMap::iterator it = mById.begin(); it != mById.end(); ++it) {
+        Container &ct = it->second;
+        snprintf(buffer, sizeof(buffer), "%s %s {%s} %s -> %s on %s (%s)",
+                 ct.type == ASEC ? "ASEC" : "OBB", ct.id.c_str(), ct.idHash.c_str(),
+                 ct.loopDevice.c_str(),
+                 ct.dmDevice.empty() ? "(unencrypted)" : ct.dmDevice.c_str(),
+                 ct.mountPoint.c_str(), ct.owner ? ct.owner->getLabel() : "internal");
+        c->sendMsg(0, buffer, false);
+    }
+    snprintf(buffer, sizeof(buffer), "%d containers on %d volumes", (int) mById.size(),
+             (int) mByOwner.size());
+    pthread_mutex_unlock(&mLock);
+
+    c->sendMsg(0, buffer, false);
+    return 0;
+}
@@ -0,0 +1,75 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _CONTAINERREGISTRY_H
+#define _CONTAINERREGISTRY_H
+
+#include <pthread.h>
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+class SocketClient;
+class Volume;
+
+typedef enum { ASEC, OBB } container_type_t;
+
+/*
+ * The ASECs and OBBs vold currently has mounted, indexed by id and by the
+ * volume their backing file lives on. Each entry remembers the devices and
+ * mountpoint set up for it, so teardown never has to recompute them.
+ */
+class ContainerRegistry {
+public:
+    struct Container {
+        std::string      id;            /* ASEC id, or the OBB's file name */
+        container_type_t type;
+        std::string      idHash;
+        std::string      fileName;
+        std::string      loopDevice;
+        std::string      dmDevice;      /* empty when not encrypted */
+        std::string      mountPoint;
+        Volume          *owner;         /* NULL for internal storage */
+    };
+
+private:
+    typedef std::map<std::string, Container>          ContainerMap;
+    typedef std::map<Volume *, std::set<std::string> > OwnerMap;
+
+    pthread_mutex_t mLock;
+    ContainerMap    mById;
+    OwnerMap        mByOwner;
+
+public:
+    ContainerRegistry();
+    virtual ~ContainerRegistry();
+
+    /* Fails with EADDRINUSE if 'c.id' is already registered */
+    int add(const Container &c);
+    /* Fails with ENOENT if 'id' isn't registered */
+    int remove(const char *id);
+    bool lookup(const char *id, Container *c);
+
+    void listByType(container_type_t type, std::vector<Container> *containers);
+    void listByOwner(Volume *owner, std::vector<Container> *containers);
+    size_t size();
+
+    int dumpState(SocketClient *c);
+};
+
+#endif
@@ -25,15 +25,11 @@ class SocketClient;
 class Devmapper {
 public:
     static int create(const char *name, const char *loopFile, const char *key,
-                      unsigned int numSectors, char *buffer, size_t len);
-    static int destroy(const char *name);
+                      unsigned int numSectors, char *buffer, size_t len,
+                      bool readOnly = false, bool legacyGeometry = false);
+    static int destroy(const char *name, bool deferred = false);
     static int lookupActive(const char *name, char *buffer, size_t len);
     static int dumpState(SocketClient *c);
-
-private:
-    static void *_align(void *ptr, unsigned int a);
-    static void ioctlInit(struct dm_ioctl *io, size_t data_size,
-                          const char *name, unsigned flags);
 };
 
 #endif
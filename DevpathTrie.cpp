@@ -0,0 +1,112 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <stddef.h>
+
+#include "DevpathTrie.h"
+
+DevpathTrie::DevpathTrie() {
+    pthread_mutex_init(&mLock, NULL);
+    mRoot = new Node();
+    mCount = 0;
+}
+
+DevpathTrie::~DevpathTrie() {
+    freeNode(mRoot);
+    pthread_mutex_destroy(&mLock);
+}
+
+void DevpathTrie::freeNode(Node *node) {
+    std::map<char, Node *>::iterator it;
+    for (it = node->children.begin(); it != node->children.end(); ++it) {
+        freeNode(it->second);
+    }
+    delete node;
+}
+
+int DevpathTrie::insert(const char *prefix, Volume *v) {
+    int rc = 0;
+
+    pthread_mutex_lock(&mLock);
+    Node *node = mRoot;
+    for (const char *p = prefix; *p; p++) {
+        Node *&child = node->children[*p];
+        if (!child) {
+            child = new Node();
+        }
+        node = child;
+    }
+
+    if (node->volume && node->volume != v) {
+        errno = EEXIST;
+        rc = -1;
+    } else {
+        if (!node->volume) {
+            mCount++;
+        }
+        node->volume = v;
+    }
+    pthread_mutex_unlock(&mLock);
+    return rc;
+}
+
+int DevpathTrie::remove(const char *prefix) {
+    int rc = -1;
+
+    pthread_mutex_lock(&mLock);
+    Node *node = mRoot;
+    for (const char *p = prefix; *p && node; p++) {
+        std::map<char, Node *>::iterator it = node->children.find(*p);
+        node = (it == node->children.end()) ? NULL : it->second;
+    }
+
+    // Paths come and go only with encrypted volumes; leave the nodes be
+    if (node && node->volume) {
+        node->volume = NULL;
+        mCount--;
+        rc = 0;
+    } else {
+        errno = ENOENT;
+    }
+    pthread_mutex_unlock(&mLock);
+    return rc;
+}
+
+Volume *DevpathTrie::lookup(const char *devpath) {
+    pthread_mutex_lock(&mLock);
+    Node *node = mRoot;
+    Volume *owner = NULL;
+    for (const char *p = devpath; *p; p++) {
+        std::map<char, Node *>::iterator it = node->children.find(*p);
+        if (it == node->children.end()) {
+            break;
+        }
+        node = it->second;
+        if (node->volume) {
+            owner = node->volume;
+        }
+    }
+    pthread_mutex_unlock(&mLock);
+    return owner;
+}
+
+int DevpathTrie::size() {
+    pthread_mutex_lock(&mLock);
+    int count = mCount;
+    pthread_mutex_unlock(&mLock);
+    return count;
+}
@@ -0,0 +1,63 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _DEVPATHTRIE_H
+#define _DEVPATHTRIE_H
+
+#include <pthread.h>
+
+#include <map>
+
+class Volume;
+
+/*
+ * Character trie over the sysfs devpaths volumes manage. A registered path
+ * owns every devpath it is a prefix of, as the strncmp matching in
+ * DirectVolume always did, so routing a uevent is a single walk down its
+ * DEVPATH and anything that falls off the trie (loop, dm, ram, zram...) is
+ * known to be unmanaged right away. Where prefixes nest, the longest wins.
+ */
+class DevpathTrie {
+private:
+    struct Node {
+        std::map<char, Node *> children;
+        Volume                *volume;
+
+        Node() : volume(NULL) {}
+    };
+
+    pthread_mutex_t mLock;
+    Node           *mRoot;
+    int             mCount;
+
+public:
+    DevpathTrie();
+    virtual ~DevpathTrie();
+
+    /* Fails with EEXIST if 'prefix' already belongs to another volume */
+    int insert(const char *prefix, Volume *v);
+    /* Fails with ENOENT if 'prefix' isn't registered */
+    int remove(const char *prefix);
+    /* The volume owning 'devpath', or NULL */
+    Volume *lookup(const char *devpath);
+
+    int size();
+
+private:
+    static void freeNode(Node *node);
+};
+
+#endif
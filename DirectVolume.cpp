@@ -27,8 +27,10 @@
 #include <sysutils/NetlinkEvent.h>
 
 #include "DirectVolume.h"
+#include "BlockEvent.h"
 #include "VolumeManager.h"
 #include "ResponseCode.h"
+#include "SerialExecutor.h"
 #include "cryptfs.h"
 
 #define PARTITION_DEBUG
@@ -62,12 +64,17 @@ DirectVolume::DirectVolume(VolumeManager *vm, const fstab_rec* rec, int flags) :
 DirectVolume::~DirectVolume() {
     PathCollection::iterator it;
 
-    for (it = mPaths->begin(); it != mPaths->end(); ++it)
+    for (it = mPaths->begin(); it != mPaths->end(); ++it) {
+        mVm->unregisterDevpath(*it);
         free(*it);
+    }
     delete mPaths;
 }
 
 int DirectVolume::addPath(const char *path) {
+    if (mVm->registerDevpath(path, this)) {
+        return -1;
+    }
     mPaths->push_back(strdup(path));
     return 0;
 }
@@ -92,77 +99,145 @@ void DirectVolume::handleVolumeUnshared() {
     setState(Volume::State_Idle);
 }
 
-int DirectVolume::handleBlockEvent(NetlinkEvent *evt) {
-    const char *dp = evt->findParam("DEVPATH");
+/* Handles one uevent for this volume on its executor */
+class BlockEventTask : public WorkerTask {
+    DirectVolume *mVolume;
+    BlockEvent    mEvent;
 
-    PathCollection::iterator  it;
-    for (it = mPaths->begin(); it != mPaths->end(); ++it) {
-        if (!strncmp(dp, *it, strlen(*it))) {
-            /* We can handle this disk */
-            int action = evt->getAction();
-            const char *devtype = evt->findParam("DEVTYPE");
-
-            if (action == NetlinkEvent::NlActionAdd) {
-                int major = atoi(evt->findParam("MAJOR"));
-                int minor = atoi(evt->findParam("MINOR"));
-                char nodepath[255];
-
-                snprintf(nodepath,
-                         sizeof(nodepath), "/dev/block/vold/%d:%d",
-                         major, minor);
-                if (createDeviceNode(nodepath, major, minor)) {
-                    SLOGE("Error making device node '%s' (%s)", nodepath,
-                                                               strerror(errno));
-                }
-                if (!strcmp(devtype, "disk")) {
-                    handleDiskAdded(dp, evt);
-                } else {
-                    handlePartitionAdded(dp, evt);
-                }
-                /* Send notification iff disk is ready (ie all partitions found) */
-                if (getState() == Volume::State_Idle) {
-                    char msg[255];
-
-                    snprintf(msg, sizeof(msg),
-                             "Volume %s %s disk inserted (%d:%d)", getLabel(),
-                             getFuseMountpoint(), mDiskMajor, mDiskMinor);
-                    mVm->getBroadcaster()->sendBroadcast(ResponseCode::VolumeDiskInserted,
-                                                         msg, false);
-                }
-            } else if (action == NetlinkEvent::NlActionRemove) {
-                if (!strcmp(devtype, "disk")) {
+public:
+    BlockEventTask(DirectVolume *v, const BlockEvent &evt) : mVolume(v), mEvent(evt) {}
+
+    int run() {
+        mVolume->handleEvent(mEvent);
+        return 0;
+    }
+};
+
+/* Handles a settled disk's events on the executor without interruption */
+class SettledEventsTask : public WorkerTask {
+    DirectVolume            *mVolume;
+    std::vector<BlockEvent>  mEvents;
+
+public:
+    SettledEventsTask(DirectVolume *v, const std::vector<BlockEvent> &events)
+            : mVolume(v), mEvents(events) {}
+
+    int run() {
+        mVolume->handleSettledBatch(mEvents);
+        return 0;
+    }
+};
+
+/* Mount deferred until every partition of a re-inserted disk has shown up */
+class RetryMountTask : public WorkerTask {
+    Volume *mVolume;
+
+public:
+    RetryMountTask(Volume *v) : mVolume(v) {}
+
+    int run() {
+        return mVolume->mountVol();
+    }
+};
+
+/*
+ * VolumeManager has already routed the event here by its devpath. The event
+ * is queued behind whatever is in progress on this volume, so a long fsck
+ * or unmount here never holds up events for other volumes.
+ */
+int DirectVolume::handleBlockEvent(const BlockEvent &evt) {
+    mExecutor->post(new BlockEventTask(this, evt));
+    return 0;
+}
+
+int DirectVolume::handleSettledEvents(const std::vector<BlockEvent> &events) {
+    mExecutor->post(new SettledEventsTask(this, events));
+    return 0;
+}
+
+void DirectVolume::handleSettledBatch(const std::vector<BlockEvent> &events) {
+    for (size_t i = 0; i < events.size(); i++) {
+        handleEvent(events[i]);
+    }
+
+    checkColdbootReady();
+    if (getState() == Volume::State_NoMedia) {
+        // The disk is gone; its removal has been broadcast already
+        return;
+    }
+
+    char parts[128] = "none";
+    int len = 0;
+    for (int i = 1; i <= mDiskNumParts && i < MAX_PARTITIONS; i++) {
+        if (!(mPendingPartMap & (1 << i)) && len < (int) sizeof(parts) - 4) {
+            len += snprintf(parts + len, sizeof(parts) - len, "%s%d", len ? "," : "", i);
+        }
+    }
+
+    char msg[255];
+    snprintf(msg, sizeof(msg), "Volume %s %s disk settled (%d:%d) partitions %s",
+             getLabel(), getFuseMountpoint(), mDiskMajor, mDiskMinor, parts);
+    mVm->getBroadcaster()->sendBroadcast(ResponseCode::VolumeDiskSettled, msg, false);
+}
+
+void DirectVolume::handleEvent(const BlockEvent &evt) {
+    int action = evt.action;
+
+    if (action == NetlinkEvent::NlActionAdd) {
+        int major = evt.major;
+        int minor = evt.minor;
+        char nodepath[255];
+
+        snprintf(nodepath,
+                 sizeof(nodepath), "/dev/block/vold/%d:%d",
+                 major, minor);
+        if (createDeviceNode(nodepath, major, minor)) {
+            SLOGE("Error making device node '%s' (%s)", nodepath,
+                                                       strerror(errno));
+        }
+        if (evt.isDisk()) {
+            handleDiskAdded(evt);
+        } else {
+            handlePartitionAdded(evt);
+        }
+        /* Send notification iff disk is ready (ie all partitions found) */
+        if (getState() == Volume::State_Idle) {
+            char msg[255];
+
+            snprintf(msg, sizeof(msg),
+                     "Volume %s %s disk inserted (%d:%d)", getLabel(),
+                     getFuseMountpoint(), mDiskMajor, mDiskMinor);
+            mVm->getBroadcaster()->sendBroadcast(ResponseCode::VolumeDiskInserted,
+                                                 msg, false);
+        }
+    } else if (action == NetlinkEvent::NlActionRemove) {
+        if (evt.isDisk()) {
 #ifdef SUPPORTED_MULTI_USB_PARTITIONS
-                    if (!strcmp(getLabel(),USB_DISK_LABEL))
-                        handlePartitionRemoved(dp, evt);
+            if (!strcmp(getLabel(),USB_DISK_LABEL))
+                handlePartitionRemoved(evt);
 #endif
-                    handleDiskRemoved(dp, evt);
-                } else {
-                    handlePartitionRemoved(dp, evt);
-                }
-            } else if (action == NetlinkEvent::NlActionChange) {
-                if (!strcmp(devtype, "disk")) {
-                    handleDiskChanged(dp, evt);
-                } else {
-                    handlePartitionChanged(dp, evt);
-                }
-            } else {
-                    SLOGW("Ignoring non add/remove/change event");
-            }
-
-            return 0;
+            handleDiskRemoved(evt);
+        } else {
+            handlePartitionRemoved(evt);
         }
+    } else if (action == NetlinkEvent::NlActionChange) {
+        if (evt.isDisk()) {
+            handleDiskChanged(evt);
+        } else {
+            handlePartitionChanged(evt);
+        }
+    } else {
+            SLOGW("Ignoring non add/remove/change event");
     }
-    errno = ENODEV;
-    return -1;
+    checkColdbootReady();
 }
 
-void DirectVolume::handleDiskAdded(const char *devpath, NetlinkEvent *evt) {
-    mDiskMajor = atoi(evt->findParam("MAJOR"));
-    mDiskMinor = atoi(evt->findParam("MINOR"));
+void DirectVolume::handleDiskAdded(const BlockEvent &evt) {
+    mDiskMajor = evt.major;
+    mDiskMinor = evt.minor;
 
-    const char *tmp = evt->findParam("NPARTS");
-    if (tmp) {
-        mDiskNumParts = atoi(tmp);
+    if (evt.nparts >= 0) {
+        mDiskNumParts = evt.nparts;
     } else {
         SLOGW("Kernel block uevent missing 'NPARTS'");
         mDiskNumParts = 1;
@@ -199,16 +274,14 @@ void DirectVolume::handleDiskAdded(const char *devpath, NetlinkEvent *evt) {
     }
 }
 
-void DirectVolume::handlePartitionAdded(const char *devpath, NetlinkEvent *evt) {
-    int major = atoi(evt->findParam("MAJOR"));
-    int minor = atoi(evt->findParam("MINOR"));
+void DirectVolume::handlePartitionAdded(const BlockEvent &evt) {
+    int major = evt.major;
+    int minor = evt.minor;
 
     int part_num;
 
-    const char *tmp = evt->findParam("PARTN");
-
-    if (tmp) {
-        part_num = atoi(tmp);
+    if (evt.partn >= 0) {
+        part_num = evt.partn;
     } else {
         SLOGW("Kernel block uevent missing 'PARTN'");
         part_num = 1;
@@ -230,7 +303,7 @@ void DirectVolume::handlePartitionAdded(const char *devpath, NetlinkEvent *evt)
 	SLOGD("---handlePartitionAdded,part_num=%d,major=%d,minor=%d",part_num,major,minor);
 #endif
     if (major != mDiskMajor) {
-        SLOGE("Partition '%s' has a different major than its disk!", devpath);
+        SLOGE("Partition '%s' has a different major than its disk!", evt.devpath.c_str());
         return;
     }
 #ifdef PARTITION_DEBUG
@@ -251,7 +324,8 @@ void DirectVolume::handlePartitionAdded(const char *devpath, NetlinkEvent *evt)
             setState(Volume::State_Idle);
             if (mRetryMount == true) {
                 mRetryMount = false;
-                mountVol();
+                // Queued so the netlink thread isn't held up by fsck
+                mExecutor->post(new RetryMountTask(this));
             }
         }
     } else {
@@ -261,18 +335,17 @@ void DirectVolume::handlePartitionAdded(const char *devpath, NetlinkEvent *evt)
     }
 }
 
-void DirectVolume::handleDiskChanged(const char *devpath, NetlinkEvent *evt) {
-    int major = atoi(evt->findParam("MAJOR"));
-    int minor = atoi(evt->findParam("MINOR"));
+void DirectVolume::handleDiskChanged(const BlockEvent &evt) {
+    int major = evt.major;
+    int minor = evt.minor;
 
     if ((major != mDiskMajor) || (minor != mDiskMinor)) {
         return;
     }
 
     SLOGI("Volume %s disk has changed", getLabel());
-    const char *tmp = evt->findParam("NPARTS");
-    if (tmp) {
-        mDiskNumParts = atoi(tmp);
+    if (evt.nparts >= 0) {
+        mDiskNumParts = evt.nparts;
     } else {
         SLOGW("Kernel block uevent missing 'NPARTS'");
         mDiskNumParts = 1;
@@ -294,15 +367,15 @@ void DirectVolume::handleDiskChanged(const char *devpath, NetlinkEvent *evt) {
     }
 }
 
-void DirectVolume::handlePartitionChanged(const char *devpath, NetlinkEvent *evt) {
-    int major = atoi(evt->findParam("MAJOR"));
-    int minor = atoi(evt->findParam("MINOR"));
+void DirectVolume::handlePartitionChanged(const BlockEvent &evt) {
+    int major = evt.major;
+    int minor = evt.minor;
     SLOGD("Volume %s %s partition %d:%d changed\n", getLabel(), getMountpoint(), major, minor);
 }
 
-void DirectVolume::handleDiskRemoved(const char *devpath, NetlinkEvent *evt) {
-    int major = atoi(evt->findParam("MAJOR"));
-    int minor = atoi(evt->findParam("MINOR"));
+void DirectVolume::handleDiskRemoved(const BlockEvent &evt) {
+    int major = evt.major;
+    int minor = evt.minor;
     char msg[255];
 	char devicePath[255];
     bool enabled;
@@ -331,7 +404,7 @@ void DirectVolume::handleDiskRemoved(const char *devpath, NetlinkEvent *evt) {
         /*
          * Confirm partition removed.
          */
-         if (Volume::unmountVol(true, false)) {
+         if (getState() == Volume::State_Mounted && Volume::unmountVolMediaGone()) {
             SLOGE("Failed to unmount volume on bad removal (%s)",
                  strerror(errno));
              // XXX: At this point we're screwed for now
@@ -352,9 +425,9 @@ void DirectVolume::handleDiskRemoved(const char *devpath, NetlinkEvent *evt) {
     setState(Volume::State_NoMedia);
 }
 
-void DirectVolume::handlePartitionRemoved(const char *devpath, NetlinkEvent *evt) {
-    int major = atoi(evt->findParam("MAJOR"));
-    int minor = atoi(evt->findParam("MINOR"));
+void DirectVolume::handlePartitionRemoved(const BlockEvent &evt) {
+    int major = evt.major;
+    int minor = evt.minor;
     char msg[255];
     int state;
 
@@ -370,7 +443,7 @@ void DirectVolume::handlePartitionRemoved(const char *devpath, NetlinkEvent *evt
 
        char devicePath[255];
        sprintf(devicePath, "/dev/block/vold/%d:%d", major,minor);
-       SLOGD("handlePartitionRemoved,ready to unlink: %s (%s)",devicePath,devpath);
+       SLOGD("handlePartitionRemoved,ready to unlink: %s (%s)",devicePath,evt.devpath.c_str());
        if ( 0 != unlink(devicePath) ) {
            SLOGE("Failed to unlink %s",devicePath);
        } 
@@ -399,17 +472,12 @@ void DirectVolume::handlePartitionRemoved(const char *devpath, NetlinkEvent *evt
          * Yikes, our mounted partition is going away!
          */
 
-        bool providesAsec = (getFlags() & VOL_PROVIDES_ASEC) != 0;
-        if (providesAsec && mVm->cleanupAsec(this, true)) {
-            SLOGE("Failed to cleanup ASEC - unmount will probably fail!");
-        }
-
         snprintf(msg, sizeof(msg), "Volume %s %s bad removal (%d:%d)",
                  getLabel(), getFuseMountpoint(), major, minor);
         mVm->getBroadcaster()->sendBroadcast(ResponseCode::VolumeBadRemoval,
                                              msg, false);
 
-        if (Volume::unmountVol(true, false)) {
+        if (Volume::unmountVolMediaGone()) {
             SLOGE("Failed to unmount volume on bad removal (%s)", 
                  strerror(errno));
             // XXX: At this point we're screwed for now
@@ -479,10 +547,18 @@ int DirectVolume::updateDeviceInfo(char *new_path, int new_major, int new_minor)
         return -1;
     }
 
+    /* Claim the new path first, so a clash leaves the old one in place */
+    if (mVm->registerDevpath(new_path, this)) {
+        SLOGE("Cannot change path of %s to %s\n", getLabel(), new_path);
+        errno = EEXIST;
+        return -1;
+    }
+
     it = mPaths->begin();
+    mVm->unregisterDevpath(*it);
     free(*it); /* Free the string storage */
     mPaths->erase(it); /* Remove it from the list */
-    addPath(new_path); /* Put the new path on the list */
+    mPaths->push_back(strdup(new_path)); /* Put the new path on the list */
 
     /* Save away original info so we can restore it when doing factory reset.
      * Then, when doing the format, it will format the original device in the
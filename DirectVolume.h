@@ -25,7 +25,13 @@
 
 typedef android::List<char *> PathCollection;
 
+class BlockEventTask;
+class SettledEventsTask;
+
 class DirectVolume : public Volume {
+    friend class BlockEventTask;
+    friend class SettledEventsTask;
+
 public:
     static const int MAX_PARTITIONS = 32;
 protected:
@@ -55,7 +61,8 @@ public:
     const char *getUdiskMountpoint(char* devicepath,int major,int minor,char letter);
 #endif
 
-    int handleBlockEvent(NetlinkEvent *evt);
+    int handleBlockEvent(const BlockEvent &evt);
+    int handleSettledEvents(const std::vector<BlockEvent> &events);
     dev_t getDiskDevice();
     dev_t getShareDevice();
     void handleVolumeShared();
@@ -69,12 +76,15 @@ protected:
     int isDecrypted() { return mIsDecrypted; }
 
 private:
-    void handleDiskAdded(const char *devpath, NetlinkEvent *evt);
-    void handleDiskRemoved(const char *devpath, NetlinkEvent *evt);
-    void handleDiskChanged(const char *devpath, NetlinkEvent *evt);
-    void handlePartitionAdded(const char *devpath, NetlinkEvent *evt);
-    void handlePartitionRemoved(const char *devpath, NetlinkEvent *evt);
-    void handlePartitionChanged(const char *devpath, NetlinkEvent *evt);
+    /* These run on the executor */
+    void handleEvent(const BlockEvent &evt);
+    void handleSettledBatch(const std::vector<BlockEvent> &events);
+    void handleDiskAdded(const BlockEvent &evt);
+    void handleDiskRemoved(const BlockEvent &evt);
+    void handleDiskChanged(const BlockEvent &evt);
+    void handlePartitionAdded(const BlockEvent &evt);
+    void handlePartitionRemoved(const BlockEvent &evt);
+    void handlePartitionChanged(const BlockEvent &evt);
 
     int doMountVfat(const char *deviceNode, const char *mountPoint);
 
@@ -67,18 +67,26 @@ int Ext4::doMount(const char *fsPath, const char *mountPoint, bool ro, bool remo
     return rc;
 }
 
-int Ext4::format(const char *fsPath, const char *mountpoint) {
+int Ext4::format(const char *fsPath, const char *mountpoint, const char *label, bool wipe) {
     int fd;
-    const char *args[5];
+    const char *args[8];
+    int argc = 0;
     int rc;
     int status;
 
-    args[0] = MKEXT4FS_PATH;
-    args[1] = "-J";
-    args[2] = "-a";
-    args[3] = mountpoint;
-    args[4] = fsPath;
-    rc = android_fork_execvp(ARRAY_SIZE(args), (char **)args, &status, false,
+    args[argc++] = MKEXT4FS_PATH;
+    args[argc++] = "-J";
+    if (wipe) {
+        args[argc++] = "-w";
+    }
+    if (label && label[0]) {
+        args[argc++] = "-L";
+        args[argc++] = label;
+    }
+    args[argc++] = "-a";
+    args[argc++] = mountpoint;
+    args[argc++] = fsPath;
+    rc = android_fork_execvp(argc, (char **)args, &status, false,
             true);
     if (rc != 0) {
         SLOGE("Filesystem (ext4) format failed due to logwrap error");
@@ -23,7 +23,9 @@ class Ext4 {
 public:
     static int doMount(const char *fsPath, const char *mountPoint, bool ro, bool remount,
             bool executable);
-    static int format(const char *fsPath, const char *mountpoint);
+    /* 'label' may be NULL; 'wipe' discards the whole device first */
+    static int format(const char *fsPath, const char *mountpoint, const char *label = NULL,
+            bool wipe = false);
 };
 
 #endif
@@ -49,6 +49,154 @@ static char FSCK_MSDOS_PATH[] = "/system/bin/fsck_msdos";
 static char MKDOSFS_PATH[] = "/system/bin/newfs_msdos";
 extern "C" int mount(const char *, const char *, const char *, unsigned long, const void *);
 
+const int Fat::STATE_CLEAN;
+const int Fat::STATE_DIRTY;
+const int Fat::STATE_UNKNOWN;
+
+#define FAT_BOOT_SECTOR_SIZE 512
+
+/* Volume state byte the Linux and NT drivers set while mounted */
+#define FAT16_STATE_OFFSET   0x25
+#define FAT32_STATE_OFFSET   0x41
+#define FAT_STATE_DIRTY      0x01
+
+/* Flags in the FAT[1] entry, set while clean */
+#define FAT16_CLEAN_SHUTDOWN 0x8000
+#define FAT16_NO_IO_ERROR    0x4000
+#define FAT32_CLEAN_SHUTDOWN 0x08000000
+#define FAT32_NO_IO_ERROR    0x04000000
+
+enum { FAT_TYPE_12, FAT_TYPE_16, FAT_TYPE_32 };
+
+static unsigned int le16(const unsigned char *p) {
+    return p[0] | (p[1] << 8);
+}
+
+static unsigned int le32(const unsigned char *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int) p[3] << 24);
+}
+
+/*
+ * Sanity checks the BPB and works out the FAT type from the cluster count
+ * as the FAT specification defines it. Returns -1 if this isn't FAT.
+ */
+static int parseBpb(const unsigned char *boot, int *type, long long *fatOffset) {
+    unsigned int bytesPerSector = le16(boot + 0x0b);
+    unsigned int sectorsPerCluster = boot[0x0d];
+    unsigned int reservedSectors = le16(boot + 0x0e);
+    unsigned int numFats = boot[0x10];
+    unsigned int rootEntries = le16(boot + 0x11);
+    unsigned int totalSectors = le16(boot + 0x13);
+    unsigned int fatSize = le16(boot + 0x16);
+
+    if (boot[510] != 0x55 || boot[511] != 0xaa) {
+        return -1;
+    }
+    if (bytesPerSector < 512 || bytesPerSector > 4096 ||
+            (bytesPerSector & (bytesPerSector - 1))) {
+        return -1;
+    }
+    if (!sectorsPerCluster || (sectorsPerCluster & (sectorsPerCluster - 1)) ||
+            !reservedSectors || !numFats) {
+        return -1;
+    }
+
+    if (!totalSectors) {
+        totalSectors = le32(boot + 0x20);
+    }
+    if (!fatSize) {
+        fatSize = le32(boot + 0x24);
+    }
+
+    unsigned int rootSectors = ((rootEntries * 32) + (bytesPerSector - 1)) / bytesPerSector;
+    unsigned long long metaSectors = reservedSectors +
+            (unsigned long long) numFats * fatSize + rootSectors;
+    if (!fatSize || metaSectors >= totalSectors) {
+        return -1;
+    }
+
+    unsigned long long clusters = (totalSectors - metaSectors) / sectorsPerCluster;
+    if (clusters < 4085) {
+        *type = FAT_TYPE_12;
+    } else if (clusters < 65525) {
+        *type = FAT_TYPE_16;
+    } else {
+        *type = FAT_TYPE_32;
+    }
+    *fatOffset = (long long) reservedSectors * bytesPerSector;
+    return 0;
+}
+
+long long Fat::getFatOffset(const unsigned char *bootSector) {
+    int type;
+    long long offset;
+
+    if (parseBpb(bootSector, &type, &offset)) {
+        return -1;
+    }
+    return offset;
+}
+
+int Fat::parseCleanState(const unsigned char *bootSector, const unsigned char *fat) {
+    int type;
+    long long offset;
+
+    if (parseBpb(bootSector, &type, &offset)) {
+        return STATE_UNKNOWN;
+    }
+
+    switch (type) {
+    case FAT_TYPE_16: {
+        unsigned int entry = le16(fat + 2);
+        if ((bootSector[FAT16_STATE_OFFSET] & FAT_STATE_DIRTY) ||
+                !(entry & FAT16_CLEAN_SHUTDOWN) || !(entry & FAT16_NO_IO_ERROR)) {
+            return STATE_DIRTY;
+        }
+        return STATE_CLEAN;
+    }
+    case FAT_TYPE_32: {
+        unsigned int entry = le32(fat + 4);
+        if ((bootSector[FAT32_STATE_OFFSET] & FAT_STATE_DIRTY) ||
+                !(entry & FAT32_CLEAN_SHUTDOWN) || !(entry & FAT32_NO_IO_ERROR)) {
+            return STATE_DIRTY;
+        }
+        return STATE_CLEAN;
+    }
+    default:
+        return STATE_UNKNOWN;
+    }
+}
+
+int Fat::probeClean(const char *fsPath) {
+    unsigned char boot[FAT_BOOT_SECTOR_SIZE];
+    unsigned char fat[8];
+    int fd;
+
+    if ((fd = open(fsPath, O_RDONLY)) < 0) {
+        SLOGE("Unable to open %s for probing (%s)", fsPath, strerror(errno));
+        return -1;
+    }
+
+    int state = STATE_UNKNOWN;
+    long long offset;
+    if (pread(fd, boot, sizeof(boot), 0) != sizeof(boot)) {
+        SLOGW("Unable to read boot sector of %s (%s)", fsPath, strerror(errno));
+        state = -1;
+    } else if ((offset = getFatOffset(boot)) < 0) {
+        SLOGW("%s has no FAT boot sector we understand", fsPath);
+    } else if (pread64(fd, fat, sizeof(fat), offset) != sizeof(fat)) {
+        SLOGW("Unable to read FAT of %s (%s)", fsPath, strerror(errno));
+        state = -1;
+    } else {
+        state = parseCleanState(boot, fat);
+    }
+
+    int saved_errno = errno;
+    close(fd);
+    errno = saved_errno;
+    return state;
+}
+
 int Fat::check(const char *fsPath) {
     bool rw = true;
     if (access(FSCK_MSDOS_PATH, X_OK)) {
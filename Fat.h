@@ -21,7 +21,26 @@
 
 class Fat {
 public:
+    /* Results of probeClean() */
+    static const int STATE_CLEAN   = 0;
+    static const int STATE_DIRTY   = 1;
+    static const int STATE_UNKNOWN = 2;
+
     static int check(const char *fsPath);
+    /*
+     * Reads the boot sector and FAT[1] of 'fsPath' and reports whether the
+     * filesystem was cleanly unmounted without I/O errors. FAT12 keeps no
+     * such flags and anything unparseable is STATE_UNKNOWN; both still need
+     * a full check(). Returns -1 if the device can't be read.
+     */
+    static int probeClean(const char *fsPath);
+    /*
+     * The same decision from an in-memory boot sector (at least 512 bytes)
+     * and the first 8 bytes of the first FAT. Exposed for tests.
+     */
+    static int parseCleanState(const unsigned char *bootSector, const unsigned char *fat);
+    /* Byte offset of the first FAT, or -1 if 'bootSector' is not FAT */
+    static long long getFatOffset(const unsigned char *bootSector);
     static int doMount(const char *fsPath, const char *mountPoint,
                        bool ro, bool remount, bool executable,
                        int ownerUid, int ownerGid, int permMask,
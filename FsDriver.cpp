@@ -0,0 +1,346 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+
+#define LOG_TAG "Vold"
+
+#include <cutils/log.h>
+
+#include <sysutils/SocketClient.h>
+
+#include "FsDriver.h"
+#include "Fat.h"
+#include "Ext4.h"
+#include "Ntfs.h"
+#include "VoldUtil.h"
+
+const int FsDriver::STATE_CLEAN;
+const int FsDriver::STATE_DIRTY;
+const int FsDriver::STATE_UNKNOWN;
+
+std::vector<FsDriver *> FsDriver::sDrivers;
+
+static const char *kOpNames[] = { "probe", "check", "mount", "format", "trim" };
+
+FsDriver::FsDriver(const char *name) {
+    mName = name;
+    pthread_mutex_init(&mStatsLock, NULL);
+    memset(mStats, 0, sizeof(mStats));
+}
+
+FsDriver::~FsDriver() {
+    pthread_mutex_destroy(&mStatsLock);
+}
+
+void FsDriver::account(int op, unsigned long long start, int rc) {
+    unsigned long long elapsed = get_monotonic_us() - start;
+
+    pthread_mutex_lock(&mStatsLock);
+    mStats[op].calls++;
+    if (rc < 0) {
+        mStats[op].failures++;
+    }
+    mStats[op].totalUs += elapsed;
+    if (elapsed > mStats[op].maxUs) {
+        mStats[op].maxUs = elapsed;
+    }
+    pthread_mutex_unlock(&mStatsLock);
+
+    SLOGI("%s %s took %llu ms%s", mName, kOpNames[op], elapsed / 1000,
+          rc < 0 ? " and failed" : "");
+}
+
+int FsDriver::probeClean(const char *devicePath) {
+    unsigned long long start = get_monotonic_us();
+    int rc = doProbeClean(devicePath);
+    int saved_errno = errno;
+    account(OP_PROBE, start, rc);
+    errno = saved_errno;
+    return rc < 0 ? STATE_UNKNOWN : rc;
+}
+
+int FsDriver::check(const char *devicePath) {
+    unsigned long long start = get_monotonic_us();
+    int rc = doCheck(devicePath);
+    int saved_errno = errno;
+    account(OP_CHECK, start, rc);
+    errno = saved_errno;
+    return rc;
+}
+
+int FsDriver::mount(const char *devicePath, const char *mountPoint, const MountOptions &opts) {
+    unsigned long long start = get_monotonic_us();
+    int rc = doMount(devicePath, mountPoint, opts);
+    int saved_errno = errno;
+    account(OP_MOUNT, start, rc);
+    errno = saved_errno;
+    return rc;
+}
+
+int FsDriver::format(const char *devicePath, const char *mountPoint, const char *label,
+                     bool wipe) {
+    unsigned long long start = get_monotonic_us();
+    int rc = doFormat(devicePath, mountPoint, label, wipe);
+    int saved_errno = errno;
+    account(OP_FORMAT, start, rc);
+    errno = saved_errno;
+    return rc;
+}
+
+int FsDriver::trim(const char *mountPoint) {
+    unsigned long long start = get_monotonic_us();
+    int rc = doTrim(mountPoint);
+    int saved_errno = errno;
+    account(OP_TRIM, start, rc);
+    errno = saved_errno;
+    return rc;
+}
+
+int FsDriver::doProbeClean(const char *devicePath) {
+    return STATE_UNKNOWN;
+}
+
+int FsDriver::doCheck(const char *devicePath) {
+    SLOGE("Checking %s is not supported", mName);
+    errno = ENOSYS;
+    return -1;
+}
+
+int FsDriver::doFormat(const char *devicePath, const char *mountPoint, const char *label,
+                       bool wipe) {
+    SLOGE("Formatting as %s is not supported", mName);
+    errno = ENOSYS;
+    return -1;
+}
+
+int FsDriver::doTrim(const char *mountPoint) {
+    struct fstrim_range range;
+    int fd;
+
+    if ((fd = open(mountPoint, O_RDONLY | O_DIRECTORY)) < 0) {
+        SLOGE("Cannot open %s for FITRIM (%s)", mountPoint, strerror(errno));
+        return -1;
+    }
+
+    memset(&range, 0, sizeof(range));
+    range.len = ULLONG_MAX;
+    SLOGI("Invoking FITRIM ioctl on %s", mountPoint);
+    if (ioctl(fd, FITRIM, &range)) {
+        int saved_errno = errno;
+        SLOGE("FITRIM ioctl failed on %s (%s)", mountPoint, strerror(errno));
+        close(fd);
+        errno = saved_errno;
+        return -1;
+    }
+    close(fd);
+
+    SLOGI("Trimmed %llu bytes on %s", range.len, mountPoint);
+    return 0;
+}
+
+int FsDriver::dumpState(SocketClient *c) {
+    char buffer[256];
+
+    pthread_mutex_lock(&mStatsLock);
+    for (int op = 0; op < OP_COUNT; op++) {
+        const OpStats &s = mStats[op];
+        if (!s.calls) {
+            continue;
+        }
+        snprintf(buffer, sizeof(buffer), "%s %s: %u calls, %u failed, avg %llu ms, max %llu ms",
+                 mName, kOpNames[op], s.calls, s.failures, s.totalUs / s.calls / 1000,
+                 s.maxUs / 1000);
+        c->sendMsg(0, buffer, false);
+    }
+    pthread_mutex_unlock(&mStatsLock);
+    return 0;
+}
+
+FsDriver *FsDriver::lookup(const FsProbe::Result &fs) {
+    for (size_t i = 0; i < sDrivers.size(); i++) {
+        if (sDrivers[i]->handles(fs)) {
+            return sDrivers[i];
+        }
+    }
+    return NULL;
+}
+
+FsDriver *FsDriver::lookupByName(const char *name) {
+    for (size_t i = 0; i < sDrivers.size(); i++) {
+        if (!strcmp(sDrivers[i]->getName(), name)) {
+            return sDrivers[i];
+        }
+    }
+    return NULL;
+}
+
+void FsDriver::registerDriver(FsDriver *driver) {
+    sDrivers.push_back(driver);
+}
+
+int FsDriver::dumpAll(SocketClient *c) {
+    for (size_t i = 0; i < sDrivers.size(); i++) {
+        sDrivers[i]->dumpState(c);
+    }
+    return 0;
+}
+
+class FatDriver : public FsDriver {
+public:
+    FatDriver() : FsDriver("vfat") {}
+
+protected:
+    bool handles(const FsProbe::Result &fs) {
+        return fs.type == "vfat" || fs.type == "msdos";
+    }
+
+    int doProbeClean(const char *devicePath) {
+        switch (Fat::probeClean(devicePath)) {
+        case Fat::STATE_CLEAN:
+            return STATE_CLEAN;
+        case Fat::STATE_DIRTY:
+            return STATE_DIRTY;
+        case -1:
+            return -1;
+        default:
+            return STATE_UNKNOWN;
+        }
+    }
+
+    int doCheck(const char *devicePath) {
+        return Fat::check(devicePath);
+    }
+
+    int doMount(const char *devicePath, const char *mountPoint, const MountOptions &opts) {
+        return Fat::doMount(devicePath, mountPoint, opts.ro, false, opts.executable,
+                            opts.ownerUid, opts.ownerGid, opts.permMask, opts.createLost);
+    }
+
+    int doFormat(const char *devicePath, const char *mountPoint, const char *label, bool wipe) {
+        return Fat::format(devicePath, 0, wipe, label);
+    }
+};
+
+class NtfsDriver : public FsDriver {
+public:
+    NtfsDriver() : FsDriver("ntfs") {}
+
+    // ntfs-3g replays the log itself when mounting
+    bool hasChecker() {
+        return false;
+    }
+
+protected:
+    bool handles(const FsProbe::Result &fs) {
+        return fs.type == "ntfs";
+    }
+
+    int doMount(const char *devicePath, const char *mountPoint, const MountOptions &opts) {
+        return Ntfs::doMount(devicePath, mountPoint, opts.ro, opts.ownerUid);
+    }
+
+    // ntfs-3g is a fuse filesystem and doesn't pass FITRIM on
+    int doTrim(const char *mountPoint) {
+        SLOGE("Trimming %s is not supported", getName());
+        errno = ENOSYS;
+        return -1;
+    }
+};
+
+class Ext4Driver : public FsDriver {
+public:
+    Ext4Driver() : FsDriver("ext4") {}
+
+    // The journal is replayed by the kernel on mount
+    bool hasChecker() {
+        return false;
+    }
+
+protected:
+    bool handles(const FsProbe::Result &fs) {
+        return fs.type == "ext4";
+    }
+
+    /*
+     * ext4 has no mount options for ownership, so hand the root directory
+     * to the owner instead. Files already on the card keep their owners.
+     */
+    int doMount(const char *devicePath, const char *mountPoint, const MountOptions &opts) {
+        if (Ext4::doMount(devicePath, mountPoint, opts.ro, false, opts.executable)) {
+            return -1;
+        }
+        if (!opts.ro && (chown(mountPoint, opts.ownerUid, opts.ownerGid) ||
+                chmod(mountPoint, 0777 & ~opts.permMask))) {
+            SLOGW("Unable to set owner of %s (%s)", mountPoint, strerror(errno));
+        }
+        return 0;
+    }
+
+    int doFormat(const char *devicePath, const char *mountPoint, const char *label, bool wipe) {
+        return Ext4::format(devicePath, mountPoint, label, wipe);
+    }
+};
+
+/*
+ * Only ever used for internal partitions, which fs_mgr mounts, so it never
+ * claims removable media and can't mount it; it is there for fstrim.
+ */
+class F2fsDriver : public FsDriver {
+public:
+    F2fsDriver() : FsDriver("f2fs") {}
+
+    bool hasChecker() {
+        return false;
+    }
+
+protected:
+    bool handles(const FsProbe::Result &fs) {
+        return false;
+    }
+
+    int doMount(const char *devicePath, const char *mountPoint, const MountOptions &opts) {
+        SLOGE("Mounting %s is not supported", getName());
+        errno = ENOSYS;
+        return -1;
+    }
+};
+
+void FsDriver::registerBuiltins() {
+    registerDriver(new FatDriver());
+    registerDriver(new NtfsDriver());
+    registerDriver(new Ext4Driver());
+    registerDriver(new F2fsDriver());
+}
+
+extern "C" int vold_trimFilesystem(const char *fsType, const char *mountPoint) {
+    FsDriver *driver = FsDriver::lookupByName(fsType);
+
+    if (!driver) {
+        SLOGE("No driver to trim %s (%s)", mountPoint, fsType);
+        errno = ENOSYS;
+        return -1;
+    }
+    return driver->trim(mountPoint);
+}
@@ -0,0 +1,124 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _FSDRIVER_H
+#define _FSDRIVER_H
+
+#ifdef __cplusplus
+#include <pthread.h>
+
+#include <vector>
+
+#include "FsProbe.h"
+
+class SocketClient;
+
+/*
+ * A filesystem vold can put on removable media. Volume picks the driver
+ * from the probe result and only goes through this interface, so adding a
+ * filesystem doesn't touch the mount state machine. fstrim goes through it
+ * as well for the internal partitions. The public calls time
+ * themselves; 'dump' reports the numbers per driver.
+ */
+class FsDriver {
+public:
+    /* Results of probeClean() */
+    static const int STATE_CLEAN   = 0;
+    static const int STATE_DIRTY   = 1;
+    static const int STATE_UNKNOWN = 2;
+
+    struct MountOptions {
+        bool ro;
+        bool executable;
+        int  ownerUid;
+        int  ownerGid;
+        int  permMask;
+        bool createLost;
+    };
+
+private:
+    enum { OP_PROBE, OP_CHECK, OP_MOUNT, OP_FORMAT, OP_TRIM, OP_COUNT };
+
+    struct OpStats {
+        unsigned int       calls;
+        unsigned int       failures;
+        unsigned long long totalUs;
+        unsigned long long maxUs;
+    };
+
+    static std::vector<FsDriver *> sDrivers;
+
+    const char      *mName;
+    pthread_mutex_t  mStatsLock;
+    OpStats          mStats[OP_COUNT];
+
+public:
+    virtual ~FsDriver();
+
+    const char *getName() const { return mName; }
+
+    /*
+     * Cheap check for whether a full check() is needed. Drivers without a
+     * checker skip both.
+     */
+    virtual bool hasChecker() { return true; }
+    int probeClean(const char *devicePath);
+    int check(const char *devicePath);
+    int mount(const char *devicePath, const char *mountPoint, const MountOptions &opts);
+    int format(const char *devicePath, const char *mountPoint, const char *label, bool wipe);
+    /* Discards the unused blocks of the filesystem mounted at 'mountPoint' */
+    int trim(const char *mountPoint);
+
+    int dumpState(SocketClient *c);
+
+    /* The first registered driver that handles the probed type, or NULL */
+    static FsDriver *lookup(const FsProbe::Result &fs);
+    static FsDriver *lookupByName(const char *name);
+    static void registerDriver(FsDriver *driver);
+    /* Registers vfat, ntfs, ext4 and f2fs, in that order */
+    static void registerBuiltins();
+    static int dumpAll(SocketClient *c);
+
+protected:
+    FsDriver(const char *name);
+
+    /* Whether a blkid TYPE belongs to this driver */
+    virtual bool handles(const FsProbe::Result &fs) = 0;
+    /* One of the STATE_ values, or -1 with errno set if the device can't be read */
+    virtual int doProbeClean(const char *devicePath);
+    /* Fails with ENOSYS unless overridden, along with hasChecker() */
+    virtual int doCheck(const char *devicePath);
+    virtual int doMount(const char *devicePath, const char *mountPoint,
+                        const MountOptions &opts) = 0;
+    /* Fails with ENOSYS unless overridden */
+    virtual int doFormat(const char *devicePath, const char *mountPoint, const char *label,
+                         bool wipe);
+    /* FITRIM on the mountpoint; fails with ENOSYS for drivers that can't */
+    virtual int doTrim(const char *mountPoint);
+
+private:
+    void account(int op, unsigned long long start, int rc);
+};
+
+extern "C" {
+#endif /* __cplusplus */
+    /* FsDriver::trim() for C callers, through the driver named 'fsType' */
+    int vold_trimFilesystem(const char *fsType, const char *mountPoint);
+#ifdef __cplusplus
+}
+#endif
+
+#endif
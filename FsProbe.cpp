@@ -0,0 +1,73 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+#include <errno.h>
+
+#define LOG_TAG "Vold"
+
+#include <cutils/log.h>
+
+#include "blkid/blkid.h"
+
+#include "FsProbe.h"
+#include "VoldUtil.h"
+
+int FsProbe::probe(const char *devicePath, Result *result) {
+    blkid_cache cache = NULL;
+    unsigned long long start = get_monotonic_us();
+
+    result->type.clear();
+    result->uuid.clear();
+    result->label.clear();
+
+    // Keep the cache in memory only; nothing is written under /data
+    if (blkid_get_cache(&cache, "/dev/null") < 0) {
+        SLOGE("Unable to create blkid cache");
+        errno = ENOMEM;
+        return -1;
+    }
+
+    blkid_dev dev = blkid_get_dev(cache, devicePath, BLKID_DEV_NORMAL);
+    if (dev) {
+        blkid_tag_iterate iter = blkid_tag_iterate_begin(dev);
+        const char *type;
+        const char *value;
+
+        while (blkid_tag_next(iter, &type, &value) == 0) {
+            if (!strcmp(type, "TYPE")) {
+                result->type = value;
+            } else if (!strcmp(type, "UUID")) {
+                result->uuid = value;
+            } else if (!strcmp(type, "LABEL")) {
+                result->label = value;
+            }
+        }
+        blkid_tag_iterate_end(iter);
+    }
+    blkid_put_cache(cache);
+
+    if (result->type.empty()) {
+        SLOGW("%s has no filesystem blkid recognizes", devicePath);
+        errno = ENODATA;
+        return -1;
+    }
+
+    SLOGI("%s is %s UUID=\"%s\" LABEL=\"%s\" (probed in %llu us)", devicePath,
+          result->type.c_str(), result->uuid.c_str(), result->label.c_str(),
+          get_monotonic_us() - start);
+    return 0;
+}
@@ -0,0 +1,38 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _FSPROBE_H
+#define _FSPROBE_H
+
+#include <string>
+
+/*
+ * Identifies the filesystem on a block device with the statically linked
+ * libblkid, reading its superblock once and without a cache file.
+ */
+class FsProbe {
+public:
+    struct Result {
+        std::string type;   /* blkid TYPE, e.g. "vfat" or "ntfs" */
+        std::string uuid;
+        std::string label;
+    };
+
+    /* Fails with ENODATA if no known filesystem was found */
+    static int probe(const char *devicePath, Result *result);
+};
+
+#endif
@@ -0,0 +1,166 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#define LOG_TAG "Vold"
+
+#include <cutils/log.h>
+
+#include <sysutils/SocketClient.h>
+#include <sysutils/SocketListener.h>
+
+#include "JobEngine.h"
+#include "ResponseCode.h"
+#include "SerialExecutor.h"
+#include "VoldUtil.h"
+
+JobEngine *JobEngine::sInstance = NULL;
+
+JobEngine *JobEngine::Instance() {
+    if (!sInstance)
+        sInstance = new JobEngine();
+    return sInstance;
+}
+
+JobEngine::JobEngine() {
+    pthread_mutex_init(&mLock, NULL);
+    pthread_cond_init(&mCond, NULL);
+    mNextId = 1;
+    mBroadcaster = NULL;
+}
+
+JobEngine::~JobEngine() {
+    pthread_cond_destroy(&mCond);
+    pthread_mutex_destroy(&mLock);
+}
+
+int JobEngine::start() {
+    if (pthread_create(&mThread, NULL, JobEngine::threadStart, this)) {
+        SLOGE("pthread_create (%s)", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+int JobEngine::submit(Job *job) {
+    pthread_mutex_lock(&mLock);
+    job->mId = mNextId++;
+    job->mQueuedUs = get_monotonic_us();
+    mQueue.push_back(job);
+    int id = job->mId;
+    pthread_cond_signal(&mCond);
+    pthread_mutex_unlock(&mLock);
+
+    SLOGI("Job %d queued: %s", id, job->getDescription());
+    return id;
+}
+
+int JobEngine::listJobs(SocketClient *c) {
+    char buffer[256];
+
+    pthread_mutex_lock(&mLock);
+    for (std::list<Job *>::iterator it = mRunning.begin(); it != mRunning.end(); ++it) {
+        snprintf(buffer, sizeof(buffer), "%d running %s", (*it)->mId, (*it)->getDescription());
+        c->sendMsg(ResponseCode::JobListResult, buffer, false);
+    }
+    for (std::list<Job *>::iterator it = mQueue.begin(); it != mQueue.end(); ++it) {
+        snprintf(buffer, sizeof(buffer), "%d queued %s", (*it)->mId, (*it)->getDescription());
+        c->sendMsg(ResponseCode::JobListResult, buffer, false);
+    }
+    pthread_mutex_unlock(&mLock);
+    return 0;
+}
+
+void JobEngine::broadcast(int code, const char *msg) {
+    if (mBroadcaster) {
+        mBroadcaster->sendBroadcast(code, msg, false);
+    }
+}
+
+void *JobEngine::threadStart(void *obj) {
+    JobEngine *me = reinterpret_cast<JobEngine *>(obj);
+
+    me->runJobs();
+    pthread_exit(NULL);
+    return NULL;
+}
+
+/* Runs a dispatched job on the executor it asked for */
+class ExecutorJobTask : public WorkerTask {
+    JobEngine *mEngine;
+    Job       *mJob;
+
+public:
+    ExecutorJobTask(JobEngine *engine, Job *job) : mEngine(engine), mJob(job) {}
+
+    int run() {
+        return mEngine->runJob(mJob);
+    }
+};
+
+void JobEngine::runJobs() {
+    while (true) {
+        pthread_mutex_lock(&mLock);
+        while (mQueue.empty()) {
+            pthread_cond_wait(&mCond, &mLock);
+        }
+        Job *job = mQueue.front();
+        mQueue.pop_front();
+        mRunning.push_back(job);
+        pthread_mutex_unlock(&mLock);
+
+        SerialExecutor *executor = job->getExecutor();
+        if (executor) {
+            executor->post(new ExecutorJobTask(this, job));
+        } else {
+            runJob(job);
+        }
+    }
+}
+
+/* Runs and deletes 'job', which must be on mRunning */
+int JobEngine::runJob(Job *job) {
+    char msg[256];
+
+    unsigned long long start = get_monotonic_us();
+    snprintf(msg, sizeof(msg), "%d started %s", job->mId, job->getDescription());
+    broadcast(ResponseCode::JobProgress, msg);
+
+    errno = 0;
+    int code = ResponseCode::CommandOkay;
+    if (job->run()) {
+        code = ResponseCode::convertFromErrno();
+    }
+
+    unsigned long long end = get_monotonic_us();
+    SLOGI("Job %d (%s) finished with %d after %llu ms, queued for %llu ms", job->mId,
+          job->getDescription(), code, (end - start) / 1000,
+          (start - job->mQueuedUs) / 1000);
+    snprintf(msg, sizeof(msg), "%d %d %s", job->mId, code,
+             job->mResult.empty() ? job->getDescription() : job->mResult.c_str());
+    broadcast(ResponseCode::JobCompleted, msg);
+
+    pthread_mutex_lock(&mLock);
+    mRunning.remove(job);
+    pthread_mutex_unlock(&mLock);
+    delete job;
+
+    // The outcome has been broadcast; don't let the executor log it again
+    return 0;
+}
@@ -0,0 +1,102 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _JOBENGINE_H
+#define _JOBENGINE_H
+
+#include <pthread.h>
+
+#include <list>
+#include <string>
+
+class SerialExecutor;
+class SocketClient;
+class SocketListener;
+
+/*
+ * A long running command queued through 'job'. run() returns 0 or -1 with
+ * errno set, exactly like the synchronous command would. The completion
+ * broadcast carries the description unless run() sets a result.
+ */
+class Job {
+    friend class JobEngine;
+
+    int                mId;
+    std::string        mDescription;
+    std::string        mResult;
+    unsigned long long mQueuedUs;
+
+public:
+    Job(const char *description) : mId(-1), mDescription(description), mQueuedUs(0) {}
+    virtual ~Job() {}
+
+    virtual int run() = 0;
+    /*
+     * Executor the job must run on, typically that of the volume it works
+     * on, or NULL for the engine's own thread.
+     */
+    virtual SerialExecutor *getExecutor() { return NULL; }
+
+    int getId() const { return mId; }
+    const char *getDescription() const { return mDescription.c_str(); }
+
+protected:
+    void setResult(const char *result) { mResult = result; }
+};
+
+/*
+ * Runs mutating commands off the listener thread so queries keep being
+ * answered while a slow unmount or fsck is in progress. Jobs are dispatched
+ * in submission order; those bound to an executor run there, so jobs on
+ * different volumes overlap while jobs on one volume stay ordered. The rest
+ * run one at a time on the engine's thread. Start and completion are
+ * broadcast as JobProgress and JobCompleted with the job id first.
+ */
+class JobEngine {
+    friend class ExecutorJobTask;
+
+private:
+    static JobEngine *sInstance;
+
+    pthread_mutex_t   mLock;
+    pthread_cond_t    mCond;
+    pthread_t         mThread;
+    std::list<Job *>  mQueue;
+    std::list<Job *>  mRunning;
+    int               mNextId;
+    SocketListener   *mBroadcaster;
+
+public:
+    static JobEngine *Instance();
+    virtual ~JobEngine();
+
+    int start();
+    void setBroadcaster(SocketListener *sl) { mBroadcaster = sl; }
+
+    /* Takes ownership of 'job' and returns its id */
+    int submit(Job *job);
+    /* Sends the running and queued jobs as JobListResult lines */
+    int listJobs(SocketClient *c);
+
+private:
+    JobEngine();
+    static void *threadStart(void *obj);
+    void runJobs();
+    int runJob(Job *job);
+    void broadcast(int code, const char *msg);
+};
+
+#endif
@@ -20,6 +20,9 @@
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
 
 #include <sys/mount.h>
 #include <sys/types.h>
@@ -31,121 +34,250 @@
 #define LOG_TAG "Vold"
 
 #include <cutils/log.h>
+#include <cutils/properties.h>
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
 
 #include <sysutils/SocketClient.h>
 #include "Loop.h"
 #include "Asec.h"
 
-int Loop::dumpState(SocketClient *c) {
-    int i;
-    int fd;
-    char filename[256];
+#ifndef LOOP_CTL_GET_FREE
+#define LOOP_CTL_GET_FREE 0x4C82
+#endif
 
-    for (i = 0; i < LOOP_MAX; i++) {
-        struct loop_info64 li;
-        int rc;
+#ifndef LOOP_SET_DIRECT_IO
+#define LOOP_SET_DIRECT_IO 0x4C08
+#endif
 
-        sprintf(filename, "/dev/block/loop%d", i);
+#ifndef LOOP_CONFIGURE
+#define LOOP_CONFIGURE 0x4C0A
 
-        if ((fd = open(filename, O_RDWR)) < 0) {
-            if (errno != ENOENT) {
-                SLOGE("Unable to open %s (%s)", filename, strerror(errno));
-            } else {
-                continue;
-            }
+struct loop_config {
+    __u32               fd;
+    __u32               block_size;
+    struct loop_info64  info;
+    __u64               __reserved[8];
+};
+#endif
+
+/* The LO_FLAGS_* values are an enum, so older headers can't be tested for them */
+#define LO_READ_ONLY_FLAG  1
+#define LO_AUTOCLEAR_FLAG  4
+#define LO_PARTSCAN_FLAG   8
+#define LO_DIRECT_IO_FLAG 16
+
+/*
+ * Containers are laid out in 512 byte sectors: FAT images use 512 byte
+ * logical sectors and the ASEC superblock lives in the final sector.
+ */
+#define LOOP_BLOCK_SIZE 512
+
+#define LOOP_CONTROL_PATH "/dev/loop-control"
+#define LOOP_SYSFS_DIR "/sys/block"
+#define LOOP_CREATE_RETRIES 5
+
+/*
+ * Index of the loop devices vold has bound, keyed by the id stored in
+ * lo_crypt_name. Loaded from sysfs the first time it is needed and kept
+ * current by create() and destroyByDevice().
+ */
+static pthread_mutex_t sIndexLock = PTHREAD_MUTEX_INITIALIZER;
+static bool sIndexLoaded = false;
+static std::map<std::string, std::string> sActive;
+
+static bool sHasLoopConfigure = true;
+
+/*
+ * The kernel starts us off with 8 loop nodes, but more
+ * are created on-demand if needed.
+ */
+static int makeLoopNode(int n, char *filename, size_t len) {
+    snprintf(filename, len, "/dev/block/loop%d", n);
+
+    mode_t mode = 0660 | S_IFBLK;
+    unsigned int dev = (0xff & n) | ((n << 12) & 0xfff00000) | (7 << 8);
+    if (mknod(filename, mode, dev) < 0) {
+        if (errno != EEXIST) {
+            SLOGE("Error creating loop device node (%s)", strerror(errno));
             return -1;
         }
+    }
+    return 0;
+}
 
-        rc = ioctl(fd, LOOP_GET_STATUS64, &li);
-        close(fd);
-        if (rc < 0 && errno == ENXIO) {
-            continue;
-        }
+/*
+ * Collects the numbers of all loop devices that have a backing file.
+ */
+static int listBoundLoops(std::vector<int> *loops) {
+    DIR *d;
+    struct dirent *de;
+    char path[PATH_MAX];
+    int n;
+
+    if (!(d = opendir(LOOP_SYSFS_DIR))) {
+        SLOGE("Unable to open %s (%s)", LOOP_SYSFS_DIR, strerror(errno));
+        return -1;
+    }
 
-        if (rc < 0) {
-            SLOGE("Unable to get loop status for %s (%s)", filename,
-                 strerror(errno));
-            return -1;
+    while ((de = readdir(d))) {
+        if (sscanf(de->d_name, "loop%d", &n) != 1)
+            continue;
+        snprintf(path, sizeof(path), "%s/%s/loop/backing_file", LOOP_SYSFS_DIR, de->d_name);
+        if (!access(path, F_OK)) {
+            loops->push_back(n);
         }
-        char *tmp = NULL;
-        asprintf(&tmp, "%s %d %lld:%lld %llu %lld:%lld %lld 0x%x {%s} {%s}", filename, li.lo_number,
-                MAJOR(li.lo_device), MINOR(li.lo_device), li.lo_inode, MAJOR(li.lo_rdevice),
-                        MINOR(li.lo_rdevice), li.lo_offset, li.lo_flags, li.lo_crypt_name,
-                        li.lo_file_name);
-        c->sendMsg(0, tmp, false);
-        free(tmp);
     }
+    closedir(d);
+
+    std::sort(loops->begin(), loops->end());
     return 0;
 }
 
-int Loop::lookupActive(const char *id, char *buffer, size_t len) {
-    int i;
+static int getStatus(const char *filename, struct loop_info64 *li) {
     int fd;
+    int rc;
+
+    if ((fd = open(filename, O_RDONLY)) < 0) {
+        SLOGE("Unable to open %s (%s)", filename, strerror(errno));
+        return -1;
+    }
+
+    rc = ioctl(fd, LOOP_GET_STATUS64, li);
+    close(fd);
+    return rc;
+}
+
+static int loadIndexLocked() {
+    std::vector<int> loops;
     char filename[256];
 
-    memset(buffer, 0, len);
+    if (sIndexLoaded) {
+        return 0;
+    }
+    if (listBoundLoops(&loops)) {
+        return -1;
+    }
 
-    for (i = 0; i < LOOP_MAX; i++) {
+    for (size_t i = 0; i < loops.size(); i++) {
         struct loop_info64 li;
-        int rc;
-
-        sprintf(filename, "/dev/block/loop%d", i);
 
-        if ((fd = open(filename, O_RDWR)) < 0) {
-            if (errno != ENOENT) {
-                SLOGE("Unable to open %s (%s)", filename, strerror(errno));
-            } else {
-                continue;
-            }
-            return -1;
+        if (makeLoopNode(loops[i], filename, sizeof(filename))) {
+            continue;
         }
-
-        rc = ioctl(fd, LOOP_GET_STATUS64, &li);
-        close(fd);
-        if (rc < 0 && errno == ENXIO) {
+        if (getStatus(filename, &li) < 0) {
             continue;
         }
+        li.lo_crypt_name[LO_NAME_SIZE - 1] = '\0';
+        if (li.lo_crypt_name[0]) {
+            sActive[(const char *) li.lo_crypt_name] = filename;
+        }
+    }
 
-        if (rc < 0) {
+    SLOGI("Found %zu bound loop devices, %zu of them ours", loops.size(), sActive.size());
+    sIndexLoaded = true;
+    return 0;
+}
+
+static void flagsToStr(unsigned int flags, char *buffer, size_t len) {
+    static const struct {
+        unsigned int flag;
+        const char *name;
+    } names[] = {
+        { LO_AUTOCLEAR_FLAG, "autoclear" },
+        { LO_PARTSCAN_FLAG,  "partscan" },
+        { LO_DIRECT_IO_FLAG, "dio" },
+    };
+
+    strlcpy(buffer, (flags & LO_READ_ONLY_FLAG) ? "ro" : "rw", len);
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if (flags & names[i].flag) {
+            strlcat(buffer, ",", len);
+            strlcat(buffer, names[i].name, len);
+        }
+    }
+}
+
+int Loop::init() {
+    int rc;
+
+    pthread_mutex_lock(&sIndexLock);
+    rc = loadIndexLocked();
+    pthread_mutex_unlock(&sIndexLock);
+    return rc;
+}
+
+int Loop::dumpState(SocketClient *c) {
+    std::vector<int> loops;
+    char filename[256];
+
+    if (listBoundLoops(&loops)) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < loops.size(); i++) {
+        struct loop_info64 li;
+
+        snprintf(filename, sizeof(filename), "/dev/block/loop%d", loops[i]);
+        if (getStatus(filename, &li) < 0) {
+            if (errno == ENXIO || errno == ENOENT) {
+                continue;
+            }
             SLOGE("Unable to get loop status for %s (%s)", filename,
                  strerror(errno));
             return -1;
         }
-        if (!strncmp((const char*) li.lo_crypt_name, id, LO_NAME_SIZE)) {
-            break;
-        }
-    }
+        char flags[64];
+        flagsToStr(li.lo_flags, flags, sizeof(flags));
 
-    if (i == LOOP_MAX) {
-        errno = ENOENT;
-        return -1;
+        char *tmp = NULL;
+        asprintf(&tmp, "%s %d %lld:%lld %llu %lld:%lld %lld 0x%x <%s> {%s} {%s}", filename,
+                li.lo_number, MAJOR(li.lo_device), MINOR(li.lo_device), li.lo_inode,
+                        MAJOR(li.lo_rdevice), MINOR(li.lo_rdevice), li.lo_offset, li.lo_flags,
+                        flags, li.lo_crypt_name, li.lo_file_name);
+        c->sendMsg(0, tmp, false);
+        free(tmp);
     }
-    strncpy(buffer, filename, len -1);
     return 0;
 }
 
-int Loop::create(const char *id, const char *loopFile, char *loopDeviceBuffer, size_t len) {
+int Loop::lookupActive(const char *id, char *buffer, size_t len) {
+    int rc = -1;
+
+    memset(buffer, 0, len);
+
+    pthread_mutex_lock(&sIndexLock);
+    if (!loadIndexLocked()) {
+        std::map<std::string, std::string>::iterator it =
+                sActive.find(std::string(id, strnlen(id, LO_NAME_SIZE - 1)));
+        if (it == sActive.end()) {
+            errno = ENOENT;
+        } else {
+            strncpy(buffer, it->second.c_str(), len - 1);
+            rc = 0;
+        }
+    }
+    pthread_mutex_unlock(&sIndexLock);
+    return rc;
+}
+
+/*
+ * Pre-3.1 kernels have no loop-control, so walk the nodes looking for one
+ * without a backing file. Returns the open device fd.
+ */
+static int findFreeLegacy(char *filename, size_t len) {
     int i;
     int fd;
-    char filename[256];
 
-    for (i = 0; i < LOOP_MAX; i++) {
+    for (i = 0; i < Loop::LOOP_MAX; i++) {
         struct loop_info64 li;
         int rc;
 
-        sprintf(filename, "/dev/block/loop%d", i);
-
-        /*
-         * The kernel starts us off with 8 loop nodes, but more
-         * are created on-demand if needed.
-         */
-        mode_t mode = 0660 | S_IFBLK;
-        unsigned int dev = (0xff & i) | ((i << 12) & 0xfff00000) | (7 << 8);
-        if (mknod(filename, mode, dev) < 0) {
-            if (errno != EEXIST) {
-                SLOGE("Error creating loop device node (%s)", strerror(errno));
-                return -1;
-            }
+        if (makeLoopNode(i, filename, len)) {
+            return -1;
         }
 
         if ((fd = open(filename, O_RDWR)) < 0) {
@@ -155,7 +287,7 @@ int Loop::create(const char *id, const char *loopFile, char *loopDeviceBuffer, s
 
         rc = ioctl(fd, LOOP_GET_STATUS64, &li);
         if (rc < 0 && errno == ENXIO)
-            break;
+            return fd;
 
         close(fd);
 
@@ -166,26 +298,119 @@ int Loop::create(const char *id, const char *loopFile, char *loopDeviceBuffer, s
         }
     }
 
-    if (i == LOOP_MAX) {
-        SLOGE("Exhausted all loop devices");
-        errno = ENOSPC;
+    SLOGE("Exhausted all loop devices");
+    errno = ENOSPC;
+    return -1;
+}
+
+/*
+ * Asks the kernel for an unbound loop device, creating it if needed.
+ * Returns the open device fd.
+ */
+static int findFree(char *filename, size_t len) {
+    int ctl_fd;
+    int n;
+    int fd;
+
+    if ((ctl_fd = open(LOOP_CONTROL_PATH, O_RDWR)) < 0) {
+        if (errno == ENOENT) {
+            return findFreeLegacy(filename, len);
+        }
+        SLOGE("Unable to open %s (%s)", LOOP_CONTROL_PATH, strerror(errno));
         return -1;
     }
 
-    strncpy(loopDeviceBuffer, filename, len -1);
-
-    int file_fd;
+    n = ioctl(ctl_fd, LOOP_CTL_GET_FREE);
+    close(ctl_fd);
+    if (n < 0) {
+        SLOGE("Unable to allocate loop device (%s)", strerror(errno));
+        return -1;
+    }
 
-    if ((file_fd = open(loopFile, O_RDWR)) < 0) {
-        SLOGE("Unable to open %s (%s)", loopFile, strerror(errno));
-        close(fd);
+    if (makeLoopNode(n, filename, len)) {
+        return -1;
+    }
+    if ((fd = open(filename, O_RDWR)) < 0) {
+        SLOGE("Unable to open %s (%s)", filename, strerror(errno));
         return -1;
     }
+    return fd;
+}
+
+static bool useDirectIo() {
+    char value[PROPERTY_VALUE_MAX];
+
+    property_get("ro.vold.loop_direct_io", value, "1");
+    return strcmp(value, "0") && strcmp(value, "false");
+}
+
+/*
+ * Binds and configures the device with a single LOOP_CONFIGURE. Returns
+ * 1 if the kernel does not know the ioctl so the caller can fall back.
+ */
+static int configure(int fd, int file_fd, const struct loop_info64 *li) {
+    struct loop_config config;
+
+    if (!sHasLoopConfigure) {
+        return 1;
+    }
+
+    memset(&config, 0, sizeof(config));
+    config.fd = file_fd;
+    config.block_size = LOOP_BLOCK_SIZE;
+    memcpy(&config.info, li, sizeof(config.info));
+
+    if (ioctl(fd, LOOP_CONFIGURE, &config) == 0) {
+        return 0;
+    }
+    if (errno == EINVAL || errno == ENOTTY) {
+        SLOGI("LOOP_CONFIGURE not supported, using LOOP_SET_FD");
+        sHasLoopConfigure = false;
+        return 1;
+    }
+    return -1;
+}
+
+/*
+ * Pre-5.8 path: bind, then set the status. Read-only comes from how the
+ * backing file was opened, and direct I/O is switched on afterwards when
+ * the kernel has LOOP_SET_DIRECT_IO.
+ */
+static int setFdAndStatus(int fd, int file_fd, const struct loop_info64 *li) {
+    struct loop_info64 status;
 
     if (ioctl(fd, LOOP_SET_FD, file_fd) < 0) {
-        SLOGE("Error setting up loopback interface (%s)", strerror(errno));
-        close(file_fd);
-        close(fd);
+        return -1;
+    }
+
+    memcpy(&status, li, sizeof(status));
+    status.lo_flags &= ~(LO_DIRECT_IO_FLAG | LO_READ_ONLY_FLAG);
+    if (ioctl(fd, LOOP_SET_STATUS64, &status) < 0) {
+        int err = errno;
+        SLOGE("Error setting loopback status (%s)", strerror(err));
+        ioctl(fd, LOOP_CLR_FD, 0);
+        errno = err;
+        return -1;
+    }
+
+    if (li->lo_flags & LO_DIRECT_IO_FLAG) {
+        if (ioctl(fd, LOOP_SET_DIRECT_IO, 1) < 0) {
+            SLOGW("Unable to enable direct I/O (%s)", strerror(errno));
+        }
+    }
+    return 0;
+}
+
+int Loop::create(const char *id, const char *loopFile, char *loopDeviceBuffer, size_t len,
+                 bool readOnly) {
+    char filename[256];
+    int retries = LOOP_CREATE_RETRIES;
+    int file_fd;
+    int fd;
+    int rc;
+
+    if ((file_fd = open(loopFile, readOnly ? O_RDONLY : O_RDWR)) < 0) {
+        SLOGE("Unable to open %s (%s)", loopFile, strerror(errno));
         return -1;
     }
 
@@ -194,17 +419,51 @@ int Loop::create(const char *id, const char *loopFile, char *loopDeviceBuffer, s
     memset(&li, 0, sizeof(li));
     strlcpy((char*) li.lo_crypt_name, id, LO_NAME_SIZE);
     strlcpy((char*) li.lo_file_name, loopFile, LO_NAME_SIZE);
+    if (readOnly) {
+        li.lo_flags |= LO_READ_ONLY_FLAG;
+    }
+    if (useDirectIo()) {
+        li.lo_flags |= LO_DIRECT_IO_FLAG;
+    }
 
-    if (ioctl(fd, LOOP_SET_STATUS64, &li) < 0) {
-        SLOGE("Error setting loopback status (%s)", strerror(errno));
-        close(file_fd);
+    /*
+     * Another thread can grab the device between finding it free and
+     * binding it, in which case we just ask for another one.
+     */
+    while (true) {
+        if ((fd = findFree(filename, sizeof(filename))) < 0) {
+            close(file_fd);
+            return -1;
+        }
+
+        if ((rc = configure(fd, file_fd, &li)) > 0) {
+            rc = setFdAndStatus(fd, file_fd, &li);
+        }
+        if (rc == 0) {
+            break;
+        }
+
+        int err = errno;
         close(fd);
-        return -1;
+        if (err != EBUSY || !--retries) {
+            SLOGE("Error setting up loopback interface (%s)", strerror(err));
+            close(file_fd);
+            errno = err;
+            return -1;
+        }
     }
 
+    strncpy(loopDeviceBuffer, filename, len -1);
+
     close(fd);
     close(file_fd);
 
+    pthread_mutex_lock(&sIndexLock);
+    if (sIndexLoaded) {
+        sActive[(const char *) li.lo_crypt_name] = filename;
+    }
+    pthread_mutex_unlock(&sIndexLock);
+
     return 0;
 }
 
@@ -224,6 +483,17 @@ int Loop::destroyByDevice(const char *loopDevice) {
     }
 
     close(device_fd);
+
+    pthread_mutex_lock(&sIndexLock);
+    std::map<std::string, std::string>::iterator it;
+    for (it = sActive.begin(); it != sActive.end(); ++it) {
+        if (it->second == loopDevice) {
+            sActive.erase(it);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&sIndexLock);
+
     return 0;
 }
 
@@ -232,6 +502,33 @@ int Loop::destroyByFile(const char *loopFile) {
     return -1;
 }
 
+int Loop::readSuperblock(const char *imageFile, struct asec_superblock *sb) {
+    struct stat st;
+    int fd;
+
+    if ((fd = open(imageFile, O_RDONLY)) < 0) {
+        SLOGE("Unable to open %s (%s)", imageFile, strerror(errno));
+        return -1;
+    }
+
+    if (fstat(fd, &st) < 0 || st.st_size < 512) {
+        SLOGE("Unable to size %s", imageFile);
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+
+    memset(sb, 0, sizeof(struct asec_superblock));
+    if (pread(fd, sb, sizeof(struct asec_superblock), (st.st_size & ~511LL) - 512) !=
+            sizeof(struct asec_superblock)) {
+        SLOGE("superblock read failed (%s)", strerror(errno));
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
 int Loop::createImageFile(const char *file, unsigned int numSectors) {
     int fd;
 
@@ -26,9 +26,19 @@ class Loop {
 public:
     static const int LOOP_MAX = 4096;
 public:
+    /* Builds the id -> loop device index from the devices already bound */
+    static int init();
     static int lookupActive(const char *id, char *buffer, size_t len);
     static int lookupInfo(const char *loopDevice, struct asec_superblock *sb, unsigned int *nr_sec);
-    static int create(const char *id, const char *loopFile, char *loopDeviceBuffer, size_t len);
+    /* Reads the trailing ASEC superblock straight from an image file */
+    static int readSuperblock(const char *imageFile, struct asec_superblock *sb);
+    /*
+     * Binds 'loopFile' to a free loop device, with direct I/O unless
+     * ro.vold.loop_direct_io is off. A read-only device can't be written
+     * even by a later read-write remount of the filesystem on it.
+     */
+    static int create(const char *id, const char *loopFile, char *loopDeviceBuffer, size_t len,
+                      bool readOnly = false);
     static int destroyByDevice(const char *loopDevice);
     static int destroyByFile(const char *loopFile);
     static int createImageFile(const char *file, unsigned int numSectors);
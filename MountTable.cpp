@@ -0,0 +1,298 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <linux/kdev_t.h>
+
+#define LOG_TAG "Vold"
+
+#include <cutils/log.h>
+
+#include <sysutils/SocketClient.h>
+
+#include "MountTable.h"
+#include "VoldUtil.h"
+
+#define MOUNTINFO_PATH "/proc/self/mountinfo"
+#define MOUNTINFO_INITIAL_BUFFER 16384
+
+MountTable *MountTable::sInstance = NULL;
+static pthread_once_t sInstanceOnce = PTHREAD_ONCE_INIT;
+
+void MountTable::createInstance() {
+    sInstance = new MountTable();
+}
+
+/*
+ * Worker, executor and job threads all look mounts up, so the first call
+ * may come from any of them.
+ */
+MountTable *MountTable::Instance() {
+    pthread_once(&sInstanceOnce, createInstance);
+    return sInstance;
+}
+
+MountTable::MountTable() {
+    pthread_mutex_init(&mLock, NULL);
+    mFd = -1;
+    mBuffer = NULL;
+    mBufferSize = 0;
+    mLookups = 0;
+    mHits = 0;
+    mParses = 0;
+    mLastParseUs = 0;
+}
+
+MountTable::~MountTable() {
+    if (mFd >= 0)
+        close(mFd);
+    free(mBuffer);
+    pthread_mutex_destroy(&mLock);
+}
+
+/*
+ * mountinfo escapes space, tab, newline and backslash as \ooo
+ */
+static void unescape(char *s) {
+    char *out = s;
+
+    while (*s) {
+        if (s[0] == '\\' && s[1] >= '0' && s[1] <= '3' &&
+                s[2] >= '0' && s[2] <= '7' && s[3] >= '0' && s[3] <= '7') {
+            *out++ = ((s[1] - '0') << 6) | ((s[2] - '0') << 3) | (s[3] - '0');
+            s += 4;
+        } else {
+            *out++ = *s++;
+        }
+    }
+    *out = '\0';
+}
+
+/*
+ * Should look like:
+ * 36 35 98:0 /mnt1 /mnt/parent rw,noatime master:1 - ext3 /dev/root rw,errors=continue
+ * (1)(2)(3)   (4)   (5)         (6)       (7)      (8)(9)  (10)      (11)
+ * where (7) is zero or more optional fields terminated by the '-' in (8).
+ */
+int MountTable::parseLine(char *line, Mount *mount) {
+    char *fields[6];
+    char *save = NULL;
+    char *tok;
+    int n = 0;
+    unsigned int major, minor;
+
+    for (tok = strtok_r(line, " \n", &save); tok && n < 6;
+            tok = strtok_r(NULL, " \n", &save)) {
+        fields[n++] = tok;
+    }
+    if (n < 6) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    // Skip the optional fields
+    while (tok && strcmp(tok, "-")) {
+        tok = strtok_r(NULL, " \n", &save);
+    }
+    if (!tok) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    char *fsType = strtok_r(NULL, " \n", &save);
+    char *source = strtok_r(NULL, " \n", &save);
+    if (!fsType || !source) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (sscanf(fields[2], "%u:%u", &major, &minor) != 2) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    unescape(fields[4]);
+    unescape(source);
+
+    mount->mountPoint = fields[4];
+    mount->source = source;
+    mount->fsType = fsType;
+    mount->device = MKDEV(major, minor);
+    return 0;
+}
+
+int MountTable::parseLocked() {
+    unsigned long long start = get_monotonic_us();
+    size_t len = 0;
+    ssize_t rc;
+
+    if (lseek(mFd, 0, SEEK_SET) < 0) {
+        SLOGE("Failed to rewind %s (%s)", MOUNTINFO_PATH, strerror(errno));
+        return -1;
+    }
+
+    if (!mBuffer) {
+        mBufferSize = MOUNTINFO_INITIAL_BUFFER;
+        if (!(mBuffer = (char *) malloc(mBufferSize))) {
+            SLOGE("Error allocating memory (%s)", strerror(errno));
+            return -1;
+        }
+    }
+
+    while ((rc = read(mFd, mBuffer + len, mBufferSize - len - 1)) != 0) {
+        if (rc < 0) {
+            if (errno == EINTR)
+                continue;
+            SLOGE("Failed to read %s (%s)", MOUNTINFO_PATH, strerror(errno));
+            return -1;
+        }
+        len += rc;
+        if (len == mBufferSize - 1) {
+            char *bigger = (char *) realloc(mBuffer, mBufferSize * 2);
+            if (!bigger) {
+                SLOGE("Error allocating memory (%s)", strerror(errno));
+                return -1;
+            }
+            mBuffer = bigger;
+            mBufferSize *= 2;
+        }
+    }
+    mBuffer[len] = '\0';
+
+    mMounts.clear();
+    char *line = mBuffer;
+    while (line && *line) {
+        char *next = strchr(line, '\n');
+        if (next) {
+            *next++ = '\0';
+        }
+
+        Mount m;
+        if (!parseLine(line, &m)) {
+            // Later lines are mounted on top of earlier ones
+            mMounts[m.mountPoint] = m;
+        }
+        line = next;
+    }
+
+    mParses++;
+    mLastParseUs = get_monotonic_us() - start;
+    return 0;
+}
+
+int MountTable::refreshLocked() {
+    mLookups++;
+
+    if (mFd < 0) {
+        if ((mFd = open(MOUNTINFO_PATH, O_RDONLY)) < 0) {
+            SLOGE("Failed to open %s (%s)", MOUNTINFO_PATH, strerror(errno));
+            return -1;
+        }
+        fcntl(mFd, F_SETFD, FD_CLOEXEC);
+        return parseLocked();
+    }
+
+    struct pollfd pfd;
+    pfd.fd = mFd;
+    pfd.events = POLLPRI;
+    pfd.revents = 0;
+
+    if (poll(&pfd, 1, 0) < 0) {
+        SLOGE("Failed to poll %s (%s)", MOUNTINFO_PATH, strerror(errno));
+        return parseLocked();
+    }
+    if (pfd.revents & (POLLPRI | POLLERR)) {
+        return parseLocked();
+    }
+
+    mHits++;
+    return 0;
+}
+
+bool MountTable::lookup(const char *path, Mount *mount) {
+    bool found = false;
+
+    if (!path) {
+        SLOGE("MountTable lookup of NULL path");
+        return false;
+    }
+
+    pthread_mutex_lock(&mLock);
+    if (!refreshLocked()) {
+        std::map<std::string, Mount>::iterator it = mMounts.find(path);
+        if (it != mMounts.end()) {
+            found = true;
+            if (mount) {
+                *mount = it->second;
+            }
+        }
+    }
+    pthread_mutex_unlock(&mLock);
+    return found;
+}
+
+bool MountTable::isMounted(const char *path) {
+    return lookup(path, NULL);
+}
+
+dev_t MountTable::deviceFor(const char *path) {
+    Mount m;
+
+    if (!lookup(path, &m)) {
+        return 0;
+    }
+    return m.device;
+}
+
+int MountTable::listUnder(const char *dir, std::vector<Mount> *mounts) {
+    std::string prefix(dir);
+    int rc;
+
+    if (prefix.empty() || prefix[prefix.size() - 1] != '/') {
+        prefix += '/';
+    }
+
+    pthread_mutex_lock(&mLock);
+    if (!(rc = refreshLocked())) {
+        std::map<std::string, Mount>::iterator it = mMounts.lower_bound(prefix);
+        for (; it != mMounts.end() && !it->first.compare(0, prefix.size(), prefix); ++it) {
+            mounts->push_back(it->second);
+        }
+    }
+    pthread_mutex_unlock(&mLock);
+    return rc;
+}
+
+int MountTable::dumpState(SocketClient *c) {
+    char buffer[256];
+
+    pthread_mutex_lock(&mLock);
+    snprintf(buffer, sizeof(buffer),
+             "%zu mounts, %u parses (last took %llu us), %u lookups, %u cached (%u%%)",
+             mMounts.size(), mParses, mLastParseUs, mLookups, mHits,
+             mLookups ? (mHits * 100) / mLookups : 0);
+    pthread_mutex_unlock(&mLock);
+
+    c->sendMsg(0, buffer, false);
+    return 0;
+}
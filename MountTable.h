@@ -0,0 +1,80 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _MOUNTTABLE_H
+#define _MOUNTTABLE_H
+
+#include <pthread.h>
+#include <sys/types.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+class SocketClient;
+
+/*
+ * Cached copy of /proc/self/mountinfo keyed by mountpoint. The kernel
+ * flags the open mountinfo fd with POLLPRI whenever the mount table
+ * changes, so lookups only re-read it after something was (un)mounted.
+ */
+class MountTable {
+public:
+    struct Mount {
+        std::string mountPoint;
+        std::string source;
+        std::string fsType;
+        dev_t device;
+    };
+
+private:
+    static MountTable *sInstance;
+
+    pthread_mutex_t              mLock;
+    int                          mFd;
+    std::map<std::string, Mount> mMounts;
+    char                        *mBuffer;
+    size_t                       mBufferSize;
+
+    unsigned int       mLookups;
+    unsigned int       mHits;
+    unsigned int       mParses;
+    unsigned long long mLastParseUs;
+
+public:
+    static MountTable *Instance();
+    virtual ~MountTable();
+
+    bool isMounted(const char *path);
+    /* Returns the device mounted at 'path', or 0 if nothing is */
+    dev_t deviceFor(const char *path);
+    bool lookup(const char *path, Mount *mount);
+    /* Collects every mount strictly below 'dir' */
+    int listUnder(const char *dir, std::vector<Mount> *mounts);
+
+    int dumpState(SocketClient *c);
+
+    /* Parses one mountinfo line. Exposed for tests. */
+    static int parseLine(char *line, Mount *mount);
+
+private:
+    MountTable();
+    static void createInstance();
+    int refreshLocked();
+    int parseLocked();
+};
+
+#endif
@@ -26,6 +26,7 @@
 #include <sysutils/NetlinkEvent.h>
 #include "NetlinkHandler.h"
 #include "VolumeManager.h"
+#include "UeventCoalescer.h"
 #include "MiscManager.h"
 NetlinkHandler::NetlinkHandler(int listenerSocket) :
                 NetlinkListener(listenerSocket) {
@@ -43,7 +44,6 @@ int NetlinkHandler::stop() {
 }
 
 void NetlinkHandler::onEvent(NetlinkEvent *evt) {
-    VolumeManager *vm = VolumeManager::Instance();
     const char *subsys = evt->getSubsystem();
 
     if (!subsys) {
@@ -52,7 +52,10 @@ void NetlinkHandler::onEvent(NetlinkEvent *evt) {
     }
 
     if (!strcmp(subsys, "block")) {
-        vm->handleBlockEvent(evt);
+        BlockEvent blockEvent;
+        if (BlockEvent::parse(evt, &blockEvent)) {
+            UeventCoalescer::Instance()->handleEvent(blockEvent);
+        }
 #ifdef USE_USB_MODE_SWITCH
     }else if(!strcmp(subsys, "usb")
 	|| !strcmp(subsys, "scsi_device")) {
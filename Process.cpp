@@ -31,6 +31,7 @@
 #include <cutils/log.h>
 
 #include "Process.h"
+#include "ProcessScanner.h"
 
 int Process::readSymLink(const char *path, char *link, size_t max) {
     struct stat s;
@@ -178,45 +179,11 @@ int Process::getPid(const char *s) {
  */
 // hunt down and kill processes that have files open on the given mount point
 void Process::killProcessesWithOpenFiles(const char *path, int action) {
-    DIR*    dir;
-    struct dirent* de;
+    ProcessScanner scanner;
 
-    if (!(dir = opendir("/proc"))) {
-        SLOGE("opendir failed (%s)", strerror(errno));
+    scanner.addMountpoint(path);
+    if (scanner.scan() < 0) {
         return;
     }
-
-    while ((de = readdir(dir))) {
-        int killed = 0;
-        int pid = getPid(de->d_name);
-        char name[PATH_MAX];
-
-        if (pid == -1)
-            continue;
-        getProcessName(pid, name, sizeof(name));
-
-        char openfile[PATH_MAX];
-
-        if (checkFileDescriptorSymLinks(pid, path, openfile, sizeof(openfile))) {
-            SLOGE("Process %s (%d) has open file %s", name, pid, openfile);
-        } else if (checkFileMaps(pid, path, openfile, sizeof(openfile))) {
-            SLOGE("Process %s (%d) has open filemap for %s", name, pid, openfile);
-        } else if (checkSymLink(pid, path, "cwd")) {
-            SLOGE("Process %s (%d) has cwd within %s", name, pid, path);
-        } else if (checkSymLink(pid, path, "root")) {
-            SLOGE("Process %s (%d) has chroot within %s", name, pid, path);
-        } else if (checkSymLink(pid, path, "exe")) {
-            SLOGE("Process %s (%d) has executable path within %s", name, pid, path);
-        } else {
-            continue;
-        }
-        if (action == 1) {
-            SLOGW("Sending SIGHUP to process %d", pid);
-            kill(pid, SIGTERM);
-        } else if (action == 2) {
-            SLOGE("Sending SIGKILL to process %d", pid);
-            kill(pid, SIGKILL);
-        }
-    }
-    closedir(dir);
+    scanner.killHolders(action);
 }
@@ -0,0 +1,254 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <dirent.h>
+#include <limits.h>
+#include <signal.h>
+
+#define LOG_TAG "ProcessKiller"
+#include <cutils/log.h>
+
+#include "ProcessScanner.h"
+#include "Process.h"
+#include "VoldUtil.h"
+
+static const char *holdToStr(int kind) {
+    switch (kind) {
+    case ProcessScanner::Hold_OpenFile:
+        return "open file";
+    case ProcessScanner::Hold_FileMap:
+        return "open filemap for";
+    case ProcessScanner::Hold_Cwd:
+        return "cwd within";
+    case ProcessScanner::Hold_Root:
+        return "chroot within";
+    case ProcessScanner::Hold_Exe:
+        return "executable path within";
+    default:
+        return "unknown hold on";
+    }
+}
+
+ProcessScanner::ProcessScanner() {
+    mScanCount = 0;
+    mLastExamined = 0;
+    mLastScanUs = 0;
+    mTotalScanUs = 0;
+}
+
+void ProcessScanner::addMountpoint(const char *mountPoint) {
+    std::vector<std::string>::iterator it;
+
+    for (it = mMountpoints.begin(); it != mMountpoints.end(); ++it) {
+        if (*it == mountPoint) {
+            return;
+        }
+    }
+    mMountpoints.push_back(mountPoint);
+}
+
+void ProcessScanner::removeMountpoint(const char *mountPoint) {
+    std::vector<std::string>::iterator it;
+
+    for (it = mMountpoints.begin(); it != mMountpoints.end(); ++it) {
+        if (*it == mountPoint) {
+            mMountpoints.erase(it);
+            break;
+        }
+    }
+    mHolders.erase(mountPoint);
+}
+
+const ProcessScanner::HolderList *ProcessScanner::getHolders(const char *mountPoint) const {
+    std::map<std::string, HolderList>::const_iterator it = mHolders.find(mountPoint);
+
+    if (it == mHolders.end()) {
+        return NULL;
+    }
+    return &it->second;
+}
+
+int ProcessScanner::scan() {
+    unsigned long long start = get_monotonic_us();
+    std::set<int> seen;
+    std::set<int> lastHolders;
+    struct dirent *de;
+    DIR *dir;
+
+    if (!(dir = opendir("/proc"))) {
+        SLOGE("opendir failed (%s)", strerror(errno));
+        return -1;
+    }
+
+    bool fullScan = (mScanCount % FULL_SCAN_INTERVAL) == 0;
+
+    lastHolders.swap(mHolderPids);
+    mHolders.clear();
+    mLastExamined = 0;
+
+    while ((de = readdir(dir))) {
+        int pid = Process::getPid(de->d_name);
+
+        if (pid == -1)
+            continue;
+        seen.insert(pid);
+
+        /*
+         * A process we already looked at that held nothing last time is
+         * not worth another look, except on the periodic full pass.
+         */
+        if (!fullScan && mSeenPids.count(pid) && !lastHolders.count(pid))
+            continue;
+
+        examine(pid);
+        mLastExamined++;
+    }
+    closedir(dir);
+
+    mSeenPids.swap(seen);
+    mScanCount++;
+    mLastScanUs = get_monotonic_us() - start;
+    mTotalScanUs += mLastScanUs;
+
+    return mHolderPids.size();
+}
+
+void ProcessScanner::addHolder(size_t mpIndex, int pid, int kind, const char *path,
+                               std::vector<bool> *matched, size_t *remaining) {
+    Holder h;
+
+    h.pid = pid;
+    h.kind = kind;
+    h.path = path;
+    mHolders[mMountpoints[mpIndex]].push_back(h);
+    mHolderPids.insert(pid);
+
+    (*matched)[mpIndex] = true;
+    (*remaining)--;
+}
+
+/*
+ * Records the first thing the process holds under each mountpoint. The
+ * fd table and maps are read once no matter how many mountpoints we track.
+ */
+void ProcessScanner::examine(int pid) {
+    size_t remaining = mMountpoints.size();
+    std::vector<bool> matched(remaining, false);
+    char path[PATH_MAX];
+    char link[PATH_MAX];
+    size_t i;
+
+    snprintf(path, sizeof(path), "/proc/%d/fd", pid);
+    DIR *dir = opendir(path);
+    if (dir) {
+        int parent_length = strlen(path);
+        path[parent_length++] = '/';
+
+        struct dirent *de;
+        while (remaining && (de = readdir(dir))) {
+            if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..")
+                    || strlen(de->d_name) + parent_length + 1 >= PATH_MAX)
+                continue;
+
+            path[parent_length] = 0;
+            strcat(path, de->d_name);
+
+            if (!Process::readSymLink(path, link, sizeof(link)))
+                continue;
+            for (i = 0; i < mMountpoints.size(); i++) {
+                if (!matched[i] &&
+                        Process::pathMatchesMountPoint(link, mMountpoints[i].c_str())) {
+                    addHolder(i, pid, Hold_OpenFile, link, &matched, &remaining);
+                }
+            }
+        }
+        closedir(dir);
+    }
+
+    if (remaining) {
+        char buffer[PATH_MAX + 100];
+        FILE *file;
+
+        snprintf(buffer, sizeof(buffer), "/proc/%d/maps", pid);
+        if ((file = fopen(buffer, "r"))) {
+            while (remaining && fgets(buffer, sizeof(buffer), file)) {
+                const char *mapPath = strchr(buffer, '/');
+                if (!mapPath)
+                    continue;
+                buffer[strcspn(buffer, "\n")] = 0;
+                for (i = 0; i < mMountpoints.size(); i++) {
+                    if (!matched[i] &&
+                            Process::pathMatchesMountPoint(mapPath, mMountpoints[i].c_str())) {
+                        addHolder(i, pid, Hold_FileMap, mapPath, &matched, &remaining);
+                    }
+                }
+            }
+            fclose(file);
+        }
+    }
+
+    static const struct {
+        const char *name;
+        int kind;
+    } links[] = {
+        { "cwd",  Hold_Cwd },
+        { "root", Hold_Root },
+        { "exe",  Hold_Exe },
+    };
+
+    for (size_t l = 0; remaining && l < sizeof(links) / sizeof(links[0]); l++) {
+        snprintf(path, sizeof(path), "/proc/%d/%s", pid, links[l].name);
+        if (!Process::readSymLink(path, link, sizeof(link)))
+            continue;
+        for (i = 0; i < mMountpoints.size(); i++) {
+            if (!matched[i] &&
+                    Process::pathMatchesMountPoint(link, mMountpoints[i].c_str())) {
+                addHolder(i, pid, links[l].kind, link, &matched, &remaining);
+            }
+        }
+    }
+}
+
+int ProcessScanner::killHolders(int action) {
+    std::map<std::string, HolderList>::iterator it;
+    std::set<int>::iterator pit;
+    char name[PATH_MAX];
+
+    for (it = mHolders.begin(); it != mHolders.end(); ++it) {
+        HolderList::iterator h;
+        for (h = it->second.begin(); h != it->second.end(); ++h) {
+            Process::getProcessName(h->pid, name, sizeof(name));
+            SLOGE("Process %s (%d) has %s %s", name, h->pid, holdToStr(h->kind),
+                    h->path.c_str());
+        }
+    }
+
+    for (pit = mHolderPids.begin(); pit != mHolderPids.end(); ++pit) {
+        if (action == 1) {
+            SLOGW("Sending SIGHUP to process %d", *pit);
+            kill(*pit, SIGTERM);
+        } else if (action == 2) {
+            SLOGE("Sending SIGKILL to process %d", *pit);
+            kill(*pit, SIGKILL);
+        }
+    }
+
+    return mHolderPids.size();
+}
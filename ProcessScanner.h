@@ -0,0 +1,99 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _PROCESSSCANNER_H
+#define _PROCESSSCANNER_H
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+/*
+ * Finds the processes holding files beneath a set of mountpoints with a
+ * single walk of /proc, building a mountpoint -> (pid, path) index.
+ *
+ * A scanner is meant to live across the retries of an unmount loop: after
+ * the first pass, later passes only look at pids that did not exist last
+ * time or that were holders last time, with a full pass every
+ * FULL_SCAN_INTERVAL scans to catch processes that opened files since.
+ */
+class ProcessScanner {
+public:
+    static const int Hold_OpenFile = 0;
+    static const int Hold_FileMap  = 1;
+    static const int Hold_Cwd      = 2;
+    static const int Hold_Root     = 3;
+    static const int Hold_Exe      = 4;
+
+    static const int FULL_SCAN_INTERVAL = 10;
+
+    struct Holder {
+        int pid;
+        int kind;
+        std::string path;
+    };
+    typedef std::vector<Holder> HolderList;
+
+private:
+    std::vector<std::string>          mMountpoints;
+    std::map<std::string, HolderList> mHolders;
+    std::set<int>                     mSeenPids;
+    std::set<int>                     mHolderPids;
+
+    int                mScanCount;
+    int                mLastExamined;
+    unsigned long long mLastScanUs;
+    unsigned long long mTotalScanUs;
+
+public:
+    ProcessScanner();
+    virtual ~ProcessScanner() {}
+
+    void addMountpoint(const char *mountPoint);
+    void removeMountpoint(const char *mountPoint);
+    bool hasMountpoints() const { return !mMountpoints.empty(); }
+
+    /*
+     * Rebuilds the holder index. Returns the number of distinct holder
+     * pids, or -1 if /proc could not be read.
+     */
+    int scan();
+
+    const HolderList *getHolders(const char *mountPoint) const;
+    int getHolderCount() const { return mHolderPids.size(); }
+
+    /*
+     * Logs every holder found by the last scan and signals each holding
+     * pid once, no matter how many mountpoints it holds.
+     * action = 0 to just warn,
+     * action = 1 to SIGTERM,
+     * action = 2 to SIGKILL
+     */
+    int killHolders(int action);
+
+    int getScanCount() const { return mScanCount; }
+    int getLastExamined() const { return mLastExamined; }
+    unsigned long long getLastScanUs() const { return mLastScanUs; }
+    unsigned long long getTotalScanUs() const { return mTotalScanUs; }
+
+private:
+    void examine(int pid);
+    void addHolder(size_t mpIndex, int pid, int kind, const char *path,
+                   std::vector<bool> *matched, size_t *remaining);
+};
+
+#endif
@@ -27,6 +27,9 @@ public:
     static const int AsecListResult           = 111;
     static const int StorageUsersListResult   = 112;
     static const int CryptfsGetfieldResult    = 113;
+    static const int AsecMountBatchResult     = 114;
+    static const int JobListResult            = 115;
+    static const int CryptfsBenchmarkResult   = 116;
 
     // 200 series - Requested action has been successfully completed
     static const int CommandOkay              = 200;
@@ -34,6 +37,7 @@ public:
     static const int AsecPathResult           = 211;
     static const int ShareEnabledResult       = 212;
     static const int XwarpStatusResult        = 213;
+    static const int JobQueuedResult          = 214;
 
     // 400 series - The command was accepted but the requested action
     // did not take place.
@@ -59,12 +63,18 @@ public:
     static const int VolumeMountFailedNoMedia       = 612;
     static const int VolumeUuidChange               = 613;
     static const int VolumeUserLabelChange          = 614;
+    static const int VolumeFsCheckResult            = 615;
 
     static const int ShareAvailabilityChange        = 620;
 
     static const int VolumeDiskInserted            = 630;
     static const int VolumeDiskRemoved             = 631;
     static const int VolumeBadRemoval              = 632;
+    static const int VolumeDiskSettled             = 633;
+    static const int VolumeReady                   = 634;
+
+    static const int JobProgress                   = 640;
+    static const int JobCompleted                  = 641;
 
     static int convertFromErrno();
 };
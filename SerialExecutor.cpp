@@ -0,0 +1,163 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <string.h>
+
+#define LOG_TAG "Vold"
+
+#include <cutils/log.h>
+
+#include "SerialExecutor.h"
+
+struct SerialExecutor::Completion {
+    bool done;
+    int  rc;
+    int  error;
+};
+
+SerialExecutor::SerialExecutor(const char *name) : mName(name) {
+    pthread_mutex_init(&mLock, NULL);
+    pthread_cond_init(&mWorkCond, NULL);
+    pthread_cond_init(&mDoneCond, NULL);
+    mStarted = false;
+    mFailed = false;
+    mStopping = false;
+}
+
+SerialExecutor::~SerialExecutor() {
+    pthread_mutex_lock(&mLock);
+    bool started = mStarted;
+    mStopping = true;
+    pthread_cond_signal(&mWorkCond);
+    pthread_mutex_unlock(&mLock);
+
+    if (started) {
+        pthread_join(mThread, NULL);
+    }
+
+    pthread_cond_destroy(&mDoneCond);
+    pthread_cond_destroy(&mWorkCond);
+    pthread_mutex_destroy(&mLock);
+}
+
+bool SerialExecutor::startLocked() {
+    if (!mStarted && !mFailed) {
+        int rc = pthread_create(&mThread, NULL, SerialExecutor::threadStart, this);
+        if (rc) {
+            SLOGW("Unable to start executor for %s (%s); running inline",
+                  mName.c_str(), strerror(rc));
+            mFailed = true;
+        } else {
+            mStarted = true;
+        }
+    }
+    return mStarted;
+}
+
+bool SerialExecutor::isCurrentThread() {
+    pthread_mutex_lock(&mLock);
+    bool current = mStarted && pthread_equal(mThread, pthread_self());
+    pthread_mutex_unlock(&mLock);
+    return current;
+}
+
+int SerialExecutor::call(WorkerTask *task) {
+    Completion completion;
+    completion.done = false;
+    completion.rc = 0;
+    completion.error = 0;
+
+    Item item;
+    item.task = task;
+    item.completion = &completion;
+
+    pthread_mutex_lock(&mLock);
+    if ((mStarted && pthread_equal(mThread, pthread_self())) || !startLocked()) {
+        pthread_mutex_unlock(&mLock);
+        runItem(item);
+    } else {
+        mQueue.push_back(item);
+        pthread_cond_signal(&mWorkCond);
+        while (!completion.done) {
+            pthread_cond_wait(&mDoneCond, &mLock);
+        }
+        pthread_mutex_unlock(&mLock);
+    }
+
+    errno = completion.error;
+    return completion.rc;
+}
+
+void SerialExecutor::post(WorkerTask *task) {
+    Item item;
+    item.task = task;
+    item.completion = NULL;
+
+    pthread_mutex_lock(&mLock);
+    if (!startLocked()) {
+        pthread_mutex_unlock(&mLock);
+        runItem(item);
+        return;
+    }
+    mQueue.push_back(item);
+    pthread_cond_signal(&mWorkCond);
+    pthread_mutex_unlock(&mLock);
+}
+
+void *SerialExecutor::threadStart(void *obj) {
+    SerialExecutor *me = reinterpret_cast<SerialExecutor *>(obj);
+
+    me->executorLoop();
+    pthread_exit(NULL);
+    return NULL;
+}
+
+void SerialExecutor::executorLoop() {
+    while (true) {
+        pthread_mutex_lock(&mLock);
+        while (mQueue.empty() && !mStopping) {
+            pthread_cond_wait(&mWorkCond, &mLock);
+        }
+        if (mQueue.empty()) {
+            pthread_mutex_unlock(&mLock);
+            return;
+        }
+        Item item = mQueue.front();
+        mQueue.pop_front();
+        pthread_mutex_unlock(&mLock);
+
+        runItem(item);
+    }
+}
+
+void SerialExecutor::runItem(const Item &item) {
+    errno = 0;
+    int rc = item.task->run();
+    int error = errno;
+    delete item.task;
+
+    pthread_mutex_lock(&mLock);
+    if (item.completion) {
+        item.completion->rc = rc;
+        item.completion->error = error;
+        item.completion->done = true;
+        pthread_cond_broadcast(&mDoneCond);
+    } else if (rc) {
+        SLOGW("Queued task on %s failed (%s)", mName.c_str(), strerror(error));
+    }
+    pthread_mutex_unlock(&mLock);
+}
@@ -0,0 +1,78 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _SERIALEXECUTOR_H
+#define _SERIALEXECUTOR_H
+
+#include <pthread.h>
+
+#include <deque>
+#include <string>
+
+#include "WorkerPool.h"
+
+/*
+ * A single thread that runs tasks one at a time in submission order. Each
+ * volume owns one, so everything that changes a volume's state is
+ * serialized against itself while different volumes make progress
+ * concurrently. The thread is started on first use. Like WorkerPool, the
+ * executor owns submitted tasks and deletes them once they have run;
+ * destroying it drains the queue first.
+ */
+class SerialExecutor {
+private:
+    struct Completion;
+
+    struct Item {
+        WorkerTask *task;
+        Completion *completion;
+    };
+
+    std::string         mName;
+    pthread_mutex_t     mLock;
+    pthread_cond_t      mWorkCond;
+    pthread_cond_t      mDoneCond;
+    std::deque<Item>    mQueue;
+    pthread_t           mThread;
+    bool                mStarted;
+    bool                mFailed;
+    bool                mStopping;
+
+public:
+    SerialExecutor(const char *name);
+    virtual ~SerialExecutor();
+
+    /*
+     * Runs 'task' on the executor and waits for it. Returns what run()
+     * returned with errno as run() left it. Called from the executor's own
+     * thread the task runs inline, so a task may call back into code that
+     * uses call() on the same executor.
+     */
+    int call(WorkerTask *task);
+    /* Queues 'task' without waiting for it */
+    void post(WorkerTask *task);
+
+    bool isCurrentThread();
+    const char *getName() const { return mName.c_str(); }
+
+private:
+    bool startLocked();
+    static void *threadStart(void *obj);
+    void executorLoop();
+    void runItem(const Item &item);
+};
+
+#endif
@@ -0,0 +1,315 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+#define LOG_TAG "Vold"
+
+#include <cutils/log.h>
+#include <cutils/properties.h>
+
+#include <sysutils/NetlinkEvent.h>
+#include <sysutils/SocketClient.h>
+
+#include "UeventCoalescer.h"
+#include "VolumeManager.h"
+#include "VoldUtil.h"
+
+const int UeventCoalescer::DEFAULT_SETTLE_MS;
+const int UeventCoalescer::MAX_HOLD_WINDOWS;
+
+UeventCoalescer *UeventCoalescer::sInstance = NULL;
+
+UeventCoalescer *UeventCoalescer::Instance() {
+    if (!sInstance)
+        sInstance = new UeventCoalescer();
+    return sInstance;
+}
+
+UeventCoalescer::UeventCoalescer() {
+    pthread_mutex_init(&mLock, NULL);
+    pthread_mutex_init(&mDeliverLock, NULL);
+    mWakePipe[0] = mWakePipe[1] = -1;
+    mSettleMs = 0;
+    mStarted = false;
+    mReceived = 0;
+    mUnmanaged = 0;
+    mDelivered = 0;
+    mSuppressed = 0;
+    mBatches = 0;
+}
+
+UeventCoalescer::~UeventCoalescer() {
+    pthread_mutex_destroy(&mDeliverLock);
+    pthread_mutex_destroy(&mLock);
+}
+
+int UeventCoalescer::start() {
+    char value[PROPERTY_VALUE_MAX];
+    char dflt[16];
+
+    snprintf(dflt, sizeof(dflt), "%d", DEFAULT_SETTLE_MS);
+    property_get("ro.vold.uevent_settle_ms", value, dflt);
+    mSettleMs = atoi(value);
+    if (mSettleMs <= 0) {
+        SLOGI("Block uevent coalescing disabled");
+        mSettleMs = 0;
+        return 0;
+    }
+
+    if (pipe(mWakePipe)) {
+        SLOGE("Unable to create wake pipe (%s)", strerror(errno));
+        return -1;
+    }
+    for (int i = 0; i < 2; i++) {
+        fcntl(mWakePipe[i], F_SETFL, O_NONBLOCK);
+        fcntl(mWakePipe[i], F_SETFD, FD_CLOEXEC);
+    }
+
+    if (pthread_create(&mThread, NULL, UeventCoalescer::threadStart, this)) {
+        SLOGE("pthread_create (%s)", strerror(errno));
+        close(mWakePipe[0]);
+        close(mWakePipe[1]);
+        mWakePipe[0] = mWakePipe[1] = -1;
+        return -1;
+    }
+
+    pthread_mutex_lock(&mLock);
+    mStarted = true;
+    pthread_mutex_unlock(&mLock);
+    SLOGI("Coalescing block uevents over %d ms", mSettleMs);
+    return 0;
+}
+
+int UeventCoalescer::coalesce(std::vector<BlockEvent> *events) {
+    std::vector<bool> keep(events->size(), true);
+    // Index of the add, and of the last change, still kept for each device
+    std::map<std::string, size_t> pendingAdd;
+    std::map<std::string, size_t> lastChange;
+
+    for (size_t i = 0; i < events->size(); i++) {
+        BlockEvent &u = (*events)[i];
+        std::map<std::string, size_t>::iterator add = pendingAdd.find(u.devpath);
+        std::map<std::string, size_t>::iterator change = lastChange.find(u.devpath);
+
+        if (u.action == NetlinkEvent::NlActionAdd) {
+            if (add != pendingAdd.end()) {
+                keep[add->second] = false;
+            }
+            pendingAdd[u.devpath] = i;
+            if (change != lastChange.end()) {
+                lastChange.erase(change);
+            }
+        } else if (u.action == NetlinkEvent::NlActionRemove) {
+            if (add != pendingAdd.end()) {
+                // Came and went within the window; nobody needs to know
+                keep[add->second] = false;
+                keep[i] = false;
+                pendingAdd.erase(add);
+            }
+            if (change != lastChange.end()) {
+                lastChange.erase(change);
+            }
+        } else if (u.action == NetlinkEvent::NlActionChange) {
+            if (add != pendingAdd.end()) {
+                BlockEvent &a = (*events)[add->second];
+                if (u.nparts >= 0) {
+                    a.nparts = u.nparts;
+                }
+                keep[i] = false;
+            } else {
+                if (change != lastChange.end()) {
+                    keep[change->second] = false;
+                }
+                lastChange[u.devpath] = i;
+            }
+        }
+    }
+
+    size_t out = 0;
+    for (size_t i = 0; i < events->size(); i++) {
+        if (keep[i]) {
+            if (out != i) {
+                (*events)[out] = (*events)[i];
+            }
+            out++;
+        }
+    }
+    int dropped = events->size() - out;
+    events->resize(out);
+    return dropped;
+}
+
+void UeventCoalescer::handleEvent(const BlockEvent &evt) {
+    VolumeManager *vm = VolumeManager::Instance();
+
+    // Container churn floods us with loop and dm events; drop them here
+    if (!vm->lookupVolumeByDevpath(evt.devpath.c_str())) {
+        pthread_mutex_lock(&mLock);
+        mUnmanaged++;
+        pthread_mutex_unlock(&mLock);
+        return;
+    }
+
+    pthread_mutex_lock(&mLock);
+    bool started = mStarted;
+    pthread_mutex_unlock(&mLock);
+
+    if (!started) {
+        vm->handleBlockEvent(evt);
+        return;
+    }
+
+    unsigned long long now = get_monotonic_us();
+    unsigned long long window = (unsigned long long) mSettleMs * 1000;
+    std::string diskPath = evt.diskPath();
+
+    // Nothing is left to settle once the disk itself is gone
+    if (evt.isDisk() && evt.action == NetlinkEvent::NlActionRemove) {
+        std::vector<BlockEvent> events;
+
+        pthread_mutex_lock(&mDeliverLock);
+        pthread_mutex_lock(&mLock);
+        mReceived++;
+        std::map<std::string, Disk>::iterator it = mDisks.find(diskPath);
+        if (it != mDisks.end()) {
+            events.swap(it->second.events);
+            mDisks.erase(it);
+        }
+        events.push_back(evt);
+        pthread_mutex_unlock(&mLock);
+
+        deliver(diskPath, &events);
+        pthread_mutex_unlock(&mDeliverLock);
+        return;
+    }
+
+    pthread_mutex_lock(&mLock);
+    mReceived++;
+    Disk &disk = mDisks[diskPath];
+    if (disk.events.empty()) {
+        disk.firstUs = now;
+    }
+    disk.events.push_back(evt);
+    disk.deadlineUs = now + window;
+    if (disk.deadlineUs > disk.firstUs + window * MAX_HOLD_WINDOWS) {
+        disk.deadlineUs = disk.firstUs + window * MAX_HOLD_WINDOWS;
+    }
+    pthread_mutex_unlock(&mLock);
+
+    if (write(mWakePipe[1], "w", 1) < 0 && errno != EAGAIN) {
+        SLOGW("Unable to wake uevent settle thread (%s)", strerror(errno));
+    }
+}
+
+void *UeventCoalescer::threadStart(void *obj) {
+    UeventCoalescer *me = reinterpret_cast<UeventCoalescer *>(obj);
+
+    me->settleLoop();
+    pthread_exit(NULL);
+    return NULL;
+}
+
+void UeventCoalescer::settleLoop() {
+    while (true) {
+        std::vector<std::string> readyPaths;
+        std::vector<std::vector<BlockEvent> > ready;
+        int timeoutMs = -1;
+        unsigned long long now = get_monotonic_us();
+
+        pthread_mutex_lock(&mDeliverLock);
+        pthread_mutex_lock(&mLock);
+        std::map<std::string, Disk>::iterator it = mDisks.begin();
+        while (it != mDisks.end()) {
+            if (it->second.deadlineUs <= now) {
+                readyPaths.push_back(it->first);
+                ready.push_back(it->second.events);
+                mDisks.erase(it++);
+            } else {
+                int ms = (it->second.deadlineUs - now + 999) / 1000;
+                if (timeoutMs < 0 || ms < timeoutMs) {
+                    timeoutMs = ms;
+                }
+                ++it;
+            }
+        }
+        pthread_mutex_unlock(&mLock);
+
+        for (size_t i = 0; i < ready.size(); i++) {
+            deliver(readyPaths[i], &ready[i]);
+        }
+        pthread_mutex_unlock(&mDeliverLock);
+        if (!ready.empty()) {
+            // Delivery can take a while; look at the deadlines again
+            continue;
+        }
+
+        struct pollfd pfd;
+        pfd.fd = mWakePipe[0];
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        if (poll(&pfd, 1, timeoutMs) > 0) {
+            char buf[64];
+            while (read(mWakePipe[0], buf, sizeof(buf)) > 0)
+                ;
+        }
+    }
+}
+
+void UeventCoalescer::deliver(const std::string &diskPath, std::vector<BlockEvent> *events) {
+    size_t received = events->size();
+    int dropped = coalesce(events);
+
+    pthread_mutex_lock(&mLock);
+    mSuppressed += dropped;
+    mDelivered += events->size();
+    mBatches++;
+    pthread_mutex_unlock(&mLock);
+
+    if (dropped) {
+        SLOGI("Disk %s settled; %d of %d uevents suppressed", diskPath.c_str(), dropped,
+              (int) received);
+    }
+    if (!events->empty()) {
+        VolumeManager::Instance()->handleSettledEvents(*events);
+    }
+}
+
+int UeventCoalescer::dumpState(SocketClient *c) {
+    char buffer[256];
+
+    pthread_mutex_lock(&mLock);
+    if (!mStarted) {
+        snprintf(buffer, sizeof(buffer), "Coalescing disabled, %u unmanaged uevents dropped",
+                 mUnmanaged);
+    } else {
+        snprintf(buffer, sizeof(buffer),
+                 "%d ms window, %u uevents received, %u delivered in %u batches, "
+                 "%u suppressed, %u unmanaged dropped, %d disks settling",
+                 mSettleMs, mReceived, mDelivered, mBatches, mSuppressed, mUnmanaged,
+                 (int) mDisks.size());
+    }
+    pthread_mutex_unlock(&mLock);
+
+    c->sendMsg(0, buffer, false);
+    return 0;
+}
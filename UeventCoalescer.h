@@ -0,0 +1,102 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _UEVENTCOALESCER_H
+#define _UEVENTCOALESCER_H
+
+#include <pthread.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "BlockEvent.h"
+
+class SocketClient;
+
+/*
+ * Sits between NetlinkHandler and the volumes for block uevents. Events for
+ * devices no volume manages are dropped at once. The rest are grouped by
+ * disk and held until that disk has been quiet for the settle window
+ * (ro.vold.uevent_settle_ms), then reduced by coalesce() and handed to the
+ * owning volume as a single batch, which ends with one "disk settled"
+ * notification. A disk remove is not held: it goes out at once, together
+ * with whatever that disk still had pending. A window of 0 passes every
+ * event straight through.
+ */
+class UeventCoalescer {
+public:
+    static const int DEFAULT_SETTLE_MS = 200;
+    /* A disk that never goes quiet is flushed after this many windows */
+    static const int MAX_HOLD_WINDOWS  = 10;
+
+private:
+    struct Disk {
+        std::vector<BlockEvent> events;
+        unsigned long long      firstUs;
+        unsigned long long      deadlineUs;
+    };
+
+    static UeventCoalescer *sInstance;
+
+    pthread_mutex_t              mLock;
+    /* Held from taking a disk's batch out of mDisks until it is handed on */
+    pthread_mutex_t              mDeliverLock;
+    pthread_t                    mThread;
+    int                          mWakePipe[2];
+    int                          mSettleMs;
+    bool                         mStarted;
+    std::map<std::string, Disk>  mDisks;
+
+    unsigned int mReceived;
+    unsigned int mUnmanaged;
+    unsigned int mDelivered;
+    unsigned int mSuppressed;
+    unsigned int mBatches;
+
+public:
+    static UeventCoalescer *Instance();
+    virtual ~UeventCoalescer();
+
+    /* Starts the settle thread unless the window is 0 */
+    int start();
+
+    /* Called from the netlink thread for every block uevent */
+    void handleEvent(const BlockEvent &evt);
+
+    int dumpState(SocketClient *c);
+
+    /*
+     * Reduces the events of one disk, in arrival order, to what still
+     * matters once it has settled:
+     *  - an add followed by a remove of the same device cancels out,
+     *    together with any change in between;
+     *  - a change of a device added in the same batch is folded into the
+     *    add, and of several changes only the last is kept;
+     *  - of repeated adds only the last is kept.
+     * A remove followed by an add is kept since the media may have been
+     * swapped. Returns the number of events dropped.
+     */
+    static int coalesce(std::vector<BlockEvent> *events);
+
+private:
+    UeventCoalescer();
+    static void *threadStart(void *obj);
+    void settleLoop();
+    void deliver(const std::string &diskPath, std::vector<BlockEvent> *events);
+};
+
+#endif
@@ -15,7 +15,13 @@
  */
 
 #include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <linux/fs.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
 
 unsigned int get_blkdev_size(int fd)
 {
@@ -27,3 +33,56 @@ unsigned int get_blkdev_size(int fd)
 
   return nr_sec;
 }
+
+/* Microseconds on a clock that does not jump, for timing vold's own work */
+unsigned long long get_monotonic_us(void)
+{
+  struct timespec t;
+
+  t.tv_sec = 0;
+  t.tv_nsec = 0;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+
+  return (t.tv_sec * 1000000ULL) + (t.tv_nsec / 1000);
+}
+
+/*
+ * Returns the device number of the disk holding the block device at 'path',
+ * which is the device itself unless it is a partition, or 0 if unknown.
+ */
+dev_t get_blkdev_disk(const char *path)
+{
+  char sysfs[64];
+  char buf[32];
+  unsigned int maj, min;
+  struct stat st;
+  int fd, len;
+
+  if (stat(path, &st) || !S_ISBLK(st.st_mode)) {
+    return 0;
+  }
+
+  snprintf(sysfs, sizeof(sysfs), "/sys/dev/block/%u:%u/partition",
+           major(st.st_rdev), minor(st.st_rdev));
+  if (access(sysfs, F_OK)) {
+    return st.st_rdev;
+  }
+
+  /* A partition's parent in sysfs is its disk */
+  snprintf(sysfs, sizeof(sysfs), "/sys/dev/block/%u:%u/../dev",
+           major(st.st_rdev), minor(st.st_rdev));
+  if ((fd = open(sysfs, O_RDONLY)) < 0) {
+    return 0;
+  }
+  len = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (len <= 0) {
+    return 0;
+  }
+  buf[len] = '\0';
+  if (sscanf(buf, "%u:%u", &maj, &min) != 2) {
+    return 0;
+  }
+
+  return makedev(maj, min);
+}
@@ -18,11 +18,14 @@
 #define _VOLDUTIL_H
 
 #include <sys/cdefs.h>
+#include <sys/types.h>
 
 #define ARRAY_SIZE(a) (sizeof(a) / sizeof(*(a)))
 
 __BEGIN_DECLS
   unsigned int get_blkdev_size(int fd);
+  unsigned long long get_monotonic_us(void);
+  dev_t get_blkdev_disk(const char *path);
 __END_DECLS
 
 #endif
@@ -41,13 +41,20 @@
 #include <cutils/log.h>
 
 #include <string>
+#include <vector>
 
 #include "Ntfs.h"
 #include "Volume.h"
 #include "VolumeManager.h"
 #include "ResponseCode.h"
 #include "Fat.h"
+#include "FsDriver.h"
+#include "MountTable.h"
+#include "AsecCatalog.h"
 #include "Process.h"
+#include "ProcessScanner.h"
+#include "SerialExecutor.h"
+#include "VoldUtil.h"
 #include "cryptfs.h"
 
 #ifdef SUPPORTED_MULTI_USB_PARTITIONS 
@@ -90,7 +97,6 @@ const char *Volume::ASECDIR           = "/mnt/asec";
  */
 const char *Volume::LOOPDIR           = "/mnt/obb";
 
-const char *Volume::BLKID_PATH = "/system/bin/blkid";
 
 static const char *stateToStr(int state) {
     if (state == Volume::State_Init)
@@ -128,6 +134,10 @@ Volume::Volume(VolumeManager *vm, const fstab_rec* rec, int flags) {
     mCurrentlyMountedKdev = -1;
     mPartIdx = rec->partnum;
     mRetryMount = false;
+    mChecksSkipped = 0;
+    mExecutor = new SerialExecutor(mLabel);
+    mColdbootPending = false;
+    mReadyReported = false;
 	mSkipAsec =false;
 #ifdef SUPPORTED_MULTI_USB_PARTITIONS
     mLetters = 0;
@@ -138,6 +148,7 @@ Volume::~Volume() {
     free(mLabel);
     free(mUuid);
     free(mUserLabel);
+    delete mExecutor;
 }
 
 void Volume::setDebug(bool enable) {
@@ -158,7 +169,12 @@ void Volume::handleVolumeShared() {
 void Volume::handleVolumeUnshared() {
 }
 
-int Volume::handleBlockEvent(NetlinkEvent *evt) {
+int Volume::handleBlockEvent(const BlockEvent &evt) {
+    errno = ENOSYS;
+    return -1;
+}
+
+int Volume::handleSettledEvents(const std::vector<BlockEvent> &events) {
     errno = ENOSYS;
     return -1;
 }
@@ -254,6 +270,57 @@ void Volume::setState(int state) {
                                          msg, false);
 }
 
+/* Coldboot bookkeeping, kept on the volume's executor with its events */
+class ColdbootStateTask : public WorkerTask {
+public:
+    enum Op { SetPending, Finish };
+
+private:
+    Volume *mVolume;
+    Op      mOp;
+
+public:
+    ColdbootStateTask(Volume *v, Op op) : mVolume(v), mOp(op) {}
+
+    int run() {
+        if (mOp == SetPending) {
+            mVolume->mColdbootPending = true;
+        } else if (!mVolume->mColdbootPending) {
+            mVolume->reportReady();
+        }
+        return 0;
+    }
+};
+
+void Volume::setColdbootPending() {
+    mExecutor->post(new ColdbootStateTask(this, ColdbootStateTask::SetPending));
+}
+
+void Volume::finishColdboot() {
+    mExecutor->post(new ColdbootStateTask(this, ColdbootStateTask::Finish));
+}
+
+void Volume::reportReady() {
+    char msg[255];
+
+    mColdbootPending = false;
+    if (mReadyReported) {
+        return;
+    }
+    mReadyReported = true;
+    snprintf(msg, sizeof(msg), "Volume %s %s ready in state %d (%s)", getLabel(),
+             getFuseMountpoint(), mState, stateToStr(mState));
+    mVm->getBroadcaster()->sendBroadcast(ResponseCode::VolumeReady, msg, false);
+}
+
+void Volume::checkColdbootReady() {
+    // Still waiting for the disk or some of its partitions
+    if (mColdbootPending && mState != Volume::State_NoMedia &&
+            mState != Volume::State_Pending) {
+        reportReady();
+    }
+}
+
 int Volume::createDeviceNode(const char *path, int major, int minor) {
     mode_t mode = 0660 | S_IFBLK;
     dev_t dev = (major << 8) | minor;
@@ -283,6 +350,15 @@ int Volume::formatVol(bool wipe) {
         return -1;
     }
 
+    char fsType[PROPERTY_VALUE_MAX];
+    property_get("persist.vold.format_fs", fsType, "vfat");
+    FsDriver *driver = FsDriver::lookupByName(fsType);
+    if (!driver) {
+        SLOGE("No driver to format %s as %s", getLabel(), fsType);
+        errno = ENOSYS;
+        return -1;
+    }
+
     bool formatEntireDevice = (mPartIdx == -1);
     char devicePath[255];
     char label[PROPERTY_VALUE_MAX] = "";
@@ -321,8 +397,8 @@ int Volume::formatVol(bool wipe) {
         SLOGI("Formatting volume %s (%s)", getLabel(), devicePath);
     }
 
-    if (Fat::format(devicePath, 0, wipe, label)) {
-        SLOGE("Failed to format (%s)", strerror(errno));
+    if (driver->format(devicePath, getMountpoint(), label, wipe)) {
+        SLOGE("Failed to format as %s (%s)", driver->getName(), strerror(errno));
         goto err;
     }
     if (!strcmp(getLabel(),"internal_sd")) {
@@ -337,34 +413,13 @@ err:
 }
 
 bool Volume::isMountpointMounted(const char *path) {
-    char device[256];
-    char mount_path[256];
-    char rest[256];
-    FILE *fp;
-    char line[1024];
-
     if (!path)
     {
         SLOGE("isMountpointMounted path is NULL !");
         return false;
     }
 
-    if (!(fp = fopen("/proc/mounts", "r"))) {
-        SLOGE("Error opening /proc/mounts (%s)", strerror(errno));
-        return false;
-    }
-
-    while(fgets(line, sizeof(line), fp)) {
-        line[strlen(line)-1] = '\0';
-        sscanf(line, "%255s %255s %255s\n", device, mount_path, rest);
-        if (!strcmp(mount_path, path)) {
-            fclose(fp);
-            return true;
-        }
-    }
-
-    fclose(fp);
-    return false;
+    return MountTable::Instance()->isMounted(path);
 }
 
 int Volume::mountVol() {
@@ -485,7 +540,11 @@ UDISKNOMOUNTED:
 
         // Todo: Either create sys filename from nodepath, or pass in bogus path so
         //       vold ignores state changes on this internal device.
-        updateDeviceInfo(nodepath, new_major, new_minor);
+        if (updateDeviceInfo(nodepath, new_major, new_minor)) {
+            SLOGE("Failed to switch %s to its crypto mapping\n", getLabel());
+            cryptfs_revert_volume(getLabel());
+            return -1;
+        }
 
         /* Get the device nodes again, because they just changed */
         n = getDeviceNodes((dev_t *) &deviceNodes, 4);
@@ -506,11 +565,20 @@ UDISKNOMOUNTED:
         errno = 0;
         setState(Volume::State_Checking);
 
-        if (Fat::check(devicePath) && !isSupNtfs) {
-            if (errno == ENODATA) {
-                SLOGW("%s does not contain a FAT filesystem\n", devicePath);
-                continue;
-            }
+        FsProbe::Result fs;
+        if (FsProbe::probe(devicePath, &fs)) {
+            SLOGW("%s does not contain a recognizable filesystem\n", devicePath);
+            continue;
+        }
+        FsDriver *driver = FsDriver::lookup(fs);
+        if (!driver || !isRemovableFsEnabled(driver) ||
+                (!isSupNtfs && !strcmp(driver->getName(), "ntfs"))) {
+            SLOGW("%s contains unsupported filesystem %s\n", devicePath, fs.type.c_str());
+            continue;
+        }
+        bool isFat = !strcmp(driver->getName(), "vfat");
+
+        if (checkFilesystem(driver, devicePath) && !isSupNtfs) {
             errno = EIO;
             /* Badness - abort the mount */
             SLOGE("%s failed FS checks (%s)", devicePath, strerror(errno));
@@ -542,53 +610,42 @@ UDISKNOMOUNTED:
             const char *mountpoint = getMountpoint();
             strcpy(mount_point,mountpoint);
         }
-	    if(!strcmp("true",has_ums))//has UMS function ,set group to AID_SDCARD_RW
-	    {
-        	if (Fat::doMount(devicePath, mount_point, false, false, false,
-        	        AID_SYSTEM,AID_SDCARD_RW, 0002, true)) {
-        		SLOGE("%s failed to mount via VFAT (%s)\n", devicePath, strerror(errno));
-        			if(providesAsec)
-        			{
-						mSkipAsec = true;
-						SLOGE("---------set mSkipAsec to disable app2sd because mount Vfat fail for %s, mountpoint =%s",getLabel(),getMountpoint());
-					}
-                	if(Ntfs::doMount(devicePath, mount_point, false, 1000)){ 
-               			SLOGE("%s failed to mount via VNTFS (%s)\n", devicePath, strerror(errno));
-#ifdef SUPPORTED_MULTI_USB_PARTITIONS
-                        if (!strcmp(getLabel(),USB_DISK_LABEL)){
-                            setState(Volume::State_Idle);
-                            rmdir(mount_point);
-                            releaseLetter(letter);
-                        }
-#endif
-                		continue;
-               		}
-        	}
-			else//mount flash as fat succeed
-			{
-				mSkipAsec = false;
-				SLOGE("---------set mSkipAsec to enable app2sd because mount Vfat succeed for %s, mountpoint =%s",getLabel(),getMountpoint());
-			}
-	    }
-	    else //do not has ums,set group to AID_MEDIA_RW
-	    {
-        	if (Fat::doMount(devicePath, mount_point, false, false, false,
-               		AID_SYSTEM,AID_MEDIA_RW, 0002, true)) {
-            		SLOGE("%s failed to mount via VFAT (%s)\n", devicePath, strerror(errno));
-            
-			    if(Ntfs::doMount(devicePath, mount_point, false, 1000)){
-               			SLOGE("%s failed to mount via VNTFS (%s)\n", devicePath, strerror(errno));
+
+        bool hasUms = !strcmp("true", has_ums);
+        //has UMS function ,set group to AID_SDCARD_RW, otherwise AID_MEDIA_RW
+        gid = hasUms ? AID_SDCARD_RW : AID_MEDIA_RW;
+
+        FsDriver::MountOptions opts;
+        opts.ro = false;
+        opts.executable = false;
+        opts.ownerUid = AID_SYSTEM;
+        opts.ownerGid = gid;
+        opts.permMask = 0002;
+        opts.createLost = true;
+
+        int rc = driver->mount(devicePath, mount_point, opts);
+        if (rc) {
+            SLOGE("%s failed to mount via %s (%s)\n", devicePath, driver->getName(),
+                  strerror(errno));
+        }
+
+        if (hasUms && providesAsec) {
+            // app2sd needs the secure area on a FAT mount
+            mSkipAsec = !isFat || rc;
+            SLOGI("%s app2sd for %s, mountpoint =%s", mSkipAsec ? "Disabling" : "Enabling",
+                  getLabel(), getMountpoint());
+        }
+
+        if (rc) {
 #ifdef SUPPORTED_MULTI_USB_PARTITIONS
-                        if (!strcmp(getLabel(),USB_DISK_LABEL)){
-                            setState(Volume::State_Idle);
-                            rmdir(mount_point);
-                            releaseLetter(letter);
-                        }
+            if (!strcmp(getLabel(),USB_DISK_LABEL)){
+                setState(Volume::State_Idle);
+                rmdir(mount_point);
+                releaseLetter(letter);
+            }
 #endif
-		       		continue;
-		     	}
-        	}
-	    }   
+            continue;
+        }
 
 #ifdef SUPPORTED_MULTI_USB_PARTITIONS
         if (!strcmp(getLabel(),USB_DISK_LABEL)){
@@ -602,7 +659,7 @@ UDISKNOMOUNTED:
             mPartitions.push_back(pt);
         }
 #endif
-        extractMetadata(devicePath);
+        applyMetadata(fs);
 
         if (providesAsec&&!mSkipAsec&& mountAsecExternal() != 0) {
             SLOGE("Failed to mount secure area (%s)", strerror(errno));
@@ -679,12 +736,16 @@ int Volume::mountAsecExternal() {
                 SEC_ASECDIR_EXT, strerror(errno));
         return -1;
     }
+    AsecCatalog::Instance()->invalidate(SEC_ASECDIR_EXT);
 	property_set("sys.vold.hasAsec","true"); 
     return 0;
 }
 
 int Volume::doUnmount(const char *path, bool force) {
     int retries = 150;
+    ProcessScanner scanner;
+
+    scanner.addMountpoint(path);
 
     if (mDebug) {
         SLOGD("Unmounting {%s}, force = %d", path, force);
@@ -693,6 +754,10 @@ int Volume::doUnmount(const char *path, bool force) {
     while (retries--) {
         if (!umount(path) || errno == EINVAL || errno == ENOENT) {
             SLOGI("%s sucessfully unmounted", path);
+            if (scanner.getScanCount()) {
+                SLOGI("%d /proc scans for %s took %llu ms", scanner.getScanCount(),
+                      path, scanner.getTotalScanUs() / 1000);
+            }
 			notifyStateKernel(2);
             return 0;
         }
@@ -710,7 +775,13 @@ int Volume::doUnmount(const char *path, bool force) {
         	SLOGW("Failed to unmount %s (%s, retries %d, action %d)",
                 path, strerror(errno), retries, action);
 
-        Process::killProcessesWithOpenFiles(path, action);
+        if (scanner.scan() >= 0) {
+            scanner.killHolders(action);
+            if (mDebug) {
+                SLOGD("Examined %d processes for %s in %llu us",
+                      scanner.getLastExamined(), path, scanner.getLastScanUs());
+            }
+        }
         usleep(1000*30);
     }
     errno = EBUSY;
@@ -718,8 +789,80 @@ int Volume::doUnmount(const char *path, bool force) {
     return -1;
 }
 
+/*
+ * Gives the framework a chance to react to State_Unmounting: returns as
+ * soon as nothing but the fuse daemon holds files on the volume, or when
+ * the timeout runs out.
+ */
+void Volume::waitForFrameworkRelease(int timeoutMs) {
+    ProcessScanner scanner;
+    unsigned long long deadline = get_monotonic_us() + timeoutMs * 1000ULL;
+
+    /* Apps go through the fuse mount when there is one */
+    scanner.addMountpoint(getFuseMountpoint());
+
+    while (scanner.scan() > 0) {
+        if (get_monotonic_us() >= deadline) {
+            if (mDebug) {
+                SLOGD("%d processes still hold %s", scanner.getHolderCount(),
+                      getFuseMountpoint());
+            }
+            return;
+        }
+        usleep(FRAMEWORK_RELEASE_POLL_MS * 1000);
+    }
+}
+
+/*
+ * Stops the fuse service wrapping this volume and waits for init to
+ * report it stopped. Returns -1 if it is still running at the timeout.
+ */
+int Volume::stopFuse(int timeoutMs) {
+    char service[64];
+    char prop[PROPERTY_KEY_MAX];
+    char status[PROPERTY_VALUE_MAX];
+
+    snprintf(service, sizeof(service), "fuse_%s", getLabel());
+    snprintf(prop, sizeof(prop), "init.svc.%s", service);
+
+    /* Nothing to do for volumes without a fuse service, or a dead one */
+    property_get(prop, status, "");
+    if (!status[0] || !strcmp(status, "stopped")) {
+        return 0;
+    }
+
+    property_set("ctl.stop", service);
+
+    unsigned long long deadline = get_monotonic_us() + timeoutMs * 1000ULL;
+    while (true) {
+        property_get(prop, status, "");
+        if (!status[0] || !strcmp(status, "stopped")) {
+            return 0;
+        }
+        if (get_monotonic_us() >= deadline) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        usleep(FUSE_STOP_POLL_MS * 1000);
+    }
+}
+
+/*
+ * The mounts belonging to this volume, in the order they have to go away.
+ */
+void Volume::getOwnMounts(std::vector<std::string> *mounts, bool providesAsec) {
+    if (providesAsec) {
+        mounts->push_back(Volume::SEC_ASECDIR_EXT);
+    }
+    if (strcmp(getFuseMountpoint(), getMountpoint())) {
+        mounts->push_back(getFuseMountpoint());
+    }
+    mounts->push_back(getMountpoint());
+}
+
 int Volume::unmountVol(bool force, bool revert) {
     int i, rc;
+    std::vector<std::string> mounts;
 
     int flags = getFlags();
     bool providesAsec = ((flags & VOL_PROVIDES_ASEC) != 0)&&(!mSkipAsec);
@@ -732,38 +875,39 @@ int Volume::unmountVol(bool force, bool revert) {
     }
 
     setState(Volume::State_Unmounting);
-    usleep(1000 * 1000); // Give the framework some time to react
 
-    char service[64];
-    snprintf(service, 64, "fuse_%s", getLabel());
-    property_set("ctl.stop", service);
-    /* Give it a chance to stop.  I wish we had a synchronous way to determine this... */
-    sleep(1);
+    unsigned long long start = get_monotonic_us();
+    waitForFrameworkRelease(FRAMEWORK_RELEASE_TIMEOUT_MS);
+    unsigned long long released = get_monotonic_us();
+    if (stopFuse(FUSE_STOP_TIMEOUT_MS)) {
+        SLOGW("fuse_%s did not stop within %d ms", getLabel(), FUSE_STOP_TIMEOUT_MS);
+    }
+    SLOGI("Volume %s released by framework in %llu ms, fuse stopped in %llu ms",
+          getLabel(), (released - start) / 1000, (get_monotonic_us() - released) / 1000);
 
     // TODO: determine failure mode if FUSE times out
 
-    if (providesAsec) {
-		if(doUnmount(Volume::SEC_ASECDIR_EXT, force) != 0)
-		{
-        	SLOGE("Failed to unmount secure area on %s (%s)", getMountpoint(), strerror(errno));
-        	goto out_mounted;
-		}
-		else
-		{
-			property_set("sys.vold.hasAsec","false"); 
-			SLOGE("Succeed to umount secure area on %s",getMountpoint());
-		}
+    /*
+     * Take the secure area, the fuse mount and the real sd card down in
+     * that order, after any containers living on them. Each one is only
+     * tried once everything stacked on it is gone, so whatever is left
+     * over tells how far we got.
+     */
+    getOwnMounts(&mounts, providesAsec);
+    rc = mVm->teardownVolume(this, &mounts, force);
+    if (rc) {
+        SLOGE("Failed to unmount %s (%s)", mounts.front().c_str(), strerror(errno));
     }
 
-    /* Now that the fuse daemon is dead, unmount it */
-    if (doUnmount(getFuseMountpoint(), force) != 0) {
-        SLOGE("Failed to unmount %s (%s)", getFuseMountpoint(), strerror(errno));
-        //goto fail_remount_secure;
+    if (providesAsec && (mounts.empty() || mounts.front() != Volume::SEC_ASECDIR_EXT)) {
+        AsecCatalog::Instance()->invalidate(SEC_ASECDIR_EXT);
+        property_set("sys.vold.hasAsec","false");
     }
 
-    /* Unmount the real sd card */
-    if (doUnmount(getMountpoint(), force) != 0) {
-        SLOGE("Failed to unmount %s (%s)", getMountpoint(), strerror(errno));
+    if (rc) {
+        if (providesAsec && mounts.front() == Volume::SEC_ASECDIR_EXT) {
+            goto out_mounted;
+        }
         goto fail_remount_secure;
     }
 
@@ -800,6 +944,45 @@ out_nomedia:
     return -1;
 }
 
+/*
+ * The media has been pulled, so nothing is going to be flushed and waiting
+ * for holders to let go only delays telling the framework. Lazily detach
+ * everything, let the kernel drop the devices on last close and report who
+ * was still using the volume.
+ */
+int Volume::unmountVolMediaGone() {
+    std::vector<std::string> mounts;
+    bool providesAsec = ((getFlags() & VOL_PROVIDES_ASEC) != 0) && (!mSkipAsec);
+
+    if (getState() != Volume::State_Mounted) {
+        SLOGE("Volume %s media gone when not mounted", getLabel());
+        errno = EINVAL;
+        return UNMOUNT_NOT_MOUNTED_ERR;
+    }
+
+    SLOGW("Volume %s media is gone, detaching %s", getLabel(), getMountpoint());
+
+    char service[64];
+    snprintf(service, 64, "fuse_%s", getLabel());
+    property_set("ctl.stop", service);
+
+    getOwnMounts(&mounts, providesAsec);
+    if (mVm->detachVolume(this, &mounts)) {
+        SLOGE("Failed to detach all mounts of %s", getLabel());
+    }
+
+    if (providesAsec) {
+        AsecCatalog::Instance()->invalidate(SEC_ASECDIR_EXT);
+        property_set("sys.vold.hasAsec","false");
+    }
+
+    setUuid(NULL);
+    setUserLabel(NULL);
+    mCurrentlyMountedKdev = -1;
+    setState(Volume::State_NoMedia);
+    return 0;
+}
+
 #ifdef SUPPORTED_MULTI_USB_PARTITIONS
 int Volume::unmountPartition(int major, int minor){
     setState(Volume::State_Unmounting);
@@ -866,91 +1049,85 @@ int Volume::initializeMbr(const char *deviceNode) {
 }
 
 /*
- * Use blkid to extract UUID and label from device, since it handles many
- * obscure edge cases around partition types and formats. Always broadcasts
- * updated metadata values.
+ * Only runs the full check when the driver can't tell that the filesystem
+ * was cleanly unmounted, unless persist.vold.fat_fsck is "always".
+ * persist.vold.fat_fsck_interval forces a full check after that many
+ * skipped ones. Broadcasts which path was taken and how long it took.
  */
-int Volume::extractMetadata(const char* devicePath) {
-    int res = 0;
-
-    std::string cmd;
-    cmd = BLKID_PATH;
-    cmd += " -c /data/data/blkid ";
-    cmd += devicePath;
-
-    FILE* fp = popen(cmd.c_str(), "r");
-    if (!fp) {
-        ALOGE("Failed to run %s: %s", cmd.c_str(), strerror(errno));
-        res = -1;
-        goto done;
+int Volume::checkFilesystem(FsDriver *driver, const char *devicePath) {
+    char policy[PROPERTY_VALUE_MAX];
+    char interval[PROPERTY_VALUE_MAX];
+    const char *method;
+    unsigned long long start = get_monotonic_us();
+    int rc = 0;
+
+    property_get("persist.vold.fat_fsck", policy, "dirty");
+    property_get("persist.vold.fat_fsck_interval", interval, "0");
+    int maxSkipped = atoi(interval);
+
+    int state = FsDriver::STATE_UNKNOWN;
+    if (driver->hasChecker() && strcmp(policy, "always")) {
+        state = driver->probeClean(devicePath);
     }
 
-    char line[1024];
-    char value[128];
-    if (fgets(line, sizeof(line), fp) != NULL) {
-        ALOGD("blkid identified as %s", line);
-
-        char* start = strstr(line, "UUID=");
-        if (start != NULL && sscanf(start + 5, "\"%127[^\"]\"", value) == 1) {
-            setUuid(value);
-        } else {
-            setUuid(NULL);
-        }
-
-        start = strstr(line, "LABEL=");
-        if (start != NULL && sscanf(start + 6, "\"%127[^\"]\"", value) == 1) {
-            setUserLabel(value);
-        } else {
-            setUserLabel(NULL);
-        }
+    if (!driver->hasChecker()) {
+        method = "skipped";
+    } else if (state == FsDriver::STATE_CLEAN &&
+            (maxSkipped <= 0 || mChecksSkipped < maxSkipped)) {
+        SLOGI("%s was cleanly unmounted, skipping fsck", devicePath);
+        mChecksSkipped++;
+        method = "clean";
     } else {
-        ALOGW("blkid failed to identify %s", devicePath);
-        //res = -1;
-        int fd = open("/data/data/blkid", O_RDONLY);
-		if(fd<0)
-		{
-			ALOGD("---extractMetadata open cache fail---");
-			res = -1;
-			remove("/data/data/blkid");
-			goto done;
-		}
-		int nbytes = read(fd, line, sizeof(line) - 1);
-		if (nbytes <= 0) 
-		{
-			ALOGD("---extractMetadata read cache fail---");
-			res = -1;
-			close(fd);
-			remove("/data/data/blkid");
-			goto done;
-		}
-        char* start = strstr(line, devicePath);
-		start=strstr(line, "UUID=");
-        if (start != NULL && sscanf(start + 5, "\"%127[^\"]\"", value) == 1) {
-            setUuid(value);
-			ALOGD("---get uuid =%s",value);
+        if (state == FsDriver::STATE_CLEAN) {
+            SLOGI("%s skipped %d checks, forcing fsck", devicePath, mChecksSkipped);
+            method = "periodic";
+        } else if (state == FsDriver::STATE_DIRTY) {
+            method = "dirty";
         } else {
-            setUuid(NULL);
+            method = "full";
         }
-
-        start = strstr(line, "LABEL=");
-        if (start != NULL && sscanf(start + 6, "\"%127[^\"]\"", value) == 1) {
-            setUserLabel(value);
-			ALOGD("---get label =%s",value);
-        } else {
-            setUserLabel(NULL);
+        rc = driver->check(devicePath);
+        if (!rc) {
+            mChecksSkipped = 0;
         }
-		close(fd);
-		remove("/data/data/blkid");
     }
 
-    pclose(fp);
+    int saved_errno = errno;
+    char msg[255];
+    unsigned long long elapsed = (get_monotonic_us() - start) / 1000;
+    snprintf(msg, sizeof(msg), "%s %s %s %llu %s %s", getLabel(), getFuseMountpoint(), method,
+             elapsed, rc ? "failed" : "ok", driver->getName());
+    SLOGI("%s check of %s (%s) took %llu ms", driver->getName(), devicePath, method, elapsed);
+    mVm->getBroadcaster()->sendBroadcast(ResponseCode::VolumeFsCheckResult, msg, false);
+
+    errno = saved_errno;
+    return rc;
+}
+
+/*
+ * Filesystems vold will mount on this kind of media, from the comma
+ * separated ro.vold.removable_fs.
+ */
+bool Volume::isRemovableFsEnabled(FsDriver *driver) {
+    char list[PROPERTY_VALUE_MAX];
+    char *saveptr;
 
-done:
-    if (res == -1) {
-        setUuid(NULL);
-        setUserLabel(NULL);
+    property_get("ro.vold.removable_fs", list, "vfat,ntfs");
+    for (char *tok = strtok_r(list, ",", &saveptr); tok; tok = strtok_r(NULL, ",", &saveptr)) {
+        if (!strcmp(tok, driver->getName())) {
+            return true;
+        }
     }
-    return res;
+    return false;
+}
+
+/*
+ * Publishes the UUID and label blkid found when probing the device. Always
+ * broadcasts updated metadata values.
+ */
+void Volume::applyMetadata(const FsProbe::Result &fs) {
+    setUuid(fs.uuid.empty() ? NULL : fs.uuid.c_str());
+    setUserLabel(fs.label.empty() ? NULL : fs.label.c_str());
 }
 
 #ifdef SUPPORTED_MULTI_USB_PARTITIONS
@@ -17,10 +17,18 @@
 #ifndef _VOLUME_H
 #define _VOLUME_H
 
+#include <string>
+#include <vector>
+
 #include <utils/List.h>
 #include <fs_mgr.h>
 
-class NetlinkEvent;
+#include "BlockEvent.h"
+#include "FsProbe.h"
+
+class ColdbootStateTask;
+class FsDriver;
+class SerialExecutor;
 class VolumeManager;
 
 #define USB_DISK_LABEL "usb_storage"
@@ -35,6 +43,8 @@ typedef android::List<VolumePartition *> Partitions;
 #endif
 
 class Volume {
+    friend class ColdbootStateTask;
+
 private:
     int mState;
     int mFlags;
@@ -51,13 +61,17 @@ public:
     static const int State_Shared     = 7;
     static const int State_SharedMnt  = 8;
 
+    static const int FRAMEWORK_RELEASE_TIMEOUT_MS = 1000;
+    static const int FRAMEWORK_RELEASE_POLL_MS    = 50;
+    static const int FUSE_STOP_TIMEOUT_MS         = 1000;
+    static const int FUSE_STOP_POLL_MS            = 10;
+
     static const char *MEDIA_DIR;
     static const char *FUSE_DIR;
     static const char *SEC_ASECDIR_EXT;
     static const char *SEC_ASECDIR_INT;
     static const char *ASECDIR;
     static const char *LOOPDIR;
-    static const char *BLKID_PATH;
 
 protected:
     char* mLabel;
@@ -69,6 +83,16 @@ protected:
     int mPartIdx;
     int mOrigPartIdx;
     bool mRetryMount;
+    // Mounts that skipped fsck since the last full check
+    int mChecksSkipped;
+    // Runs every state transition of this volume, one at a time
+    SerialExecutor *mExecutor;
+    /*
+     * Set while the events replayed for it at coldboot are on their way.
+     * Both flags are only touched on mExecutor.
+     */
+    bool mColdbootPending;
+    bool mReadyReported;
 #ifdef SUPPORTED_MULTI_USB_PARTITIONS
     Partitions mPartitions;
     int32_t mLetters;
@@ -85,6 +109,8 @@ public:
 
     int mountVol();
     int unmountVol(bool force, bool revert);
+    /* Unmount path for media that has already been removed */
+    int unmountVolMediaGone();
 #ifdef SUPPORTED_MULTI_USB_PARTITIONS
     int unmountPartition(int major, int minor);
 #endif
@@ -95,6 +121,15 @@ public:
     const char* getUserLabel() { return mUserLabel; }
     int getState() { return mState; }
     int getFlags() { return mFlags; };
+    SerialExecutor *getExecutor() { return mExecutor; }
+
+    /* Queued on the executor ahead of the events coldboot is about to replay */
+    void setColdbootPending();
+    /*
+     * Queued once coldboot is done: reports the volume ready unless its
+     * replayed events are still to come.
+     */
+    void finishColdboot();
 
     /* Mountpoint of the raw volume */
     virtual const char *getMountpoint() = 0;
@@ -104,7 +139,13 @@ public:
     bool isPartitionEmpty() {return mPartitions.empty();}
 #endif
 
-    virtual int handleBlockEvent(NetlinkEvent *evt);
+    /* Events VolumeManager routed here by their devpath */
+    virtual int handleBlockEvent(const BlockEvent &evt);
+    /*
+     * Handles the coalesced events of a disk that has settled, all in one
+     * go, followed by a single VolumeDiskSettled broadcast.
+     */
+    virtual int handleSettledEvents(const std::vector<BlockEvent> &events);
     virtual dev_t getDiskDevice();
     virtual dev_t getShareDevice();
     virtual void handleVolumeShared();
@@ -112,11 +153,20 @@ public:
 
     void setDebug(bool enable);
     virtual int getVolInfo(struct volume_info *v) = 0;
+    /* Tells the SDMMC driver how an unmount of the sd card is going */
+    void notifyStateKernel(int number);
 
 protected:
     void setUuid(const char* uuid);
     void setUserLabel(const char* userLabel);
     void setState(int state);
+    /* Reports readiness once the coldboot events have been handled */
+    void checkColdbootReady();
+    /*
+     * Broadcasts VolumeReady with the state coldboot left the volume in,
+     * once. Runs on the executor.
+     */
+    void reportReady();
 #ifdef SUPPORTED_MULTI_USB_PARTITIONS
     void getVolumeLabel(const char* devicepath, char*, char letter);
 #endif
@@ -133,8 +183,12 @@ private:
     bool isMountpointMounted(const char *path);
     int mountAsecExternal();
     int doUnmount(const char *path, bool force);
-    int extractMetadata(const char* devicePath);
-	void notifyStateKernel(int number);
+    void getOwnMounts(std::vector<std::string> *mounts, bool providesAsec);
+    void waitForFrameworkRelease(int timeoutMs);
+    int stopFuse(int timeoutMs);
+    void applyMetadata(const FsProbe::Result &fs);
+    int checkFilesystem(FsDriver *driver, const char *devicePath);
+    bool isRemovableFsEnabled(FsDriver *driver);
 #ifdef SUPPORTED_MULTI_USB_PARTITIONS
     size_t gb2312_to_utf8(char* pOut,size_t pOutLen, char* pIn, size_t pInlen) ;
     char getNextLetter();
@@ -26,6 +26,9 @@
 #include <sys/mount.h>
 #include <dirent.h>
 
+#include <algorithm>
+#include <set>
+
 #include <linux/kdev_t.h>
 
 #define LOG_TAG "Vold"
@@ -35,7 +38,6 @@
 #include <cutils/fs.h>
 #include <cutils/log.h>
 
-#include <sysutils/NetlinkEvent.h>
 
 #include <private/android_filesystem_config.h>
 
@@ -43,10 +45,17 @@
 #include "DirectVolume.h"
 #include "ResponseCode.h"
 #include "Loop.h"
+#include "MountTable.h"
+#include "AsecCatalog.h"
 #include "Ext4.h"
 #include "Fat.h"
+#include "FsDriver.h"
 #include "Devmapper.h"
 #include "Process.h"
+#include "ProcessScanner.h"
+#include "WorkerPool.h"
+#include "SerialExecutor.h"
+#include "VoldUtil.h"
 #include "Asec.h"
 #include "cryptfs.h"
 
@@ -64,8 +73,15 @@ VolumeManager *VolumeManager::Instance() {
 VolumeManager::VolumeManager() {
     mDebug = false;
     mVolumes = new VolumeCollection();
-    mActiveContainers = new AsecIdCollection();
+    mContainers = new ContainerRegistry();
+    mDevpaths = new DevpathTrie();
     mBroadcaster = NULL;
+    pthread_mutex_init(&mUmsLock, NULL);
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&mContainerLock, &attr);
+    pthread_mutexattr_destroy(&attr);
     mUmsSharingCount = 0;
     mSavedDirtyRatio = -1;
     mUmsDirtyRatio = 5; // use 0 on linux 3.x would cause a vfs_write timeout during ums copying
@@ -74,9 +90,21 @@ VolumeManager::VolumeManager() {
 
 VolumeManager::~VolumeManager() {
     delete mVolumes;
-    delete mActiveContainers;
+    delete mContainers;
+    delete mDevpaths;
+    pthread_mutex_destroy(&mUmsLock);
+    pthread_mutex_destroy(&mContainerLock);
 }
 
+/* Holds a mutex until the end of the enclosing scope */
+class ScopedLock {
+    pthread_mutex_t *mLock;
+
+public:
+    ScopedLock(pthread_mutex_t *lock) : mLock(lock) { pthread_mutex_lock(mLock); }
+    ~ScopedLock() { pthread_mutex_unlock(mLock); }
+};
+
 char *VolumeManager::asecHash(const char *id, char *buffer, size_t len) {
     static const char* digits = "0123456789abcdef";
 
@@ -118,6 +146,13 @@ void VolumeManager::setDebug(bool enable) {
 }
 
 int VolumeManager::start() {
+    if (Loop::init()) {
+        SLOGW("Unable to index active loop devices (%s)", strerror(errno));
+    }
+    FsDriver::registerBuiltins();
+    if (AsecCatalog::Instance()->start()) {
+        SLOGW("ASEC catalog will rescan on every lookup (%s)", strerror(errno));
+    }
     return 0;
 }
 
@@ -130,27 +165,53 @@ int VolumeManager::addVolume(Volume *v) {
     return 0;
 }
 
-void VolumeManager::handleBlockEvent(NetlinkEvent *evt) {
-    const char *devpath = evt->findParam("DEVPATH");
+int VolumeManager::registerDevpath(const char *devpath, Volume *v) {
+    if (mDevpaths->insert(devpath, v)) {
+        SLOGE("Devpath %s already belongs to another volume", devpath);
+        return -1;
+    }
+    return 0;
+}
 
-    /* Lookup a volume to handle this device */
+void VolumeManager::unregisterDevpath(const char *devpath) {
+    mDevpaths->remove(devpath);
+}
+
+void VolumeManager::finishColdboot() {
     VolumeCollection::iterator it;
-    bool hit = false;
+
     for (it = mVolumes->begin(); it != mVolumes->end(); ++it) {
-        if (!(*it)->handleBlockEvent(evt)) {
+        (*it)->finishColdboot();
+    }
+}
+
+void VolumeManager::handleBlockEvent(const BlockEvent &evt) {
+    /* Lookup a volume to handle this device */
+    Volume *v = mDevpaths->lookup(evt.devpath.c_str());
+
+    if (!v) {
 #ifdef NETLINK_DEBUG
-            SLOGD("Device '%s' event handled by volume %s\n", devpath, (*it)->getLabel());
+        SLOGW("No volumes handled block event for '%s'", evt.devpath.c_str());
 #endif
-            hit = true;
-            break;
-        }
+        return;
     }
+#ifdef NETLINK_DEBUG
+    SLOGD("Device '%s' event handled by volume %s\n", evt.devpath.c_str(), v->getLabel());
+#endif
+    v->handleBlockEvent(evt);
+}
+
+void VolumeManager::handleSettledEvents(const std::vector<BlockEvent> &events) {
+    // A batch only ever holds one disk and its partitions
+    Volume *v = mDevpaths->lookup(events[0].devpath.c_str());
 
-    if (!hit) {
+    if (!v) {
 #ifdef NETLINK_DEBUG
-        SLOGW("No volumes handled block event for '%s'", devpath);
+        SLOGW("No volumes handled settled events for '%s'", events[0].devpath.c_str());
 #endif
+        return;
     }
+    v->handleSettledEvents(events);
 }
 
 int VolumeManager::listVolumes(SocketClient *cli) {
@@ -168,6 +229,48 @@ int VolumeManager::listVolumes(SocketClient *cli) {
     return 0;
 }
 
+/*
+ * One state transition of a volume. These always run on the volume's own
+ * executor so the state checks and the transition itself can't interleave
+ * with netlink events or other commands for the same volume.
+ */
+class VolumeOpTask : public WorkerTask {
+public:
+    enum Op { Mount, Unmount, Format, Share, Unshare };
+
+private:
+    VolumeManager *mVm;
+    Volume        *mVolume;
+    Op             mOp;
+
+public:
+    // Arguments of the operation; only those it uses need setting
+    bool           force;
+    bool           revert;
+    bool           wipe;
+    std::string    method;
+
+    VolumeOpTask(VolumeManager *vm, Volume *v, Op op)
+            : mVm(vm), mVolume(v), mOp(op), force(false), revert(false), wipe(false) {}
+
+    int run() {
+        switch (mOp) {
+        case Mount:
+            return mVolume->mountVol();
+        case Unmount:
+            return mVm->doUnmountVolume(mVolume, force, revert);
+        case Format:
+            return mVm->doFormatVolume(mVolume, wipe);
+        case Share:
+            return mVm->doShareVolume(mVolume, method.c_str());
+        case Unshare:
+            return mVm->doUnshareVolume(mVolume, method.c_str());
+        }
+        errno = EINVAL;
+        return -1;
+    }
+};
+
 int VolumeManager::formatVolume(const char *label, bool wipe) {
     Volume *v = lookupVolume(label);
 
@@ -176,6 +279,12 @@ int VolumeManager::formatVolume(const char *label, bool wipe) {
         return -1;
     }
 
+    VolumeOpTask *task = new VolumeOpTask(this, v, VolumeOpTask::Format);
+    task->wipe = wipe;
+    return v->getExecutor()->call(task);
+}
+
+int VolumeManager::doFormatVolume(Volume *v, bool wipe) {
     if (mVolManagerDisabled) {
         errno = EBUSY;
         return -1;
@@ -185,21 +294,17 @@ int VolumeManager::formatVolume(const char *label, bool wipe) {
 }
 
 int VolumeManager::getObbMountPath(const char *sourceFile, char *mountPath, int mountPathLen) {
-    char idHash[33];
-    if (!asecHash(sourceFile, idHash, sizeof(idHash))) {
-        SLOGE("Hash of '%s' failed (%s)", sourceFile, strerror(errno));
-        return -1;
-    }
+    ContainerRegistry::Container c;
 
     memset(mountPath, 0, mountPathLen);
-    int written = snprintf(mountPath, mountPathLen, "%s/%s", Volume::LOOPDIR, idHash);
-    if ((written < 0) || (written >= mountPathLen)) {
-        errno = EINVAL;
+    if (!mContainers->lookup(sourceFile, &c) || c.type != OBB) {
+        errno = ENOENT;
         return -1;
     }
 
-    if (access(mountPath, F_OK)) {
-        errno = ENOENT;
+    int written = snprintf(mountPath, mountPathLen, "%s", c.mountPoint.c_str());
+    if ((written < 0) || (written >= mountPathLen)) {
+        errno = EINVAL;
         return -1;
     }
 
@@ -221,11 +326,6 @@ int VolumeManager::getAsecMountPath(const char *id, char *buffer, int maxlen) {
     }
 
     memset(buffer, 0, maxlen);
-    if (access(asecFileName, F_OK)) {
-        errno = ENOENT;
-        return -1;
-    }
-
     int written = snprintf(buffer, maxlen, "%s/%s", Volume::ASECDIR, id);
     if ((written < 0) || (written >= maxlen)) {
         SLOGE("getAsecMountPath failed for %s: couldn't construct path in buffer", id);
@@ -251,11 +351,6 @@ int VolumeManager::getAsecFilesystemPath(const char *id, char *buffer, int maxle
     }
 
     memset(buffer, 0, maxlen);
-    if (access(asecFileName, F_OK)) {
-        errno = ENOENT;
-        return -1;
-    }
-
     int written = snprintf(buffer, maxlen, "%s", asecFileName);
     if ((written < 0) || (written >= maxlen)) {
         errno = EINVAL;
@@ -267,6 +362,7 @@ int VolumeManager::getAsecFilesystemPath(const char *id, char *buffer, int maxle
 
 int VolumeManager::createAsec(const char *id, unsigned int numSectors, const char *fstype,
         const char *key, const int ownerUid, bool isExternal) {
+    ScopedLock lock(&mContainerLock);
     struct asec_superblock sb;
     memset(&sb, 0, sizeof(sb));
 
@@ -364,8 +460,9 @@ int VolumeManager::createAsec(const char *id, unsigned int numSectors, const cha
     if (strcmp(key, "none")) {
         // XXX: This is all we support for now
         sb.c_cipher = ASEC_SB_C_CIPHER_TWOFISH;
+        // Only FAT formatting wants the legacy geometry
         if (Devmapper::create(idHash, loopDevice, key, numImgSectors, dmDevice,
-                             sizeof(dmDevice))) {
+                             sizeof(dmDevice), false, wantFilesystem && !usingExt4)) {
             SLOGE("ASEC device mapping failed (%s)", strerror(errno));
             Loop::destroyByDevice(loopDevice);
             unlink(asecFileName);
@@ -490,11 +587,18 @@ int VolumeManager::createAsec(const char *id, unsigned int numSectors, const cha
         SLOGI("Created raw secure container %s (no filesystem)", id);
     }
 
-    mActiveContainers->push_back(new ContainerData(strdup(id), ASEC));
+    // The superblock was written after the watcher first saw the file
+    AsecCatalog::Instance()->update(asecDir, id);
+
+    char mountPoint[255];
+    snprintf(mountPoint, sizeof(mountPoint), "%s/%s", Volume::ASECDIR, id);
+    registerContainer(ASEC, id, idHash, asecFileName, loopDevice, cleanupDm ? dmDevice : NULL,
+                      mountPoint);
     return 0;
 }
 
 int VolumeManager::finalizeAsec(const char *id) {
+    ScopedLock lock(&mContainerLock);
     char asecFileName[255];
     char loopDevice[255];
     char mountPoint[255];
@@ -553,6 +657,7 @@ int VolumeManager::finalizeAsec(const char *id) {
 }
 
 int VolumeManager::fixupAsecPermissions(const char *id, gid_t gid, const char* filename) {
+    ScopedLock lock(&mContainerLock);
     char asecFileName[255];
     char loopDevice[255];
     char mountPoint[255];
@@ -675,6 +780,7 @@ int VolumeManager::fixupAsecPermissions(const char *id, gid_t gid, const char* f
 }
 
 int VolumeManager::renameAsec(const char *id1, const char *id2) {
+    ScopedLock lock(&mContainerLock);
     char asecFilename1[255];
     char *asecFilename2;
     char mountPoint[255];
@@ -734,6 +840,8 @@ int VolumeManager::renameAsec(const char *id1, const char *id2) {
         SLOGE("Rename of '%s' to '%s' failed (%s)", asecFilename1, asecFilename2, strerror(errno));
         goto out_err;
     }
+    AsecCatalog::Instance()->update(dir, id1);
+    AsecCatalog::Instance()->update(dir, id2);
 
     free(asecFilename2);
     return 0;
@@ -746,6 +854,7 @@ out_err:
 #define UNMOUNT_RETRIES 5
 #define UNMOUNT_SLEEP_BETWEEN_RETRY_MS (1000 * 1000)
 int VolumeManager::unmountAsec(const char *id, bool force) {
+    ScopedLock lock(&mContainerLock);
     char asecFileName[255];
     char mountPoint[255];
 
@@ -776,6 +885,7 @@ int VolumeManager::unmountAsec(const char *id, bool force) {
 }
 
 int VolumeManager::unmountObb(const char *fileName, bool force) {
+    ScopedLock lock(&mContainerLock);
     char mountPoint[255];
 
     char idHash[33];
@@ -801,6 +911,9 @@ int VolumeManager::unmountLoopImage(const char *id, const char *idHash,
         return -1;
     }
 
+    ProcessScanner scanner;
+    scanner.addMountpoint(mountPoint);
+
     int i, rc;
     for (i = 1; i <= UNMOUNT_RETRIES; i++) {
         rc = umount(mountPoint);
@@ -824,7 +937,13 @@ int VolumeManager::unmountLoopImage(const char *id, const char *idHash,
                 action = 1; // SIGHUP
         }
 
-        Process::killProcessesWithOpenFiles(mountPoint, action);
+        if (scanner.scan() >= 0) {
+            scanner.killHolders(action);
+            if (mDebug) {
+                SLOGD("Scanned %d processes holding %s in %llu us",
+                      scanner.getLastExamined(), mountPoint, scanner.getLastScanUs());
+            }
+        }
         usleep(UNMOUNT_SLEEP_BETWEEN_RETRY_MS);
     }
 
@@ -834,7 +953,17 @@ int VolumeManager::unmountLoopImage(const char *id, const char *idHash,
         return -1;
     }
 
-    int retries = 10;
+    return releaseLoopImage(id, idHash, mountPoint);
+}
+
+/*
+ * Removes what is left of a container once its mountpoint is gone: the
+ * mountpoint directory, the devmapper and loop devices and our record of it.
+ */
+int VolumeManager::releaseLoopImage(const char *id, const char *idHash,
+        const char *mountPoint, bool wait) {
+    int retries = wait ? 10 : 1;
+    int rc = 0;
 
     while(retries--) {
         if (!rmdir(mountPoint)) {
@@ -842,42 +971,264 @@ int VolumeManager::unmountLoopImage(const char *id, const char *idHash,
         }
 
         SLOGW("Failed to rmdir %s (%s)", mountPoint, strerror(errno));
-        usleep(UNMOUNT_SLEEP_BETWEEN_RETRY_MS);
+        if (retries) {
+            usleep(UNMOUNT_SLEEP_BETWEEN_RETRY_MS);
+        }
     }
 
-    if (!retries) {
+    if (!retries && wait) {
         SLOGE("Timed out trying to rmdir %s (%s)", mountPoint, strerror(errno));
     }
 
-    if (Devmapper::destroy(idHash) && errno != ENXIO) {
+    /*
+     * When not waiting the devices may still be held by a detached mount;
+     * the kernel drops the mapping and clears the loop device on last close.
+     */
+    if (Devmapper::destroy(idHash, !wait) && errno != ENXIO) {
         SLOGE("Failed to destroy devmapper instance (%s)", strerror(errno));
+        rc = -1;
     }
 
+    ContainerRegistry::Container c;
     char loopDevice[255];
-    if (!Loop::lookupActive(idHash, loopDevice, sizeof(loopDevice))) {
-        Loop::destroyByDevice(loopDevice);
+    const char *loop = NULL;
+    if (mContainers->lookup(id, &c) && !c.loopDevice.empty()) {
+        loop = c.loopDevice.c_str();
+    } else if (!Loop::lookupActive(idHash, loopDevice, sizeof(loopDevice))) {
+        loop = loopDevice;
+    }
+    if (loop) {
+        /* A detached loop that is still busy clears itself on last close */
+        if (Loop::destroyByDevice(loop) && (wait || errno != EBUSY)) {
+            rc = -1;
+        }
     } else {
-        SLOGW("Failed to find loop device for {%s} (%s)", fileName, strerror(errno));
+        SLOGW("Failed to find loop device for {%s} (%s)", id, strerror(errno));
+    }
+
+    if (mContainers->remove(id)) {
+        SLOGW("Container %s was not registered", id);
+    }
+    return rc;
+}
+
+class ReleaseContainerTask : public WorkerTask {
+    VolumeManager  *mVm;
+    ContainerMount  mContainer;
+    bool            mDetach;
+
+public:
+    ReleaseContainerTask(VolumeManager *vm, const ContainerMount &container, bool detach)
+            : mVm(vm), mContainer(container), mDetach(detach) {}
+
+    int run() {
+        int rc = 0;
+
+        if (mDetach && umount2(mContainer.mountPoint.c_str(), MNT_DETACH) &&
+                errno != EINVAL && errno != ENOENT) {
+            SLOGE("Failed to detach container %s (%s)", mContainer.id.c_str(),
+                  strerror(errno));
+            rc = -1;
+        }
+        if (mVm->releaseLoopImage(mContainer.id.c_str(), mContainer.idHash.c_str(),
+                                  mContainer.mountPoint.c_str(), !mDetach)) {
+            rc = -1;
+        }
+        return rc;
     }
+};
+
+int VolumeManager::releaseContainers(const std::vector<ContainerMount> &containers,
+                                     const std::vector<std::string> &stillMounted,
+                                     bool detach) {
+    unsigned long long start = get_monotonic_us();
+    int failures = 0;
+    size_t i;
 
-    AsecIdCollection::iterator it;
-    for (it = mActiveContainers->begin(); it != mActiveContainers->end(); ++it) {
-        ContainerData* cd = *it;
-        if (!strcmp(cd->id, id)) {
-            free(*it);
-            mActiveContainers->erase(it);
+    if (containers.empty()) {
+        return 0;
+    }
+
+    WorkerPool pool(containers.size());
+    for (i = 0; i < containers.size(); i++) {
+        const ContainerMount &cm = containers[i];
+        if (std::find(stillMounted.begin(), stillMounted.end(), cm.mountPoint) !=
+                stillMounted.end()) {
+            SLOGE("Failed to unmount container %s", cm.id.c_str());
+            failures++;
+            continue;
+        }
+        pool.submit(new ReleaseContainerTask(this, cm, detach));
+    }
+    failures += pool.wait();
+
+    SLOGI("Released %zu containers on %d threads in %llu ms (%d failed)", containers.size(),
+          pool.getThreadCount(), (get_monotonic_us() - start) / 1000, failures);
+
+    if (failures) {
+        errno = EBUSY;
+        return -1;
+    }
+    return 0;
+}
+
+#define TEARDOWN_RETRIES 150
+#define TEARDOWN_SLEEP_BETWEEN_RETRY_MS (30 * 1000)
+int VolumeManager::teardownMounts(std::vector<std::string> *mounts, bool force,
+                                  Volume *owner, bool stacked) {
+    ProcessScanner scanner;
+    int retries = TEARDOWN_RETRIES;
+    std::vector<std::string>::iterator it;
+
+    /*
+     * A stacked mount can't go before the ones on top of it, so only the
+     * front entry is worth hunting holders for; independent mounts are all
+     * scanned for together.
+     */
+    for (it = mounts->begin(); it != mounts->end(); ++it) {
+        scanner.addMountpoint(it->c_str());
+        if (stacked) {
+            break;
+        }
+    }
+
+    while (true) {
+        it = mounts->begin();
+        while (it != mounts->end()) {
+            if (!umount(it->c_str()) || errno == EINVAL || errno == ENOENT) {
+                SLOGI("%s sucessfully unmounted", it->c_str());
+                scanner.removeMountpoint(it->c_str());
+                it = mounts->erase(it);
+                if (owner) {
+                    owner->notifyStateKernel(2);
+                }
+                if (stacked && it != mounts->end()) {
+                    /* Next layer down gets a full retry budget of its own */
+                    scanner.addMountpoint(it->c_str());
+                    retries = TEARDOWN_RETRIES;
+                }
+            } else if (stacked) {
+                break;
+            } else {
+                ++it;
+            }
+        }
+
+        if (mounts->empty() || !retries--) {
             break;
         }
+
+        if (owner) {
+            owner->notifyStateKernel(3);
+        }
+
+        int action = 0;
+        if (force) {
+            if (retries <= 120) {
+                action = 2; // SIGKILL
+            } else if (retries <= 130) {
+                action = 1; // SIGHUP
+            }
+        }
+        if (retries % 10 == 0) {
+            SLOGW("Failed to unmount %zu mountpoints, first %s (retries %d, action %d)",
+                  mounts->size(), mounts->front().c_str(), retries, action);
+        }
+
+        if (scanner.scan() >= 0) {
+            scanner.killHolders(action);
+        }
+        usleep(TEARDOWN_SLEEP_BETWEEN_RETRY_MS);
     }
-    if (it == mActiveContainers->end()) {
-        SLOGW("mActiveContainers is inconsistent!");
+
+    if (scanner.getScanCount()) {
+        SLOGI("%d /proc scans during teardown took %llu ms", scanner.getScanCount(),
+              scanner.getTotalScanUs() / 1000);
+    }
+
+    if (!mounts->empty()) {
+        for (it = mounts->begin(); it != mounts->end(); ++it) {
+            SLOGE("Giving up on unmount %s", it->c_str());
+        }
+        errno = EBUSY;
+        return -1;
     }
     return 0;
 }
 
+int VolumeManager::teardownVolume(Volume *v, std::vector<std::string> *mounts, bool force) {
+    ScopedLock lock(&mContainerLock);
+    std::vector<ContainerMount> containers;
+    std::vector<std::string> containerMounts;
+    int rc = 0;
+    size_t i;
+
+    collectDependentContainers(v, &containers);
+    for (i = 0; i < containers.size(); i++) {
+        containerMounts.push_back(containers[i].mountPoint);
+    }
+
+    /*
+     * The containers' loop devices keep their backing files on the volume
+     * open, so they have to be gone before the volume can be unmounted.
+     */
+    if (teardownMounts(&containerMounts, force)) {
+        rc = -1;
+    }
+    if (releaseContainers(containers, containerMounts, false)) {
+        rc = -1;
+    }
+    if (rc) {
+        /* The volume is still in use, leave all of its own mounts alone */
+        errno = EBUSY;
+        return rc;
+    }
+
+    return teardownMounts(mounts, force, v, true);
+}
+
+int VolumeManager::detachVolume(Volume *v, std::vector<std::string> *mounts) {
+    ScopedLock lock(&mContainerLock);
+    std::vector<ContainerMount> containers;
+    ProcessScanner scanner;
+    int rc = 0;
+    size_t i;
+
+    collectDependentContainers(v, &containers);
+    for (i = 0; i < containers.size(); i++) {
+        scanner.addMountpoint(containers[i].mountPoint.c_str());
+    }
+    for (i = 0; i < mounts->size(); i++) {
+        scanner.addMountpoint((*mounts)[i].c_str());
+    }
+
+    /* Once detached, holders no longer show up under the mountpoints */
+    if (scanner.scan() > 0) {
+        scanner.killHolders(0);
+    }
+
+    if (releaseContainers(containers, std::vector<std::string>(), true)) {
+        rc = -1;
+    }
+
+    for (i = 0; i < mounts->size(); i++) {
+        const char *mp = (*mounts)[i].c_str();
+        if (umount2(mp, MNT_DETACH) && errno != EINVAL && errno != ENOENT) {
+            SLOGE("Failed to detach %s (%s)", mp, strerror(errno));
+            rc = -1;
+        } else {
+            SLOGI("%s detached", mp);
+        }
+    }
+
+    return rc;
+}
+
 int VolumeManager::destroyAsec(const char *id, bool force) {
+    ScopedLock lock(&mContainerLock);
     char asecFileName[255];
     char mountPoint[255];
+    const char *dir;
 
     if (!isLegalAsecId(id)) {
         SLOGE("destroyAsec: Invalid asec id \"%s\"", id);
@@ -885,7 +1236,7 @@ int VolumeManager::destroyAsec(const char *id, bool force) {
         return -1;
     }
 
-    if (findAsec(id, asecFileName, sizeof(asecFileName))) {
+    if (findAsec(id, asecFileName, sizeof(asecFileName), &dir)) {
         SLOGE("Couldn't find ASEC %s", id);
         return -1;
     }
@@ -910,6 +1261,7 @@ int VolumeManager::destroyAsec(const char *id, bool force) {
         SLOGE("Failed to unlink asec '%s' (%s)", asecFileName, strerror(errno));
         return -1;
     }
+    AsecCatalog::Instance()->update(dir, id);
 
     if (mDebug) {
         SLOGD("ASEC %s destroyed", id);
@@ -949,29 +1301,9 @@ bool VolumeManager::isLegalAsecId(const char *id) const {
     return true;
 }
 
-bool VolumeManager::isAsecInDirectory(const char *dir, const char *asecName) const {
-    int dirfd = open(dir, O_DIRECTORY);
-    if (dirfd < 0) {
-        SLOGE("Couldn't open internal ASEC dir (%s)", strerror(errno));
-        return -1;
-    }
-
-    bool ret = false;
-
-    if (!faccessat(dirfd, asecName, F_OK, AT_SYMLINK_NOFOLLOW)) {
-        ret = true;
-    }
-
-    close(dirfd);
-
-    return ret;
-}
-
 int VolumeManager::findAsec(const char *id, char *asecPath, size_t asecPathLen,
         const char **directory) const {
-    int dirfd, fd;
-    const int idLen = strlen(id);
-    char *asecName;
+    AsecCatalog::Entry entry;
 
     if (!isLegalAsecId(id)) {
         SLOGE("findAsec: Invalid asec id \"%s\"", id);
@@ -979,41 +1311,50 @@ int VolumeManager::findAsec(const char *id, char *asecPath, size_t asecPathLen,
         return -1;
     }
 
-    if (asprintf(&asecName, "%s.asec", id) < 0) {
-        SLOGE("Couldn't allocate string to write ASEC name");
-        return -1;
-    }
-
-    const char *dir;
-    if (isAsecInDirectory(Volume::SEC_ASECDIR_INT, asecName)) {
-        dir = Volume::SEC_ASECDIR_INT;
-    } else if (isAsecInDirectory(Volume::SEC_ASECDIR_EXT, asecName)) {
-        dir = Volume::SEC_ASECDIR_EXT;
-    } else {
-        free(asecName);
+    if (!AsecCatalog::Instance()->lookup(id, &entry)) {
         return -1;
     }
 
     if (directory != NULL) {
-        *directory = dir;
+        *directory = entry.dir;
     }
 
     if (asecPath != NULL) {
-        int written = snprintf(asecPath, asecPathLen, "%s/%s", dir, asecName);
+        int written = snprintf(asecPath, asecPathLen, "%s/%s.asec", entry.dir, id);
         if ((written < 0) || (size_t(written) >= asecPathLen)) {
             SLOGE("findAsec failed for %s: couldn't construct ASEC path", id);
-            free(asecName);
             return -1;
         }
     }
 
-    free(asecName);
     return 0;
 }
 
-int VolumeManager::mountAsec(const char *id, const char *key, int ownerUid) {
+/*
+ * State carried by one ASEC through the mount stages below. A plain
+ * 'asec mount' runs the stages back to back; 'asec mount-batch' pipelines
+ * them across worker pools.
+ */
+struct AsecMountJob {
+    std::string id;
+    std::string key;
+    int ownerUid;
+
     char asecFileName[255];
     char mountPoint[255];
+    char idHash[33];
+    char loopDevice[255];
+    char dmDevice[255];
+    bool readOnly;
+    bool cleanupDm;
+    unsigned int nr_sec;
+    struct asec_superblock sb;
+
+    int err;
+};
+
+int VolumeManager::prepareAsecMount(AsecMountJob *job) {
+    const char *id = job->id.c_str();
 
     if (!isLegalAsecId(id)) {
         SLOGE("mountAsec: Invalid asec id \"%s\"", id);
@@ -1021,32 +1362,47 @@ int VolumeManager::mountAsec(const char *id, const char *key, int ownerUid) {
         return -1;
     }
 
-    if (findAsec(id, asecFileName, sizeof(asecFileName))) {
+    if (findAsec(id, job->asecFileName, sizeof(job->asecFileName))) {
         SLOGE("Couldn't find ASEC %s", id);
         return -1;
     }
 
-    int written = snprintf(mountPoint, sizeof(mountPoint), "%s/%s", Volume::ASECDIR, id);
-    if ((written < 0) || (size_t(written) >= sizeof(mountPoint))) {
+    int written = snprintf(job->mountPoint, sizeof(job->mountPoint), "%s/%s",
+                           Volume::ASECDIR, id);
+    if ((written < 0) || (size_t(written) >= sizeof(job->mountPoint))) {
         SLOGE("ASEC mount failed: couldn't construct mountpoint", id);
         return -1;
     }
 
-    if (isMountpointMounted(mountPoint)) {
+    if (isMountpointMounted(job->mountPoint)) {
         SLOGE("ASEC %s already mounted", id);
         errno = EBUSY;
         return -1;
     }
 
-    char idHash[33];
-    if (!asecHash(id, idHash, sizeof(idHash))) {
+    if (!asecHash(id, job->idHash, sizeof(job->idHash))) {
         SLOGE("Hash of '%s' failed (%s)", id, strerror(errno));
         return -1;
     }
 
-    char loopDevice[255];
-    if (Loop::lookupActive(idHash, loopDevice, sizeof(loopDevice))) {
-        if (Loop::create(idHash, asecFileName, loopDevice, sizeof(loopDevice))) {
+    /*
+     * Ext4 containers are remounted read-write to fix up permissions
+     * after install, so only FAT containers get a read-only loop.
+     */
+    struct asec_superblock peek;
+    job->readOnly = !Loop::readSuperblock(job->asecFileName, &peek) &&
+            peek.magic == ASEC_SB_MAGIC && !(peek.c_opts & ASEC_SB_C_OPTS_EXT4);
+    job->cleanupDm = false;
+    job->nr_sec = 0;
+    return 0;
+}
+
+int VolumeManager::attachAsecLoop(AsecMountJob *job) {
+    char *loopDevice = job->loopDevice;
+
+    if (Loop::lookupActive(job->idHash, loopDevice, sizeof(job->loopDevice))) {
+        if (Loop::create(job->idHash, job->asecFileName, loopDevice, sizeof(job->loopDevice),
+                         job->readOnly)) {
             SLOGE("ASEC loop device creation failed (%s)", strerror(errno));
             return -1;
         }
@@ -1055,59 +1411,64 @@ int VolumeManager::mountAsec(const char *id, const char *key, int ownerUid) {
         }
     } else {
         if (mDebug) {
-            SLOGD("Found active loopback for %s at %s", asecFileName, loopDevice);
+            SLOGD("Found active loopback for %s at %s", job->asecFileName, loopDevice);
         }
     }
 
-    char dmDevice[255];
-    bool cleanupDm = false;
-    int fd;
-    unsigned int nr_sec = 0;
-    struct asec_superblock sb;
-
-    if (Loop::lookupInfo(loopDevice, &sb, &nr_sec)) {
+    if (Loop::lookupInfo(loopDevice, &job->sb, &job->nr_sec)) {
         return -1;
     }
 
     if (mDebug) {
-        SLOGD("Container sb magic/ver (%.8x/%.2x)", sb.magic, sb.ver);
+        SLOGD("Container sb magic/ver (%.8x/%.2x)", job->sb.magic, job->sb.ver);
     }
-    if (sb.magic != ASEC_SB_MAGIC || sb.ver != ASEC_SB_VER) {
-        SLOGE("Bad container magic/version (%.8x/%.2x)", sb.magic, sb.ver);
+    if (job->sb.magic != ASEC_SB_MAGIC || job->sb.ver != ASEC_SB_VER) {
+        SLOGE("Bad container magic/version (%.8x/%.2x)", job->sb.magic, job->sb.ver);
         Loop::destroyByDevice(loopDevice);
         errno = EMEDIUMTYPE;
         return -1;
     }
-    nr_sec--; // We don't want the devmapping to extend onto our superblock
+    job->nr_sec--; // We don't want the devmapping to extend onto our superblock
+    return 0;
+}
+
+int VolumeManager::mapAsec(AsecMountJob *job) {
+    const char *key = job->key.c_str();
 
     if (strcmp(key, "none")) {
-        if (Devmapper::lookupActive(idHash, dmDevice, sizeof(dmDevice))) {
-            if (Devmapper::create(idHash, loopDevice, key, nr_sec,
-                                  dmDevice, sizeof(dmDevice))) {
+        if (Devmapper::lookupActive(job->idHash, job->dmDevice, sizeof(job->dmDevice))) {
+            if (Devmapper::create(job->idHash, job->loopDevice, key, job->nr_sec,
+                                  job->dmDevice, sizeof(job->dmDevice), job->readOnly)) {
                 SLOGE("ASEC device mapping failed (%s)", strerror(errno));
-                Loop::destroyByDevice(loopDevice);
+                Loop::destroyByDevice(job->loopDevice);
                 return -1;
             }
             if (mDebug) {
-                SLOGD("New devmapper instance created at %s", dmDevice);
+                SLOGD("New devmapper instance created at %s", job->dmDevice);
             }
         } else {
             if (mDebug) {
-                SLOGD("Found active devmapper for %s at %s", asecFileName, dmDevice);
+                SLOGD("Found active devmapper for %s at %s", job->asecFileName, job->dmDevice);
             }
         }
-        cleanupDm = true;
+        job->cleanupDm = true;
     } else {
-        strcpy(dmDevice, loopDevice);
+        strcpy(job->dmDevice, job->loopDevice);
     }
+    return 0;
+}
+
+int VolumeManager::finishAsecMount(AsecMountJob *job) {
+    const char *dmDevice = job->dmDevice;
+    const char *mountPoint = job->mountPoint;
 
     if (mkdir(mountPoint, 0000)) {
         if (errno != EEXIST) {
             SLOGE("Mountpoint creation failed (%s)", strerror(errno));
-            if (cleanupDm) {
-                Devmapper::destroy(idHash);
+            if (job->cleanupDm) {
+                Devmapper::destroy(job->idHash);
             }
-            Loop::destroyByDevice(loopDevice);
+            Loop::destroyByDevice(job->loopDevice);
             return -1;
         }
     }
@@ -1126,24 +1487,162 @@ int VolumeManager::mountAsec(const char *id, const char *key, int ownerUid) {
     }
 
     int result;
-    if (sb.c_opts & ASEC_SB_C_OPTS_EXT4) {
+    if (job->sb.c_opts & ASEC_SB_C_OPTS_EXT4) {
         result = Ext4::doMount(dmDevice, mountPoint, true, false, true);
     } else {
-        result = Fat::doMount(dmDevice, mountPoint, true, false, true, ownerUid, 0, 0222, false);
+        result = Fat::doMount(dmDevice, mountPoint, true, false, true, job->ownerUid, 0, 0222,
+                              false);
     }
 
     if (result) {
         SLOGE("ASEC mount failed (%s)", strerror(errno));
-        if (cleanupDm) {
-            Devmapper::destroy(idHash);
+        if (job->cleanupDm) {
+            Devmapper::destroy(job->idHash);
         }
-        Loop::destroyByDevice(loopDevice);
+        Loop::destroyByDevice(job->loopDevice);
         return -1;
     }
 
-    mActiveContainers->push_back(new ContainerData(strdup(id), ASEC));
+    registerContainer(ASEC, job->id.c_str(), job->idHash, job->asecFileName, job->loopDevice,
+                      job->cleanupDm ? job->dmDevice : NULL, mountPoint);
     if (mDebug) {
-        SLOGD("ASEC %s mounted", id);
+        SLOGD("ASEC %s mounted", job->id.c_str());
+    }
+    return 0;
+}
+
+int VolumeManager::runAsecMountStage(AsecMountJob *job, int stage) {
+    switch (stage) {
+    case AsecStage_Loop:
+        return attachAsecLoop(job);
+    case AsecStage_Map:
+        return mapAsec(job);
+    case AsecStage_Mount:
+        return finishAsecMount(job);
+    default:
+        errno = EINVAL;
+        return -1;
+    }
+}
+
+int VolumeManager::mountAsec(const char *id, const char *key, int ownerUid) {
+    ScopedLock lock(&mContainerLock);
+    AsecMountJob job;
+
+    job.id = id;
+    job.key = key;
+    job.ownerUid = ownerUid;
+
+    if (prepareAsecMount(&job)) {
+        return -1;
+    }
+    for (int stage = AsecStage_Loop; stage < AsecStage_Count; stage++) {
+        if (runAsecMountStage(&job, stage)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void reportAsecMount(SocketClient *cli, const AsecMountJob *job, int rc) {
+    char msg[255];
+    int code = ResponseCode::CommandOkay;
+
+    if (rc) {
+        errno = job->err;
+        code = ResponseCode::convertFromErrno();
+    }
+    snprintf(msg, sizeof(msg), "%s %d", job->id.c_str(), code);
+    cli->sendMsg(ResponseCode::AsecMountBatchResult, msg, false);
+}
+
+/*
+ * Runs one stage of one container, then hands the container to the next
+ * stage's pool. The final stage, or a failure, reports the result.
+ */
+class AsecMountStageTask : public WorkerTask {
+    VolumeManager             *mVm;
+    std::vector<WorkerPool *> *mPools;
+    AsecMountJob              *mJob;
+    int                        mStage;
+    SocketClient              *mCli;
+
+public:
+    AsecMountStageTask(VolumeManager *vm, std::vector<WorkerPool *> *pools, AsecMountJob *job,
+                       int stage, SocketClient *cli)
+            : mVm(vm), mPools(pools), mJob(job), mStage(stage), mCli(cli) {}
+
+    int run() {
+        if (mVm->runAsecMountStage(mJob, mStage)) {
+            mJob->err = errno;
+            reportAsecMount(mCli, mJob, -1);
+            return -1;
+        }
+        if (mStage + 1 < VolumeManager::AsecStage_Count) {
+            (*mPools)[mStage + 1]->submit(
+                    new AsecMountStageTask(mVm, mPools, mJob, mStage + 1, mCli));
+        } else {
+            reportAsecMount(mCli, mJob, 0);
+        }
+        return 0;
+    }
+};
+
+int VolumeManager::mountAsecBatch(const std::vector<AsecMountRequest> &requests,
+                                  SocketClient *cli) {
+    ScopedLock lock(&mContainerLock);
+    unsigned long long start = get_monotonic_us();
+    std::vector<AsecMountJob> jobs(requests.size());
+    std::vector<WorkerPool *> pools;
+    std::set<std::string> ids;
+    int failures = 0;
+    size_t i;
+
+    /* Validation touches shared state, so it stays on the caller's thread */
+    for (i = 0; i < requests.size(); i++) {
+        AsecMountJob &job = jobs[i];
+
+        job.id = requests[i].id;
+        job.key = requests[i].key;
+        job.ownerUid = requests[i].ownerUid;
+        job.err = 0;
+
+        if (!ids.insert(job.id).second) {
+            SLOGE("ASEC %s listed twice in batch", job.id.c_str());
+            job.err = EBUSY;
+        } else if (prepareAsecMount(&job)) {
+            job.err = errno;
+        }
+    }
+
+    for (int stage = 0; stage < AsecStage_Count; stage++) {
+        pools.push_back(new WorkerPool(requests.size()));
+    }
+
+    for (i = 0; i < jobs.size(); i++) {
+        if (jobs[i].err) {
+            reportAsecMount(cli, &jobs[i], -1);
+            failures++;
+            continue;
+        }
+        pools[AsecStage_Loop]->submit(
+                new AsecMountStageTask(this, &pools, &jobs[i], AsecStage_Loop, cli));
+    }
+
+    /* Earlier stages feed later ones, so drain them in order */
+    for (int stage = 0; stage < AsecStage_Count; stage++) {
+        failures += pools[stage]->wait();
+    }
+    for (int stage = 0; stage < AsecStage_Count; stage++) {
+        delete pools[stage];
+    }
+
+    SLOGI("Mounted %zu of %zu ASECs in %llu ms", requests.size() - failures, requests.size(),
+          (get_monotonic_us() - start) / 1000);
+
+    if (failures) {
+        errno = EIO;
+        return -1;
     }
     return 0;
 }
@@ -1165,6 +1664,7 @@ Volume* VolumeManager::getVolumeForFile(const char *fileName) {
  * Mounts an image file <code>img</code>.
  */
 int VolumeManager::mountObb(const char *img, const char *key, int ownerGid) {
+    ScopedLock lock(&mContainerLock);
     char mountPoint[255];
 
     char idHash[33];
@@ -1187,7 +1687,7 @@ int VolumeManager::mountObb(const char *img, const char *key, int ownerGid) {
 
     char loopDevice[255];
     if (Loop::lookupActive(idHash, loopDevice, sizeof(loopDevice))) {
-        if (Loop::create(idHash, img, loopDevice, sizeof(loopDevice))) {
+        if (Loop::create(idHash, img, loopDevice, sizeof(loopDevice), true)) {
             SLOGE("Image loop device creation failed (%s)", strerror(errno));
             return -1;
         }
@@ -1223,7 +1723,7 @@ int VolumeManager::mountObb(const char *img, const char *key, int ownerGid) {
     if (strcmp(key, "none")) {
         if (Devmapper::lookupActive(idHash, dmDevice, sizeof(dmDevice))) {
             if (Devmapper::create(idHash, loopDevice, key, nr_sec,
-                                  dmDevice, sizeof(dmDevice))) {
+                                  dmDevice, sizeof(dmDevice), true)) {
                 SLOGE("ASEC device mapping failed (%s)", strerror(errno));
                 Loop::destroyByDevice(loopDevice);
                 return -1;
@@ -1262,7 +1762,8 @@ int VolumeManager::mountObb(const char *img, const char *key, int ownerGid) {
         return -1;
     }
 
-    mActiveContainers->push_back(new ContainerData(strdup(img), OBB));
+    registerContainer(OBB, img, idHash, img, loopDevice, cleanupDm ? dmDevice : NULL,
+                      mountPoint);
     if (mDebug) {
         SLOGD("Image %s mounted", img);
     }
@@ -1277,51 +1778,18 @@ int VolumeManager::mountVolume(const char *label) {
         return -1;
     }
 
-    return v->mountVol();
+    return v->getExecutor()->call(new VolumeOpTask(this, v, VolumeOpTask::Mount));
 }
 
 int VolumeManager::listMountedObbs(SocketClient* cli) {
-    char device[256];
-    char mount_path[256];
-    char rest[256];
-    FILE *fp;
-    char line[1024];
-
-    if (!(fp = fopen("/proc/mounts", "r"))) {
-        SLOGE("Error opening /proc/mounts (%s)", strerror(errno));
-        return -1;
-    }
-
-    // Create a string to compare against that has a trailing slash
-    int loopDirLen = strlen(Volume::LOOPDIR);
-    char loopDir[loopDirLen + 2];
-    strcpy(loopDir, Volume::LOOPDIR);
-    loopDir[loopDirLen++] = '/';
-    loopDir[loopDirLen] = '\0';
-
-    while(fgets(line, sizeof(line), fp)) {
-        line[strlen(line)-1] = '\0';
-
-        /*
-         * Should look like:
-         * /dev/block/loop0 /mnt/obb/fc99df1323fd36424f864dcb76b76d65 ...
-         */
-        sscanf(line, "%255s %255s %255s\n", device, mount_path, rest);
-
-        if (!strncmp(mount_path, loopDir, loopDirLen)) {
-            int fd = open(device, O_RDONLY);
-            if (fd >= 0) {
-                struct loop_info64 li;
-                if (ioctl(fd, LOOP_GET_STATUS64, &li) >= 0) {
-                    cli->sendMsg(ResponseCode::AsecListResult,
-                            (const char*) li.lo_file_name, false);
-                }
-                close(fd);
-            }
-        }
+    ScopedLock lock(&mContainerLock);
+    std::vector<ContainerRegistry::Container> obbs;
+
+    mContainers->listByType(OBB, &obbs);
+    for (size_t i = 0; i < obbs.size(); i++) {
+        cli->sendMsg(ResponseCode::AsecListResult, obbs[i].fileName.c_str(), false);
     }
 
-    fclose(fp);
     return 0;
 }
 
@@ -1354,6 +1822,14 @@ int VolumeManager::shareVolume(const char *label, const char *method) {
         return -1;
     }
 
+    VolumeOpTask *task = new VolumeOpTask(this, v, VolumeOpTask::Share);
+    task->method = method;
+    return v->getExecutor()->call(task);
+}
+
+int VolumeManager::doShareVolume(Volume *v, const char *method) {
+    const char *label = v->getLabel();
+
     /*
      * Eventually, we'll want to support additional share back-ends,
      * some of which may work while the media is mounted. For now,
@@ -1419,6 +1895,9 @@ int VolumeManager::shareVolume(const char *label, const char *method) {
 
     close(fd);
     v->handleVolumeShared();
+
+    // Volumes are shared from their own executors, so guard the count
+    pthread_mutex_lock(&mUmsLock);
     if (mUmsSharingCount++ == 0) {
         FILE* fp;
         mSavedDirtyRatio = -1; // in case we fail
@@ -1434,6 +1913,7 @@ int VolumeManager::shareVolume(const char *label, const char *method) {
             SLOGE("Failed to open /proc/sys/vm/dirty_ratio (%s)", strerror(errno));
         }
     }
+    pthread_mutex_unlock(&mUmsLock);
     return 0;
 }
 
@@ -1445,6 +1925,14 @@ int VolumeManager::unshareVolume(const char *label, const char *method) {
         return -1;
     }
 
+    VolumeOpTask *task = new VolumeOpTask(this, v, VolumeOpTask::Unshare);
+    task->method = method;
+    return v->getExecutor()->call(task);
+}
+
+int VolumeManager::doUnshareVolume(Volume *v, const char *method) {
+    const char *label = v->getLabel();
+
     if (strcmp(method, "ums")) {
         errno = ENOSYS;
         return -1;
@@ -1482,6 +1970,8 @@ int VolumeManager::unshareVolume(const char *label, const char *method) {
 
     close(fd);
     v->handleVolumeUnshared();
+
+    pthread_mutex_lock(&mUmsLock);
     if (--mUmsSharingCount == 0 && mSavedDirtyRatio != -1) {
         FILE* fp;
         if ((fp = fopen("/proc/sys/vm/dirty_ratio", "r+"))) {
@@ -1492,6 +1982,7 @@ int VolumeManager::unshareVolume(const char *label, const char *method) {
         }
         mSavedDirtyRatio = -1;
     }
+    pthread_mutex_unlock(&mUmsLock);
     return 0;
 }
 
@@ -1549,6 +2040,13 @@ int VolumeManager::unmountVolume(const char *label, bool force, bool revert) {
         return -1;
     }
 
+    VolumeOpTask *task = new VolumeOpTask(this, v, VolumeOpTask::Unmount);
+    task->force = force;
+    task->revert = revert;
+    return v->getExecutor()->call(task);
+}
+
+int VolumeManager::doUnmountVolume(Volume *v, bool force, bool revert) {
     if (v->getState() == Volume::State_NoMedia) {
         errno = ENODEV;
         return -1;
@@ -1561,8 +2059,6 @@ int VolumeManager::unmountVolume(const char *label, bool force, bool revert) {
         return UNMOUNT_NOT_MOUNTED_ERR;
     }
 
-    cleanupAsec(v, force);
-
     return v->unmountVol(force, revert);
 }
 
@@ -1581,6 +2077,9 @@ extern "C" int vold_unmountAllAsecs(void) {
 #define ASEC_SUFFIX ".asec"
 #define ASEC_SUFFIX_LEN (sizeof(ASEC_SUFFIX) - 1)
 int VolumeManager::unmountAllAsecsInDir(const char *directory) {
+    ScopedLock lock(&mContainerLock);
+    std::vector<ContainerMount> containers;
+    std::vector<std::string> mounts;
     DIR *d = opendir(directory);
     int rc = 0;
 
@@ -1608,17 +2107,49 @@ int VolumeManager::unmountAllAsecsInDir(const char *directory) {
         if (name_len > 5 && name_len < (ID_BUF_LEN + ASEC_SUFFIX_LEN - 1) &&
                 !strcmp(&dent->d_name[name_len - 5], ASEC_SUFFIX)) {
             char id[ID_BUF_LEN];
+            char idHash[33];
+            char mountPoint[255];
+
             strlcpy(id, dent->d_name, name_len - 4);
-            if (unmountAsec(id, true)) {
-                /* Register the error, but try to unmount more asecs */
+            if (!isLegalAsecId(id)) {
+                continue;
+            }
+
+            int written = snprintf(mountPoint, sizeof(mountPoint), "%s/%s", Volume::ASECDIR, id);
+            if ((written < 0) || (size_t(written) >= sizeof(mountPoint))) {
+                SLOGE("ASEC unmount failed for %s: couldn't construct mountpoint", id);
                 rc = -1;
+                continue;
             }
+            if (!isMountpointMounted(mountPoint)) {
+                continue;
+            }
+            if (!asecHash(id, idHash, sizeof(idHash))) {
+                SLOGE("Hash of '%s' failed (%s)", id, strerror(errno));
+                rc = -1;
+                continue;
+            }
+
+            ContainerMount cm;
+            cm.id = id;
+            cm.idHash = idHash;
+            cm.mountPoint = mountPoint;
+            containers.push_back(cm);
+            mounts.push_back(mountPoint);
         }
     }
     closedir(d);
 
     free(dent);
 
+    /* Unmount them all together, then release their devices in parallel */
+    if (teardownMounts(&mounts, true)) {
+        rc = -1;
+    }
+    if (releaseContainers(containers, mounts, false)) {
+        rc = -1;
+    }
+
     return rc;
 }
 
@@ -1642,81 +2173,72 @@ Volume *VolumeManager::lookupVolume(const char *label) {
 
 bool VolumeManager::isMountpointMounted(const char *mp)
 {
-    char device[256];
-    char mount_path[256];
-    char rest[256];
-    FILE *fp;
-    char line[1024];
-
-    if (!(fp = fopen("/proc/mounts", "r"))) {
-        SLOGE("Error opening /proc/mounts (%s)", strerror(errno));
-        return false;
-    }
-
-    while(fgets(line, sizeof(line), fp)) {
-        line[strlen(line)-1] = '\0';
-        sscanf(line, "%255s %255s %255s\n", device, mount_path, rest);
-        if (!strcmp(mount_path, mp)) {
-            fclose(fp);
-            return true;
-        }
-    }
-
-    fclose(fp);
-    return false;
+    return MountTable::Instance()->isMounted(mp);
 }
 
-int VolumeManager::cleanupAsec(Volume *v, bool force) {
-    int rc = 0;
+void VolumeManager::collectDependentContainers(Volume *v, std::vector<ContainerMount> *deps) {
+    std::vector<ContainerRegistry::Container> containers;
 
-    char asecFileName[255];
+    mContainers->listByOwner(v, &containers);
+    for (size_t i = 0; i < containers.size(); i++) {
+        const ContainerRegistry::Container &c = containers[i];
 
-    AsecIdCollection removeAsec;
-    AsecIdCollection removeObb;
+        SLOGI("Unmounting %s %s (dependent on %s)", c.type == ASEC ? "ASEC" : "OBB",
+              c.id.c_str(), v->getLabel());
 
-    for (AsecIdCollection::iterator it = mActiveContainers->begin(); it != mActiveContainers->end();
-            ++it) {
-        ContainerData* cd = *it;
+        ContainerMount cm;
+        cm.id = c.id;
+        cm.idHash = c.idHash;
+        cm.mountPoint = c.mountPoint;
+        deps->push_back(cm);
+    }
+}
 
-        if (cd->type == ASEC) {
-            if (findAsec(cd->id, asecFileName, sizeof(asecFileName))) {
-                SLOGE("Couldn't find ASEC %s; cleaning up", cd->id);
-                removeAsec.push_back(cd);
-            } else {
-                SLOGD("Found ASEC at path %s", asecFileName);
-                if (!strncmp(asecFileName, Volume::SEC_ASECDIR_EXT,
-                        strlen(Volume::SEC_ASECDIR_EXT))) {
-                    removeAsec.push_back(cd);
-                }
-            }
-        } else if (cd->type == OBB) {
-            if (v == getVolumeForFile(cd->id)) {
-                removeObb.push_back(cd);
-            }
-        } else {
-            SLOGE("Unknown container type %d!", cd->type);
-        }
+/*
+ * The volume a container's backing file lives on. External ASECs belong to
+ * whichever volume provides the secure area.
+ */
+Volume *VolumeManager::getContainerOwner(container_type_t type, const char *fileName) {
+    if (type == OBB) {
+        return getVolumeForFile(fileName);
     }
 
-    for (AsecIdCollection::iterator it = removeAsec.begin(); it != removeAsec.end(); ++it) {
-        ContainerData *cd = *it;
-        SLOGI("Unmounting ASEC %s (dependent on %s)", cd->id, v->getLabel());
-        if (unmountAsec(cd->id, force)) {
-            SLOGE("Failed to unmount ASEC %s (%s)", cd->id, strerror(errno));
-            rc = -1;
+    if (strncmp(fileName, Volume::SEC_ASECDIR_EXT, strlen(Volume::SEC_ASECDIR_EXT))) {
+        return NULL;
+    }
+    for (VolumeCollection::iterator i = mVolumes->begin(); i != mVolumes->end(); ++i) {
+        if ((*i)->getFlags() & VOL_PROVIDES_ASEC) {
+            return *i;
         }
     }
+    return NULL;
+}
 
-    for (AsecIdCollection::iterator it = removeObb.begin(); it != removeObb.end(); ++it) {
-        ContainerData *cd = *it;
-        SLOGI("Unmounting OBB %s (dependent on %s)", cd->id, v->getLabel());
-        if (unmountObb(cd->id, force)) {
-            SLOGE("Failed to unmount OBB %s (%s)", cd->id, strerror(errno));
-            rc = -1;
-        }
+void VolumeManager::registerContainer(container_type_t type, const char *id, const char *idHash,
+        const char *fileName, const char *loopDevice, const char *dmDevice,
+        const char *mountPoint) {
+    ContainerRegistry::Container c;
+
+    c.id = id;
+    c.type = type;
+    c.idHash = idHash;
+    c.fileName = fileName;
+    c.loopDevice = loopDevice;
+    if (dmDevice) {
+        c.dmDevice = dmDevice;
     }
+    c.mountPoint = mountPoint;
+    c.owner = getContainerOwner(type, fileName);
 
-    return rc;
+    if (mContainers->add(c)) {
+        SLOGW("Container %s registered twice", id);
+    }
+}
+
+int VolumeManager::cleanupAsec(Volume *v, bool force) {
+    std::vector<std::string> mounts;
+
+    return teardownVolume(v, &mounts, force);
 }
 
 int VolumeManager::mkdirs(char* path) {
@@ -20,37 +20,58 @@
 #include <pthread.h>
 
 #ifdef __cplusplus
+#include <string>
+#include <vector>
+
 #include <utils/List.h>
 #include <sysutils/SocketListener.h>
 
 #include "Volume.h"
+#include "ContainerRegistry.h"
+#include "DevpathTrie.h"
 
 /* The length of an MD5 hash when encoded into ASCII hex characters */
 #define MD5_ASCII_LENGTH_PLUS_NULL ((MD5_DIGEST_LENGTH*2)+1)
 
-typedef enum { ASEC, OBB } container_type_t;
-
-class ContainerData {
-public:
-    ContainerData(char* _id, container_type_t _type)
-            : id(_id)
-            , type(_type)
-    {}
-
-    ~ContainerData() {
-        if (id != NULL) {
-            free(id);
-            id = NULL;
-        }
-    }
-
-    char *id;
-    container_type_t type;
+/* A mounted container as seen by the volume teardown code */
+struct ContainerMount {
+    std::string id;
+    std::string idHash;
+    std::string mountPoint;
 };
 
-typedef android::List<ContainerData*> AsecIdCollection;
+class ReleaseContainerTask;
+class VolumeOpTask;
+class AsecMountStageTask;
+struct AsecMountJob;
+
+/*
+ * Most containers one 'asec mount-batch' command may list. FrameworkListener
+ * splits a command into at most CMD_ARGS_MAX (26) words, 'asec' and
+ * 'mount-batch' included, and drops commands longer than 1 KB. Clients with
+ * more containers, or long ids, send several commands back to back.
+ */
+#define ASEC_MOUNT_BATCH_MAX 8
+
+/* One container of an 'asec mount-batch' request */
+struct AsecMountRequest {
+    std::string id;
+    std::string key;
+    int ownerUid;
+};
 
 class VolumeManager {
+    friend class ReleaseContainerTask;
+    friend class VolumeOpTask;
+    friend class AsecMountStageTask;
+
+public:
+    /* Pipeline stages of an ASEC mount, after validation */
+    static const int AsecStage_Loop  = 0;
+    static const int AsecStage_Map   = 1;
+    static const int AsecStage_Mount = 2;
+    static const int AsecStage_Count = 3;
+
 private:
     static VolumeManager *sInstance;
 
@@ -58,10 +79,19 @@ private:
     SocketListener        *mBroadcaster;
 
     VolumeCollection      *mVolumes;
-    AsecIdCollection      *mActiveContainers;
+    ContainerRegistry     *mContainers;
+    DevpathTrie           *mDevpaths;
     bool                   mDebug;
 
+    /*
+     * Serializes ASEC and OBB operations. The listener, the job engine and
+     * the volume executors all reach them, and finding, mounting and
+     * releasing a container is not atomic. Recursive, as destroy unmounts.
+     */
+    pthread_mutex_t        mContainerLock;
+
     // for adjusting /proc/sys/vm/dirty_ratio when UMS is active
+    pthread_mutex_t        mUmsLock;
     int                    mUmsSharingCount;
     int                    mSavedDirtyRatio;
     int                    mUmsDirtyRatio;
@@ -73,11 +103,28 @@ public:
     int start();
     int stop();
 
-    void handleBlockEvent(NetlinkEvent *evt);
+    void handleBlockEvent(const BlockEvent &evt);
+    /* Hands the coalesced events of one settled disk to its volume */
+    void handleSettledEvents(const std::vector<BlockEvent> &events);
+
+    /* Routing of uevents to the volume whose devpath prefix they match */
+    int registerDevpath(const char *devpath, Volume *v);
+    void unregisterDevpath(const char *devpath);
+    Volume *lookupVolumeByDevpath(const char *devpath) { return mDevpaths->lookup(devpath); }
+    /*
+     * Called once coldboot has replayed the managed disks. Volumes that got
+     * nothing to replay are ready now; the rest report once their events
+     * have been handled.
+     */
+    void finishColdboot();
 
     int addVolume(Volume *v);
 
     int listVolumes(SocketClient *cli);
+    /*
+     * Volume state transitions. Each runs on the volume's executor and
+     * returns once it has finished there.
+     */
     int mountVolume(const char *label);
     int unmountVolume(const char *label, bool force, bool revert);
     int shareVolume(const char *label, const char *method);
@@ -106,6 +153,12 @@ public:
     int fixupAsecPermissions(const char *id, gid_t gid, const char* privateFilename);
     int destroyAsec(const char *id, bool force);
     int mountAsec(const char *id, const char *key, int ownerUid);
+    /*
+     * Mounts many ASECs at once, running their loop, devmapper and mount
+     * stages as a pipeline on worker pools. One AsecMountBatchResult line
+     * per container is streamed to 'cli' as it finishes.
+     */
+    int mountAsecBatch(const std::vector<AsecMountRequest> &requests, SocketClient *cli);
     int unmountAsec(const char *id, bool force);
     int renameAsec(const char *id1, const char *id2);
     int getAsecMountPath(const char *id, char *buffer, int maxlen);
@@ -123,7 +176,38 @@ public:
     int unmountLoopImage(const char *containerId, const char *loopId,
             const char *fileName, const char *mountPoint, bool force);
 
+    /*
+     * Unmounts every mountpoint in 'mounts'. Processes holding any of them
+     * are found with a single /proc walk per retry and signalled once. If
+     * 'stacked' is set, each entry is mounted on top of the next one: they
+     * are unmounted front to back and an entry is only tried once everything
+     * before it is gone. On return 'mounts' holds whatever is still mounted,
+     * in the original order. If 'owner' is given, its kernel driver is told
+     * about every unmount and every failed round.
+     */
+    int teardownMounts(std::vector<std::string> *mounts, bool force, Volume *owner = NULL,
+                       bool stacked = false);
+
+    /*
+     * Tears down the given mounts of a volume together with every ASEC and
+     * OBB container that lives on it. The containers are unmounted and their
+     * loop and devmapper devices released first, since those hold the
+     * backing files on the volume open; if any of them stays busy the
+     * volume's own mounts are not touched. 'mounts' is stacked as for
+     * teardownMounts() and holds what is still mounted on return.
+     */
+    int teardownVolume(Volume *v, std::vector<std::string> *mounts, bool force);
+
+    /*
+     * For media that is already gone: lazily detaches the given mounts and
+     * those of every dependent container without retrying, and releases the
+     * containers' devices as soon as their last user lets go. Processes still
+     * holding anything are only reported.
+     */
+    int detachVolume(Volume *v, std::vector<std::string> *mounts);
+
     void setDebug(bool enable);
+    int dumpContainers(SocketClient *c) { return mContainers->dumpState(c); }
 
     // XXX: Post froyo this should be moved and cleaned up
     int cleanupAsec(Volume *v, bool force);
@@ -153,8 +237,31 @@ private:
     VolumeManager();
     void readInitialState();
     bool isMountpointMounted(const char *mp);
-    bool isAsecInDirectory(const char *dir, const char *asec) const;
+    int doUnmountVolume(Volume *v, bool force, bool revert);
+    int doFormatVolume(Volume *v, bool wipe);
+    int doShareVolume(Volume *v, const char *method);
+    int doUnshareVolume(Volume *v, const char *method);
     bool isLegalAsecId(const char *id) const;
+    void collectDependentContainers(Volume *v, std::vector<ContainerMount> *deps);
+    Volume *getContainerOwner(container_type_t type, const char *fileName);
+    void registerContainer(container_type_t type, const char *id, const char *idHash,
+                           const char *fileName, const char *loopDevice, const char *dmDevice,
+                           const char *mountPoint);
+    int releaseLoopImage(const char *id, const char *idHash, const char *mountPoint,
+                         bool wait = true);
+    /*
+     * Releases the containers no longer listed in 'stillMounted' on a worker
+     * pool, lazily detaching them first if 'detach' is set. Returns -1 if
+     * any container could not be unmounted, detached or have its devices
+     * destroyed.
+     */
+    int releaseContainers(const std::vector<ContainerMount> &containers,
+                          const std::vector<std::string> &stillMounted, bool detach);
+    int prepareAsecMount(AsecMountJob *job);
+    int attachAsecLoop(AsecMountJob *job);
+    int mapAsec(AsecMountJob *job);
+    int finishAsecMount(AsecMountJob *job);
+    int runAsecMountStage(AsecMountJob *job, int stage);
 };
 
 extern "C" {
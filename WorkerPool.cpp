@@ -0,0 +1,138 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#define LOG_TAG "Vold"
+
+#include <cutils/log.h>
+
+#include "WorkerPool.h"
+
+const int WorkerPool::MAX_THREADS;
+
+WorkerPool::WorkerPool(int threads) {
+    pthread_mutex_init(&mLock, NULL);
+    pthread_cond_init(&mWorkCond, NULL);
+    pthread_cond_init(&mIdleCond, NULL);
+    mPending = 0;
+    mFailures = 0;
+    mStopping = false;
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus > 0 && threads > cpus) {
+        threads = cpus;
+    }
+    if (threads > MAX_THREADS) {
+        threads = MAX_THREADS;
+    }
+
+    for (int i = 0; i < threads; i++) {
+        pthread_t thread;
+        int rc = pthread_create(&thread, NULL, WorkerPool::threadStart, this);
+        if (rc) {
+            SLOGW("Unable to start worker thread (%s)", strerror(rc));
+            break;
+        }
+        mThreads.push_back(thread);
+    }
+}
+
+WorkerPool::~WorkerPool() {
+    wait();
+
+    pthread_mutex_lock(&mLock);
+    mStopping = true;
+    pthread_cond_broadcast(&mWorkCond);
+    pthread_mutex_unlock(&mLock);
+
+    for (size_t i = 0; i < mThreads.size(); i++) {
+        pthread_join(mThreads[i], NULL);
+    }
+
+    pthread_cond_destroy(&mIdleCond);
+    pthread_cond_destroy(&mWorkCond);
+    pthread_mutex_destroy(&mLock);
+}
+
+void WorkerPool::submit(WorkerTask *task) {
+    pthread_mutex_lock(&mLock);
+    mPending++;
+    if (mThreads.empty()) {
+        // No workers could be started; degrade to running inline
+        pthread_mutex_unlock(&mLock);
+        runTask(task);
+        return;
+    }
+    mQueue.push_back(task);
+    pthread_cond_signal(&mWorkCond);
+    pthread_mutex_unlock(&mLock);
+}
+
+int WorkerPool::wait() {
+    int failures;
+
+    pthread_mutex_lock(&mLock);
+    while (mPending) {
+        pthread_cond_wait(&mIdleCond, &mLock);
+    }
+    failures = mFailures;
+    mFailures = 0;
+    pthread_mutex_unlock(&mLock);
+    return failures;
+}
+
+void *WorkerPool::threadStart(void *obj) {
+    WorkerPool *me = reinterpret_cast<WorkerPool *>(obj);
+
+    me->workerLoop();
+    pthread_exit(NULL);
+    return NULL;
+}
+
+void WorkerPool::workerLoop() {
+    while (true) {
+        pthread_mutex_lock(&mLock);
+        while (mQueue.empty() && !mStopping) {
+            pthread_cond_wait(&mWorkCond, &mLock);
+        }
+        if (mQueue.empty()) {
+            pthread_mutex_unlock(&mLock);
+            return;
+        }
+        WorkerTask *task = mQueue.front();
+        mQueue.pop_front();
+        pthread_mutex_unlock(&mLock);
+
+        runTask(task);
+    }
+}
+
+void WorkerPool::runTask(WorkerTask *task) {
+    int rc = task->run();
+    delete task;
+
+    pthread_mutex_lock(&mLock);
+    if (rc) {
+        mFailures++;
+    }
+    if (--mPending == 0) {
+        pthread_cond_broadcast(&mIdleCond);
+    }
+    pthread_mutex_unlock(&mLock);
+}
@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _WORKERPOOL_H
+#define _WORKERPOOL_H
+
+#include <pthread.h>
+
+#include <deque>
+#include <vector>
+
+class WorkerTask {
+public:
+    virtual ~WorkerTask() {}
+    /* Returns 0 on success; failures are counted by the pool */
+    virtual int run() = 0;
+};
+
+/*
+ * Fixed set of pthreads draining a FIFO of tasks. The pool owns submitted
+ * tasks and deletes them once they have run.
+ */
+class WorkerPool {
+public:
+    static const int MAX_THREADS = 4;
+
+private:
+    pthread_mutex_t           mLock;
+    pthread_cond_t            mWorkCond;
+    pthread_cond_t            mIdleCond;
+    std::deque<WorkerTask *>  mQueue;
+    std::vector<pthread_t>    mThreads;
+    int                       mPending;
+    int                       mFailures;
+    bool                      mStopping;
+
+public:
+    /* At most 'threads' workers, capped to MAX_THREADS and the cpu count */
+    WorkerPool(int threads = MAX_THREADS);
+    virtual ~WorkerPool();
+
+    void submit(WorkerTask *task);
+    /*
+     * Blocks until every submitted task has run. Returns the number that
+     * failed since the last wait().
+     */
+    int wait();
+
+    int getThreadCount() const { return mThreads.size(); }
+
+private:
+    static void *threadStart(void *obj);
+    void workerLoop();
+    void runTask(WorkerTask *task);
+};
+
+#endif
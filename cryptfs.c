@@ -27,7 +27,6 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <sys/ioctl.h>
-#include <linux/dm-ioctl.h>
 #include <libgen.h>
 #include <stdlib.h>
 #include <sys/param.h>
@@ -36,6 +35,7 @@
 #include <openssl/evp.h>
 #include <openssl/sha.h>
 #include <errno.h>
+#include <pthread.h>
 #include <ext4.h>
 #include <linux/kdev_t.h>
 #include <fs_mgr.h>
@@ -48,6 +48,9 @@
 #include <logwrap/logwrap.h>
 #include "VolumeManager.h"
 #include "VoldUtil.h"
+#include "dmclient.h"
+#include "cryptfs_inplace.h"
+#include "cryptfs_alloc.h"
 #include "crypto_scrypt.h"
 
 #define DM_CRYPT_BUF_SIZE 4096
@@ -62,6 +65,12 @@
 #define EXT4_FS 1
 #define FAT_FS 2
 
+/* scrypt calibration starts timing at this N factor, and stays within
+ * SCRYPT_MAX_MEM of memory */
+#define SCRYPT_CALIBRATE_N_FACTOR 10
+#define SCRYPT_MAX_N_FACTOR 20
+#define SCRYPT_MAX_MEM (128 * 1024 * 1024)
+
 #define TABLE_LOAD_RETRIES 10
 
 char *me = "cryptfs";
@@ -71,6 +80,13 @@ static char *saved_mount_point;
 static int  master_key_saved = 0;
 static struct crypt_persist_data *persist_data = NULL;
 
+/*
+ * The entry points below are called from the listener, job and volume
+ * threads, and all share the globals above and the footer on disk, so
+ * each one runs with this held.
+ */
+static pthread_mutex_t cryptfs_lock = PTHREAD_MUTEX_INITIALIZER;
+
 extern struct fstab *fstab;
 
 static void cryptfs_reboot(int recovery)
@@ -86,20 +102,6 @@ static void cryptfs_reboot(int recovery)
     return;
 }
 
-static void ioctl_init(struct dm_ioctl *io, size_t dataSize, const char *name, unsigned flags)
-{
-    memset(io, 0, dataSize);
-    io->data_size = dataSize;
-    io->data_start = sizeof(struct dm_ioctl);
-    io->version[0] = 4;
-    io->version[1] = 0;
-    io->version[2] = 0;
-    io->flags = flags;
-    if (name) {
-        strncpy(io->name, name, sizeof(io->name));
-    }
-}
-
 /**
  * Gets the default device scrypt parameters for key derivation time tuning.
  * The parameters should lead to about one second derivation time for the
@@ -290,6 +292,154 @@ errout:
 
 }
 
+/* The number of hotzone checksums each checkpoint slot has room for */
+static unsigned int hotzone_slot_sums(const struct crypt_mnt_ftr *crypt_ftr)
+{
+  if (crypt_ftr->checkpoint_slots < 1 || crypt_ftr->checkpoint_slots > CRYPT_INPLACE_CHECKPOINTS) {
+    return 0;
+  }
+  return CRYPT_HOTZONE_MAX_SUMS / crypt_ftr->checkpoint_slots;
+}
+
+static int hotzone_slot_offset(const struct crypt_mnt_ftr *crypt_ftr, int slot)
+{
+  return CRYPT_FOOTER_TO_HOTZONE_OFFSET + slot * hotzone_slot_sums(crypt_ftr) * sizeof(__le32);
+}
+
+/*
+ * Writes the footer and the checksums of the hotzone of checkpoint 'slot',
+ * which share the footer's first 4K block, with a single write and waits
+ * for them to reach the disk. 'sums' may be NULL when there is no hotzone.
+ * The checksums of the other slots are kept.
+ */
+static int put_crypt_ftr_checkpoint(struct crypt_mnt_ftr *crypt_ftr, int slot,
+                                    const unsigned int *sums)
+{
+  struct crypt_inplace_checkpoint *cp = &crypt_ftr->checkpoint[slot];
+  char block[0x1000];
+  off64_t starting_off;
+  char *fname = NULL;
+  int fd;
+  int rc = -1;
+
+  if (slot >= (int) crypt_ftr->checkpoint_slots ||
+      cp->hotzone_sums > hotzone_slot_sums(crypt_ftr) ||
+      cp->hotzone_count > CRYPT_HOTZONE_MAX_CHUNKS) {
+    SLOGE("Crypt footer checkpoint is too large\n");
+    errno = EINVAL;
+    return -1;
+  }
+  if (get_crypt_ftr_info(&fname, &starting_off)) {
+    SLOGE("Unable to get crypt_ftr_info\n");
+    return -1;
+  }
+  if ( (fd = open(fname, O_RDWR)) < 0) {
+    SLOGE("Cannot open footer file %s for checkpoint\n", fname);
+    return -1;
+  }
+
+  if (TEMP_FAILURE_RETRY(pread64(fd, block, sizeof(block), starting_off)) != sizeof(block)) {
+    SLOGE("Cannot read crypt footer block\n");
+    goto errout;
+  }
+  memcpy(block, crypt_ftr, sizeof(struct crypt_mnt_ftr));
+  memset(block + hotzone_slot_offset(crypt_ftr, slot), 0,
+         hotzone_slot_sums(crypt_ftr) * sizeof(*sums));
+  if (sums) {
+    memcpy(block + hotzone_slot_offset(crypt_ftr, slot), sums,
+           cp->hotzone_sums * sizeof(*sums));
+  }
+
+  if (TEMP_FAILURE_RETRY(pwrite64(fd, block, sizeof(block), starting_off)) != sizeof(block)) {
+    SLOGE("Cannot write crypt footer checkpoint\n");
+    goto errout;
+  }
+  if (fsync(fd)) {
+    SLOGE("Cannot sync crypt footer checkpoint (%s)\n", strerror(errno));
+    goto errout;
+  }
+  rc = 0;
+
+errout:
+  close(fd);
+  return rc;
+}
+
+/* Reads back the hotzone of 'slot' recorded by put_crypt_ftr_checkpoint() */
+static int get_crypt_ftr_hotzone(const struct crypt_mnt_ftr *crypt_ftr, int slot,
+                                 struct inplace_hotzone *hz)
+{
+  const struct crypt_inplace_checkpoint *cp = &crypt_ftr->checkpoint[slot];
+  off64_t starting_off;
+  char *fname = NULL;
+  size_t len;
+  unsigned int i;
+  int fd;
+  int rc = -1;
+
+  if (slot >= (int) crypt_ftr->checkpoint_slots ||
+      cp->hotzone_sums > hotzone_slot_sums(crypt_ftr) ||
+      cp->hotzone_count > CRYPT_HOTZONE_MAX_CHUNKS) {
+    SLOGE("Crypt footer checkpoint is corrupt\n");
+    return -1;
+  }
+
+  memset(hz, 0, sizeof(*hz));
+  hz->done = cp->encrypted_upto;
+  hz->count = cp->hotzone_count;
+  for (i = 0; i < cp->hotzone_count; i++) {
+    hz->chunks[i].start = cp->hotzone[i].start;
+    hz->chunks[i].count = cp->hotzone[i].count;
+  }
+  hz->num_sums = cp->hotzone_sums;
+
+  if (get_crypt_ftr_info(&fname, &starting_off)) {
+    SLOGE("Unable to get crypt_ftr_info\n");
+    return -1;
+  }
+  if ( (fd = open(fname, O_RDONLY)) < 0) {
+    SLOGE("Cannot open footer file %s for checkpoint\n", fname);
+    return -1;
+  }
+  len = hz->num_sums * sizeof(hz->sums[0]);
+  if (TEMP_FAILURE_RETRY(pread64(fd, hz->sums, len,
+                                 starting_off + hotzone_slot_offset(crypt_ftr, slot))) !=
+      (ssize_t) len) {
+    SLOGE("Cannot read crypt footer checkpoint\n");
+  } else {
+    rc = 0;
+  }
+  close(fd);
+  return rc;
+}
+
+/* True if checkpoint 'slot' describes a device that was partly encrypted */
+static int checkpoint_in_use(const struct crypt_mnt_ftr *crypt_ftr, int slot)
+{
+  return slot < (int) crypt_ftr->checkpoint_slots &&
+         (crypt_ftr->checkpoint[slot].encrypted_upto ||
+          crypt_ftr->checkpoint[slot].hotzone_count);
+}
+
+/* True if an interrupted in-place encryption left a checkpoint to resume from */
+static int has_inplace_checkpoint(const struct crypt_mnt_ftr *crypt_ftr)
+{
+  int i;
+
+  if (!(crypt_ftr->flags & CRYPT_ENCRYPTION_IN_PROGRESS)) {
+    return 0;
+  }
+  if (crypt_ftr->encrypted_devices) {
+    return 1;
+  }
+  for (i = 0; i < CRYPT_INPLACE_CHECKPOINTS; i++) {
+    if (checkpoint_in_use(crypt_ftr, i)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
 static inline int unix_read(int  fd, void*  buff, int  len)
 {
     return TEMP_FAILURE_RETRY(read(fd, buff, len));
@@ -359,6 +509,16 @@ static void upgrade_crypt_ftr(int fd, struct crypt_mnt_ftr *crypt_ftr, off64_t o
         crypt_ftr->minor_version = 2;
     }
 
+    if ((crypt_ftr->major_version == 1) && (crypt_ftr->minor_version == 2)) {
+        SLOGW("upgrading crypto footer to 1.3");
+        /* No checkpoint: whatever follows a 1.2 footer is not one */
+        crypt_ftr->encrypted_devices = 0;
+        crypt_ftr->checkpoint_slots = 0;
+        memset(crypt_ftr->checkpoint, 0, sizeof(crypt_ftr->checkpoint));
+        crypt_ftr->ftr_size = sizeof(struct crypt_mnt_ftr);
+        crypt_ftr->minor_version = 3;
+    }
+
     if ((orig_major != crypt_ftr->major_version) || (orig_minor != crypt_ftr->minor_version)) {
         if (lseek64(fd, offset, SEEK_SET) == -1) {
             SLOGE("Cannot seek to crypt footer\n");
@@ -684,126 +844,17 @@ void convert_key_to_hex_ascii(unsigned char *master_key, unsigned int keysize,
 
 }
 
-static int load_crypto_mapping_table(struct crypt_mnt_ftr *crypt_ftr, unsigned char *master_key,
-                                     char *real_blk_name, const char *name, int fd,
-                                     char *extra_params)
-{
-  char buffer[DM_CRYPT_BUF_SIZE];
-  struct dm_ioctl *io;
-  struct dm_target_spec *tgt;
-  char *crypt_params;
-  char master_key_ascii[129]; /* Large enough to hold 512 bit key and null */
-  int i;
-
-  io = (struct dm_ioctl *) buffer;
-
-  /* Load the mapping table for this device */
-  tgt = (struct dm_target_spec *) &buffer[sizeof(struct dm_ioctl)];
-
-  ioctl_init(io, DM_CRYPT_BUF_SIZE, name, 0);
-  io->target_count = 1;
-  tgt->status = 0;
-  tgt->sector_start = 0;
-  tgt->length = crypt_ftr->fs_size;
-  strcpy(tgt->target_type, "crypt");
-
-  crypt_params = buffer + sizeof(struct dm_ioctl) + sizeof(struct dm_target_spec);
-  convert_key_to_hex_ascii(master_key, crypt_ftr->keysize, master_key_ascii);
-  sprintf(crypt_params, "%s %s 0 %s 0 %s", crypt_ftr->crypto_type_name,
-          master_key_ascii, real_blk_name, extra_params);
-  crypt_params += strlen(crypt_params) + 1;
-  crypt_params = (char *) (((unsigned long)crypt_params + 7) & ~8); /* Align to an 8 byte boundary */
-  tgt->next = crypt_params - buffer;
-
-  for (i = 0; i < TABLE_LOAD_RETRIES; i++) {
-    if (! ioctl(fd, DM_TABLE_LOAD, io)) {
-      break;
-    }
-    usleep(500000);
-  }
-
-  if (i == TABLE_LOAD_RETRIES) {
-    /* We failed to load the table, return an error */
-    return -1;
-  } else {
-    return i + 1;
-  }
-}
-
-
-static int get_dm_crypt_version(int fd, const char *name,  int *version)
-{
-    char buffer[DM_CRYPT_BUF_SIZE];
-    struct dm_ioctl *io;
-    struct dm_target_versions *v;
-    int i;
-
-    io = (struct dm_ioctl *) buffer;
-
-    ioctl_init(io, DM_CRYPT_BUF_SIZE, name, 0);
-
-    if (ioctl(fd, DM_LIST_VERSIONS, io)) {
-        return -1;
-    }
-
-    /* Iterate over the returned versions, looking for name of "crypt".
-     * When found, get and return the version.
-     */
-    v = (struct dm_target_versions *) &buffer[sizeof(struct dm_ioctl)];
-    while (v->next) {
-        if (! strcmp(v->name, "crypt")) {
-            /* We found the crypt driver, return the version, and get out */
-            version[0] = v->version[0];
-            version[1] = v->version[1];
-            version[2] = v->version[2];
-            return 0;
-        }
-        v = (struct dm_target_versions *)(((char *)v) + v->next);
-    }
-
-    return -1;
-}
-
 static int create_crypto_blk_dev(struct crypt_mnt_ftr *crypt_ftr, unsigned char *master_key,
                                     char *real_blk_name, char *crypto_blk_name, const char *name)
 {
-  char buffer[DM_CRYPT_BUF_SIZE];
   char master_key_ascii[129]; /* Large enough to hold 512 bit key and null */
-  char *crypt_params;
-  struct dm_ioctl *io;
-  struct dm_target_spec *tgt;
-  unsigned int minor;
-  int fd;
-  int i;
-  int retval = -1;
+  char crypt_params[DM_CRYPT_BUF_SIZE];
+  struct dm_table_spec spec;
   int version[3];
   char *extra_params;
-  int load_count;
-
-  if ((fd = open("/dev/device-mapper", O_RDWR)) < 0 ) {
-    SLOGE("Cannot open device-mapper\n");
-    goto errout;
-  }
-
-  io = (struct dm_ioctl *) buffer;
-
-  ioctl_init(io, DM_CRYPT_BUF_SIZE, name, 0);
-  if (ioctl(fd, DM_DEV_CREATE, io)) {
-    SLOGE("Cannot create dm-crypt device\n");
-    goto errout;
-  }
-
-  /* Get the device status, in particular, the name of it's device file */
-  ioctl_init(io, DM_CRYPT_BUF_SIZE, name, 0);
-  if (ioctl(fd, DM_DEV_STATUS, io)) {
-    SLOGE("Cannot retrieve dm-crypt device status\n");
-    goto errout;
-  }
-  minor = (io->dev & 0xff) | ((io->dev >> 12) & 0xfff00);
-  snprintf(crypto_blk_name, MAXPATHLEN, "/dev/block/dm-%u", minor);
 
   extra_params = "";
-  if (! get_dm_crypt_version(fd, name, version)) {
+  if (! dm_get_target_version("crypt", version)) {
       /* Support for allow_discards was added in version 1.11.0 */
       if ((version[0] >= 2) ||
           ((version[0] == 1) && (version[1] >= 11))) {
@@ -812,60 +863,35 @@ static int create_crypto_blk_dev(struct crypt_mnt_ftr *crypt_ftr, unsigned char
       }
   }
 
-  load_count = load_crypto_mapping_table(crypt_ftr, master_key, real_blk_name, name,
-                                         fd, extra_params);
-  if (load_count < 0) {
-      SLOGE("Cannot load dm-crypt mapping table.\n");
-      goto errout;
-  } else if (load_count > 1) {
-      SLOGI("Took %d tries to load dmcrypt table.\n", load_count);
-  }
+  convert_key_to_hex_ascii(master_key, crypt_ftr->keysize, master_key_ascii);
+  snprintf(crypt_params, sizeof(crypt_params), "%s %s 0 %s 0 %s",
+           crypt_ftr->crypto_type_name, master_key_ascii, real_blk_name, extra_params);
 
-  /* Resume this device to activate it */
-  ioctl_init(io, DM_CRYPT_BUF_SIZE, name, 0);
+  memset(&spec, 0, sizeof(spec));
+  spec.target_type = "crypt";
+  spec.length = crypt_ftr->fs_size;
+  spec.params = crypt_params;
+  spec.load_retries = TABLE_LOAD_RETRIES - 1;
 
-  if (ioctl(fd, DM_DEV_SUSPEND, io)) {
-    SLOGE("Cannot resume the dm-crypt device\n");
-    goto errout;
+  if (dm_create(name, &spec, crypto_blk_name, MAXPATHLEN)) {
+    SLOGE("Cannot create dm-crypt device\n");
+    memset(crypt_params, 0, sizeof(crypt_params));
+    memset(master_key_ascii, 0, sizeof(master_key_ascii));
+    return -1;
   }
 
-  /* We made it here with no errors.  Woot! */
-  retval = 0;
-
-errout:
-  close(fd);   /* If fd is <0 from a failed open call, it's safe to just ignore the close error */
-
-  return retval;
+  memset(crypt_params, 0, sizeof(crypt_params));
+  memset(master_key_ascii, 0, sizeof(master_key_ascii));
+  return 0;
 }
 
 static int delete_crypto_blk_dev(char *name)
 {
-  int fd;
-  char buffer[DM_CRYPT_BUF_SIZE];
-  struct dm_ioctl *io;
-  int retval = -1;
-
-  if ((fd = open("/dev/device-mapper", O_RDWR)) < 0 ) {
-    SLOGE("Cannot open device-mapper\n");
-    goto errout;
-  }
-
-  io = (struct dm_ioctl *) buffer;
-
-  ioctl_init(io, DM_CRYPT_BUF_SIZE, name, 0);
-  if (ioctl(fd, DM_DEV_REMOVE, io)) {
+  if (dm_remove(name, 0)) {
     SLOGE("Cannot remove dm-crypt device\n");
-    goto errout;
+    return -1;
   }
-
-  /* We made it here with no errors.  Woot! */
-  retval = 0;
-
-errout:
-  close(fd);    /* If fd is <0 from a failed open call, it's safe to just ignore the close error */
-
-  return retval;
-
+  return 0;
 }
 
 static void pbkdf2(char *passwd, unsigned char *salt, unsigned char *ikey, void *params) {
@@ -886,6 +912,70 @@ static void scrypt(char *passwd, unsigned char *salt, unsigned char *ikey, void
             KEY_LEN_BYTES + IV_LEN_BYTES);
 }
 
+/* Times one scrypt derivation, in microseconds, or returns -1 */
+static int time_scrypt(int N_factor, int r_factor, int p_factor, unsigned long long *us)
+{
+    unsigned char salt[SALT_LEN] = { 0 };
+    unsigned char ikey[KEY_LEN_BYTES + IV_LEN_BYTES];
+    unsigned long long start = get_monotonic_us();
+
+    if (crypto_scrypt((const unsigned char *) "benchmark", 9, salt, SALT_LEN,
+                      1ULL << N_factor, 1 << r_factor, 1 << p_factor,
+                      ikey, sizeof(ikey))) {
+        SLOGE("scrypt %d:%d:%d failed (%s)", N_factor, r_factor, p_factor, strerror(errno));
+        return -1;
+    }
+    *us = get_monotonic_us() - start;
+    return 0;
+}
+
+static unsigned long long scrypt_mem(int N_factor, int r_factor)
+{
+    return 128ULL << (N_factor + r_factor);
+}
+
+/*
+ * With SCRYPT_BUDGET_PROP set, picks the largest N for which deriving the
+ * key takes no longer than the budget on this device. r and p are kept as
+ * they are, and N is not lowered below SCRYPT_CALIBRATE_N_FACTOR. Since
+ * the cost of scrypt is linear in N, a cheap run is scaled up and only the
+ * choice is timed again.
+ */
+static void calibrate_scrypt_params(struct crypt_mnt_ftr *ftr)
+{
+    char value[PROPERTY_VALUE_MAX];
+    unsigned long long budget, us;
+    int n = SCRYPT_CALIBRATE_N_FACTOR;
+
+    property_get(SCRYPT_BUDGET_PROP, value, "0");
+    budget = strtoull(value, NULL, 10) * 1000;
+    if (!budget) {
+        return;
+    }
+
+    if (time_scrypt(n, ftr->r_factor, ftr->p_factor, &us)) {
+        return;
+    }
+    while (n < SCRYPT_MAX_N_FACTOR && us * 2 <= budget &&
+           scrypt_mem(n + 1, ftr->r_factor) <= SCRYPT_MAX_MEM) {
+        n++;
+        us *= 2;
+    }
+    if (n > SCRYPT_CALIBRATE_N_FACTOR) {
+        if (time_scrypt(n, ftr->r_factor, ftr->p_factor, &us)) {
+            return;
+        }
+        if (us > budget) {
+            n--;
+            us /= 2;
+        }
+    }
+
+    SLOGI("scrypt calibrated to %d:%d:%d, about %llu ms for a %llu ms budget",
+          n, ftr->r_factor, ftr->p_factor, us / 1000, budget / 1000);
+    ftr->N_factor = n;
+}
+
 static int encrypt_master_key(char *passwd, unsigned char *salt,
                               unsigned char *decrypted_master_key,
                               unsigned char *encrypted_master_key,
@@ -897,6 +987,7 @@ static int encrypt_master_key(char *passwd, unsigned char *salt,
 
     /* Turn the password into a key and IV that can decrypt the master key */
     get_device_scrypt_params(crypt_ftr);
+    calibrate_scrypt_params(crypt_ftr);
     scrypt(passwd, salt, ikey, crypt_ftr);
 
     /* Initialize the decryption engine */
@@ -1066,7 +1157,7 @@ static int prep_data_fs(void)
     }
 }
 
-int cryptfs_restart(void)
+static int cryptfs_restart_locked(void)
 {
     char fs_type[32];
     char real_blkdev[MAXPATHLEN];
@@ -1155,6 +1246,7 @@ static int do_crypto_complete(char *mount_point)
   struct crypt_mnt_ftr crypt_ftr;
   char encrypted_state[PROPERTY_VALUE_MAX];
   char key_loc[PROPERTY_VALUE_MAX];
+  char value[PROPERTY_VALUE_MAX];
 
   property_get("ro.crypto.state", encrypted_state, "");
   if (strcmp(encrypted_state, "encrypted") ) {
@@ -1181,6 +1273,17 @@ static int do_crypto_complete(char *mount_point)
     }
   }
 
+  /*
+   * Only a framework that knows to answer -3 with "cryptfs enablecrypto
+   * inplace" and the same password may be told; any other one has to see
+   * -2 and stop, or it would ask for the password of a half-encrypted fs.
+   */
+  property_get("ro.vold.encrypt_report_resumable", value, "0");
+  if (has_inplace_checkpoint(&crypt_ftr) && atoi(value)) {
+    SLOGE("Encryption process was interrupted, it can be resumed\n");
+    return -3;
+  }
+
   if (crypt_ftr.flags & CRYPT_ENCRYPTION_IN_PROGRESS) {
     SLOGE("Encryption process didn't finish successfully\n");
     return -2;  /* -2 is the clue to the UI that there is no usable data on the disk,
@@ -1218,6 +1321,12 @@ static int test_mount_encrypted_fs(char *passwd, char *mount_point, char *label)
     return -1;
   }
 
+  /* Part of the fs is still plaintext; only resuming the encryption may touch it */
+  if (has_inplace_checkpoint(&crypt_ftr)) {
+    SLOGE("Encryption was interrupted, not mounting a half encrypted fs\n");
+    return -1;
+  }
+
   SLOGD("crypt_ftr->fs_size = %lld\n", crypt_ftr.fs_size);
   orig_failed_decrypt_count = crypt_ftr.failed_decrypt_count;
 
@@ -1298,7 +1407,7 @@ static int test_mount_encrypted_fs(char *passwd, char *mount_point, char *label)
  * manages.  This is usually in response to a factory reset, when we want
  * to undo the crypto mapping so the volume is formatted in the clear.
  */
-int cryptfs_revert_volume(const char *label)
+static int cryptfs_revert_volume_locked(const char *label)
 {
     return delete_crypto_blk_dev((char *)label);
 }
@@ -1308,7 +1417,7 @@ int cryptfs_revert_volume(const char *label)
  * Setup a dm-crypt mapping, use the saved master key from
  * setting up the /data mapping, and return the new device path.
  */
-int cryptfs_setup_volume(const char *label, int major, int minor,
+static int cryptfs_setup_volume_locked(const char *label, int major, int minor,
                          char *crypto_sys_path, unsigned int max_path,
                          int *new_major, int *new_minor)
 {
@@ -1344,12 +1453,12 @@ int cryptfs_setup_volume(const char *label, int major, int minor,
     return 0;
 }
 
-int cryptfs_crypto_complete(void)
+static int cryptfs_crypto_complete_locked(void)
 {
   return do_crypto_complete("/data");
 }
 
-int cryptfs_check_passwd(char *passwd)
+static int cryptfs_check_passwd_locked(char *passwd)
 {
     int rc = -1;
 
@@ -1358,7 +1467,7 @@ int cryptfs_check_passwd(char *passwd)
     return rc;
 }
 
-int cryptfs_verify_passwd(char *passwd)
+static int cryptfs_verify_passwd_locked(char *passwd)
 {
     struct crypt_mnt_ftr crypt_ftr;
     /* Allocate enough space for a 256 bit key, but we may use less */
@@ -1494,97 +1603,602 @@ static int cryptfs_enable_wipe(char *crypto_blkdev, off64_t size, int type)
     return rc;
 }
 
-#define CRYPT_INPLACE_BUFSIZE 4096
-#define CRYPT_SECTORS_PER_BUFSIZE (CRYPT_INPLACE_BUFSIZE / 512)
-static int cryptfs_enable_inplace(char *crypto_blkdev, char *real_blkdev, off64_t size,
-                                  off64_t *size_already_done, off64_t tot_size)
+static inline int should_encrypt(struct volume_info *volume)
 {
-    int realfd, cryptofd;
-    char *buf[CRYPT_INPLACE_BUFSIZE];
-    int rc = -1;
-    off64_t numblocks, i, remainder;
-    off64_t one_pct, cur_pct, new_pct;
-    off64_t blocks_already_done, tot_numblocks;
+    return (volume->flags & (VOL_ENCRYPTABLE | VOL_NONREMOVABLE)) == 
+            (VOL_ENCRYPTABLE | VOL_NONREMOVABLE);
+}
 
-    if ( (realfd = open(real_blkdev, O_RDONLY)) < 0) { 
-        SLOGE("Error opening real_blkdev %s for inplace encrypt\n", real_blkdev);
-        return -1;
+/* Devices with a bit in crypt_mnt_ftr.encrypted_devices */
+#define CRYPT_INPLACE_MAX_DEVICES 32
+
+/* A device to encrypt: /data, or one of vold's volumes */
+struct encrypt_device {
+    char    *crypto_blkdev;     /* NULL if the volume is not encrypted */
+    char    *real_blkdev;
+    off64_t  size;
+    int      fs_type;
+    const struct alloc_map *map;
+};
+
+struct encrypt_job;
+
+/*
+ * The devices of one disk, encrypted one after the other by a thread of
+ * their own, so that each disk is kept busy without making two of them
+ * compete for the same one.
+ */
+struct encrypt_lane {
+    struct encrypt_job *job;
+    pthread_t thread;
+    int       slot;             /* checkpoint slot in the footer */
+    dev_t     disk;
+    int       num_devices;
+    int       devices[CRYPT_INPLACE_MAX_DEVICES];
+    int       device;           /* the one being encrypted */
+    off64_t   done;             /* sectors of its earlier devices */
+    off64_t   current;          /* sectors of the current device */
+    int       rc;
+};
+
+struct encrypt_job {
+    pthread_mutex_t lock;       /* guards crypt_ftr and the counters below */
+    pthread_cond_t  cond;
+    /*
+     * Held from changing a checkpoint in crypt_ftr until a copy of it is
+     * on disk, so that the footer never pairs a slot with checksums it
+     * doesn't own yet. The write is done without 'lock', which the
+     * progress of every lane needs. Taken before 'lock'.
+     */
+    pthread_mutex_t footer_lock;
+    int       how;
+    struct crypt_mnt_ftr *crypt_ftr;
+    int       num_devices;
+    struct encrypt_device devices[CRYPT_INPLACE_MAX_DEVICES];
+    int       num_lanes;
+    struct encrypt_lane lanes[CRYPT_INPLACE_CHECKPOINTS];
+    off64_t   tot_size;
+    off64_t   cur_pct;
+    int       data_started;     /* /data's superblock is encrypted on disk */
+    int       failed;
+};
+
+/* Called by the copy engine of each lane about once a second */
+static void update_inplace_progress(off64_t sectors_done, void *arg)
+{
+    struct encrypt_lane *lane = (struct encrypt_lane *) arg;
+    struct encrypt_job *job = lane->job;
+    off64_t total = 0;
+    off64_t new_pct;
+    char buf[8];
+    int i;
+
+    pthread_mutex_lock(&job->lock);
+    lane->current = sectors_done;
+    for (i = 0; i < job->num_lanes; i++) {
+        total += job->lanes[i].done + job->lanes[i].current;
+    }
+    if (job->tot_size > 0) {
+        new_pct = total * 100 / job->tot_size;
+        if (new_pct > 100) {
+            new_pct = 100;
+        }
+        if (new_pct > job->cur_pct) {
+            job->cur_pct = new_pct;
+            snprintf(buf, sizeof(buf), "%lld", new_pct);
+            property_set("vold.encrypt_progress", buf);
+        }
     }
+    pthread_mutex_unlock(&job->lock);
+}
+
+/* Records the interval a lane's copy engine is about to write in the footer */
+static int checkpoint_inplace(const struct inplace_hotzone *hz, void *arg)
+{
+    struct encrypt_lane *lane = (struct encrypt_lane *) arg;
+    struct encrypt_job *job = lane->job;
+    struct crypt_inplace_checkpoint *cp = &job->crypt_ftr->checkpoint[lane->slot];
+    struct crypt_mnt_ftr crypt_ftr;
+    int i, rc;
 
-    if ( (cryptofd = open(crypto_blkdev, O_WRONLY)) < 0) { 
-        SLOGE("Error opening crypto_blkdev %s for inplace encrypt\n", crypto_blkdev);
-        close(realfd);
+    pthread_mutex_lock(&job->footer_lock);
+    pthread_mutex_lock(&job->lock);
+    if (job->failed) {
+        /* Stop at a checkpoint so that the run can be resumed */
+        pthread_mutex_unlock(&job->lock);
+        pthread_mutex_unlock(&job->footer_lock);
+        errno = ECANCELED;
+        return -1;
+    }
+    if (hz->count > CRYPT_HOTZONE_MAX_CHUNKS ||
+        hz->num_sums > (int) hotzone_slot_sums(job->crypt_ftr)) {
+        pthread_mutex_unlock(&job->lock);
+        pthread_mutex_unlock(&job->footer_lock);
+        errno = EINVAL;
         return -1;
     }
 
-    /* This is pretty much a simple loop of reading 4K, and writing 4K.
-     * The size passed in is the number of 512 byte sectors in the filesystem.
-     * So compute the number of whole 4K blocks we should read/write,
-     * and the remainder.
-     */
-    numblocks = size / CRYPT_SECTORS_PER_BUFSIZE;
-    remainder = size % CRYPT_SECTORS_PER_BUFSIZE;
-    tot_numblocks = tot_size / CRYPT_SECTORS_PER_BUFSIZE;
-    blocks_already_done = *size_already_done / CRYPT_SECTORS_PER_BUFSIZE;
-
-    SLOGE("Encrypting filesystem in place...");
-
-    one_pct = tot_numblocks / 100;
-    cur_pct = 0;
-    /* process the majority of the filesystem in blocks */
-    for (i=0; i<numblocks; i++) {
-        new_pct = (i + blocks_already_done) / one_pct;
-        if (new_pct > cur_pct) {
-            char buf[8];
-
-            cur_pct = new_pct;
-            snprintf(buf, sizeof(buf), "%lld", cur_pct);
-            property_set("vold.encrypt_progress", buf);
+    cp->encrypt_device = lane->device;
+    cp->encrypted_upto = hz->done;
+    cp->hotzone_count = hz->count;
+    cp->hotzone_sums = hz->num_sums;
+    memset(cp->hotzone, 0, sizeof(cp->hotzone));
+    for (i = 0; i < hz->count; i++) {
+        cp->hotzone[i].start = hz->chunks[i].start;
+        cp->hotzone[i].count = hz->chunks[i].count;
+    }
+    crypt_ftr = *job->crypt_ftr;
+    pthread_mutex_unlock(&job->lock);
+
+    rc = put_crypt_ftr_checkpoint(&crypt_ftr, lane->slot, hz->sums);
+    pthread_mutex_unlock(&job->footer_lock);
+    if (rc) {
+        return rc;
+    }
+
+    /* The first interval of /data, with its superblock, has been flushed */
+    if (lane->device == 0 && hz->done) {
+        pthread_mutex_lock(&job->lock);
+        job->data_started = 1;
+        pthread_cond_broadcast(&job->cond);
+        pthread_mutex_unlock(&job->lock);
+    }
+    return 0;
+}
+
+/*
+ * Encrypts the lane's current device in place, checkpointing its progress
+ * in the lane's slot of the footer, or picks up where a previous attempt
+ * stopped. A device without an allocation map is encrypted in full.
+ */
+static int cryptfs_enable_inplace(struct encrypt_lane *lane)
+{
+    struct encrypt_job *job = lane->job;
+    struct encrypt_device *dev = &job->devices[lane->device];
+    struct crypt_mnt_ftr *crypt_ftr = job->crypt_ftr;
+    struct crypt_inplace_checkpoint *cp = &crypt_ftr->checkpoint[lane->slot];
+    struct crypt_mnt_ftr written;
+    struct inplace_copy_params params;
+    struct inplace_hotzone *resume = NULL;
+    int already_done, resuming;
+    int i, rc;
+
+    pthread_mutex_lock(&job->lock);
+    already_done = crypt_ftr->encrypted_devices & (1 << lane->device);
+    resuming = checkpoint_in_use(crypt_ftr, lane->slot) &&
+               cp->encrypt_device == (unsigned int) lane->device;
+    pthread_mutex_unlock(&job->lock);
+
+    if (already_done) {
+        SLOGI("%s is already encrypted", dev->real_blkdev);
+        pthread_mutex_lock(&job->lock);
+        lane->done += dev->size;
+        pthread_mutex_unlock(&job->lock);
+        return 0;
+    }
+
+    memset(&params, 0, sizeof(params));
+    params.real_blkdev = dev->real_blkdev;
+    params.crypto_blkdev = dev->crypto_blkdev;
+    params.size = dev->size;
+    params.extents = (dev->map && dev->map->extents) ? dev->map->extents : NULL;
+    params.num_extents = (dev->map && dev->map->extents) ? dev->map->count : 0;
+    params.progress = update_inplace_progress;
+    params.checkpoint = checkpoint_inplace;
+    params.max_hotzone_sums = hotzone_slot_sums(crypt_ftr);
+    params.arg = lane;
+
+    if (resuming) {
+        if (!(resume = malloc(sizeof(*resume)))) {
+            return -1;
         }
-        if (unix_read(realfd, buf, CRYPT_INPLACE_BUFSIZE) <= 0) {
-            SLOGE("Error reading real_blkdev %s for inplace encrypt\n", crypto_blkdev);
-            goto errout;
+        /* Only this lane changes its slot */
+        pthread_mutex_lock(&job->footer_lock);
+        rc = get_crypt_ftr_hotzone(crypt_ftr, lane->slot, resume);
+        pthread_mutex_unlock(&job->footer_lock);
+        if (rc) {
+            free(resume);
+            return -1;
         }
-        if (unix_write(cryptofd, buf, CRYPT_INPLACE_BUFSIZE) <= 0) {
-            SLOGE("Error writing crypto_blkdev %s for inplace encrypt\n", crypto_blkdev);
-            goto errout;
+        params.start = resume->done;
+        for (i = 0; i < resume->count; i++) {
+            if (resume->chunks[i].start + resume->chunks[i].count > params.start) {
+                params.start = resume->chunks[i].start + resume->chunks[i].count;
+            }
         }
+        params.resume = resume;
+        SLOGI("Resuming encryption of %s at sector %lld", dev->real_blkdev, params.start);
     }
+    pthread_mutex_lock(&job->lock);
+    lane->done += params.start;
+    pthread_mutex_unlock(&job->lock);
 
-    /* Do any remaining sectors */
-    for (i=0; i<remainder; i++) {
-        if (unix_read(realfd, buf, 512) <= 0) {
-            SLOGE("Error reading rival sectors from real_blkdev %s for inplace encrypt\n", crypto_blkdev);
-            goto errout;
-        }
-        if (unix_write(cryptofd, buf, 512) <= 0) {
-            SLOGE("Error writing final sectors to crypto_blkdev %s for inplace encrypt\n", crypto_blkdev);
-            goto errout;
-        }
+    SLOGE("Encrypting %s in place...", dev->real_blkdev);
+
+    rc = inplace_copy(&params);
+    free(resume);
+    if (rc) {
+        SLOGE("Error encrypting %s in place (%s)\n", dev->real_blkdev, strerror(errno));
+        return -1;
     }
 
-    *size_already_done += size;
-    rc = 0;
+    pthread_mutex_lock(&job->footer_lock);
+    pthread_mutex_lock(&job->lock);
+    crypt_ftr->encrypted_devices |= 1 << lane->device;
+    memset(cp, 0, sizeof(*cp));
+    lane->done += params.extents ? dev->map->sectors : dev->size - params.start;
+    lane->current = 0;
+    written = *crypt_ftr;
+    pthread_mutex_unlock(&job->lock);
 
-errout:
-    close(realfd);
-    close(cryptofd);
+    rc = put_crypt_ftr_checkpoint(&written, lane->slot, NULL);
+    pthread_mutex_unlock(&job->footer_lock);
+    return rc;
+}
+
+static int has_ext4_magic(const char *blkdev)
+{
+    struct ext4_super_block sb;
+    int fd, rc;
 
+    if ((fd = open(blkdev, O_RDONLY)) < 0) {
+        return 0;
+    }
+    rc = TEMP_FAILURE_RETRY(pread64(fd, &sb, sizeof(sb), 1024)) == sizeof(sb) &&
+         sb.s_magic == EXT4_SUPER_MAGIC;
+    close(fd);
     return rc;
 }
 
+/*
+ * Decides whether the interrupted encryption recorded in 'crypt_ftr' can
+ * be resumed with 'passwd'. The first block of /data, which holds its
+ * superblock, is in the first interval written, so once it is encrypted the
+ * superblock has to read back through a mapping made with the decrypted
+ * key; a wrong password would otherwise mix two keys on the disk. Returns
+ * 1 to resume, 0 if nothing was encrypted and it is safe to start over,
+ * or -1.
+ */
+static int check_inplace_resume(char *passwd, struct crypt_mnt_ftr *crypt_ftr,
+                                char *real_blkdev)
+{
+    unsigned char decrypted_master_key[KEY_LEN_BYTES];
+    char crypto_blkdev[MAXPATHLEN];
+    const struct crypt_inplace_checkpoint *cp = &crypt_ftr->checkpoint[0];
+    struct inplace_hotzone *hz;
+    int data_started = (crypt_ftr->encrypted_devices & 1) ||
+                       (checkpoint_in_use(crypt_ftr, 0) &&
+                        (cp->encrypt_device || cp->encrypted_upto));
+    int encrypted, written, i;
+
+    if (decrypt_master_key(passwd, decrypted_master_key, crypt_ftr) ||
+        create_crypto_blk_dev(crypt_ftr, decrypted_master_key, real_blkdev, crypto_blkdev,
+                              "userdata")) {
+        return -1;
+    }
+    encrypted = has_ext4_magic(crypto_blkdev);
+    delete_crypto_blk_dev("userdata");
+
+    if (encrypted) {
+        return 1;
+    }
+    if (!has_ext4_magic(real_blkdev)) {
+        SLOGE("Wrong password to resume encryption");
+        return -1;
+    }
+
+    /* The superblock is still plaintext */
+    if (data_started) {
+        SLOGW("Crypto footer checkpoint does not match /data, starting over");
+        return 0;
+    }
+    /* Other disks only start once /data's superblock is encrypted */
+    for (i = 1; i < CRYPT_INPLACE_CHECKPOINTS; i++) {
+        if (checkpoint_in_use(crypt_ftr, i) || (crypt_ftr->encrypted_devices & ~1)) {
+            SLOGE("Cannot verify the password to resume encryption");
+            return -1;
+        }
+    }
+    if (!checkpoint_in_use(crypt_ftr, 0)) {
+        return 0;
+    }
+    if (!(hz = malloc(sizeof(*hz))) || get_crypt_ftr_hotzone(crypt_ftr, 0, hz)) {
+        free(hz);
+        return -1;
+    }
+    written = inplace_hotzone_written(real_blkdev, hz);
+    free(hz);
+    if (written) {
+        SLOGE("Cannot verify the password to resume encryption");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * With ro.vold.encrypt_allocated_only set, only the blocks the filesystem
+ * uses are encrypted; free space keeps whatever plaintext it held. Returns
+ * one map for /data followed by one per entry of vol_list, and adjusts
+ * *tot_size to what will actually be written. A device whose filesystem
+ * cannot be parsed gets an empty map and is encrypted in full.
+ */
+static struct alloc_map *map_allocated_blocks(char *real_blkdev, off64_t data_size,
+                                              struct volume_info *vol_list, int num_vols,
+                                              off64_t *tot_size)
+{
+    char value[PROPERTY_VALUE_MAX];
+    struct alloc_map *maps;
+    int i;
+
+    property_get("ro.vold.encrypt_allocated_only", value, "0");
+    if (strcmp(value, "1")) {
+        return NULL;
+    }
+
+    if (!(maps = calloc(num_vols + 1, sizeof(*maps)))) {
+        return NULL;
+    }
+
+    *tot_size = 0;
+    if (!alloc_map_build(real_blkdev, &maps[0])) {
+        *tot_size += maps[0].sectors;
+    } else {
+        *tot_size += data_size;
+    }
+    for (i = 0; i < num_vols; i++) {
+        if (!should_encrypt(&vol_list[i])) {
+            continue;
+        }
+        if (!alloc_map_build(vol_list[i].blk_dev, &maps[i + 1])) {
+            *tot_size += maps[i + 1].sectors;
+        } else {
+            *tot_size += vol_list[i].crypt_ftr.fs_size;
+        }
+    }
+    return maps;
+}
+
+static void free_allocated_blocks(struct alloc_map *maps, int num_vols)
+{
+    int i;
+
+    if (maps) {
+        for (i = 0; i < num_vols + 1; i++) {
+            alloc_map_free(&maps[i]);
+        }
+        free(maps);
+    }
+}
+
 #define CRYPTO_ENABLE_WIPE 1
 #define CRYPTO_ENABLE_INPLACE 2
 
-#define FRAMEWORK_BOOT_WAIT 60
+static int lane_has_device(const struct encrypt_lane *lane, int device)
+{
+    int i;
 
-static inline int should_encrypt(struct volume_info *volume)
+    for (i = 0; i < lane->num_devices; i++) {
+        if (lane->devices[i] == device) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Takes 'device' out of the lanes of 'job', so that it is left alone */
+static void drop_lane_device(struct encrypt_job *job, int device)
 {
-    return (volume->flags & (VOL_ENCRYPTABLE | VOL_NONREMOVABLE)) == 
-            (VOL_ENCRYPTABLE | VOL_NONREMOVABLE);
+    struct encrypt_lane *lane;
+    int i, j;
+
+    for (i = 0; i < job->num_lanes; i++) {
+        lane = &job->lanes[i];
+        for (j = 0; j < lane->num_devices; j++) {
+            if (lane->devices[j] == device) {
+                memmove(&lane->devices[j], &lane->devices[j + 1],
+                        (lane->num_devices - j - 1) * sizeof(lane->devices[0]));
+                lane->num_devices--;
+                job->tot_size -= job->devices[device].size;
+                return;
+            }
+        }
+    }
+}
+
+/*
+ * Sorts the devices of 'job' into one lane per disk, /data's first. A
+ * device whose disk is unknown stays with /data, and disks beyond the
+ * last checkpoint slot share the last lane. A resumed run must end up
+ * with each checkpoint in the lane of the device it describes, and with
+ * as many slots, since that decides where the checksums of all but slot
+ * 0 are. A checkpoint that doesn't fit, because a card was removed or
+ * moved, fails: its device is left partly encrypted so that /data can
+ * still be finished.
+ */
+static int plan_encrypt_lanes(struct encrypt_job *job, int resume)
+{
+    struct crypt_mnt_ftr *crypt_ftr = job->crypt_ftr;
+    struct encrypt_lane *lane;
+    dev_t disk;
+    int i, j;
+
+    for (i = 0; i < job->num_devices; i++) {
+        if (!job->devices[i].crypto_blkdev) {
+            continue;
+        }
+        disk = get_blkdev_disk(job->devices[i].real_blkdev);
+        lane = NULL;
+        for (j = 0; j < job->num_lanes; j++) {
+            if (job->lanes[j].disk == disk) {
+                lane = &job->lanes[j];
+                break;
+            }
+        }
+        if (!lane) {
+            if (!disk && job->num_lanes) {
+                lane = &job->lanes[0];
+            } else if (job->num_lanes < CRYPT_INPLACE_CHECKPOINTS) {
+                lane = &job->lanes[job->num_lanes];
+                lane->job = job;
+                lane->slot = job->num_lanes++;
+                lane->disk = disk;
+            } else {
+                lane = &job->lanes[job->num_lanes - 1];
+            }
+        }
+        lane->devices[lane->num_devices++] = i;
+    }
+
+    if (resume) {
+        for (i = 0; i < CRYPT_INPLACE_CHECKPOINTS; i++) {
+            struct crypt_inplace_checkpoint *cp = &crypt_ftr->checkpoint[i];
+
+            if (!checkpoint_in_use(crypt_ftr, i) ||
+                (i < job->num_lanes && lane_has_device(&job->lanes[i], cp->encrypt_device) &&
+                 (!i || (int) crypt_ftr->checkpoint_slots == job->num_lanes))) {
+                continue;
+            }
+            if (!cp->encrypt_device) {
+                SLOGE("Crypto footer checkpoint does not match /data\n");
+                errno = EINVAL;
+                return -1;
+            }
+            SLOGE("Cannot resume encrypting volume %d on this set of disks, "
+                  "leaving it partly encrypted\n", cp->encrypt_device - 1);
+            if ((int) cp->encrypt_device < job->num_devices) {
+                drop_lane_device(job, cp->encrypt_device);
+            }
+            memset(cp, 0, sizeof(*cp));
+        }
+    }
+    crypt_ftr->checkpoint_slots = job->num_lanes;
+
+    SLOGI("Encrypting on %d disk(s) at once", job->num_lanes);
+    return 0;
+}
+
+static void *encrypt_lane_thread(void *arg)
+{
+    struct encrypt_lane *lane = (struct encrypt_lane *) arg;
+    struct encrypt_job *job = lane->job;
+    struct encrypt_device *dev;
+    int i;
+
+    /* Other disks wait until a resume could check the password on /data */
+    pthread_mutex_lock(&job->lock);
+    while (lane->slot && !job->data_started && !job->failed) {
+        pthread_cond_wait(&job->cond, &job->lock);
+    }
+    lane->rc = job->failed ? -1 : 0;
+    pthread_mutex_unlock(&job->lock);
+
+    for (i = 0; i < lane->num_devices && !lane->rc; i++) {
+        lane->device = lane->devices[i];
+        dev = &job->devices[lane->device];
+        if (job->how == CRYPTO_ENABLE_WIPE) {
+            lane->rc = cryptfs_enable_wipe(dev->crypto_blkdev, dev->size, dev->fs_type);
+        } else {
+            lane->rc = cryptfs_enable_inplace(lane);
+        }
+        if (!lane->rc && lane->device == 0) {
+            pthread_mutex_lock(&job->lock);
+            job->data_started = 1;
+            pthread_cond_broadcast(&job->cond);
+            pthread_mutex_unlock(&job->lock);
+        }
+    }
+
+    if (lane->rc) {
+        /* The other lanes stop at their next checkpoint */
+        pthread_mutex_lock(&job->lock);
+        job->failed = 1;
+        pthread_cond_broadcast(&job->cond);
+        pthread_mutex_unlock(&job->lock);
+    }
+    return NULL;
+}
+
+/*
+ * Encrypts /data and the encryptable volumes in vol_list, the devices of
+ * each disk in turn but the disks at the same time, so that the whole run
+ * takes about as long as its slowest disk. /data's lane runs on the
+ * calling thread.
+ */
+static int encrypt_devices(int how, int resume, struct crypt_mnt_ftr *crypt_ftr,
+                           char *crypto_blkdev, char *real_blkdev,
+                           struct volume_info *vol_list, int num_vols,
+                           const struct alloc_map *maps, off64_t tot_size)
+{
+    struct encrypt_job job;
+    int started;
+    int i, rc;
+
+    if (num_vols + 1 > CRYPT_INPLACE_MAX_DEVICES) {
+        SLOGE("Too many volumes to encrypt\n");
+        return -1;
+    }
+
+    memset(&job, 0, sizeof(job));
+    job.how = how;
+    job.crypt_ftr = crypt_ftr;
+    job.tot_size = tot_size;
+    /* Only a new in-place run has to hold the other disks back */
+    job.data_started = how == CRYPTO_ENABLE_WIPE || resume;
+    job.num_devices = num_vols + 1;
+    job.devices[0].crypto_blkdev = crypto_blkdev;
+    job.devices[0].real_blkdev = real_blkdev;
+    job.devices[0].size = crypt_ftr->fs_size;
+    job.devices[0].fs_type = EXT4_FS;
+    job.devices[0].map = maps ? &maps[0] : NULL;
+    for (i = 0; i < num_vols; i++) {
+        if (should_encrypt(&vol_list[i])) {
+            job.devices[i + 1].crypto_blkdev = vol_list[i].crypto_blkdev;
+            job.devices[i + 1].real_blkdev = vol_list[i].blk_dev;
+            job.devices[i + 1].size = vol_list[i].crypt_ftr.fs_size;
+            job.devices[i + 1].fs_type = FAT_FS;
+            job.devices[i + 1].map = maps ? &maps[i + 1] : NULL;
+        }
+    }
+
+    if (plan_encrypt_lanes(&job, resume)) {
+        return -1;
+    }
+
+    pthread_mutex_init(&job.lock, NULL);
+    pthread_mutex_init(&job.footer_lock, NULL);
+    pthread_cond_init(&job.cond, NULL);
+
+    for (started = 1; started < job.num_lanes; started++) {
+        if ((rc = pthread_create(&job.lanes[started].thread, NULL, encrypt_lane_thread,
+                                 &job.lanes[started]))) {
+            SLOGW("Cannot start encryption thread (%s), encrypting in turn", strerror(rc));
+            break;
+        }
+    }
+    encrypt_lane_thread(&job.lanes[0]);
+    for (i = started; i < job.num_lanes; i++) {
+        encrypt_lane_thread(&job.lanes[i]);
+    }
+    for (i = 1; i < started; i++) {
+        pthread_join(job.lanes[i].thread, NULL);
+    }
+
+    pthread_cond_destroy(&job.cond);
+    pthread_mutex_destroy(&job.footer_lock);
+    pthread_mutex_destroy(&job.lock);
+
+    rc = 0;
+    for (i = 0; i < job.num_lanes; i++) {
+        if (job.lanes[i].rc) {
+            rc = -1;
+        }
+    }
+    return rc;
 }
 
-int cryptfs_enable(char *howarg, char *passwd)
+#define FRAMEWORK_BOOT_WAIT 60
+
+static int cryptfs_enable_locked(char *howarg, char *passwd)
 {
     int how = 0;
     char crypto_blkdev[MAXPATHLEN], real_blkdev[MAXPATHLEN], sd_crypto_blkdev[MAXPATHLEN];
@@ -1602,10 +2216,20 @@ int cryptfs_enable(char *howarg, char *passwd)
     char sd_blk_dev[256] = { 0 };
     int num_vols;
     struct volume_info *vol_list = 0;
-    off64_t cur_encryption_done=0, tot_encryption_size=0;
+    off64_t tot_encryption_size=0;
+    int resume = 0;
+
+    /* An interrupted in-place encryption is picked up where it stopped */
+    if (!strcmp(howarg, "inplace") && !get_crypt_ftr_and_key(&crypt_ftr) &&
+        has_inplace_checkpoint(&crypt_ftr)) {
+        fs_mgr_get_crypt_info(fstab, 0, real_blkdev, sizeof(real_blkdev));
+        if ((resume = check_inplace_resume(passwd, &crypt_ftr, real_blkdev)) < 0) {
+            return -1;
+        }
+    }
 
     property_get("ro.crypto.state", encrypted_state, "");
-    if (strcmp(encrypted_state, "unencrypted")) {
+    if (!resume && strcmp(encrypted_state, "unencrypted")) {
         SLOGE("Device is already running encrypted, aborting");
         goto error_unencrypted;
     }
@@ -1632,7 +2256,7 @@ int cryptfs_enable(char *howarg, char *passwd)
     close(fd);
 
     /* If doing inplace encryption, make sure the orig fs doesn't include the crypto footer */
-    if ((how == CRYPTO_ENABLE_INPLACE) && (!strcmp(key_loc, KEY_IN_FOOTER))) {
+    if (!resume && (how == CRYPTO_ENABLE_INPLACE) && (!strcmp(key_loc, KEY_IN_FOOTER))) {
         unsigned int fs_size_sec, max_fs_size_sec;
 
         fs_size_sec = get_fs_size(real_blkdev);
@@ -1673,7 +2297,13 @@ int cryptfs_enable(char *howarg, char *passwd)
             }
             close(fd);
 
+            /*
+             * The volume's thread may be waiting for cryptfs_lock in
+             * cryptfs_setup_volume(), so let go while it unmounts.
+             */
+            pthread_mutex_unlock(&cryptfs_lock);
             ret=vold_disableVol(vol_list[i].label);
+            pthread_mutex_lock(&cryptfs_lock);
             if ((ret < 0) && (ret != UNMOUNT_NOT_MOUNTED_ERR)) {
                 /* -2 is returned when the device exists but is not currently mounted.
                  * ignore the error and continue. */
@@ -1751,25 +2381,30 @@ int cryptfs_enable(char *howarg, char *passwd)
     }
 
     /* Start the actual work of making an encrypted filesystem */
-    /* Initialize a crypt_mnt_ftr for the partition */
-    cryptfs_init_crypt_mnt_ftr(&crypt_ftr);
-
-    if (!strcmp(key_loc, KEY_IN_FOOTER)) {
-        crypt_ftr.fs_size = nr_sec - (CRYPT_FOOTER_OFFSET / 512);
+    if (resume) {
+        /* Keep the key and checkpoint of the interrupted attempt */
+        SLOGI("Resuming interrupted encryption");
     } else {
-        crypt_ftr.fs_size = nr_sec;
-    }
-    crypt_ftr.flags |= CRYPT_ENCRYPTION_IN_PROGRESS;
-    strcpy((char *)crypt_ftr.crypto_type_name, "aes-cbc-essiv:sha256");
+        /* Initialize a crypt_mnt_ftr for the partition */
+        cryptfs_init_crypt_mnt_ftr(&crypt_ftr);
 
-    /* Make an encrypted master key */
-    if (create_encrypted_random_key(passwd, crypt_ftr.master_key, crypt_ftr.salt, &crypt_ftr)) {
-        SLOGE("Cannot create encrypted master key\n");
-        goto error_unencrypted;
-    }
+        if (!strcmp(key_loc, KEY_IN_FOOTER)) {
+            crypt_ftr.fs_size = nr_sec - (CRYPT_FOOTER_OFFSET / 512);
+        } else {
+            crypt_ftr.fs_size = nr_sec;
+        }
+        crypt_ftr.flags |= CRYPT_ENCRYPTION_IN_PROGRESS;
+        strcpy((char *)crypt_ftr.crypto_type_name, "aes-cbc-essiv:sha256");
 
-    /* Write the key to the end of the partition */
-    put_crypt_ftr_and_key(&crypt_ftr);
+        /* Make an encrypted master key */
+        if (create_encrypted_random_key(passwd, crypt_ftr.master_key, crypt_ftr.salt, &crypt_ftr)) {
+            SLOGE("Cannot create encrypted master key\n");
+            goto error_unencrypted;
+        }
+
+        /* Write the key to the end of the partition */
+        put_crypt_ftr_and_key(&crypt_ftr);
+    }
 
     /* If any persistent data has been remembered, save it.
      * If none, create a valid empty table and save that.
@@ -1805,30 +2440,20 @@ int cryptfs_enable(char *howarg, char *passwd)
     }
 
     if (how == CRYPTO_ENABLE_WIPE) {
-        rc = cryptfs_enable_wipe(crypto_blkdev, crypt_ftr.fs_size, EXT4_FS);
-        /* Encrypt all encryptable volumes handled by vold */
-        if (!rc) {
-            for (i=0; i<num_vols; i++) {
-                if (should_encrypt(&vol_list[i])) {
-                    rc = cryptfs_enable_wipe(vol_list[i].crypto_blkdev,
-                                             vol_list[i].crypt_ftr.fs_size, FAT_FS);
-                }
-            }
-        }
+        /* Encrypt /data and all encryptable volumes handled by vold */
+        rc = encrypt_devices(how, 0, &crypt_ftr, crypto_blkdev, real_blkdev,
+                             vol_list, num_vols, NULL, tot_encryption_size);
     } else if (how == CRYPTO_ENABLE_INPLACE) {
-        rc = cryptfs_enable_inplace(crypto_blkdev, real_blkdev, crypt_ftr.fs_size,
-                                    &cur_encryption_done, tot_encryption_size);
-        /* Encrypt all encryptable volumes handled by vold */
-        if (!rc) {
-            for (i=0; i<num_vols; i++) {
-                if (should_encrypt(&vol_list[i])) {
-                    rc = cryptfs_enable_inplace(vol_list[i].crypto_blkdev,
-                                                vol_list[i].blk_dev,
-                                                vol_list[i].crypt_ftr.fs_size,
-                                                &cur_encryption_done, tot_encryption_size);
-                }
-            }
-        }
+        /* A resumed run encrypts everything past its checkpoint, since
+         * the filesystems can no longer be read as plaintext */
+        struct alloc_map *maps = resume ? NULL :
+                                 map_allocated_blocks(real_blkdev, crypt_ftr.fs_size,
+                                                      vol_list, num_vols,
+                                                      &tot_encryption_size);
+
+        rc = encrypt_devices(how, resume, &crypt_ftr, crypto_blkdev, real_blkdev,
+                             vol_list, num_vols, maps, tot_encryption_size);
+        free_allocated_blocks(maps, num_vols);
         if (!rc) {
             /* The inplace routine never actually sets the progress to 100%
              * due to the round down nature of integer division, so set it here */
@@ -1855,6 +2480,7 @@ int cryptfs_enable(char *howarg, char *passwd)
 
         /* Clear the encryption in progres flag in the footer */
         crypt_ftr.flags &= ~CRYPT_ENCRYPTION_IN_PROGRESS;
+        crypt_ftr.encrypted_devices = 0;
         put_crypt_ftr_and_key(&crypt_ftr);
 
         sleep(2); /* Give the UI a chance to show 100% progress */
@@ -1863,7 +2489,12 @@ int cryptfs_enable(char *howarg, char *passwd)
         char value[PROPERTY_VALUE_MAX];
 
         property_get("ro.vold.wipe_on_crypt_fail", value, "0");
-        if (!strcmp(value, "1")) {
+        if (has_inplace_checkpoint(&crypt_ftr)) {
+            /* Don't wipe what can still be resumed */
+            SLOGE("encryption failed - it can be resumed from its last checkpoint\n");
+            property_set("vold.encrypt_progress", "error_partially_encrypted");
+            release_wake_lock(lockid);
+        } else if (!strcmp(value, "1")) {
             /* wipe data if encryption failed */
             SLOGE("encryption failed - rebooting into recovery to wipe data\n");
             mkdir("/cache/recovery", 0700);
@@ -1916,7 +2547,7 @@ error_shutting_down:
     return -1;
 }
 
-int cryptfs_changepw(char *newpw)
+static int cryptfs_changepw_locked(char *newpw)
 {
     struct crypt_mnt_ftr crypt_ftr;
     unsigned char decrypted_master_key[KEY_LEN_BYTES];
@@ -1941,6 +2572,51 @@ int cryptfs_changepw(char *newpw)
     return 0;
 }
 
+/*
+ * Times PBKDF2 and scrypt at a range of N factors on this device, and the
+ * parameters the device would use for a new password. Each result is
+ * passed to 'cb' as a line of text.
+ */
+static int cryptfs_benchmark_kdf_locked(kdf_benchmark_cb cb, void *arg)
+{
+    static const int n_factors[] = { 10, 12, 14, 15, 16 };
+    unsigned char salt[SALT_LEN] = { 0 };
+    unsigned char ikey[KEY_LEN_BYTES + IV_LEN_BYTES];
+    struct crypt_mnt_ftr ftr;
+    char line[128];
+    unsigned long long start, us;
+    unsigned int i;
+
+    start = get_monotonic_us();
+    PKCS5_PBKDF2_HMAC_SHA1("benchmark", 9, salt, SALT_LEN, HASH_COUNT, sizeof(ikey), ikey);
+    us = get_monotonic_us() - start;
+    snprintf(line, sizeof(line), "pbkdf2 %d %llu", HASH_COUNT, us / 1000);
+    cb(line, arg);
+
+    memset(&ftr, 0, sizeof(ftr));
+    get_device_scrypt_params(&ftr);
+    for (i = 0; i < ARRAY_SIZE(n_factors); i++) {
+        if (scrypt_mem(n_factors[i], ftr.r_factor) > SCRYPT_MAX_MEM ||
+            time_scrypt(n_factors[i], ftr.r_factor, ftr.p_factor, &us)) {
+            continue;
+        }
+        snprintf(line, sizeof(line), "scrypt %d:%d:%d %llu",
+                 n_factors[i], ftr.r_factor, ftr.p_factor, us / 1000);
+        cb(line, arg);
+    }
+
+    /* What a password set now would get */
+    calibrate_scrypt_params(&ftr);
+    if (time_scrypt(ftr.N_factor, ftr.r_factor, ftr.p_factor, &us)) {
+        return -1;
+    }
+    snprintf(line, sizeof(line), "device %d:%d:%d %llu",
+             ftr.N_factor, ftr.r_factor, ftr.p_factor, us / 1000);
+    cb(line, arg);
+
+    return 0;
+}
+
 static int persist_get_key(char *fieldname, char *value)
 {
     unsigned int i;
@@ -2009,7 +2685,7 @@ static int persist_set_key(char *fieldname, char *value, int encrypted)
 }
 
 /* Return the value of the specified field. */
-int cryptfs_getfield(char *fieldname, char *value, int len)
+static int cryptfs_getfield_locked(char *fieldname, char *value, int len)
 {
     char temp_value[PROPERTY_VALUE_MAX];
     char real_blkdev[MAXPATHLEN];
@@ -2040,7 +2716,7 @@ out:
 }
 
 /* Set the value of the specified field. */
-int cryptfs_setfield(char *fieldname, char *value)
+static int cryptfs_setfield_locked(char *fieldname, char *value)
 {
     struct crypt_persist_data stored_pdata;
     struct crypt_persist_data *pdata_p;
@@ -2080,3 +2756,116 @@ int cryptfs_setfield(char *fieldname, char *value)
 out:
     return rc;
 }
+
+int cryptfs_crypto_complete(void)
+{
+    int rc;
+
+    pthread_mutex_lock(&cryptfs_lock);
+    rc = cryptfs_crypto_complete_locked();
+    pthread_mutex_unlock(&cryptfs_lock);
+    return rc;
+}
+
+int cryptfs_check_passwd(char *pw)
+{
+    int rc;
+
+    pthread_mutex_lock(&cryptfs_lock);
+    rc = cryptfs_check_passwd_locked(pw);
+    pthread_mutex_unlock(&cryptfs_lock);
+    return rc;
+}
+
+int cryptfs_verify_passwd(char *newpw)
+{
+    int rc;
+
+    pthread_mutex_lock(&cryptfs_lock);
+    rc = cryptfs_verify_passwd_locked(newpw);
+    pthread_mutex_unlock(&cryptfs_lock);
+    return rc;
+}
+
+int cryptfs_restart(void)
+{
+    int rc;
+
+    pthread_mutex_lock(&cryptfs_lock);
+    rc = cryptfs_restart_locked();
+    pthread_mutex_unlock(&cryptfs_lock);
+    return rc;
+}
+
+int cryptfs_enable(char *flag, char *passwd)
+{
+    int rc;
+
+    pthread_mutex_lock(&cryptfs_lock);
+    rc = cryptfs_enable_locked(flag, passwd);
+    pthread_mutex_unlock(&cryptfs_lock);
+    return rc;
+}
+
+int cryptfs_changepw(char *newpw)
+{
+    int rc;
+
+    pthread_mutex_lock(&cryptfs_lock);
+    rc = cryptfs_changepw_locked(newpw);
+    pthread_mutex_unlock(&cryptfs_lock);
+    return rc;
+}
+
+int cryptfs_setup_volume(const char *label, int major, int minor,
+                         char *crypto_dev_path, unsigned int max_pathlen,
+                         int *new_major, int *new_minor)
+{
+    int rc;
+
+    pthread_mutex_lock(&cryptfs_lock);
+    rc = cryptfs_setup_volume_locked(label, major, minor, crypto_dev_path, max_pathlen,
+                                     new_major, new_minor);
+    pthread_mutex_unlock(&cryptfs_lock);
+    return rc;
+}
+
+int cryptfs_revert_volume(const char *label)
+{
+    int rc;
+
+    pthread_mutex_lock(&cryptfs_lock);
+    rc = cryptfs_revert_volume_locked(label);
+    pthread_mutex_unlock(&cryptfs_lock);
+    return rc;
+}
+
+int cryptfs_getfield(char *fieldname, char *value, int len)
+{
+    int rc;
+
+    pthread_mutex_lock(&cryptfs_lock);
+    rc = cryptfs_getfield_locked(fieldname, value, len);
+    pthread_mutex_unlock(&cryptfs_lock);
+    return rc;
+}
+
+int cryptfs_setfield(char *fieldname, char *value)
+{
+    int rc;
+
+    pthread_mutex_lock(&cryptfs_lock);
+    rc = cryptfs_setfield_locked(fieldname, value);
+    pthread_mutex_unlock(&cryptfs_lock);
+    return rc;
+}
+
+int cryptfs_benchmark_kdf(kdf_benchmark_cb cb, void *arg)
+{
+    int rc;
+
+    pthread_mutex_lock(&cryptfs_lock);
+    rc = cryptfs_benchmark_kdf_locked(cb, arg);
+    pthread_mutex_unlock(&cryptfs_lock);
+    return rc;
+}
@@ -20,7 +20,8 @@
  * The structure allocates 48 bytes for a key, but the real key size is
  * specified in the struct.  Currently, the code is hardcoded to use 128
  * bit keys.
- * The fields after salt are only valid in rev 1.1 and later stuctures.
+ * The fields after salt are only valid in rev 1.1 and later stuctures,
+ * and the in-place encryption checkpoint only in rev 1.3 and later.
  * Obviously, the filesystem does not include the last 16 kbytes
  * of the partition if the crypt_mnt_ftr lives at the end of the
  * partition.
@@ -30,11 +31,19 @@
 
 /* The current cryptfs version */
 #define CURRENT_MAJOR_VERSION 1
-#define CURRENT_MINOR_VERSION 2
+#define CURRENT_MINOR_VERSION 3
 
 #define CRYPT_FOOTER_OFFSET 0x4000
 #define CRYPT_FOOTER_TO_PERSIST_OFFSET 0x1000
 #define CRYPT_PERSIST_DATA_SIZE 0x1000
+/* The checksums of the checkpoint hotzones share the footer's first 4K
+ * block, so that both are updated by a single write. The table is split
+ * evenly between the checkpoint slots in use. */
+#define CRYPT_FOOTER_TO_HOTZONE_OFFSET 0x200
+#define CRYPT_HOTZONE_MAX_SUMS ((0x1000 - CRYPT_FOOTER_TO_HOTZONE_OFFSET) / 4)
+#define CRYPT_HOTZONE_MAX_CHUNKS 4
+/* Disks encrypted at the same time, each with its own checkpoint */
+#define CRYPT_INPLACE_CHECKPOINTS 3
 
 #define MAX_CRYPTO_TYPE_NAME_LEN 64
 
@@ -51,6 +60,8 @@
 
 #define SCRYPT_PROP "ro.crypto.scrypt_params"
 #define SCRYPT_DEFAULTS { 15, 3, 1 }
+/* When set, N is calibrated so that unlocking takes about this many ms */
+#define SCRYPT_BUDGET_PROP "ro.crypto.scrypt_budget_ms"
 
 /* Key Derivation Function algorithms */
 #define KDF_PBKDF2 1
@@ -60,6 +71,24 @@
 #define __le16 unsigned short int
 #define __le8  unsigned char
 
+/* A run of sectors that in-place encryption was about to overwrite */
+struct crypt_hotzone_chunk {
+  __le64 start;         /* in 512 byte sectors */
+  __le32 count;         /* in 512 byte sectors */
+  __le32 spare;
+};
+
+/* How far in-place encryption got on one device */
+struct crypt_inplace_checkpoint {
+  __le32 encrypt_device;    /* the device the fields below describe */
+  __le32 hotzone_count;     /* chunks above encrypted_upto that may have been written */
+  __le64 encrypted_upto;    /* every sector below this is encrypted */
+  __le32 hotzone_sums;      /* crc32s of their plaintext 64K units, stored in
+                             * this slot's share of the hotzone table */
+  __le32 spare;
+  struct crypt_hotzone_chunk hotzone[CRYPT_HOTZONE_MAX_CHUNKS];
+};
+
 struct crypt_mnt_ftr {
   __le32 magic;		/* See above */
   __le16 major_version;
@@ -90,6 +119,14 @@ struct crypt_mnt_ftr {
   __le8  N_factor; /* (1 << N) */
   __le8  r_factor; /* (1 << r) */
   __le8  p_factor; /* (1 << p) */
+
+  /* In-place encryption checkpoint, only meaningful while
+   * CRYPT_ENCRYPTION_IN_PROGRESS is set. Device 0 is the one this footer
+   * belongs to, device n the nth volume in vold's list. Each disk has a
+   * slot for the device it is working on, /data's disk slot 0. */
+  __le32 encrypted_devices; /* bit n is set once device n is fully encrypted */
+  __le32 checkpoint_slots;  /* slots in use */
+  struct crypt_inplace_checkpoint checkpoint[CRYPT_INPLACE_CHECKPOINTS];
 };
 
 /* Persistant data that should be available before decryption.
@@ -137,6 +174,8 @@ extern "C" {
 #endif
 
   typedef void (*kdf_func)(char *passwd, unsigned char *salt, unsigned char *ikey, void *params);
+  /* Receives one "<kdf> <params> <ms>" line of cryptfs_benchmark_kdf() */
+  typedef void (*kdf_benchmark_cb)(const char *result, void *arg);
 
   int cryptfs_crypto_complete(void);
   int cryptfs_check_passwd(char *pw);
@@ -150,6 +189,7 @@ extern "C" {
   int cryptfs_revert_volume(const char *label);
   int cryptfs_getfield(char *fieldname, char *value, int len);
   int cryptfs_setfield(char *fieldname, char *value);
+  int cryptfs_benchmark_kdf(kdf_benchmark_cb cb, void *arg);
 #ifdef __cplusplus
 }
 #endif
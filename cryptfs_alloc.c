@@ -0,0 +1,377 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <ext4.h>
+
+#define LOG_TAG "Cryptfs"
+
+#include <cutils/log.h>
+
+#include "cryptfs_alloc.h"
+
+#define SECTOR_SIZE        512
+#define SECTORS_PER_4K     8
+
+#ifndef EXT4_FEATURE_RO_COMPAT_SPARSE_SUPER
+#define EXT4_FEATURE_RO_COMPAT_SPARSE_SUPER 0x0001
+#endif
+
+static int read_at(int fd, void *buf, size_t len, off64_t offset)
+{
+    char *p = (char *) buf;
+
+    while (len) {
+        ssize_t rc = TEMP_FAILURE_RETRY(pread64(fd, p, len, offset));
+        if (rc <= 0) {
+            if (!rc) {
+                errno = EIO;
+            }
+            return -1;
+        }
+        p += rc;
+        len -= rc;
+        offset += rc;
+    }
+    return 0;
+}
+
+/* Appends a run of sectors. Runs must be added in ascending order. */
+static int map_add(struct alloc_map *map, off64_t start, off64_t count)
+{
+    off64_t end = start + count;
+
+    start -= start % SECTORS_PER_4K;
+    end += (SECTORS_PER_4K - end % SECTORS_PER_4K) % SECTORS_PER_4K;
+
+    if (map->count) {
+        struct inplace_extent *last = &map->extents[map->count - 1];
+        off64_t last_end = last->start + last->count;
+
+        if (start <= last_end) {
+            if (end > last_end) {
+                map->sectors += end - last_end;
+                last->count = end - last->start;
+            }
+            return 0;
+        }
+    }
+
+    if (map->count == map->capacity) {
+        int capacity = map->capacity ? map->capacity * 2 : 64;
+        struct inplace_extent *extents = realloc(map->extents, sizeof(*extents) * capacity);
+        if (!extents) {
+            errno = ENOMEM;
+            return -1;
+        }
+        map->extents = extents;
+        map->capacity = capacity;
+    }
+    map->extents[map->count].start = start;
+    map->extents[map->count].count = end - start;
+    map->count++;
+    map->sectors += end - start;
+    return 0;
+}
+
+static void set_bits(unsigned char *bits, unsigned long long first, unsigned long long count,
+                     unsigned long long limit)
+{
+    unsigned long long i;
+
+    for (i = first; i < first + count && i < limit; i++) {
+        bits[i / 8] |= 1 << (i % 8);
+    }
+}
+
+static int is_power_of(unsigned int n, unsigned int base)
+{
+    while (n > 1 && n % base == 0) {
+        n /= base;
+    }
+    return n == 1;
+}
+
+static int ext4_group_has_super(const struct ext4_super_block *sb, unsigned int group)
+{
+    if (!(sb->s_feature_ro_compat & EXT4_FEATURE_RO_COMPAT_SPARSE_SUPER)) {
+        return 1;
+    }
+    return group <= 1 || is_power_of(group, 3) || is_power_of(group, 5) ||
+           is_power_of(group, 7);
+}
+
+/*
+ * Marks every block the block bitmaps report as used, plus all bitmaps and
+ * inode tables. Groups whose bitmap was never initialised only hold their
+ * own metadata, which is marked from the descriptor instead.
+ */
+static int ext4_build(int fd, const struct ext4_super_block *sb, struct alloc_map *map)
+{
+    unsigned int block_size = 1024 << sb->s_log_block_size;
+    unsigned long long blocks = sb->s_blocks_count_lo;
+    unsigned int bpg = sb->s_blocks_per_group;
+    unsigned int desc_size = EXT4_MIN_DESC_SIZE;
+    unsigned int ngroups, gdt_blocks, itable_blocks, g;
+    unsigned long long first_meta, b, run_start = 0;
+    unsigned char *used = NULL, *gdt = NULL, *bitmap = NULL;
+    int in_run = 0;
+    int rc = -1;
+
+    if (sb->s_feature_incompat & EXT4_FEATURE_INCOMPAT_64BIT) {
+        blocks |= (unsigned long long) sb->s_blocks_count_hi << 32;
+        if (sb->s_desc_size) {
+            desc_size = sb->s_desc_size;
+        }
+    }
+    if (sb->s_feature_incompat & EXT4_FEATURE_INCOMPAT_META_BG) {
+        SLOGW("ext4 meta_bg layout is not supported for allocation-aware encryption");
+        errno = EINVAL;
+        return -1;
+    }
+    if (!bpg || block_size > 65536 || blocks <= sb->s_first_data_block) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    ngroups = (blocks - sb->s_first_data_block + bpg - 1) / bpg;
+    gdt_blocks = (ngroups * desc_size + block_size - 1) / block_size;
+    itable_blocks = ((unsigned long long) sb->s_inodes_per_group * sb->s_inode_size +
+                     block_size - 1) / block_size;
+
+    used = calloc((blocks + 7) / 8, 1);
+    gdt = malloc((size_t) gdt_blocks * block_size);
+    bitmap = malloc(block_size);
+    if (!used || !gdt || !bitmap) {
+        errno = ENOMEM;
+        goto out;
+    }
+
+    if (read_at(fd, gdt, (size_t) gdt_blocks * block_size,
+                (off64_t) (sb->s_first_data_block + 1) * block_size)) {
+        SLOGE("Cannot read ext4 group descriptors (%s)", strerror(errno));
+        goto out;
+    }
+
+    /* Boot block, superblock, descriptors and reserved descriptor blocks */
+    first_meta = sb->s_first_data_block + 1 + gdt_blocks + sb->s_reserved_gdt_blocks;
+    set_bits(used, 0, first_meta, blocks);
+
+    for (g = 0; g < ngroups; g++) {
+        const struct ext4_group_desc *gd =
+                (const struct ext4_group_desc *) (gdt + (size_t) g * desc_size);
+        unsigned long long group_start = sb->s_first_data_block + (unsigned long long) g * bpg;
+        unsigned long long block_bitmap = gd->bg_block_bitmap_lo;
+        unsigned long long inode_bitmap = gd->bg_inode_bitmap_lo;
+        unsigned long long inode_table = gd->bg_inode_table_lo;
+        unsigned int i;
+
+        if (desc_size >= EXT4_MIN_DESC_SIZE_64BIT) {
+            block_bitmap |= (unsigned long long) gd->bg_block_bitmap_hi << 32;
+            inode_bitmap |= (unsigned long long) gd->bg_inode_bitmap_hi << 32;
+            inode_table |= (unsigned long long) gd->bg_inode_table_hi << 32;
+        }
+        set_bits(used, block_bitmap, 1, blocks);
+        set_bits(used, inode_bitmap, 1, blocks);
+        set_bits(used, inode_table, itable_blocks, blocks);
+
+        if (gd->bg_flags & EXT4_BG_BLOCK_UNINIT) {
+            if (ext4_group_has_super(sb, g)) {
+                set_bits(used, group_start, 1 + gdt_blocks + sb->s_reserved_gdt_blocks, blocks);
+            }
+            continue;
+        }
+
+        if (block_bitmap >= blocks ||
+            read_at(fd, bitmap, block_size, (off64_t) block_bitmap * block_size)) {
+            SLOGE("Cannot read ext4 block bitmap of group %u", g);
+            if (!errno || block_bitmap >= blocks) {
+                errno = EIO;
+            }
+            goto out;
+        }
+        for (i = 0; i < bpg && group_start + i < blocks; i++) {
+            if (bitmap[i / 8] & (1 << (i % 8))) {
+                set_bits(used, group_start + i, 1, blocks);
+            }
+        }
+    }
+
+    /* Convert the block map into sector runs */
+    for (b = 0; b <= blocks; b++) {
+        int set = b < blocks && (used[b / 8] & (1 << (b % 8)));
+
+        if (set && !in_run) {
+            run_start = b;
+            in_run = 1;
+        } else if (!set && in_run) {
+            if (map_add(map, (off64_t) run_start * (block_size / SECTOR_SIZE),
+                        (off64_t) (b - run_start) * (block_size / SECTOR_SIZE))) {
+                goto out;
+            }
+            in_run = 0;
+        }
+    }
+    rc = 0;
+
+out:
+    free(bitmap);
+    free(gdt);
+    free(used);
+    return rc;
+}
+
+static unsigned int le16(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static unsigned int le32(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int) p[3] << 24);
+}
+
+/*
+ * Marks the reserved sectors, FATs and root directory, then every cluster
+ * whose entry in the first FAT is neither free nor marked bad.
+ */
+static int fat_build(int fd, const unsigned char *bs, struct alloc_map *map)
+{
+    unsigned int bps = le16(bs + 11);
+    unsigned int spc = bs[13];
+    unsigned int reserved = le16(bs + 14);
+    unsigned int nfats = bs[16];
+    unsigned int root_entries = le16(bs + 17);
+    unsigned int total = le16(bs + 19) ? le16(bs + 19) : le32(bs + 32);
+    unsigned int fat_size = le16(bs + 22) ? le16(bs + 22) : le32(bs + 36);
+    unsigned int root_sectors, first_data, clusters, ssz, n;
+    unsigned int bits, bad;
+    unsigned char *fat;
+    int rc = -1;
+
+    if ((bps != 512 && bps != 1024 && bps != 2048 && bps != 4096) ||
+        !spc || (spc & (spc - 1)) || !reserved || !nfats || !fat_size) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    ssz = bps / SECTOR_SIZE;
+    root_sectors = (root_entries * 32 + bps - 1) / bps;
+    first_data = reserved + nfats * fat_size + root_sectors;
+    if (total <= first_data) {
+        errno = EINVAL;
+        return -1;
+    }
+    clusters = (total - first_data) / spc;
+    if (clusters < 4085) {
+        bits = 12;
+        bad = 0xFF7;
+    } else if (clusters < 65525) {
+        bits = 16;
+        bad = 0xFFF7;
+    } else {
+        bits = 32;
+        bad = 0x0FFFFFF7;
+    }
+    if ((unsigned long long) (clusters + 2) * bits > (unsigned long long) fat_size * bps * 8) {
+        SLOGE("FAT is too small for %u clusters", clusters);
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (!(fat = malloc((size_t) fat_size * bps))) {
+        errno = ENOMEM;
+        return -1;
+    }
+    if (read_at(fd, fat, (size_t) fat_size * bps, (off64_t) reserved * bps)) {
+        SLOGE("Cannot read FAT (%s)", strerror(errno));
+        goto out;
+    }
+
+    if (map_add(map, 0, (off64_t) first_data * ssz)) {
+        goto out;
+    }
+    for (n = 2; n < clusters + 2; n++) {
+        unsigned int entry;
+
+        if (bits == 12) {
+            entry = le16(fat + n + n / 2);
+            entry = (n & 1) ? entry >> 4 : entry & 0xFFF;
+        } else if (bits == 16) {
+            entry = le16(fat + n * 2);
+        } else {
+            entry = le32(fat + n * 4) & 0x0FFFFFFF;
+        }
+        if (!entry || entry == bad) {
+            continue;
+        }
+        if (map_add(map, ((off64_t) first_data + (off64_t) (n - 2) * spc) * ssz,
+                    (off64_t) spc * ssz)) {
+            goto out;
+        }
+    }
+    rc = 0;
+
+out:
+    free(fat);
+    return rc;
+}
+
+int alloc_map_build(const char *blkdev, struct alloc_map *map)
+{
+    struct ext4_super_block sb;
+    unsigned char bs[512];
+    int fd;
+    int rc = -1;
+
+    memset(map, 0, sizeof(*map));
+
+    if ((fd = open(blkdev, O_RDONLY)) < 0) {
+        SLOGE("Cannot open %s to map allocated blocks (%s)", blkdev, strerror(errno));
+        return -1;
+    }
+
+    if (!read_at(fd, &sb, sizeof(sb), 1024) && sb.s_magic == EXT4_SUPER_MAGIC) {
+        rc = ext4_build(fd, &sb, map);
+    } else if (!read_at(fd, bs, sizeof(bs), 0) && bs[510] == 0x55 && bs[511] == 0xAA &&
+               (!memcmp(bs + 54, "FAT", 3) || !memcmp(bs + 82, "FAT", 3))) {
+        rc = fat_build(fd, bs, map);
+    } else {
+        errno = EINVAL;
+    }
+    close(fd);
+
+    if (rc) {
+        int err = errno;
+        SLOGW("Cannot map allocated blocks of %s (%s)", blkdev, strerror(err));
+        alloc_map_free(map);
+        errno = err;
+    } else {
+        SLOGI("%s: %lld sectors allocated in %d extents", blkdev, map->sectors, map->count);
+    }
+    return rc;
+}
+
+void alloc_map_free(struct alloc_map *map)
+{
+    free(map->extents);
+    memset(map, 0, sizeof(*map));
+}
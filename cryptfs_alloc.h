@@ -0,0 +1,48 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _CRYPTFS_ALLOC_H
+#define _CRYPTFS_ALLOC_H
+
+#include <sys/cdefs.h>
+#include <sys/types.h>
+
+#include "cryptfs_inplace.h"
+
+/*
+ * The parts of an unmounted filesystem that hold data, so that in-place
+ * encryption can skip free space. ext4 is read from the group descriptors
+ * and block bitmaps, vfat from the first FAT. Filesystem metadata is
+ * always included. Extents are sorted, disjoint and rounded out to 4K.
+ */
+struct alloc_map {
+    struct inplace_extent *extents;
+    int                    count;
+    int                    capacity;
+    off64_t                sectors;     /* total covered by extents */
+};
+
+__BEGIN_DECLS
+  /*
+   * Fills 'map' for the filesystem on 'blkdev'. Returns -1 with errno set
+   * to EINVAL if the filesystem is not one we can parse, in which case the
+   * whole device has to be encrypted.
+   */
+  int alloc_map_build(const char *blkdev, struct alloc_map *map);
+  void alloc_map_free(struct alloc_map *map);
+__END_DECLS
+
+#endif
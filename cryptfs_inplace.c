@@ -0,0 +1,937 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <time.h>
+#include <zlib.h>
+
+#define LOG_TAG "Cryptfs"
+
+#include <cutils/log.h>
+
+#include "cryptfs_inplace.h"
+#include "VoldUtil.h"
+
+/* O_DIRECT transfers are kept to multiples of this */
+#define INPLACE_ALIGN 4096
+#define SECTOR_SIZE   512
+
+struct inplace_slot {
+    char    *buf;
+    off64_t  offset;
+    size_t   len;
+    /* Set on the first buffer of an interval */
+    const struct inplace_hotzone *hz;
+};
+
+/* An aligned byte range that goes through the ring */
+struct inplace_run {
+    off64_t offset;
+    off64_t len;
+};
+
+struct inplace_ctx {
+    const struct inplace_copy_params *params;
+    int              realfd;
+    int              cryptofd;
+    struct inplace_run *runs;
+    int              num_runs;
+    off64_t          bytes;        /* bytes that go through the ring */
+
+    pthread_mutex_t  lock;
+    pthread_cond_t   cond;         /* ring state changed */
+    pthread_cond_t   done_cond;    /* writer finished */
+    struct inplace_slot slots[INPLACE_RING_SIZE];
+    int              head;         /* next slot the reader fills */
+    int              tail;         /* next slot the writer drains */
+    int              filled;
+    int              reader_done;
+    int              writer_done;
+    int              error;        /* errno of the first failure */
+    off64_t          written;
+    int              checkpoints;  /* intervals the writer has checkpointed */
+
+    /*
+     * With a checkpoint callback, the interval being copied and the next
+     * one, which the reader checksums meanwhile into 'scanbuf'.
+     */
+    struct inplace_hotzone *hz[2];
+    char            *scanbuf;
+};
+
+/* Where the reader is in the runs */
+struct inplace_pos {
+    int     run;
+    off64_t offset;
+};
+
+/* How far the checksums of an interval have got */
+struct inplace_scan {
+    struct inplace_hotzone *hz;
+    int     chunk;
+    off64_t pos;                   /* bytes into the chunk */
+};
+
+static int open_direct(const char *path, int flags, int *direct)
+{
+    int fd = open(path, flags | O_DIRECT);
+
+    if (fd >= 0) {
+        *direct = 1;
+        return fd;
+    }
+    if (errno != EINVAL) {
+        return -1;
+    }
+    *direct = 0;
+    SLOGW("O_DIRECT not supported on %s, using buffered I/O", path);
+    return open(path, flags);
+}
+
+static int pread_full(int fd, char *buf, size_t len, off64_t offset)
+{
+    while (len) {
+        ssize_t rc = TEMP_FAILURE_RETRY(pread64(fd, buf, len, offset));
+        if (rc < 0) {
+            return -1;
+        }
+        if (rc == 0) {
+            errno = EIO;
+            return -1;
+        }
+        buf += rc;
+        len -= rc;
+        offset += rc;
+    }
+    return 0;
+}
+
+static int pwrite_full(int fd, const char *buf, size_t len, off64_t offset)
+{
+    while (len) {
+        ssize_t rc = TEMP_FAILURE_RETRY(pwrite64(fd, buf, len, offset));
+        if (rc < 0) {
+            return -1;
+        }
+        if (rc == 0) {
+            errno = ENOSPC;
+            return -1;
+        }
+        buf += rc;
+        len -= rc;
+        offset += rc;
+    }
+    return 0;
+}
+
+/* Records the first error and wakes everyone up. Called without the lock. */
+static void set_error(struct inplace_ctx *ctx, int err)
+{
+    pthread_mutex_lock(&ctx->lock);
+    if (!ctx->error) {
+        ctx->error = err ? err : EIO;
+    }
+    pthread_cond_broadcast(&ctx->cond);
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+/* Checksums the next buffer of the interval being scanned, if any is left */
+static int scan_step(struct inplace_ctx *ctx, struct inplace_scan *scan)
+{
+    struct inplace_hotzone *hz = scan->hz;
+    const struct inplace_extent *chunk;
+    off64_t offset, left;
+    size_t len, pos;
+
+    if (!hz || scan->chunk >= hz->count) {
+        return 0;
+    }
+    chunk = &hz->chunks[scan->chunk];
+    offset = chunk->start * SECTOR_SIZE + scan->pos;
+    left = chunk->count * SECTOR_SIZE - scan->pos;
+    len = left > INPLACE_BUFSIZE ? INPLACE_BUFSIZE : (size_t) left;
+
+    if (pread_full(ctx->realfd, ctx->scanbuf, len, offset)) {
+        SLOGE("Error reading real_blkdev at %lld for inplace encrypt (%s)",
+              offset, strerror(errno));
+        set_error(ctx, errno);
+        return -1;
+    }
+    /* Buffers start on a unit of the chunk, so the units line up */
+    for (pos = 0; pos < len; pos += INPLACE_UNIT_SIZE) {
+        size_t n = len - pos > INPLACE_UNIT_SIZE ? INPLACE_UNIT_SIZE : len - pos;
+
+        hz->sums[hz->num_sums++] = crc32(0, (const Bytef *) ctx->scanbuf + pos, n);
+    }
+    scan->pos += len;
+    if (scan->pos == chunk->count * SECTOR_SIZE) {
+        scan->chunk++;
+        scan->pos = 0;
+    }
+    return 0;
+}
+
+/*
+ * Reads 'len' bytes at 'offset' into the ring, tagging the first buffer
+ * with 'hz'. After each buffer, 'scan' is taken a step further.
+ */
+static int fill_ring(struct inplace_ctx *ctx, off64_t offset, off64_t len,
+                     const struct inplace_hotzone *hz, struct inplace_scan *scan)
+{
+    while (len) {
+        struct inplace_slot *slot;
+        size_t n = len > INPLACE_BUFSIZE ? INPLACE_BUFSIZE : (size_t) len;
+
+        pthread_mutex_lock(&ctx->lock);
+        while (ctx->filled == INPLACE_RING_SIZE && !ctx->error) {
+            pthread_cond_wait(&ctx->cond, &ctx->lock);
+        }
+        if (ctx->error) {
+            pthread_mutex_unlock(&ctx->lock);
+            return -1;
+        }
+        slot = &ctx->slots[ctx->head];
+        pthread_mutex_unlock(&ctx->lock);
+
+        /* The slot is ours until it is published below */
+        if (pread_full(ctx->realfd, slot->buf, n, offset)) {
+            SLOGE("Error reading real_blkdev at %lld for inplace encrypt (%s)",
+                  offset, strerror(errno));
+            set_error(ctx, errno);
+            return -1;
+        }
+        slot->offset = offset;
+        slot->len = n;
+        slot->hz = hz;
+        hz = NULL;
+        offset += n;
+        len -= n;
+
+        pthread_mutex_lock(&ctx->lock);
+        ctx->head = (ctx->head + 1) % INPLACE_RING_SIZE;
+        ctx->filled++;
+        pthread_cond_broadcast(&ctx->cond);
+        pthread_mutex_unlock(&ctx->lock);
+
+        if (scan && scan_step(ctx, scan)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Lays out the interval starting at 'pos' in 'hz', without its checksums,
+ * and moves 'pos' past it. 'hz' is left empty at the end of the runs.
+ */
+static void plan_interval(struct inplace_ctx *ctx, struct inplace_pos *pos,
+                          struct inplace_hotzone *hz)
+{
+    int max_sums = ctx->params->max_hotzone_sums;
+    int units = 0;
+    off64_t bytes = 0;
+
+    hz->done = pos->offset / SECTOR_SIZE;
+    hz->count = 0;
+    hz->num_sums = 0;
+    while (pos->run < ctx->num_runs && hz->count < INPLACE_HOTZONE_CHUNKS &&
+           bytes < INPLACE_SYNC_BYTES && units < max_sums) {
+        const struct inplace_run *run = &ctx->runs[pos->run];
+        off64_t len = run->offset + run->len - pos->offset;
+
+        if (len > INPLACE_SYNC_BYTES - bytes) {
+            len = INPLACE_SYNC_BYTES - bytes;
+        }
+        if (len > (off64_t) (max_sums - units) * INPLACE_UNIT_SIZE) {
+            len = (off64_t) (max_sums - units) * INPLACE_UNIT_SIZE;
+        }
+        hz->chunks[hz->count].start = pos->offset / SECTOR_SIZE;
+        hz->chunks[hz->count].count = len / SECTOR_SIZE;
+        hz->count++;
+        units += (len + INPLACE_UNIT_SIZE - 1) / INPLACE_UNIT_SIZE;
+        bytes += len;
+
+        pos->offset += len;
+        if (pos->offset == run->offset + run->len && ++pos->run < ctx->num_runs) {
+            pos->offset = ctx->runs[pos->run].offset;
+        }
+    }
+}
+
+/*
+ * With a checkpoint callback, copies one interval at a time while
+ * checksumming the next one, so that its checkpoint is ready by the time
+ * the writer gets there.
+ */
+static void read_intervals(struct inplace_ctx *ctx)
+{
+    struct inplace_pos pos;
+    struct inplace_scan scan;
+    int cur = 0;
+    int index;
+    int i;
+
+    pos.run = 0;
+    pos.offset = ctx->num_runs ? ctx->runs[0].offset : 0;
+    plan_interval(ctx, &pos, ctx->hz[0]);
+    memset(&scan, 0, sizeof(scan));
+    scan.hz = ctx->hz[0];
+    while (scan.chunk < scan.hz->count) {
+        if (scan_step(ctx, &scan)) {
+            return;
+        }
+    }
+
+    for (index = 1; ctx->hz[cur]->count; index++) {
+        struct inplace_hotzone *hz = ctx->hz[cur];
+        struct inplace_hotzone *next = ctx->hz[cur ^ 1];
+
+        /* 'next' held the interval before this one until it was checkpointed */
+        pthread_mutex_lock(&ctx->lock);
+        while (ctx->checkpoints < index - 1 && !ctx->error) {
+            pthread_cond_wait(&ctx->cond, &ctx->lock);
+        }
+        pthread_mutex_unlock(&ctx->lock);
+
+        plan_interval(ctx, &pos, next);
+        memset(&scan, 0, sizeof(scan));
+        scan.hz = next;
+        for (i = 0; i < hz->count; i++) {
+            if (fill_ring(ctx, hz->chunks[i].start * SECTOR_SIZE,
+                          hz->chunks[i].count * SECTOR_SIZE, i ? NULL : hz, &scan)) {
+                return;
+            }
+        }
+        while (scan.chunk < next->count) {
+            if (scan_step(ctx, &scan)) {
+                return;
+            }
+        }
+        cur ^= 1;
+    }
+}
+
+static void *reader_thread(void *arg)
+{
+    struct inplace_ctx *ctx = (struct inplace_ctx *) arg;
+    int run;
+
+    if (ctx->params->checkpoint) {
+        read_intervals(ctx);
+    } else {
+        for (run = 0; run < ctx->num_runs; run++) {
+            if (fill_ring(ctx, ctx->runs[run].offset, ctx->runs[run].len, NULL, NULL)) {
+                break;
+            }
+        }
+    }
+
+    pthread_mutex_lock(&ctx->lock);
+    ctx->reader_done = 1;
+    pthread_cond_broadcast(&ctx->cond);
+    pthread_mutex_unlock(&ctx->lock);
+    return NULL;
+}
+
+static int sync_crypto(struct inplace_ctx *ctx)
+{
+    if (fdatasync(ctx->cryptofd)) {
+        SLOGE("Error syncing crypto_blkdev for inplace encrypt (%s)", strerror(errno));
+        set_error(ctx, errno);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Drains the ring. With a checkpoint callback, the previous interval is
+ * flushed and the next one described to the callback before its first
+ * buffer is written.
+ */
+static void *writer_thread(void *arg)
+{
+    struct inplace_ctx *ctx = (struct inplace_ctx *) arg;
+    const struct inplace_copy_params *params = ctx->params;
+    off64_t unsynced = 0;
+
+    for (;;) {
+        struct inplace_slot *slot;
+
+        pthread_mutex_lock(&ctx->lock);
+        while (!ctx->filled && !ctx->reader_done && !ctx->error) {
+            pthread_cond_wait(&ctx->cond, &ctx->lock);
+        }
+        if (ctx->error || !ctx->filled) {
+            pthread_mutex_unlock(&ctx->lock);
+            break;
+        }
+        slot = &ctx->slots[ctx->tail];
+        pthread_mutex_unlock(&ctx->lock);
+
+        if (slot->hz) {
+            if (unsynced && sync_crypto(ctx)) {
+                goto out;
+            }
+            unsynced = 0;
+            if (params->checkpoint(slot->hz, params->arg)) {
+                SLOGE("Cannot checkpoint inplace encrypt (%s)", strerror(errno));
+                set_error(ctx, errno);
+                goto out;
+            }
+            pthread_mutex_lock(&ctx->lock);
+            ctx->checkpoints++;
+            pthread_cond_broadcast(&ctx->cond);
+            pthread_mutex_unlock(&ctx->lock);
+        }
+
+        if (pwrite_full(ctx->cryptofd, slot->buf, slot->len, slot->offset)) {
+            SLOGE("Error writing crypto_blkdev at %lld for inplace encrypt (%s)",
+                  slot->offset, strerror(errno));
+            set_error(ctx, errno);
+            goto out;
+        }
+        unsynced += slot->len;
+        if (!params->checkpoint && unsynced >= INPLACE_SYNC_BYTES) {
+            if (sync_crypto(ctx)) {
+                goto out;
+            }
+            unsynced = 0;
+        }
+
+        pthread_mutex_lock(&ctx->lock);
+        ctx->written += slot->len;
+        ctx->tail = (ctx->tail + 1) % INPLACE_RING_SIZE;
+        ctx->filled--;
+        pthread_cond_broadcast(&ctx->cond);
+        pthread_mutex_unlock(&ctx->lock);
+    }
+
+    if (unsynced) {
+        sync_crypto(ctx);
+    }
+
+out:
+    pthread_mutex_lock(&ctx->lock);
+    ctx->writer_done = 1;
+    pthread_cond_signal(&ctx->done_cond);
+    pthread_mutex_unlock(&ctx->lock);
+    return NULL;
+}
+
+static void add_ms(struct timespec *ts, int ms)
+{
+    ts->tv_sec += ms / 1000;
+    ts->tv_nsec += (ms % 1000) * 1000000L;
+    if (ts->tv_nsec >= 1000000000L) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000L;
+    }
+}
+
+/*
+ * Waits for the writer to finish, calling the progress callback every
+ * INPLACE_PROGRESS_MS. The callback runs without the lock held.
+ */
+static void wait_for_writer(struct inplace_ctx *ctx, const struct inplace_copy_params *params)
+{
+    struct timespec deadline;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    add_ms(&deadline, INPLACE_PROGRESS_MS);
+
+    pthread_mutex_lock(&ctx->lock);
+    while (!ctx->writer_done) {
+        if (pthread_cond_timedwait(&ctx->done_cond, &ctx->lock, &deadline) == ETIMEDOUT) {
+            off64_t written = ctx->written;
+
+            pthread_mutex_unlock(&ctx->lock);
+            if (params->progress) {
+                params->progress(written / SECTOR_SIZE, params->arg);
+            }
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            add_ms(&deadline, INPLACE_PROGRESS_MS);
+            pthread_mutex_lock(&ctx->lock);
+        }
+    }
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+/*
+ * Copies the sectors past the last aligned block with plain buffered I/O,
+ * since O_DIRECT may reject them on devices with 4K logical blocks.
+ */
+static int copy_tail(const struct inplace_copy_params *params, off64_t offset, size_t len)
+{
+    char buf[INPLACE_ALIGN];
+    int realfd, cryptofd;
+    int failed;
+    int rc = -1;
+
+    if ((realfd = open(params->real_blkdev, O_RDONLY)) < 0) {
+        return -1;
+    }
+    if ((cryptofd = open(params->crypto_blkdev, O_WRONLY)) < 0) {
+        close(realfd);
+        return -1;
+    }
+    if (pread_full(realfd, buf, len, offset)) {
+        goto out;
+    }
+    if (params->checkpoint) {
+        struct inplace_hotzone *hz = malloc(sizeof(*hz));
+
+        if (!hz) {
+            errno = ENOMEM;
+            goto out;
+        }
+        hz->done = offset / SECTOR_SIZE;
+        hz->count = 1;
+        hz->chunks[0].start = offset / SECTOR_SIZE;
+        hz->chunks[0].count = len / SECTOR_SIZE;
+        hz->num_sums = 1;
+        hz->sums[0] = crc32(0, (const Bytef *) buf, len);
+        failed = params->checkpoint(hz, params->arg);
+        free(hz);
+        if (failed) {
+            goto out;
+        }
+    }
+    if (!pwrite_full(cryptofd, buf, len, offset) && !fdatasync(cryptofd)) {
+        rc = 0;
+    }
+
+out:
+    if (rc) {
+        SLOGE("Error copying final sectors for inplace encrypt (%s)", strerror(errno));
+    }
+    close(realfd);
+    close(cryptofd);
+    return rc;
+}
+
+/*
+ * Calls 'fn' for each unit of 'hz' with its contents on the real device
+ * and its recorded sum.
+ */
+typedef int (*hotzone_unit_fn)(off64_t offset, const char *buf, size_t len, unsigned int sum,
+                               void *arg);
+
+static int for_each_hotzone_unit(int realfd, const struct inplace_hotzone *hz,
+                                 hotzone_unit_fn fn, void *arg)
+{
+    char *buf;
+    int sum = 0;
+    int rc = -1;
+    int i;
+
+    if (!(buf = malloc(INPLACE_UNIT_SIZE))) {
+        errno = ENOMEM;
+        return -1;
+    }
+    for (i = 0; i < hz->count; i++) {
+        off64_t offset = hz->chunks[i].start * SECTOR_SIZE;
+        off64_t end = offset + hz->chunks[i].count * SECTOR_SIZE;
+
+        for (; offset < end; offset += INPLACE_UNIT_SIZE) {
+            size_t len = end - offset > INPLACE_UNIT_SIZE ? INPLACE_UNIT_SIZE : end - offset;
+
+            if (sum >= hz->num_sums) {
+                SLOGE("Inplace encrypt hotzone has too few checksums");
+                errno = EINVAL;
+                goto out;
+            }
+            if (pread_full(realfd, buf, len, offset) ||
+                fn(offset, buf, len, hz->sums[sum++], arg)) {
+                goto out;
+            }
+        }
+    }
+    rc = 0;
+
+out:
+    free(buf);
+    return rc;
+}
+
+static int count_written(off64_t offset, const char *buf, size_t len, unsigned int sum,
+                         void *arg)
+{
+    if (crc32(0, (const Bytef *) buf, len) != sum) {
+        (*(int *) arg)++;
+    }
+    return 0;
+}
+
+int inplace_hotzone_written(const char *real_blkdev, const struct inplace_hotzone *hz)
+{
+    int written = 0;
+    int fd;
+    int rc;
+
+    if ((fd = open(real_blkdev, O_RDONLY)) < 0) {
+        return -1;
+    }
+    rc = for_each_hotzone_unit(fd, hz, count_written, &written);
+    close(fd);
+    return rc ? -1 : written;
+}
+
+struct repair_state {
+    int   cryptofd;
+    char *decrypted;               /* the unit as read through the crypto device */
+    char *delta;
+    int   redone;
+    int   kept;
+    int   torn;
+};
+
+/*
+ * Finds which blocks of a unit that matches its sum neither on the real
+ * device nor through the crypto device reached the disk encrypted. Each
+ * block is either the plaintext, 'raw', or the ciphertext, whose plaintext
+ * is 'decrypted'. As crc32 is affine, swapping in the decrypted contents
+ * of block i changes the sum of the unit by a constant d_i, and the set
+ * of blocks whose d_i add up to crc32(raw) ^ sum is what was encrypted.
+ * Returns the set as a bitmask, or -1 unless it is unique.
+ */
+static int solve_torn_unit(struct repair_state *state, const char *raw, size_t len,
+                           unsigned int sum)
+{
+    unsigned int delta[INPLACE_UNIT_BLOCKS];
+    unsigned int zero_crc, target, acc = 0;
+    int blocks = len / INPLACE_BLOCK_SIZE;
+    int mask = 0, found = -1, matches = 0;
+    int g, b;
+    size_t i;
+
+    memset(state->delta, 0, len);
+    zero_crc = crc32(0, (const Bytef *) state->delta, len);
+    for (b = 0; b < blocks; b++) {
+        char *block = state->delta + b * INPLACE_BLOCK_SIZE;
+
+        for (i = 0; i < INPLACE_BLOCK_SIZE; i++) {
+            block[i] = raw[b * INPLACE_BLOCK_SIZE + i] ^
+                       state->decrypted[b * INPLACE_BLOCK_SIZE + i];
+        }
+        delta[b] = crc32(0, (const Bytef *) state->delta, len) ^ zero_crc;
+        memset(block, 0, INPLACE_BLOCK_SIZE);
+    }
+    target = crc32(0, (const Bytef *) raw, len) ^ sum;
+
+    /* Walk every subset in Gray code order, one block changing at a time */
+    for (g = 1; g < (1 << blocks); g++) {
+        b = __builtin_ctz(g);
+        mask ^= 1 << b;
+        acc ^= delta[b];
+        if (acc == target) {
+            found = mask;
+            matches++;
+        }
+    }
+    return matches == 1 ? found : -1;
+}
+
+static int repair_unit(off64_t offset, const char *buf, size_t len, unsigned int sum, void *arg)
+{
+    struct repair_state *state = (struct repair_state *) arg;
+    int encrypted;
+    int b;
+
+    if (crc32(0, (const Bytef *) buf, len) == sum) {
+        state->redone++;
+        return pwrite_full(state->cryptofd, buf, len, offset);
+    }
+    if (pread_full(state->cryptofd, state->decrypted, len, offset)) {
+        return -1;
+    }
+    if (crc32(0, (const Bytef *) state->decrypted, len) == sum) {
+        state->kept++;
+        return 0;
+    }
+
+    /* Torn, unless it is the tail of a device, which is less than a block */
+    if (len % INPLACE_BLOCK_SIZE || (encrypted = solve_torn_unit(state, buf, len, sum)) < 0) {
+        SLOGE("Cannot tell which blocks at %lld were encrypted", offset);
+        errno = EIO;
+        return -1;
+    }
+    state->torn++;
+    for (b = 0; b < (int) (len / INPLACE_BLOCK_SIZE); b++) {
+        if (!(encrypted & (1 << b)) &&
+            pwrite_full(state->cryptofd, buf + b * INPLACE_BLOCK_SIZE, INPLACE_BLOCK_SIZE,
+                        offset + b * INPLACE_BLOCK_SIZE)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Encrypts the blocks of an interrupted interval that still hold the
+ * plaintext recorded for them. The others were written before the
+ * interruption and must not be encrypted a second time.
+ */
+static int repair_hotzone(const struct inplace_copy_params *params)
+{
+    struct repair_state state;
+    int realfd;
+    int rc = -1;
+
+    memset(&state, 0, sizeof(state));
+    if ((realfd = open(params->real_blkdev, O_RDONLY)) < 0) {
+        return -1;
+    }
+    if ((state.cryptofd = open(params->crypto_blkdev, O_RDWR)) < 0) {
+        close(realfd);
+        return -1;
+    }
+    state.decrypted = malloc(INPLACE_UNIT_SIZE);
+    state.delta = malloc(INPLACE_UNIT_SIZE);
+
+    if (!state.decrypted || !state.delta) {
+        errno = ENOMEM;
+    } else if (!for_each_hotzone_unit(realfd, params->resume, repair_unit, &state) &&
+               !fdatasync(state.cryptofd)) {
+        SLOGI("Resuming %s: %d interrupted units encrypted, %d were already done, "
+              "%d partly", params->real_blkdev, state.redone, state.kept, state.torn);
+        rc = 0;
+    }
+    if (rc) {
+        SLOGE("Error resuming inplace encrypt of %s (%s)", params->real_blkdev, strerror(errno));
+    }
+    free(state.decrypted);
+    free(state.delta);
+    close(realfd);
+    close(state.cryptofd);
+    return rc;
+}
+
+/*
+ * Turns the requested extents into runs rounded out to INPLACE_ALIGN and
+ * ending at 'aligned', merging any that meet. Sets *tail if anything past
+ * 'aligned' was asked for.
+ */
+static int build_runs(const struct inplace_copy_params *params, off64_t aligned,
+                      struct inplace_ctx *ctx, int *tail)
+{
+    struct inplace_extent whole;
+    const struct inplace_extent *extents = params->extents;
+    int num_extents = params->num_extents;
+    int i;
+
+    if (!extents) {
+        whole.start = 0;
+        whole.count = params->size;
+        extents = &whole;
+        num_extents = 1;
+    }
+
+    *tail = 0;
+    ctx->runs = malloc(sizeof(*ctx->runs) * (num_extents ? num_extents : 1));
+    if (!ctx->runs) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    for (i = 0; i < num_extents; i++) {
+        off64_t start = extents[i].start * SECTOR_SIZE;
+        off64_t end = (extents[i].start + extents[i].count) * SECTOR_SIZE;
+
+        if (end > params->size * SECTOR_SIZE) {
+            end = params->size * SECTOR_SIZE;
+        }
+        if (start < params->start * SECTOR_SIZE) {
+            start = params->start * SECTOR_SIZE;
+        }
+        if (start >= end) {
+            continue;
+        }
+        if (end > aligned) {
+            *tail = 1;
+        }
+        start -= start % INPLACE_ALIGN;
+        end += (INPLACE_ALIGN - end % INPLACE_ALIGN) % INPLACE_ALIGN;
+        if (end > aligned) {
+            end = aligned;
+        }
+        if (start >= end) {
+            continue;
+        }
+
+        if (ctx->num_runs) {
+            struct inplace_run *last = &ctx->runs[ctx->num_runs - 1];
+            if (start < last->offset) {
+                SLOGE("Inplace encrypt extents are not sorted");
+                errno = EINVAL;
+                return -1;
+            }
+            if (start <= last->offset + last->len) {
+                if (end > last->offset + last->len) {
+                    ctx->bytes += end - (last->offset + last->len);
+                    last->len = end - last->offset;
+                }
+                continue;
+            }
+        }
+        ctx->runs[ctx->num_runs].offset = start;
+        ctx->runs[ctx->num_runs].len = end - start;
+        ctx->num_runs++;
+        ctx->bytes += end - start;
+    }
+    return 0;
+}
+
+int inplace_copy(const struct inplace_copy_params *params)
+{
+    struct inplace_ctx ctx;
+    pthread_t reader, writer;
+    int real_direct, crypto_direct;
+    off64_t total = params->size * SECTOR_SIZE;
+    off64_t aligned = total - (total % INPLACE_ALIGN);
+    off64_t copied;
+    unsigned long long start_us, elapsed_us;
+    int tail;
+    int started = 0;
+    int rc = -1;
+    int err;
+    int i;
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.params = params;
+    ctx.realfd = ctx.cryptofd = -1;
+    pthread_mutex_init(&ctx.lock, NULL);
+    pthread_cond_init(&ctx.cond, NULL);
+    pthread_cond_init(&ctx.done_cond, NULL);
+
+    if (params->checkpoint &&
+        (params->max_hotzone_sums < 1 || params->max_hotzone_sums > INPLACE_HOTZONE_SUMS)) {
+        SLOGE("Inplace encrypt hotzone of %d units is not supported", params->max_hotzone_sums);
+        errno = EINVAL;
+        goto out;
+    }
+    if (build_runs(params, aligned, &ctx, &tail)) {
+        goto out;
+    }
+    if (params->resume && repair_hotzone(params)) {
+        goto out;
+    }
+    copied = ctx.bytes + (tail ? total - aligned : 0);
+
+    if ((ctx.realfd = open_direct(params->real_blkdev, O_RDONLY, &real_direct)) < 0) {
+        SLOGE("Error opening real_blkdev %s for inplace encrypt (%s)",
+              params->real_blkdev, strerror(errno));
+        goto out;
+    }
+    if ((ctx.cryptofd = open_direct(params->crypto_blkdev, O_WRONLY, &crypto_direct)) < 0) {
+        SLOGE("Error opening crypto_blkdev %s for inplace encrypt (%s)",
+              params->crypto_blkdev, strerror(errno));
+        goto out;
+    }
+
+    for (i = 0; i < INPLACE_RING_SIZE; i++) {
+        if (!(ctx.slots[i].buf = memalign(INPLACE_ALIGN, INPLACE_BUFSIZE))) {
+            SLOGE("Cannot allocate inplace encrypt buffers");
+            errno = ENOMEM;
+            goto out;
+        }
+    }
+    if (params->checkpoint &&
+        (!(ctx.scanbuf = memalign(INPLACE_ALIGN, INPLACE_BUFSIZE)) ||
+         !(ctx.hz[0] = malloc(sizeof(*ctx.hz[0]))) ||
+         !(ctx.hz[1] = malloc(sizeof(*ctx.hz[1]))))) {
+        SLOGE("Cannot allocate inplace encrypt buffers");
+        errno = ENOMEM;
+        goto out;
+    }
+
+    SLOGI("Encrypting %s in place (%lld of %lld sectors in %d runs, %d x %dK buffers%s)",
+          params->real_blkdev, copied / SECTOR_SIZE, params->size, ctx.num_runs,
+          INPLACE_RING_SIZE, INPLACE_BUFSIZE / 1024,
+          (real_direct && crypto_direct) ? ", direct I/O" : "");
+
+    start_us = get_monotonic_us();
+
+    if ((err = pthread_create(&reader, NULL, reader_thread, &ctx))) {
+        SLOGE("Cannot start inplace encrypt reader (%s)", strerror(err));
+        errno = err;
+        goto out;
+    }
+    started++;
+    if ((err = pthread_create(&writer, NULL, writer_thread, &ctx))) {
+        SLOGE("Cannot start inplace encrypt writer (%s)", strerror(err));
+        set_error(&ctx, err);
+        goto out;
+    }
+    started++;
+
+    wait_for_writer(&ctx, params);
+
+out:
+    if (started > 1) {
+        pthread_join(writer, NULL);
+    }
+    if (started > 0) {
+        pthread_join(reader, NULL);
+    }
+
+    if (started > 1 && !ctx.error) {
+        if (tail && total > aligned &&
+            copy_tail(params, aligned, (size_t) (total - aligned))) {
+            ctx.error = errno;
+        } else {
+            elapsed_us = get_monotonic_us() - start_us;
+            if (!elapsed_us) {
+                elapsed_us = 1;
+            }
+            SLOGI("Encrypted %lld MB of %s in %llu ms (%llu MB/s)",
+                  copied / (1024 * 1024), params->real_blkdev, elapsed_us / 1000,
+                  (unsigned long long) copied * 1000000ULL / elapsed_us / (1024 * 1024));
+            if (params->progress) {
+                params->progress(copied / SECTOR_SIZE, params->arg);
+            }
+            rc = 0;
+        }
+    }
+
+    for (i = 0; i < INPLACE_RING_SIZE; i++) {
+        free(ctx.slots[i].buf);
+    }
+    free(ctx.scanbuf);
+    free(ctx.hz[0]);
+    free(ctx.hz[1]);
+    free(ctx.runs);
+    if (ctx.realfd >= 0) {
+        close(ctx.realfd);
+    }
+    if (ctx.cryptofd >= 0) {
+        close(ctx.cryptofd);
+    }
+    pthread_cond_destroy(&ctx.done_cond);
+    pthread_cond_destroy(&ctx.cond);
+    pthread_mutex_destroy(&ctx.lock);
+
+    if (rc && ctx.error) {
+        errno = ctx.error;
+    }
+    return rc;
+}
@@ -0,0 +1,117 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _CRYPTFS_INPLACE_H
+#define _CRYPTFS_INPLACE_H
+
+#include <sys/cdefs.h>
+#include <sys/types.h>
+
+/*
+ * Copy engine for in-place encryption. A reader thread fills a ring of
+ * large aligned buffers from the real block device while a writer thread
+ * drains them into the dm-crypt device, both with O_DIRECT where the
+ * devices allow it. The writer calls fdatasync() at a fixed interval so
+ * that the page cache never holds a large backlog. Progress is reported
+ * from the calling thread on a timer rather than per block.
+ */
+
+#define INPLACE_BUFSIZE        (1024 * 1024)
+#define INPLACE_RING_SIZE      4
+#define INPLACE_SYNC_BYTES     (64 * 1024 * 1024)
+#define INPLACE_PROGRESS_MS    1000
+/* Writes are assumed to reach the disk in whole blocks of this size */
+#define INPLACE_BLOCK_SIZE     4096
+/*
+ * Each hotzone checksum covers a unit of this many blocks, so that a
+ * checkpoint can describe a whole INPLACE_SYNC_BYTES interval.
+ */
+#define INPLACE_UNIT_BLOCKS    16
+#define INPLACE_UNIT_SIZE      (INPLACE_UNIT_BLOCKS * INPLACE_BLOCK_SIZE)
+#define INPLACE_HOTZONE_SUMS   (INPLACE_SYNC_BYTES / INPLACE_UNIT_SIZE)
+#define INPLACE_HOTZONE_CHUNKS 4
+
+/* Called with the number of 512 byte sectors written so far */
+typedef void (*inplace_progress_cb)(off64_t sectors_done, void *arg);
+
+/* A run of sectors to copy */
+struct inplace_extent {
+    off64_t start;
+    off64_t count;
+};
+
+/*
+ * The interval the writer is about to overwrite. Everything to be copied
+ * below 'done' is on disk. 'sums' holds the crc32 of the plaintext of each
+ * INPLACE_UNIT_SIZE unit of the chunks in order, the last one of a chunk
+ * possibly short. After a crash, a unit that still matches its sum has not
+ * been encrypted yet, and one that matches it through the crypto device
+ * has been. In a unit that matches neither, the blocks that were
+ * encrypted are found from the linearity of crc32.
+ */
+struct inplace_hotzone {
+    off64_t                done;
+    int                    count;
+    struct inplace_extent  chunks[INPLACE_HOTZONE_CHUNKS];
+    int                    num_sums;
+    unsigned int           sums[INPLACE_HOTZONE_SUMS];
+};
+
+/* Returns non-zero to abort the copy */
+typedef int (*inplace_checkpoint_cb)(const struct inplace_hotzone *hz, void *arg);
+
+struct inplace_copy_params {
+    const char          *real_blkdev;
+    const char          *crypto_blkdev;
+    off64_t              size;          /* in 512 byte sectors */
+    /* Sorted, disjoint runs to copy; NULL copies the whole device */
+    const struct inplace_extent *extents;
+    int                  num_extents;
+    inplace_progress_cb  progress;      /* optional */
+    /*
+     * Optional. Called before each interval is written, once the previous
+     * one has been flushed. An interval ends after INPLACE_SYNC_BYTES,
+     * 'max_hotzone_sums' units or INPLACE_HOTZONE_CHUNKS runs, whichever
+     * comes first. The reader checksums each interval while the one before
+     * it is copied, so the source is read twice.
+     */
+    inplace_checkpoint_cb checkpoint;
+    int                  max_hotzone_sums;
+    /*
+     * When resuming, sectors below 'start' are already encrypted, and the
+     * blocks of 'resume' that still hold their plaintext are encrypted
+     * before anything else. The crypto device has to be readable.
+     */
+    off64_t              start;
+    const struct inplace_hotzone *resume;
+    void                *arg;
+};
+
+__BEGIN_DECLS
+  /*
+   * Copies params->size sectors, or the given extents of them, from the
+   * real device to the crypto device. Returns 0 on success, or -1 with
+   * errno set. The throughput is logged on completion.
+   */
+  int inplace_copy(const struct inplace_copy_params *params);
+  /*
+   * Returns how many units of 'hz' on 'real_blkdev' no longer hold the
+   * plaintext recorded for them, i.e. were at least partly encrypted, or -1.
+   */
+  int inplace_hotzone_written(const char *real_blkdev, const struct inplace_hotzone *hz);
+__END_DECLS
+
+#endif
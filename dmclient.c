@@ -0,0 +1,377 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+
+#define LOG_TAG "Vold"
+
+#include <cutils/log.h>
+
+#include "dmclient.h"
+#include "VoldUtil.h"
+
+#define DM_CONTROL_PATH "/dev/device-mapper"
+#define DM_BUFFER_SIZE 4096
+#define DM_LIST_BUFFER_SIZE (1024 * 64)
+#define DM_LOAD_RETRY_US 500000
+#define DM_MAX_IOCTL_NR 32
+
+struct dm_ioctl_stats {
+    unsigned int       calls;
+    unsigned int       failures;
+    unsigned long long total_us;
+    unsigned long long max_us;
+};
+
+/*
+ * dm_lock guards the shared table buffer. Removal and lookup only need a
+ * bare dm_ioctl on the stack, so they run concurrently with each other.
+ */
+static pthread_mutex_t dm_lock = PTHREAD_MUTEX_INITIALIZER;
+/* unsigned long long keeps the dm_ioctl header and specs 8 byte aligned */
+static unsigned long long dm_buffer[DM_BUFFER_SIZE / sizeof(unsigned long long)];
+
+/* dm_state_lock guards the control fd and the stats */
+static pthread_mutex_t dm_state_lock = PTHREAD_MUTEX_INITIALIZER;
+static int dm_fd = -1;
+static struct dm_ioctl_stats dm_stats[DM_MAX_IOCTL_NR];
+
+static const char *ioctl_name(int nr)
+{
+    switch (nr) {
+    case DM_VERSION_CMD:         return "version";
+    case DM_REMOVE_ALL_CMD:      return "remove_all";
+    case DM_LIST_DEVICES_CMD:    return "list_devices";
+    case DM_DEV_CREATE_CMD:      return "dev_create";
+    case DM_DEV_REMOVE_CMD:      return "dev_remove";
+    case DM_DEV_RENAME_CMD:      return "dev_rename";
+    case DM_DEV_SUSPEND_CMD:     return "dev_suspend";
+    case DM_DEV_STATUS_CMD:      return "dev_status";
+    case DM_DEV_WAIT_CMD:        return "dev_wait";
+    case DM_TABLE_LOAD_CMD:      return "table_load";
+    case DM_TABLE_CLEAR_CMD:     return "table_clear";
+    case DM_TABLE_DEPS_CMD:      return "table_deps";
+    case DM_TABLE_STATUS_CMD:    return "table_status";
+    case DM_LIST_VERSIONS_CMD:   return "list_versions";
+    case DM_TARGET_MSG_CMD:      return "target_msg";
+    case DM_DEV_SET_GEOMETRY_CMD: return "dev_set_geometry";
+    default:                     return "unknown";
+    }
+}
+
+static void *align(void *ptr, unsigned int a)
+{
+    unsigned long agn = --a;
+
+    return (void *) (((unsigned long) ptr + agn) & ~agn);
+}
+
+static unsigned int dev_to_minor(dev_t dev)
+{
+    return (dev & 0xff) | ((dev >> 12) & 0xfff00);
+}
+
+static struct dm_ioctl *ioctl_init(void *buffer, size_t data_size, const char *name,
+                                   unsigned flags)
+{
+    struct dm_ioctl *io = (struct dm_ioctl *) buffer;
+
+    memset(io, 0, data_size);
+    io->data_size = data_size;
+    io->data_start = sizeof(struct dm_ioctl);
+    io->version[0] = 4;
+    io->version[1] = 0;
+    io->version[2] = 0;
+    io->flags = flags;
+    if (name) {
+        size_t ret = strlcpy(io->name, name, sizeof(io->name));
+        if (ret >= sizeof(io->name))
+            abort();
+    }
+    return io;
+}
+
+static int open_control(void)
+{
+    int rc = 0;
+
+    pthread_mutex_lock(&dm_state_lock);
+    if (dm_fd < 0) {
+        if ((dm_fd = open(DM_CONTROL_PATH, O_RDWR)) < 0) {
+            SLOGE("Error opening devmapper (%s)", strerror(errno));
+            rc = -1;
+        } else {
+            fcntl(dm_fd, F_SETFD, FD_CLOEXEC);
+        }
+    }
+    pthread_mutex_unlock(&dm_state_lock);
+    return rc;
+}
+
+/* Issues one dm ioctl and records how long it took */
+static int dm_do_ioctl(unsigned long cmd, struct dm_ioctl *io)
+{
+    unsigned long long start = get_monotonic_us();
+    int rc = ioctl(dm_fd, cmd, io);
+    int err = errno;
+    unsigned long long elapsed = get_monotonic_us() - start;
+    int nr = _IOC_NR(cmd);
+
+    pthread_mutex_lock(&dm_state_lock);
+    if (nr < DM_MAX_IOCTL_NR) {
+        dm_stats[nr].calls++;
+        if (rc) {
+            dm_stats[nr].failures++;
+        }
+        dm_stats[nr].total_us += elapsed;
+        if (elapsed > dm_stats[nr].max_us) {
+            dm_stats[nr].max_us = elapsed;
+        }
+    }
+    pthread_mutex_unlock(&dm_state_lock);
+
+    errno = err;
+    return rc;
+}
+
+static int create_locked(const char *name, const struct dm_table_spec *spec, char *ubuffer,
+                         size_t len, int *created)
+{
+    char *buffer = (char *) dm_buffer;
+    struct dm_ioctl *io;
+    struct dm_target_spec *tgt;
+    char *params;
+    int i;
+
+    // DM_DEV_CREATE hands back the device number, so no status call is needed
+    io = ioctl_init(buffer, DM_BUFFER_SIZE, name, spec->flags);
+    if (dm_do_ioctl(DM_DEV_CREATE, io)) {
+        SLOGE("Error creating device mapping (%s)", strerror(errno));
+        return -1;
+    }
+    *created = 1;
+    snprintf(ubuffer, len, "/dev/block/dm-%u", dev_to_minor(io->dev));
+
+    if (spec->legacy_geometry) {
+        // bps=512 spc=8 res=32 nft=2 sec=8190 mid=0xf0 spt=63 hds=64 hid=0 bspf=8 rdcl=2 infs=1 bkbs=2
+        io = ioctl_init(buffer, DM_BUFFER_SIZE, name, 0);
+        strcpy(buffer + sizeof(struct dm_ioctl), "0 64 63 0");
+        if (dm_do_ioctl(DM_DEV_SET_GEOMETRY, io)) {
+            SLOGE("Error setting device geometry (%s)", strerror(errno));
+            return -1;
+        }
+    }
+
+    io = ioctl_init(buffer, DM_BUFFER_SIZE, name, DM_STATUS_TABLE_FLAG | spec->flags);
+    io->target_count = 1;
+
+    tgt = (struct dm_target_spec *) (buffer + sizeof(struct dm_ioctl));
+    tgt->status = 0;
+    tgt->sector_start = 0;
+    tgt->length = spec->length;
+    strlcpy(tgt->target_type, spec->target_type, sizeof(tgt->target_type));
+
+    params = buffer + sizeof(struct dm_ioctl) + sizeof(struct dm_target_spec);
+    if ((size_t) snprintf(params, DM_BUFFER_SIZE - (params - buffer), "%s", spec->params) >=
+            DM_BUFFER_SIZE - (params - buffer) - 8) {
+        SLOGE("Mapping table for %s too large", name);
+        errno = E2BIG;
+        return -1;
+    }
+    params += strlen(params) + 1;
+    params = (char *) align(params, 8);
+    tgt->next = params - buffer;
+
+    for (i = 0; dm_do_ioctl(DM_TABLE_LOAD, io); i++) {
+        if (i >= spec->load_retries) {
+            SLOGE("Error loading mapping table (%s)", strerror(errno));
+            return -1;
+        }
+        usleep(DM_LOAD_RETRY_US);
+    }
+    if (i) {
+        SLOGI("Took %d tries to load %s table", i + 1, name);
+    }
+
+    io = ioctl_init(buffer, DM_BUFFER_SIZE, name, 0);
+    if (dm_do_ioctl(DM_DEV_SUSPEND, io)) {
+        SLOGE("Error resuming (%s)", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+int dm_create(const char *name, const struct dm_table_spec *spec, char *ubuffer, size_t len)
+{
+    int created = 0;
+    int rc = -1;
+
+    pthread_mutex_lock(&dm_lock);
+    if (!open_control()) {
+        if ((rc = create_locked(name, spec, ubuffer, len, &created)) && created) {
+            int err = errno;
+            struct dm_ioctl *io = ioctl_init(dm_buffer, DM_BUFFER_SIZE, name, 0);
+
+            dm_do_ioctl(DM_DEV_REMOVE, io);
+            errno = err;
+        }
+    }
+    pthread_mutex_unlock(&dm_lock);
+    return rc;
+}
+
+int dm_remove(const char *name, unsigned flags)
+{
+    struct dm_ioctl io;
+    int rc;
+
+    if (open_control()) {
+        return -1;
+    }
+
+    ioctl_init(&io, sizeof(io), name, flags);
+    if ((rc = dm_do_ioctl(DM_DEV_REMOVE, &io)) && errno != ENXIO) {
+        SLOGE("Error destroying device mapping (%s)", strerror(errno));
+    }
+    return rc;
+}
+
+int dm_lookup(const char *name, char *ubuffer, size_t len)
+{
+    struct dm_ioctl io;
+    int rc;
+
+    if (open_control()) {
+        return -1;
+    }
+
+    ioctl_init(&io, sizeof(io), name, 0);
+    if ((rc = dm_do_ioctl(DM_DEV_STATUS, &io))) {
+        if (errno != ENXIO) {
+            SLOGE("DM_DEV_STATUS ioctl failed for lookup (%s)", strerror(errno));
+        }
+    } else {
+        snprintf(ubuffer, len, "/dev/block/dm-%u", dev_to_minor(io.dev));
+    }
+    return rc;
+}
+
+int dm_get_target_version(const char *target, int *version)
+{
+    int rc = -1;
+
+    pthread_mutex_lock(&dm_lock);
+    if (!open_control()) {
+        char *buffer = (char *) dm_buffer;
+        struct dm_ioctl *io = ioctl_init(buffer, DM_BUFFER_SIZE, NULL, 0);
+
+        if (!dm_do_ioctl(DM_LIST_VERSIONS, io)) {
+            struct dm_target_versions *v =
+                    (struct dm_target_versions *) (buffer + io->data_start);
+
+            errno = ENOENT;
+            while (v->next) {
+                if (!strcmp(v->name, target)) {
+                    version[0] = v->version[0];
+                    version[1] = v->version[1];
+                    version[2] = v->version[2];
+                    rc = 0;
+                    break;
+                }
+                v = (struct dm_target_versions *) (((char *) v) + v->next);
+            }
+        }
+    }
+    pthread_mutex_unlock(&dm_lock);
+    return rc;
+}
+
+int dm_for_each_device(dm_device_cb cb, void *arg)
+{
+    char *list;
+    int rc = -1;
+
+    if (!(list = (char *) malloc(DM_LIST_BUFFER_SIZE))) {
+        SLOGE("Error allocating memory (%s)", strerror(errno));
+        return -1;
+    }
+
+    pthread_mutex_lock(&dm_lock);
+    if (open_control()) {
+        goto out;
+    }
+
+    struct dm_ioctl *io = ioctl_init(list, DM_LIST_BUFFER_SIZE, NULL, 0);
+    if (dm_do_ioctl(DM_LIST_DEVICES, io)) {
+        SLOGE("DM_LIST_DEVICES ioctl failed (%s)", strerror(errno));
+        goto out;
+    }
+
+    struct dm_name_list *n = (struct dm_name_list *) (list + io->data_start);
+    unsigned nxt = 0;
+
+    rc = 0;
+    if (!n->dev) {
+        goto out;
+    }
+
+    do {
+        n = (struct dm_name_list *) (((char *) n) + nxt);
+
+        struct dm_ioctl *status = ioctl_init(dm_buffer, DM_BUFFER_SIZE, n->name, 0);
+        if (dm_do_ioctl(DM_DEV_STATUS, status)) {
+            if (errno != ENXIO) {
+                SLOGE("DM_DEV_STATUS ioctl failed (%s)", strerror(errno));
+            }
+            status = NULL;
+        }
+        cb(n->name, n->dev, status, arg);
+        nxt = n->next;
+    } while (nxt);
+
+out:
+    pthread_mutex_unlock(&dm_lock);
+    free(list);
+    return rc;
+}
+
+void dm_dump_stats(dm_stats_cb cb, void *arg)
+{
+    struct dm_ioctl_stats stats[DM_MAX_IOCTL_NR];
+    char line[128];
+    int i;
+
+    pthread_mutex_lock(&dm_state_lock);
+    memcpy(stats, dm_stats, sizeof(stats));
+    pthread_mutex_unlock(&dm_state_lock);
+
+    for (i = 0; i < DM_MAX_IOCTL_NR; i++) {
+        if (!stats[i].calls) {
+            continue;
+        }
+        snprintf(line, sizeof(line), "%s: %u calls (%u failed), avg %llu us, max %llu us",
+                 ioctl_name(i), stats[i].calls, stats[i].failures,
+                 stats[i].total_us / stats[i].calls, stats[i].max_us);
+        cb(line, arg);
+    }
+}
@@ -0,0 +1,60 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _DMCLIENT_H
+#define _DMCLIENT_H
+
+#include <sys/cdefs.h>
+#include <sys/types.h>
+#include <linux/dm-ioctl.h>
+
+/*
+ * Device-mapper client shared by the ASEC code and cryptfs. The control
+ * fd and ioctl buffer are opened once and reused. Table setup is
+ * serialized; removals and lookups may run concurrently.
+ */
+
+/* A single-target table for dm_create() */
+struct dm_table_spec {
+    const char         *target_type;
+    unsigned long long  length;          /* in 512 byte sectors */
+    const char         *params;
+    unsigned            flags;           /* e.g. DM_READONLY_FLAG */
+    int                 legacy_geometry; /* set 64 heads/63 sectors for FAT formatting */
+    int                 load_retries;    /* extra DM_TABLE_LOAD attempts, 500ms apart */
+};
+
+typedef void (*dm_device_cb)(const char *name, dev_t dev, const struct dm_ioctl *status,
+                             void *arg);
+typedef void (*dm_stats_cb)(const char *line, void *arg);
+
+__BEGIN_DECLS
+  /*
+   * Creates 'name', optionally sets the legacy geometry, loads the table
+   * and resumes it. The device node path is returned in 'ubuffer'. A
+   * partially set up device is removed again on failure.
+   */
+  int dm_create(const char *name, const struct dm_table_spec *spec, char *ubuffer, size_t len);
+  int dm_remove(const char *name, unsigned flags);
+  int dm_lookup(const char *name, char *ubuffer, size_t len);
+  int dm_get_target_version(const char *target, int *version);
+  /* Calls 'cb' for every mapped device, with its status or NULL */
+  int dm_for_each_device(dm_device_cb cb, void *arg);
+  /* Emits one line of call count and latency per ioctl used so far */
+  void dm_dump_stats(dm_stats_cb cb, void *arg);
+__END_DECLS
+
+#endif
@@ -28,6 +28,7 @@
 #define LOG_TAG "fstrim"
 #include "cutils/log.h"
 #include "hardware_legacy/power.h"
+#include "FsDriver.h"
 
 /* These numbers must match what the MountService specified in
  * frameworks/base/services/java/com/android/server/EventLogTags.logtags
@@ -53,9 +54,7 @@ static unsigned long long get_boot_time_ms(void)
 static void *do_fstrim_filesystems(void *ignored)
 {
     int i;
-    int fd;
     int ret = 0;
-    struct fstrim_range range = { 0 };
     struct stat sb;
     extern struct fstab *fstab;
 
@@ -89,23 +88,9 @@ static void *do_fstrim_filesystems(void *ignored)
             continue;
         }
 
-        fd = open(fstab->recs[i].mount_point, O_RDONLY);
-        if (fd < 0) {
-            SLOGE("Cannot open %s for FITRIM\n", fstab->recs[i].mount_point);
+        if (vold_trimFilesystem(fstab->recs[i].fs_type, fstab->recs[i].mount_point)) {
             ret = -1;
-            continue;
-        }
-
-        memset(&range, 0, sizeof(range));
-        range.len = ULLONG_MAX;
-        SLOGI("Invoking FITRIM ioctl on %s", fstab->recs[i].mount_point);
-        if (ioctl(fd, FITRIM, &range)) {
-            SLOGE("FITRIM ioctl failed on %s", fstab->recs[i].mount_point);
-            ret = -1;
-        } else {
-            SLOGI("Trimmed %llu bytes on %s\n", range.len, fstab->recs[i].mount_point);
         }
-        close(fd);
     }
 
     /* Log the finish time in the event log */
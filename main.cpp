@@ -23,8 +23,12 @@
 
 #include <fcntl.h>
 #include <dirent.h>
+#include <limits.h>
+#include <unistd.h>
 #include <fs_mgr.h>
 
+#include <string>
+
 #define LOG_TAG "Vold"
 
 #include "cutils/klog.h"
@@ -34,13 +38,18 @@
 #include "VolumeManager.h"
 #include "CommandListener.h"
 #include "NetlinkManager.h"
+#include "JobEngine.h"
+#include "UeventCoalescer.h"
 #include "DirectVolume.h"
+#include "WorkerPool.h"
+#include "VoldUtil.h"
 #include "cryptfs.h"
 #include "G3Dev.h"
 #include  "MiscManager.h"
 #include <sysutils/NetlinkEvent.h>
 static int process_config(VolumeManager *vm);
-static void coldboot(const char *path);
+static int coldboot(VolumeManager *vm, const char *path);
+static void log_phase(const char *phase, unsigned long long *since);
 static void rk_parse_resolution();
 #define FSTAB_PREFIX "/fstab."
 struct fstab *fstab;
@@ -50,6 +59,8 @@ int main() {
     VolumeManager *vm;
     CommandListener *cl;
     NetlinkManager *nm;
+    unsigned long long phaseStart = get_monotonic_us();
+    unsigned long long bootStart = phaseStart;
 
     SLOGI("Vold 2.1 (the revenge) firing up");
     rk_parse_resolution();
@@ -78,15 +89,29 @@ int main() {
         SLOGE("Unable to start VolumeManager (%s)", strerror(errno));
         exit(1);
     }
+    log_phase("managers", &phaseStart);
+
+    JobEngine::Instance()->setBroadcaster((SocketListener *) cl);
+    if (JobEngine::Instance()->start()) {
+        SLOGE("Unable to start JobEngine (%s)", strerror(errno));
+        exit(1);
+    }
 
     if (process_config(vm)) {
         SLOGE("Error reading configuration (%s)... continuing anyways", strerror(errno));
     }
+    log_phase("config", &phaseStart);
+
+    if (UeventCoalescer::Instance()->start()) {
+        SLOGE("Unable to start uevent coalescer (%s); handling uevents directly",
+              strerror(errno));
+    }
 
     if (nm->start()) {
         SLOGE("Unable to start NetlinkManager (%s)", strerror(errno));
         exit(1);
     }
+    log_phase("netlink", &phaseStart);
  #ifdef USE_USB_MODE_SWITCH
       SLOGE("Start Misc devices Manager...");
       MiscManager *mm;
@@ -103,16 +128,23 @@ int main() {
 	  g3->handleUsb();
 	  mm->addMisc(g3);
 #endif
-    coldboot("/sys/block");
-//    coldboot("/sys/class/switch");
 
     /*
-     * Now that we're up, we can respond to commands
+     * Now that we're up, we can respond to commands. Volumes still waiting
+     * for their coldboot events simply report their current state until
+     * they broadcast VolumeReady.
      */
     if (cl->startListener()) {
         SLOGE("Unable to start CommandListener (%s)", strerror(errno));
         exit(1);
     }
+    log_phase("listener", &phaseStart);
+
+    int disks = coldboot(vm, "/sys/block");
+    vm->finishColdboot();
+    log_phase("coldboot", &phaseStart);
+    SLOGI("Startup took %llu ms, coldboot replayed %d disks",
+          (get_monotonic_us() - bootStart) / 1000, disks);
 
     // Eventually we'll become the monitoring thread
     while(1) {
@@ -140,49 +172,108 @@ int main() {
 		fclose(fp);
 	}
 }
-static void do_coldboot(DIR *d, int lvl)
+static void log_phase(const char *phase, unsigned long long *since)
 {
-    struct dirent *de;
-    int dfd, fd;
+    unsigned long long now = get_monotonic_us();
 
-    dfd = dirfd(d);
+    SLOGI("Startup phase '%s' took %llu ms", phase, (now - *since) / 1000);
+    *since = now;
+}
 
-    fd = openat(dfd, "uevent", O_WRONLY);
-    if(fd >= 0) {
+static void trigger_add(int dfd, const char *uevent)
+{
+    int fd = openat(dfd, uevent, O_WRONLY);
+    if (fd >= 0) {
         write(fd, "add\n", 4);
         close(fd);
     }
+}
 
-    while((de = readdir(d))) {
-        DIR *d2;
+/*
+ * Replays 'add' for a disk and then for its partitions, which sysfs lists
+ * as subdirectories holding a 'partition' attribute.
+ */
+static int coldboot_disk(const char *path)
+{
+    DIR *d = opendir(path);
+    struct dirent *de;
+    char attr[PATH_MAX];
 
-        if (de->d_name[0] == '.')
-            continue;
+    if (!d) {
+        SLOGW("Unable to open %s for coldboot (%s)", path, strerror(errno));
+        return -1;
+    }
 
-        if (de->d_type != DT_DIR && lvl > 0)
+    int dfd = dirfd(d);
+    trigger_add(dfd, "uevent");
+    while ((de = readdir(d))) {
+        if (de->d_name[0] == '.' || (de->d_type != DT_DIR && de->d_type != DT_UNKNOWN))
             continue;
 
-        fd = openat(dfd, de->d_name, O_RDONLY | O_DIRECTORY);
-        if(fd < 0)
+        snprintf(attr, sizeof(attr), "%s/partition", de->d_name);
+        if (faccessat(dfd, attr, F_OK, 0))
             continue;
-
-        d2 = fdopendir(fd);
-        if(d2 == 0)
-            close(fd);
-        else {
-            do_coldboot(d2, lvl + 1);
-            closedir(d2);
-        }
+        snprintf(attr, sizeof(attr), "%s/uevent", de->d_name);
+        trigger_add(dfd, attr);
     }
+    closedir(d);
+    return 0;
 }
 
-static void coldboot(const char *path)
+class ColdbootTask : public WorkerTask {
+    std::string mPath;
+
+public:
+    ColdbootTask(const char *path) : mPath(path) {}
+
+    int run() {
+        return coldboot_disk(mPath.c_str());
+    }
+};
+
+/*
+ * Replays 'add' only for the disks under 'path' that a volume manages,
+ * one worker per disk; loop, ram, zram and dm nodes are never touched.
+ * Returns the number of disks replayed.
+ */
+static int coldboot(VolumeManager *vm, const char *path)
 {
     DIR *d = opendir(path);
-    if(d) {
-        do_coldboot(d, 0);
-        closedir(d);
+    struct dirent *de;
+    int disks = 0;
+
+    if (!d) {
+        SLOGE("Unable to open %s for coldboot (%s)", path, strerror(errno));
+        return 0;
     }
+
+    WorkerPool pool;
+    while ((de = readdir(d))) {
+        char link[PATH_MAX];
+        char real[PATH_MAX];
+
+        if (de->d_name[0] == '.')
+            continue;
+
+        // Entries are symlinks into /sys/devices; uevent devpaths omit /sys
+        snprintf(link, sizeof(link), "%s/%s", path, de->d_name);
+        if (!realpath(link, real) || strncmp(real, "/sys/", 5))
+            continue;
+
+        Volume *v = vm->lookupVolumeByDevpath(real + 4);
+        if (!v)
+            continue;
+
+        v->setColdbootPending();
+        pool.submit(new ColdbootTask(real));
+        disks++;
+    }
+    closedir(d);
+
+    if (pool.wait()) {
+        SLOGW("Coldboot could not replay every disk");
+    }
+    return disks;
 }
 
 static int process_config(VolumeManager *vm)
@@ -190,7 +281,6 @@ static int process_config(VolumeManager *vm)
     char fstab_filename[PROPERTY_VALUE_MAX + sizeof(FSTAB_PREFIX)];
     char propbuf[PROPERTY_VALUE_MAX];
     int i;
-    int ret = -1;
     int flags;
 
     property_get("ro.hardware", propbuf, "");
@@ -223,17 +313,15 @@ static int process_config(VolumeManager *vm)
             dv = new DirectVolume(vm, &(fstab->recs[i]), flags);
 
             if (dv->addPath(fstab->recs[i].blk_device)) {
-                SLOGE("Failed to add devpath %s to volume %s",
+                SLOGE("Failed to add devpath %s to volume %s, skipping it",
                       fstab->recs[i].blk_device, fstab->recs[i].label);
-                goto out_fail;
+                delete dv;
+                continue;
             }
 
             vm->addVolume(dv);
         }
     }
 
-    ret = 0;
-
-out_fail:
-    return ret;
+    return 0;
 }
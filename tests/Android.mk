@@ -3,12 +3,23 @@ LOCAL_PATH := $(call my-dir)
 include $(CLEAR_VARS)
 
 test_src_files := \
-	VolumeManager_test.cpp
+	VolumeManager_test.cpp \
+	MountTable_test.cpp \
+	WorkerPool_test.cpp \
+	SerialExecutor_test.cpp \
+	UeventCoalescer_test.cpp \
+	DevpathTrie_test.cpp \
+	ContainerRegistry_test.cpp \
+	Fat_test.cpp \
+	CryptfsInplace_test.cpp \
+	CryptfsAlloc_test.cpp
 
 shared_libraries := \
 	liblog \
+	libsysutils \
 	libstlport \
-	libcrypto
+	libcrypto \
+	libz
 
 static_libraries := \
 	libvold \
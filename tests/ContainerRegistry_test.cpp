@@ -0,0 +1,97 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+
+#define LOG_TAG "ContainerRegistry_test"
+#include <utils/Log.h>
+#include "../ContainerRegistry.h"
+
+#include <gtest/gtest.h>
+
+namespace android {
+
+class ContainerRegistryTest : public testing::Test {
+protected:
+    ContainerRegistry registry;
+
+    /* The registry only uses owners as keys, so any distinct pointer will do */
+    Volume *volume(int n) {
+        return reinterpret_cast<Volume *>(0x1000 * n);
+    }
+
+    ContainerRegistry::Container make(const char *id, container_type_t type, Volume *owner) {
+        ContainerRegistry::Container c;
+        c.id = id;
+        c.type = type;
+        c.idHash = std::string(id) + "-hash";
+        c.fileName = std::string("/mnt/secure/asec/") + id + ".asec";
+        c.loopDevice = "/dev/block/loop0";
+        c.mountPoint = std::string("/mnt/asec/") + id;
+        c.owner = owner;
+        return c;
+    }
+};
+
+TEST_F(ContainerRegistryTest, AddLookupRemove) {
+    ContainerRegistry::Container c;
+
+    EXPECT_FALSE(registry.lookup("com.example", &c));
+    EXPECT_EQ(0, registry.add(make("com.example", ASEC, NULL)));
+    ASSERT_TRUE(registry.lookup("com.example", &c));
+    EXPECT_STREQ("com.example-hash", c.idHash.c_str());
+    EXPECT_STREQ("/mnt/asec/com.example", c.mountPoint.c_str());
+
+    EXPECT_EQ(-1, registry.add(make("com.example", ASEC, NULL)))
+            << "Should refuse a duplicate id";
+    EXPECT_EQ(EADDRINUSE, errno);
+
+    EXPECT_EQ(0, registry.remove("com.example"));
+    EXPECT_FALSE(registry.lookup("com.example", NULL));
+    EXPECT_EQ(-1, registry.remove("com.example"));
+    EXPECT_EQ(ENOENT, errno);
+    EXPECT_EQ(0U, registry.size());
+}
+
+TEST_F(ContainerRegistryTest, OwnerIndex) {
+    std::vector<ContainerRegistry::Container> list;
+
+    registry.add(make("a", ASEC, volume(1)));
+    registry.add(make("b", OBB, volume(1)));
+    registry.add(make("c", ASEC, volume(2)));
+    registry.add(make("d", ASEC, NULL));
+
+    registry.listByOwner(volume(1), &list);
+    ASSERT_EQ(2U, list.size());
+    EXPECT_STREQ("a", list[0].id.c_str());
+    EXPECT_STREQ("b", list[1].id.c_str());
+
+    registry.remove("a");
+    list.clear();
+    registry.listByOwner(volume(1), &list);
+    ASSERT_EQ(1U, list.size()) << "Removed containers should leave the owner index";
+    EXPECT_STREQ("b", list[0].id.c_str());
+
+    list.clear();
+    registry.listByOwner(volume(3), &list);
+    EXPECT_EQ(0U, list.size());
+
+    list.clear();
+    registry.listByType(ASEC, &list);
+    EXPECT_EQ(2U, list.size());
+}
+
+}
@@ -0,0 +1,171 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define LOG_TAG "CryptfsAlloc_test"
+#include <utils/Log.h>
+#include <ext4.h>
+#include "../cryptfs_alloc.h"
+
+#include <gtest/gtest.h>
+
+namespace android {
+
+class CryptfsAllocTest : public testing::Test {
+protected:
+    char mImage[64];
+    struct alloc_map mMap;
+
+    virtual void SetUp() {
+        strcpy(mImage, "/data/local/tmp/alloc_img.XXXXXX");
+        int fd = mkstemp(mImage);
+        ASSERT_LE(0, fd);
+        close(fd);
+        memset(&mMap, 0, sizeof(mMap));
+    }
+
+    virtual void TearDown() {
+        alloc_map_free(&mMap);
+        unlink(mImage);
+    }
+
+    void writeAt(off64_t offset, const void *buf, size_t len) {
+        int fd = open(mImage, O_WRONLY);
+        ASSERT_EQ((ssize_t) len, pwrite64(fd, buf, len, offset));
+        close(fd);
+    }
+
+    void setSize(off64_t len) {
+        ASSERT_EQ(0, truncate(mImage, len));
+    }
+
+    static void put16(unsigned char *p, unsigned int v) {
+        p[0] = v;
+        p[1] = v >> 8;
+    }
+
+    // A single group ext4 with 4K blocks: descriptors in block 1, bitmaps
+    // in 2 and 3, and a two block inode table at 4.
+    void makeExt4(unsigned int flags, const unsigned char *bitmap) {
+        struct ext4_super_block sb;
+        struct ext4_group_desc gd;
+
+        setSize(64 * 4096);
+        memset(&sb, 0, sizeof(sb));
+        sb.s_blocks_count_lo = 64;
+        sb.s_first_data_block = 0;
+        sb.s_log_block_size = 2;
+        sb.s_blocks_per_group = 32768;
+        sb.s_inodes_per_group = 32;
+        sb.s_inode_size = 256;
+        sb.s_magic = EXT4_SUPER_MAGIC;
+        writeAt(1024, &sb, sizeof(sb));
+
+        memset(&gd, 0, sizeof(gd));
+        gd.bg_block_bitmap_lo = 2;
+        gd.bg_inode_bitmap_lo = 3;
+        gd.bg_inode_table_lo = 4;
+        gd.bg_flags = flags;
+        writeAt(4096, &gd, EXT4_MIN_DESC_SIZE);
+        writeAt(2 * 4096, bitmap, 4096);
+    }
+};
+
+TEST_F(CryptfsAllocTest, Ext4FollowsBlockBitmap) {
+    unsigned char bitmap[4096];
+
+    memset(bitmap, 0, sizeof(bitmap));
+    bitmap[0] = 0x3f;    // blocks 0-5: metadata
+    bitmap[2] = 0x70;    // blocks 20-22: a file
+    makeExt4(0, bitmap);
+
+    ASSERT_EQ(0, alloc_map_build(mImage, &mMap));
+    ASSERT_EQ(2, mMap.count);
+    EXPECT_EQ(0, mMap.extents[0].start);
+    EXPECT_EQ(6 * 8, mMap.extents[0].count);
+    EXPECT_EQ(20 * 8, mMap.extents[1].start);
+    EXPECT_EQ(3 * 8, mMap.extents[1].count);
+    EXPECT_EQ(9 * 8, mMap.sectors);
+}
+
+TEST_F(CryptfsAllocTest, Ext4UninitGroupKeepsOnlyMetadata) {
+    unsigned char bitmap[4096];
+
+    // An uninitialised bitmap must not be trusted
+    memset(bitmap, 0xff, sizeof(bitmap));
+    makeExt4(EXT4_BG_BLOCK_UNINIT, bitmap);
+
+    ASSERT_EQ(0, alloc_map_build(mImage, &mMap));
+    ASSERT_EQ(1, mMap.count);
+    EXPECT_EQ(0, mMap.extents[0].start);
+    EXPECT_EQ(6 * 8, mMap.extents[0].count);
+}
+
+TEST_F(CryptfsAllocTest, Fat16FollowsFat) {
+    unsigned char bs[512];
+    unsigned char fat[20 * 512];
+
+    // 1 reserved sector, 2 FATs of 20 sectors, 32 root dir sectors and
+    // 4 sector clusters, so data starts at sector 73
+    memset(bs, 0, sizeof(bs));
+    put16(bs + 11, 512);
+    bs[13] = 4;
+    put16(bs + 14, 1);
+    bs[16] = 2;
+    put16(bs + 17, 512);
+    put16(bs + 19, 20000);
+    put16(bs + 22, 20);
+    memcpy(bs + 54, "FAT16   ", 8);
+    bs[510] = 0x55;
+    bs[511] = 0xaa;
+
+    memset(fat, 0, sizeof(fat));
+    put16(fat + 0, 0xfff8);
+    put16(fat + 2, 0xffff);
+    put16(fat + 2 * 2, 3);          // a two cluster chain
+    put16(fat + 3 * 2, 0xffff);
+    put16(fat + 10 * 2, 0xfff7);    // bad, never read
+    put16(fat + 100 * 2, 0xffff);
+
+    setSize(20000 * 512);
+    writeAt(0, bs, sizeof(bs));
+    writeAt(512, fat, sizeof(fat));
+
+    ASSERT_EQ(0, alloc_map_build(mImage, &mMap));
+    ASSERT_EQ(2, mMap.count);
+    // Metadata and clusters 2-3 merge, rounded out to 4K
+    EXPECT_EQ(0, mMap.extents[0].start);
+    EXPECT_EQ(88, mMap.extents[0].count);
+    // Cluster 100 starts at sector 73 + 98 * 4
+    EXPECT_EQ(464, mMap.extents[1].start);
+    EXPECT_EQ(8, mMap.extents[1].count);
+    EXPECT_EQ(96, mMap.sectors);
+}
+
+TEST_F(CryptfsAllocTest, RejectsUnknownFilesystem) {
+    setSize(1024 * 1024);
+
+    EXPECT_EQ(-1, alloc_map_build(mImage, &mMap));
+    EXPECT_EQ(EINVAL, errno);
+    EXPECT_EQ(NULL, mMap.extents);
+}
+
+}
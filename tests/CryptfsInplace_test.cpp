@@ -0,0 +1,382 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <vector>
+
+#define LOG_TAG "CryptfsInplace_test"
+#include <utils/Log.h>
+#include "../cryptfs_inplace.h"
+
+#include <gtest/gtest.h>
+
+namespace android {
+
+class CryptfsInplaceTest : public testing::Test {
+protected:
+    char mSrc[64];
+    char mDst[64];
+
+    virtual void SetUp() {
+        strcpy(mSrc, "/data/local/tmp/inplace_src.XXXXXX");
+        strcpy(mDst, "/data/local/tmp/inplace_dst.XXXXXX");
+        int fd = mkstemp(mSrc);
+        ASSERT_LE(0, fd);
+        close(fd);
+        fd = mkstemp(mDst);
+        ASSERT_LE(0, fd);
+        close(fd);
+    }
+
+    virtual void TearDown() {
+        unlink(mSrc);
+        unlink(mDst);
+    }
+
+    void fill(const char *path, size_t len) {
+        char *buf = (char *) malloc(len);
+        for (size_t i = 0; i < len; i++) {
+            buf[i] = (char) (i * 7 + i / 4096);
+        }
+        int fd = open(path, O_WRONLY | O_TRUNC);
+        ASSERT_EQ((ssize_t) len, write(fd, buf, len));
+        close(fd);
+        free(buf);
+    }
+
+    void readAll(const char *path, char *buf, size_t len) {
+        int fd = open(path, O_RDONLY);
+        ASSERT_EQ((ssize_t) len, read(fd, buf, len));
+        close(fd);
+    }
+
+    void writeAll(const char *path, const char *buf, size_t len) {
+        int fd = open(path, O_WRONLY);
+        ASSERT_EQ((ssize_t) len, write(fd, buf, len));
+        close(fd);
+    }
+
+    void clear(const char *path, size_t len) {
+        std::vector<char> zero(len);
+        writeAll(path, &zero[0], len);
+    }
+
+    bool same(size_t len) {
+        char *a = (char *) malloc(len);
+        char *b = (char *) malloc(len);
+        int fa = open(mSrc, O_RDONLY);
+        int fb = open(mDst, O_RDONLY);
+        bool eq = read(fa, a, len) == (ssize_t) len &&
+                  read(fb, b, len) == (ssize_t) len &&
+                  !memcmp(a, b, len);
+        close(fa);
+        close(fb);
+        free(a);
+        free(b);
+        return eq;
+    }
+};
+
+static void recordProgress(off64_t sectors_done, void *arg) {
+    *(off64_t *) arg = sectors_done;
+}
+
+TEST_F(CryptfsInplaceTest, CopiesAcrossRingAndTail) {
+    // Several ring turns, a short last buffer and an unaligned tail
+    size_t len = (INPLACE_RING_SIZE * 2 + 1) * INPLACE_BUFSIZE + 4096 * 3 + 512 * 5;
+    off64_t done = -1;
+
+    fill(mSrc, len);
+
+    struct inplace_copy_params params;
+    memset(&params, 0, sizeof(params));
+    params.real_blkdev = mSrc;
+    params.crypto_blkdev = mDst;
+    params.size = len / 512;
+    params.progress = recordProgress;
+    params.arg = &done;
+
+    ASSERT_EQ(0, inplace_copy(&params));
+    EXPECT_EQ((off64_t) (len / 512), done)
+            << "Completion should be reported once everything is written";
+    EXPECT_TRUE(same(len));
+}
+
+TEST_F(CryptfsInplaceTest, CopiesOnlyExtents) {
+    size_t len = 2 * INPLACE_BUFSIZE + 512 * 3;
+    off64_t done = -1;
+
+    fill(mSrc, len);
+    char *zero = (char *) calloc(len, 1);
+    int fd = open(mDst, O_WRONLY);
+    ASSERT_EQ((ssize_t) len, write(fd, zero, len));
+    close(fd);
+    free(zero);
+
+    // The second run is rounded out to 4K, the last one is in the tail
+    struct inplace_extent extents[] = {
+        { 8, 8 }, { 100, 3 }, { (off64_t) len / 512 - 1, 1 },
+    };
+    struct inplace_copy_params params;
+    memset(&params, 0, sizeof(params));
+    params.real_blkdev = mSrc;
+    params.crypto_blkdev = mDst;
+    params.size = len / 512;
+    params.extents = extents;
+    params.num_extents = 3;
+    params.progress = recordProgress;
+    params.arg = &done;
+
+    ASSERT_EQ(0, inplace_copy(&params));
+    EXPECT_EQ(8 + 8 + 3, done);
+
+    char *src = (char *) malloc(len);
+    char *dst = (char *) malloc(len);
+    int fs = open(mSrc, O_RDONLY);
+    int fdst = open(mDst, O_RDONLY);
+    ASSERT_EQ((ssize_t) len, read(fs, src, len));
+    ASSERT_EQ((ssize_t) len, read(fdst, dst, len));
+    close(fs);
+    close(fdst);
+
+    for (size_t sector = 0; sector < len / 512; sector++) {
+        bool copied = (sector >= 8 && sector < 16) || (sector >= 96 && sector < 104) ||
+                      sector >= len / 512 - 3;
+        char expect[512];
+        if (copied) {
+            memcpy(expect, src + sector * 512, 512);
+        } else {
+            memset(expect, 0, 512);
+        }
+        ASSERT_EQ(0, memcmp(expect, dst + sector * 512, 512)) << "sector " << sector;
+    }
+    free(src);
+    free(dst);
+}
+
+static std::vector<inplace_hotzone> sCheckpoints;
+
+static int recordCheckpoint(const struct inplace_hotzone *hz, void *) {
+    sCheckpoints.push_back(*hz);
+    return 0;
+}
+
+TEST_F(CryptfsInplaceTest, ChecksumsEachIntervalBeforeWritingIt) {
+    size_t len = 5 * INPLACE_BUFSIZE + 512 * 3;
+    std::vector<char> src(len);
+
+    fill(mSrc, len);
+    readAll(mSrc, &src[0], len);
+    sCheckpoints.clear();
+
+    struct inplace_copy_params params;
+    memset(&params, 0, sizeof(params));
+    params.real_blkdev = mSrc;
+    params.crypto_blkdev = mDst;
+    params.size = len / 512;
+    params.checkpoint = recordCheckpoint;
+    params.max_hotzone_sums = 2 * INPLACE_BUFSIZE / INPLACE_UNIT_SIZE;
+
+    ASSERT_EQ(0, inplace_copy(&params));
+    EXPECT_TRUE(same(len));
+
+    // Two buffers' worth of units per interval, then the unaligned tail
+    ASSERT_EQ(4U, sCheckpoints.size());
+    for (size_t i = 0; i < 3; i++) {
+        const inplace_hotzone &hz = sCheckpoints[i];
+        off64_t first = i * 2 * INPLACE_BUFSIZE / 512;
+        off64_t bytes = (i < 2 ? 2 : 1) * INPLACE_BUFSIZE;
+
+        EXPECT_EQ(first, hz.done);
+        ASSERT_EQ(1, hz.count);
+        EXPECT_EQ(first, hz.chunks[0].start);
+        EXPECT_EQ(bytes / 512, hz.chunks[0].count);
+        ASSERT_EQ(bytes / INPLACE_UNIT_SIZE, hz.num_sums);
+        for (int u = 0; u < hz.num_sums; u++) {
+            EXPECT_EQ(crc32(0, (const Bytef *) &src[first * 512 + u * INPLACE_UNIT_SIZE],
+                            INPLACE_UNIT_SIZE), hz.sums[u]) << "unit " << u;
+        }
+    }
+    const inplace_hotzone &tail = sCheckpoints[3];
+    EXPECT_EQ(5 * INPLACE_BUFSIZE / 512, tail.done);
+    ASSERT_EQ(1, tail.count);
+    EXPECT_EQ(3, tail.chunks[0].count);
+    ASSERT_EQ(1, tail.num_sums);
+    EXPECT_EQ(crc32(0, (const Bytef *) &src[5 * INPLACE_BUFSIZE], 512 * 3), tail.sums[0]);
+}
+
+TEST_F(CryptfsInplaceTest, IntervalEndsAfterMaxChunks) {
+    size_t len = 2 * INPLACE_BUFSIZE;
+
+    fill(mSrc, len);
+    clear(mDst, len);
+    sCheckpoints.clear();
+
+    // Runs that don't meet, each one unit
+    struct inplace_extent extents[INPLACE_HOTZONE_CHUNKS + 2];
+    for (int i = 0; i < INPLACE_HOTZONE_CHUNKS + 2; i++) {
+        extents[i].start = i * 2 * INPLACE_UNIT_SIZE / 512;
+        extents[i].count = INPLACE_UNIT_SIZE / 512;
+    }
+    struct inplace_copy_params params;
+    memset(&params, 0, sizeof(params));
+    params.real_blkdev = mSrc;
+    params.crypto_blkdev = mDst;
+    params.size = len / 512;
+    params.extents = extents;
+    params.num_extents = INPLACE_HOTZONE_CHUNKS + 2;
+    params.checkpoint = recordCheckpoint;
+    params.max_hotzone_sums = INPLACE_HOTZONE_SUMS;
+
+    ASSERT_EQ(0, inplace_copy(&params));
+    ASSERT_EQ(2U, sCheckpoints.size());
+    EXPECT_EQ(INPLACE_HOTZONE_CHUNKS, sCheckpoints[0].count);
+    EXPECT_EQ(INPLACE_HOTZONE_CHUNKS, sCheckpoints[0].num_sums);
+    EXPECT_EQ(extents[INPLACE_HOTZONE_CHUNKS].start, sCheckpoints[1].done);
+    EXPECT_EQ(2, sCheckpoints[1].count);
+    EXPECT_EQ(2, sCheckpoints[1].num_sums);
+}
+
+static int failCheckpoint(const struct inplace_hotzone *, void *) {
+    errno = EIO;
+    return -1;
+}
+
+TEST_F(CryptfsInplaceTest, FailedCheckpointWritesNothing) {
+    size_t len = 2 * INPLACE_BUFSIZE;
+
+    fill(mSrc, len);
+    clear(mDst, len);
+
+    struct inplace_copy_params params;
+    memset(&params, 0, sizeof(params));
+    params.real_blkdev = mSrc;
+    params.crypto_blkdev = mDst;
+    params.size = len / 512;
+    params.checkpoint = failCheckpoint;
+    params.max_hotzone_sums = INPLACE_HOTZONE_SUMS;
+
+    EXPECT_EQ(-1, inplace_copy(&params));
+    EXPECT_EQ(EIO, errno);
+
+    std::vector<char> dst(len);
+    readAll(mDst, &dst[0], len);
+    for (size_t i = 0; i < len; i++) {
+        ASSERT_EQ(0, dst[i]) << "byte " << i;
+    }
+}
+
+TEST_F(CryptfsInplaceTest, ResumeSkipsBlocksAlreadyWritten) {
+    size_t len = 3 * INPLACE_BUFSIZE;
+    size_t units = INPLACE_BUFSIZE / INPLACE_UNIT_SIZE;
+    std::vector<char> plain(len);
+
+    fill(mSrc, len);
+    clear(mDst, len);
+    readAll(mSrc, &plain[0], len);
+
+    // The second megabyte was the interrupted interval
+    static struct inplace_hotzone hz;
+    memset(&hz, 0, sizeof(hz));
+    hz.done = INPLACE_BUFSIZE / 512;
+    hz.count = 1;
+    hz.chunks[0].start = INPLACE_BUFSIZE / 512;
+    hz.chunks[0].count = INPLACE_BUFSIZE / 512;
+    hz.num_sums = units;
+    for (size_t u = 0; u < units; u++) {
+        hz.sums[u] = crc32(0, (const Bytef *) &plain[INPLACE_BUFSIZE + u * INPLACE_UNIT_SIZE],
+                           INPLACE_UNIT_SIZE);
+    }
+
+    /*
+     * Stand in for dm-crypt: an encrypted block holds its plaintext with
+     * every byte flipped, and reads back as the plaintext through the
+     * crypto device. Every third unit reached the disk, the one after it
+     * did not, and the odd blocks of the next one did.
+     */
+    std::vector<char> real(plain);
+    std::vector<char> crypto(len);
+    int written = 0;
+    for (size_t u = 0; u < units; u++) {
+        if (u % 3 != 1) {
+            written++;
+        }
+        for (size_t b = 0; b < INPLACE_UNIT_BLOCKS; b++) {
+            size_t off = INPLACE_BUFSIZE + u * INPLACE_UNIT_SIZE + b * INPLACE_BLOCK_SIZE;
+            if (u % 3 == 0 || (u % 3 == 2 && b % 2)) {
+                for (size_t i = 0; i < INPLACE_BLOCK_SIZE; i++) {
+                    real[off + i] ^= 0x5a;
+                }
+                memcpy(&crypto[off], &plain[off], INPLACE_BLOCK_SIZE);
+            }
+        }
+    }
+    writeAll(mSrc, &real[0], len);
+    writeAll(mDst, &crypto[0], len);
+    EXPECT_EQ(written, inplace_hotzone_written(mSrc, &hz));
+
+    struct inplace_copy_params params;
+    memset(&params, 0, sizeof(params));
+    params.real_blkdev = mSrc;
+    params.crypto_blkdev = mDst;
+    params.size = len / 512;
+    params.start = 2 * INPLACE_BUFSIZE / 512;
+    params.resume = &hz;
+
+    ASSERT_EQ(0, inplace_copy(&params));
+
+    // Only blocks still in plaintext were encrypted again
+    std::vector<char> dst(len);
+    readAll(mDst, &dst[0], len);
+    std::vector<char> zero(INPLACE_BLOCK_SIZE);
+    for (size_t b = 0; b < len / INPLACE_BLOCK_SIZE; b++) {
+        size_t off = b * INPLACE_BLOCK_SIZE;
+        const char *expect = off >= INPLACE_BUFSIZE ? &plain[off] : &zero[0];
+        ASSERT_EQ(0, memcmp(expect, &dst[off], INPLACE_BLOCK_SIZE)) << "block " << b;
+    }
+}
+
+TEST_F(CryptfsInplaceTest, FailsOnShortSource) {
+    fill(mSrc, INPLACE_BUFSIZE);
+
+    struct inplace_copy_params params;
+    memset(&params, 0, sizeof(params));
+    params.real_blkdev = mSrc;
+    params.crypto_blkdev = mDst;
+    params.size = 4 * INPLACE_BUFSIZE / 512;
+
+    EXPECT_EQ(-1, inplace_copy(&params));
+    EXPECT_EQ(EIO, errno);
+}
+
+TEST_F(CryptfsInplaceTest, FailsOnMissingDevice) {
+    struct inplace_copy_params params;
+    memset(&params, 0, sizeof(params));
+    params.real_blkdev = "/dev/block/vold/does-not-exist";
+    params.crypto_blkdev = mDst;
+    params.size = 8;
+
+    EXPECT_EQ(-1, inplace_copy(&params));
+    EXPECT_EQ(ENOENT, errno);
+}
+
+}
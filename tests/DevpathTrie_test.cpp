@@ -0,0 +1,92 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+
+#define LOG_TAG "DevpathTrie_test"
+#include <utils/Log.h>
+#include "../DevpathTrie.h"
+
+#include <gtest/gtest.h>
+
+namespace android {
+
+#define SDCARD "/devices/platform/rk29_sdmmc.0/mmc_host/mmc0"
+#define USB    "/devices/platform/usb20_host/usb2"
+
+// Never dereferenced; the trie only hands them back
+static Volume *const kSdcard = reinterpret_cast<Volume *>(0x1000);
+static Volume *const kUsb    = reinterpret_cast<Volume *>(0x2000);
+static Volume *const kInner  = reinterpret_cast<Volume *>(0x3000);
+
+TEST(DevpathTrieTest, RoutesByPrefix) {
+    DevpathTrie trie;
+
+    ASSERT_EQ(0, trie.insert(SDCARD, kSdcard));
+    ASSERT_EQ(0, trie.insert(USB, kUsb));
+    EXPECT_EQ(2, trie.size());
+
+    EXPECT_EQ(kSdcard, trie.lookup(SDCARD "/mmc0:0001/block/mmcblk0/mmcblk0p1"));
+    EXPECT_EQ(kUsb, trie.lookup(USB "/2-1/2-1:1.0/host0/target0:0:0/0:0:0:0/block/sda"));
+    EXPECT_EQ(kSdcard, trie.lookup(SDCARD))
+            << "A registered path should own itself";
+}
+
+TEST(DevpathTrieTest, DropsUnmanaged) {
+    DevpathTrie trie;
+
+    ASSERT_EQ(0, trie.insert(SDCARD, kSdcard));
+
+    EXPECT_EQ(NULL, trie.lookup("/devices/virtual/block/loop12"));
+    EXPECT_EQ(NULL, trie.lookup("/devices/virtual/block/dm-3"));
+    EXPECT_EQ(NULL, trie.lookup("/devices/platform/rk29_sdmmc.1/mmc_host/mmc1"))
+            << "A sibling that shares part of the path isn't ours";
+    EXPECT_EQ(NULL, trie.lookup("/devices/platform"))
+            << "A parent of a registered path isn't ours";
+}
+
+TEST(DevpathTrieTest, LongestPrefixWins) {
+    DevpathTrie trie;
+
+    ASSERT_EQ(0, trie.insert(USB, kUsb));
+    ASSERT_EQ(0, trie.insert(USB "/2-1", kInner));
+
+    EXPECT_EQ(kInner, trie.lookup(USB "/2-1/block/sda"));
+    EXPECT_EQ(kUsb, trie.lookup(USB "/2-2/block/sdb"));
+}
+
+TEST(DevpathTrieTest, InsertAndRemove) {
+    DevpathTrie trie;
+
+    ASSERT_EQ(0, trie.insert(SDCARD, kSdcard));
+    EXPECT_EQ(0, trie.insert(SDCARD, kSdcard))
+            << "Registering the same owner again should succeed";
+    EXPECT_EQ(-1, trie.insert(SDCARD, kUsb));
+    EXPECT_EQ(EEXIST, errno);
+    EXPECT_EQ(1, trie.size());
+
+    EXPECT_EQ(0, trie.remove(SDCARD));
+    EXPECT_EQ(NULL, trie.lookup(SDCARD "/mmc0:0001/block/mmcblk0"));
+    EXPECT_EQ(-1, trie.remove(SDCARD));
+    EXPECT_EQ(ENOENT, errno);
+    EXPECT_EQ(0, trie.size());
+
+    // Encrypted volumes move to their dm device
+    ASSERT_EQ(0, trie.insert("/devices/virtual/block/dm-1", kSdcard));
+    EXPECT_EQ(kSdcard, trie.lookup("/devices/virtual/block/dm-1"));
+}
+
+}
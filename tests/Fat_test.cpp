@@ -0,0 +1,124 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+
+#define LOG_TAG "Fat_test"
+#include <utils/Log.h>
+#include "../Fat.h"
+
+#include <gtest/gtest.h>
+
+namespace android {
+
+class FatTest : public testing::Test {
+protected:
+    unsigned char boot[512];
+    unsigned char fat[8];
+
+    virtual void SetUp() {
+        memset(boot, 0, sizeof(boot));
+        memset(fat, 0, sizeof(fat));
+        boot[510] = 0x55;
+        boot[511] = 0xaa;
+    }
+
+    void put16(unsigned char *p, unsigned int v) {
+        p[0] = v & 0xff;
+        p[1] = (v >> 8) & 0xff;
+    }
+
+    void put32(unsigned char *p, unsigned int v) {
+        put16(p, v & 0xffff);
+        put16(p + 2, v >> 16);
+    }
+
+    /* 8 GB with 32 KB clusters, as newfs_msdos lays out an SD card */
+    void makeFat32() {
+        put16(boot + 0x0b, 512);
+        boot[0x0d] = 64;
+        put16(boot + 0x0e, 32);
+        boot[0x10] = 2;
+        put32(boot + 0x20, 16777216);
+        put32(boot + 0x24, 2048);
+        put32(fat, 0x0ffffff8);
+        put32(fat + 4, 0x0fffffff);
+    }
+
+    /* 128 MB with 2 KB clusters */
+    void makeFat16() {
+        put16(boot + 0x0b, 512);
+        boot[0x0d] = 4;
+        put16(boot + 0x0e, 1);
+        boot[0x10] = 2;
+        put16(boot + 0x11, 512);
+        put32(boot + 0x20, 262144);
+        put16(boot + 0x16, 256);
+        put16(fat, 0xfff8);
+        put16(fat + 2, 0xffff);
+    }
+};
+
+TEST_F(FatTest, Fat32States) {
+    makeFat32();
+    EXPECT_EQ(32 * 512, Fat::getFatOffset(boot));
+    EXPECT_EQ(Fat::STATE_CLEAN, Fat::parseCleanState(boot, fat));
+
+    put32(fat + 4, 0x0fffffff & ~0x08000000);
+    EXPECT_EQ(Fat::STATE_DIRTY, Fat::parseCleanState(boot, fat))
+            << "Clean shutdown bit clear should be dirty";
+
+    put32(fat + 4, 0x0fffffff & ~0x04000000);
+    EXPECT_EQ(Fat::STATE_DIRTY, Fat::parseCleanState(boot, fat))
+            << "Hard error bit clear should be dirty";
+
+    put32(fat + 4, 0x0fffffff);
+    boot[0x41] = 0x01;
+    EXPECT_EQ(Fat::STATE_DIRTY, Fat::parseCleanState(boot, fat))
+            << "Volume state dirty flag should be dirty";
+}
+
+TEST_F(FatTest, Fat16States) {
+    makeFat16();
+    EXPECT_EQ(512, Fat::getFatOffset(boot));
+    EXPECT_EQ(Fat::STATE_CLEAN, Fat::parseCleanState(boot, fat));
+
+    put16(fat + 2, 0x7fff);
+    EXPECT_EQ(Fat::STATE_DIRTY, Fat::parseCleanState(boot, fat));
+
+    put16(fat + 2, 0xffff);
+    boot[0x25] = 0x01;
+    EXPECT_EQ(Fat::STATE_DIRTY, Fat::parseCleanState(boot, fat));
+}
+
+TEST_F(FatTest, UnknownStates) {
+    makeFat16();
+    put32(boot + 0x20, 16384);
+    EXPECT_EQ(Fat::STATE_UNKNOWN, Fat::parseCleanState(boot, fat))
+            << "FAT12 keeps no clean flags";
+
+    makeFat32();
+    boot[511] = 0;
+    EXPECT_EQ(-1, Fat::getFatOffset(boot)) << "Missing signature is not FAT";
+    EXPECT_EQ(Fat::STATE_UNKNOWN, Fat::parseCleanState(boot, fat));
+
+    boot[511] = 0xaa;
+    put16(boot + 0x0b, 300);
+    EXPECT_EQ(Fat::STATE_UNKNOWN, Fat::parseCleanState(boot, fat))
+            << "Bad sector size is not FAT";
+}
+
+}
@@ -0,0 +1,69 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <string.h>
+
+#include <linux/kdev_t.h>
+
+#define LOG_TAG "MountTable_test"
+#include <utils/Log.h>
+#include "../MountTable.h"
+
+#include <gtest/gtest.h>
+
+namespace android {
+
+class MountTableTest : public testing::Test {
+protected:
+    virtual void SetUp() {
+    }
+
+    virtual void TearDown() {
+    }
+};
+
+TEST_F(MountTableTest, ParseLineTests) {
+    MountTable::Mount m;
+    char line[256];
+
+    strcpy(line, "36 35 179:33 / /mnt/external_sd rw,nosuid master:1 - vfat /dev/block/vold/179:33 rw");
+    EXPECT_EQ(0, MountTable::parseLine(line, &m))
+            << "Should parse a line with optional fields";
+    EXPECT_STREQ("/mnt/external_sd", m.mountPoint.c_str());
+    EXPECT_STREQ("/dev/block/vold/179:33", m.source.c_str());
+    EXPECT_STREQ("vfat", m.fsType.c_str());
+    EXPECT_EQ((dev_t) MKDEV(179, 33), m.device);
+
+    strcpy(line, "40 20 7:0 / /mnt/obb/abc ro - vfat /dev/block/loop0 ro");
+    EXPECT_EQ(0, MountTable::parseLine(line, &m))
+            << "Should parse a line without optional fields";
+    EXPECT_STREQ("/mnt/obb/abc", m.mountPoint.c_str());
+    EXPECT_EQ((dev_t) MKDEV(7, 0), m.device);
+
+    strcpy(line, "41 20 0:30 / /mnt/with\\040space rw - tmpfs tmpfs rw");
+    EXPECT_EQ(0, MountTable::parseLine(line, &m))
+            << "Should parse a line with an escaped mountpoint";
+    EXPECT_STREQ("/mnt/with space", m.mountPoint.c_str())
+            << "Octal escapes should be decoded";
+
+    strcpy(line, "42 20 0:31 / /mnt/broken rw");
+    EXPECT_EQ(-1, MountTable::parseLine(line, &m))
+            << "Should reject a line without the separator";
+    EXPECT_EQ(EINVAL, errno);
+}
+
+}
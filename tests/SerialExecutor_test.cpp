@@ -0,0 +1,108 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+
+#include <vector>
+
+#define LOG_TAG "SerialExecutor_test"
+#include <utils/Log.h>
+#include "../SerialExecutor.h"
+
+#include <gtest/gtest.h>
+
+namespace android {
+
+class RecordingTask : public WorkerTask {
+    SerialExecutor   *mExecutor;
+    std::vector<int> *mOrder;
+    int               mValue;
+
+public:
+    RecordingTask(SerialExecutor *executor, std::vector<int> *order, int value)
+            : mExecutor(executor), mOrder(order), mValue(value) {}
+
+    int run() {
+        // Only the executor thread touches 'order', so no lock is needed
+        mOrder->push_back(mValue);
+        if (!mExecutor->isCurrentThread()) {
+            errno = EPERM;
+            return -1;
+        }
+        return 0;
+    }
+};
+
+class FailingTask : public WorkerTask {
+public:
+    int run() {
+        errno = EBUSY;
+        return -2;
+    }
+};
+
+class NestedTask : public WorkerTask {
+    SerialExecutor *mExecutor;
+    int            *mResult;
+
+public:
+    NestedTask(SerialExecutor *executor, int *result) : mExecutor(executor), mResult(result) {}
+
+    int run() {
+        // Would deadlock if call() didn't run inline on its own thread
+        *mResult = mExecutor->call(new FailingTask());
+        return 0;
+    }
+};
+
+TEST(SerialExecutorTest, RunsInOrderOnItsThread) {
+    SerialExecutor executor("test");
+    std::vector<int> order;
+
+    EXPECT_FALSE(executor.isCurrentThread());
+    for (int i = 0; i < 50; i++) {
+        executor.post(new RecordingTask(&executor, &order, i));
+    }
+    EXPECT_EQ(0, executor.call(new RecordingTask(&executor, &order, 50)))
+            << "Tasks should run on the executor thread";
+
+    ASSERT_EQ(51U, order.size())
+            << "call() should wait for everything posted before it";
+    for (int i = 0; i <= 50; i++) {
+        EXPECT_EQ(i, order[i]);
+    }
+}
+
+TEST(SerialExecutorTest, PropagatesResult) {
+    SerialExecutor executor("test");
+
+    errno = 0;
+    EXPECT_EQ(-2, executor.call(new FailingTask()))
+            << "call() should return what run() returned";
+    EXPECT_EQ(EBUSY, errno)
+            << "call() should carry errno back to the caller";
+}
+
+TEST(SerialExecutorTest, NestedCallRunsInline) {
+    SerialExecutor executor("test");
+    int result = 0;
+
+    EXPECT_EQ(0, executor.call(new NestedTask(&executor, &result)));
+    EXPECT_EQ(-2, result);
+}
+
+}
@@ -0,0 +1,111 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <sysutils/NetlinkEvent.h>
+
+#define LOG_TAG "UeventCoalescer_test"
+#include <utils/Log.h>
+#include "../UeventCoalescer.h"
+
+#include <gtest/gtest.h>
+
+namespace android {
+
+#define DISK "/devices/platform/rk29_sdmmc.0/mmc_host/mmc0/mmc0:0001/block/mmcblk0"
+
+class UeventCoalescerTest : public testing::Test {
+protected:
+    std::vector<BlockEvent> mEvents;
+
+    void add(int action, const char *devpath, BlockEvent::Type type,
+             int nparts = -1, int partn = -1) {
+        BlockEvent u;
+        u.action = action;
+        u.devpath = devpath;
+        u.type = type;
+        u.major = 179;
+        u.minor = partn > 0 ? partn : 0;
+        u.nparts = nparts;
+        u.partn = partn;
+        mEvents.push_back(u);
+    }
+};
+
+TEST_F(UeventCoalescerTest, DiskPathOfPartition) {
+    add(NetlinkEvent::NlActionAdd, DISK "/mmcblk0p1", BlockEvent::Type_Partition, -1, 1);
+    add(NetlinkEvent::NlActionAdd, DISK, BlockEvent::Type_Disk, 1);
+
+    EXPECT_EQ(std::string(DISK), mEvents[0].diskPath())
+            << "A partition should belong to its parent disk";
+    EXPECT_EQ(std::string(DISK), mEvents[1].diskPath());
+}
+
+TEST_F(UeventCoalescerTest, InsertIsFoldedIntoAdds) {
+    add(NetlinkEvent::NlActionAdd, DISK, BlockEvent::Type_Disk, 0);
+    add(NetlinkEvent::NlActionAdd, DISK "/mmcblk0p1", BlockEvent::Type_Partition, -1, 1);
+    add(NetlinkEvent::NlActionAdd, DISK "/mmcblk0p2", BlockEvent::Type_Partition, -1, 2);
+    add(NetlinkEvent::NlActionChange, DISK, BlockEvent::Type_Disk, 2);
+
+    EXPECT_EQ(1, UeventCoalescer::coalesce(&mEvents))
+            << "The change should be folded into the disk add";
+    ASSERT_EQ(3U, mEvents.size());
+    EXPECT_EQ(NetlinkEvent::NlActionAdd, mEvents[0].action);
+    EXPECT_EQ(2, mEvents[0].nparts)
+            << "The disk add should carry the final partition count";
+    EXPECT_EQ(1, mEvents[1].partn);
+    EXPECT_EQ(2, mEvents[2].partn);
+}
+
+TEST_F(UeventCoalescerTest, FlappingReaderCancelsOut) {
+    for (int i = 0; i < 3; i++) {
+        add(NetlinkEvent::NlActionAdd, DISK, BlockEvent::Type_Disk, 1);
+        add(NetlinkEvent::NlActionAdd, DISK "/mmcblk0p1", BlockEvent::Type_Partition, -1, 1);
+        add(NetlinkEvent::NlActionRemove, DISK "/mmcblk0p1", BlockEvent::Type_Partition, -1, 1);
+        add(NetlinkEvent::NlActionRemove, DISK, BlockEvent::Type_Disk);
+    }
+    add(NetlinkEvent::NlActionAdd, DISK, BlockEvent::Type_Disk, 1);
+    add(NetlinkEvent::NlActionAdd, DISK "/mmcblk0p1", BlockEvent::Type_Partition, -1, 1);
+
+    EXPECT_EQ(12, UeventCoalescer::coalesce(&mEvents))
+            << "Every add/remove pair should be suppressed";
+    ASSERT_EQ(2U, mEvents.size());
+    EXPECT_EQ(NetlinkEvent::NlActionAdd, mEvents[0].action);
+    EXPECT_TRUE(mEvents[0].isDisk());
+    EXPECT_EQ(NetlinkEvent::NlActionAdd, mEvents[1].action);
+}
+
+TEST_F(UeventCoalescerTest, RemoveThenAddIsKept) {
+    add(NetlinkEvent::NlActionRemove, DISK "/mmcblk0p1", BlockEvent::Type_Partition, -1, 1);
+    add(NetlinkEvent::NlActionRemove, DISK, BlockEvent::Type_Disk);
+    add(NetlinkEvent::NlActionAdd, DISK, BlockEvent::Type_Disk, 1);
+    add(NetlinkEvent::NlActionAdd, DISK "/mmcblk0p1", BlockEvent::Type_Partition, -1, 1);
+
+    EXPECT_EQ(0, UeventCoalescer::coalesce(&mEvents))
+            << "Swapped media must still be seen as removed and inserted";
+    EXPECT_EQ(4U, mEvents.size());
+}
+
+TEST_F(UeventCoalescerTest, KeepsLastChange) {
+    add(NetlinkEvent::NlActionChange, DISK, BlockEvent::Type_Disk, 1);
+    add(NetlinkEvent::NlActionChange, DISK, BlockEvent::Type_Disk, 2);
+    add(NetlinkEvent::NlActionChange, DISK, BlockEvent::Type_Disk, 3);
+
+    EXPECT_EQ(2, UeventCoalescer::coalesce(&mEvents));
+    ASSERT_EQ(1U, mEvents.size());
+    EXPECT_EQ(3, mEvents[0].nparts);
+}
+
+}
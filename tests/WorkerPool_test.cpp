@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <pthread.h>
+
+#define LOG_TAG "WorkerPool_test"
+#include <utils/Log.h>
+#include "../WorkerPool.h"
+
+#include <gtest/gtest.h>
+
+namespace android {
+
+class CountingTask : public WorkerTask {
+    pthread_mutex_t *mLock;
+    int             *mCount;
+    int              mResult;
+
+public:
+    CountingTask(pthread_mutex_t *lock, int *count, int result)
+            : mLock(lock), mCount(count), mResult(result) {}
+
+    int run() {
+        pthread_mutex_lock(mLock);
+        (*mCount)++;
+        pthread_mutex_unlock(mLock);
+        return mResult;
+    }
+};
+
+class WorkerPoolTest : public testing::Test {
+protected:
+    pthread_mutex_t mLock;
+    int mCount;
+
+    virtual void SetUp() {
+        pthread_mutex_init(&mLock, NULL);
+        mCount = 0;
+    }
+
+    virtual void TearDown() {
+        pthread_mutex_destroy(&mLock);
+    }
+};
+
+TEST_F(WorkerPoolTest, RunsEveryTask) {
+    WorkerPool pool;
+
+    EXPECT_LE(pool.getThreadCount(), WorkerPool::MAX_THREADS)
+            << "Pool should stay within its thread bound";
+
+    for (int i = 0; i < 100; i++) {
+        pool.submit(new CountingTask(&mLock, &mCount, 0));
+    }
+    EXPECT_EQ(0, pool.wait())
+            << "No task should have failed";
+    EXPECT_EQ(100, mCount)
+            << "Every task should have run once";
+}
+
+TEST_F(WorkerPoolTest, CountsFailures) {
+    WorkerPool pool(2);
+
+    for (int i = 0; i < 10; i++) {
+        pool.submit(new CountingTask(&mLock, &mCount, i % 3 ? 0 : -1));
+    }
+    EXPECT_EQ(4, pool.wait())
+            << "Failed tasks should be counted";
+    EXPECT_EQ(0, pool.wait())
+            << "Failures should reset after wait";
+    EXPECT_EQ(10, mCount);
+}
+
+}